@@ -0,0 +1,718 @@
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+
+#include "utils.h"
+#include "async_writer.h"
+
+/* Buffers are used for O_DIRECT writes */
+#define ASYNC_WRITER_ALIGN      4096
+/* Fallback when io_uring is not available (old kernel, seccomp, sysctl) */
+#define ASYNC_WRITER_THREADS    2
+
+/* io_uring user_data : buffer index and operation */
+#define OP_WRITE                0
+#define OP_SYNC                 1
+#define USER_DATA(index, op)    (((uint64_t)(index) << 1) | (op))
+
+typedef struct
+{
+    uint8_t *data;
+    int fd;
+    size_t size;
+    uint64_t offset;
+    int drop_cache;
+    uint64_t tag;
+    /* Completions still expected from io_uring */
+    unsigned int pending;
+    int failed;
+    /* Written, waiting for the buffers submitted before it */
+    int done;
+} async_buffer;
+
+/* Frame data is written in large chunks, without the caller waiting for the
+ * disk. With io_uring, writes are submitted from the caller thread and
+ * completions are reaped in batches whenever a buffer is needed : no thread
+ * is spent per stream. Buffers and the file being written are registered with
+ * the ring so that the kernel does not map them again for every write */
+struct async_writer
+{
+    char name[DEVICE_NAME_MAX_SIZE];
+    async_buffer *buffers;
+    unsigned int nb_buffers;
+    size_t buffer_size;
+
+    /* Free buffers, used as a stack */
+    unsigned int *free_list;
+    unsigned int nb_free;
+    unsigned int nb_inflight;
+    int failed;
+    async_writer_done_cb done_cb;
+    void *done_arg;
+    /* Buffers in flight, in submission order : writes complete in any order
+     * but are retired in this one */
+    unsigned int *order;
+    unsigned int order_head;
+    /* A write failed : later tags are not reported anymore */
+    int done_stopped;
+
+    /* io_uring backend */
+    int ring_fd;
+    uint8_t *sq_ring;
+    uint8_t *cq_ring;
+    size_t sq_ring_size;
+    size_t cq_ring_size;
+    struct io_uring_sqe *sqes;
+    size_t sqes_size;
+    unsigned int *sq_head;
+    unsigned int *sq_tail;
+    unsigned int *sq_mask;
+    unsigned int *sq_array;
+    unsigned int *cq_head;
+    unsigned int *cq_tail;
+    unsigned int *cq_mask;
+    struct io_uring_cqe *cqes;
+    int fixed_buffers;
+    int fixed_files;
+    /* File currently registered at index 0, -1 if none */
+    int fixed_fd;
+
+    /* Thread pool backend : submitted buffers, used as a FIFO */
+    pthread_t threads[ASYNC_WRITER_THREADS];
+    unsigned int nb_threads;
+    unsigned int *queue;
+    unsigned int queue_head;
+    unsigned int nb_queued;
+    int closing;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+};
+
+static int _io_uring_setup(unsigned int entries, struct io_uring_params *p)
+{
+    return syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int _io_uring_enter(int fd, unsigned int to_submit, unsigned int min_complete, unsigned int flags)
+{
+    return syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, NULL, 0);
+}
+
+static int _io_uring_register(int fd, unsigned int opcode, void *arg, unsigned int nr_args)
+{
+    return syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+/* Without O_DIRECT, written pages are dropped right away so that the page
+ * cache does not grow with the recording */
+static void _drop_cache(async_buffer *buffer)
+{
+    posix_fadvise(buffer->fd, buffer->offset, buffer->size, POSIX_FADV_DONTNEED);
+}
+
+/* Buffers are retired in submission order, and the done callback only gets
+ * the last tag of the buffers written so far without a gap, e.g. once the
+ * second of three writes completes, nothing is reported until the first one
+ * does. Nothing is reported past a failed write */
+static void _write_done(async_writer_t *w, async_buffer *buffer)
+{
+    async_buffer *head = NULL;
+    uint64_t tag = 0;
+    int advanced = 0;
+
+    if(buffer->failed)
+        w->failed = 1;
+    else if(buffer->drop_cache)
+        _drop_cache(buffer);
+    buffer->done = 1;
+
+    while(w->nb_inflight > 0 && (head = &w->buffers[w->order[w->order_head]])->done)
+    {
+        if(head->failed)
+        {
+            w->done_stopped = 1;
+        }
+        else if(!w->done_stopped)
+        {
+            tag = head->tag;
+            advanced = 1;
+        }
+        head->done = 0;
+        w->order_head = (w->order_head + 1) % w->nb_buffers;
+        w->free_list[w->nb_free++] = head - w->buffers;
+        w->nb_inflight--;
+    }
+
+    if(advanced && w->done_cb)
+        w->done_cb(w->done_arg, tag);
+}
+
+static void _uring_close(async_writer_t *w)
+{
+    if(w->sqes)
+        munmap(w->sqes, w->sqes_size);
+    if(w->cq_ring && w->cq_ring != w->sq_ring)
+        munmap(w->cq_ring, w->cq_ring_size);
+    if(w->sq_ring)
+        munmap(w->sq_ring, w->sq_ring_size);
+    if(w->ring_fd >= 0)
+        close(w->ring_fd);
+    w->sqes = NULL;
+    w->cq_ring = NULL;
+    w->sq_ring = NULL;
+    w->ring_fd = -1;
+}
+
+/* Rings can be set up from Linux 5.1 but plain writes only came with 5.6, as
+ * did the probe : a kernel which cannot be probed is too old */
+static int _uring_probe_ops(async_writer_t *w)
+{
+    static const unsigned char ops[] = {IORING_OP_WRITE, IORING_OP_WRITE_FIXED, IORING_OP_SYNC_FILE_RANGE};
+    struct io_uring_probe *probe = NULL;
+    unsigned int i = 0;
+    int ret = -1;
+
+    probe = calloc(1, sizeof(struct io_uring_probe) + 256 * sizeof(struct io_uring_probe_op));
+    if(!probe)
+        return -1;
+
+    if(_io_uring_register(w->ring_fd, IORING_REGISTER_PROBE, probe, 256) != 0)
+    {
+        INF("%s : io_uring cannot be probed (%s), writing from a thread pool", w->name, strerror(errno));
+        goto probe_end;
+    }
+
+    for(i = 0; i < sizeof(ops); i++)
+    {
+        if(ops[i] > probe->last_op || !(probe->ops[ops[i]].flags & IO_URING_OP_SUPPORTED))
+        {
+            INF("%s : io_uring does not support operation %u, writing from a thread pool", w->name, ops[i]);
+            goto probe_end;
+        }
+    }
+    ret = 0;
+
+probe_end:
+    free(probe);
+    return ret;
+}
+
+static int _uring_init(async_writer_t *w)
+{
+    struct io_uring_params p;
+    struct iovec *iov = NULL;
+    unsigned int i = 0;
+
+    /* A write, and a sync_file_range when the page cache is used */
+    memset(&p, 0, sizeof(p));
+    w->ring_fd = _io_uring_setup(w->nb_buffers * 2, &p);
+    if(w->ring_fd < 0)
+    {
+        INF("%s : io_uring not available (%s), writing from a thread pool", w->name, strerror(errno));
+        return -1;
+    }
+
+    if(_uring_probe_ops(w) != 0)
+    {
+        _uring_close(w);
+        return -1;
+    }
+
+    w->sq_ring_size = p.sq_off.array + p.sq_entries * sizeof(unsigned int);
+    w->cq_ring_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if(p.features & IORING_FEAT_SINGLE_MMAP)
+    {
+        if(w->cq_ring_size > w->sq_ring_size)
+            w->sq_ring_size = w->cq_ring_size;
+        w->cq_ring_size = w->sq_ring_size;
+    }
+
+    w->sq_ring = mmap(NULL, w->sq_ring_size, PROT_READ | PROT_WRITE,
+            MAP_SHARED | MAP_POPULATE, w->ring_fd, IORING_OFF_SQ_RING);
+    if(w->sq_ring == MAP_FAILED)
+    {
+        w->sq_ring = NULL;
+        goto init_fail;
+    }
+
+    if(p.features & IORING_FEAT_SINGLE_MMAP)
+    {
+        w->cq_ring = w->sq_ring;
+    }
+    else
+    {
+        w->cq_ring = mmap(NULL, w->cq_ring_size, PROT_READ | PROT_WRITE,
+                MAP_SHARED | MAP_POPULATE, w->ring_fd, IORING_OFF_CQ_RING);
+        if(w->cq_ring == MAP_FAILED)
+        {
+            w->cq_ring = NULL;
+            goto init_fail;
+        }
+    }
+
+    w->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+    w->sqes = mmap(NULL, w->sqes_size, PROT_READ | PROT_WRITE,
+            MAP_SHARED | MAP_POPULATE, w->ring_fd, IORING_OFF_SQES);
+    if(w->sqes == MAP_FAILED)
+    {
+        w->sqes = NULL;
+        goto init_fail;
+    }
+
+    w->sq_head = (unsigned int *)(w->sq_ring + p.sq_off.head);
+    w->sq_tail = (unsigned int *)(w->sq_ring + p.sq_off.tail);
+    w->sq_mask = (unsigned int *)(w->sq_ring + p.sq_off.ring_mask);
+    w->sq_array = (unsigned int *)(w->sq_ring + p.sq_off.array);
+    w->cq_head = (unsigned int *)(w->cq_ring + p.cq_off.head);
+    w->cq_tail = (unsigned int *)(w->cq_ring + p.cq_off.tail);
+    w->cq_mask = (unsigned int *)(w->cq_ring + p.cq_off.ring_mask);
+    w->cqes = (struct io_uring_cqe *)(w->cq_ring + p.cq_off.cqes);
+
+    /* Registered buffers are pinned once instead of for every write. They
+     * count against RLIMIT_MEMLOCK : plain writes are used if over it */
+    iov = calloc(w->nb_buffers, sizeof(struct iovec));
+    if(iov)
+    {
+        for(i = 0; i < w->nb_buffers; i++)
+        {
+            iov[i].iov_base = w->buffers[i].data;
+            iov[i].iov_len = w->buffer_size;
+        }
+        w->fixed_buffers = _io_uring_register(w->ring_fd, IORING_REGISTER_BUFFERS, iov, w->nb_buffers) == 0;
+        free(iov);
+    }
+    if(!w->fixed_buffers)
+        INF("%s : cannot register io_uring buffers (%s), using plain writes", w->name, strerror(errno));
+
+    w->fixed_files = 1;
+    w->fixed_fd = -1;
+    return 0;
+
+init_fail:
+    ERR("%s : cannot map io_uring rings : %s", w->name, strerror(errno));
+    _uring_close(w);
+    return -1;
+}
+
+/* Index 0 of the registered file table always holds the file being written */
+static void _uring_register_file(async_writer_t *w, int fd)
+{
+    struct io_uring_files_update update;
+    int ret = 0;
+
+    if(!w->fixed_files || w->fixed_fd == fd)
+        return;
+
+    memset(&update, 0, sizeof(update));
+    update.offset = 0;
+    update.fds = (uint64_t)(uintptr_t)&fd;
+    ret = _io_uring_register(w->ring_fd, IORING_REGISTER_FILES_UPDATE, &update, 1);
+    if(ret < 0 && errno == ENXIO)
+    {
+        /* No file table yet */
+        ret = _io_uring_register(w->ring_fd, IORING_REGISTER_FILES, &fd, 1);
+    }
+    if(ret < 0)
+    {
+        INF("%s : cannot register file with io_uring (%s), using plain descriptors", w->name, strerror(errno));
+        w->fixed_files = 0;
+        w->fixed_fd = -1;
+        return;
+    }
+    w->fixed_fd = fd;
+}
+
+static struct io_uring_sqe *_uring_get_sqe(async_writer_t *w, unsigned int *tail, int fd)
+{
+    struct io_uring_sqe *sqe = &w->sqes[*tail & *w->sq_mask];
+
+    w->sq_array[*tail & *w->sq_mask] = *tail & *w->sq_mask;
+    (*tail)++;
+    memset(sqe, 0, sizeof(*sqe));
+    if(w->fixed_files)
+    {
+        sqe->fd = 0;
+        sqe->flags = IOSQE_FIXED_FILE;
+    }
+    else
+    {
+        sqe->fd = fd;
+    }
+    return sqe;
+}
+
+static int _uring_submit(async_writer_t *w, async_buffer *buffer)
+{
+    unsigned int index = buffer - w->buffers;
+    unsigned int tail = *w->sq_tail;
+    unsigned int to_submit = 0;
+    struct io_uring_sqe *sqe = NULL;
+    int ret = 0;
+
+    _uring_register_file(w, buffer->fd);
+
+    sqe = _uring_get_sqe(w, &tail, buffer->fd);
+    sqe->opcode = w->fixed_buffers ? IORING_OP_WRITE_FIXED : IORING_OP_WRITE;
+    sqe->addr = (uint64_t)(uintptr_t)buffer->data;
+    sqe->len = buffer->size;
+    sqe->off = buffer->offset;
+    sqe->buf_index = index;
+    sqe->user_data = USER_DATA(index, OP_WRITE);
+    buffer->pending = 1;
+
+    /* Writeback is started and waited for by the kernel once the write is
+     * done, so that the pages can be dropped when the buffer comes back */
+    if(buffer->drop_cache)
+    {
+        sqe->flags |= IOSQE_IO_LINK;
+        sqe = _uring_get_sqe(w, &tail, buffer->fd);
+        sqe->opcode = IORING_OP_SYNC_FILE_RANGE;
+        sqe->off = buffer->offset;
+        sqe->len = buffer->size;
+        sqe->sync_range_flags = SYNC_FILE_RANGE_WAIT_BEFORE |
+            SYNC_FILE_RANGE_WRITE | SYNC_FILE_RANGE_WAIT_AFTER;
+        sqe->user_data = USER_DATA(index, OP_SYNC);
+        buffer->pending++;
+    }
+
+    to_submit = tail - *w->sq_tail;
+    __atomic_store_n(w->sq_tail, tail, __ATOMIC_RELEASE);
+
+    do {
+        ret = _io_uring_enter(w->ring_fd, to_submit, 0, 0);
+    } while(ret < 0 && errno == EINTR);
+    if(ret < 0)
+    {
+        /* Nothing was consumed : take the entries back */
+        ERR("%s : cannot submit write : %s", w->name, strerror(errno));
+        __atomic_store_n(w->sq_tail, tail - to_submit, __ATOMIC_RELEASE);
+        return -1;
+    }
+    return 0;
+}
+
+/* Handle every completion available, without any syscall */
+static void _uring_reap(async_writer_t *w)
+{
+    unsigned int head = *w->cq_head;
+    struct io_uring_cqe *cqe = NULL;
+    async_buffer *buffer = NULL;
+    int op = 0;
+
+    while(head != __atomic_load_n(w->cq_tail, __ATOMIC_ACQUIRE))
+    {
+        cqe = &w->cqes[head & *w->cq_mask];
+        buffer = &w->buffers[cqe->user_data >> 1];
+        op = cqe->user_data & 1;
+
+        if(op == OP_WRITE && cqe->res != (int)buffer->size)
+        {
+            ERR("%s : write of %zu bytes at offset %lu failed : %s", w->name, buffer->size,
+                    (unsigned long)buffer->offset, cqe->res < 0 ? strerror(-cqe->res) : "short write");
+            buffer->failed = 1;
+        }
+        else if(op == OP_SYNC && cqe->res < 0 && cqe->res != -ECANCELED)
+        {
+            ERR("%s : cannot flush written data : %s", w->name, strerror(-cqe->res));
+        }
+
+        head++;
+        if(--buffer->pending == 0)
+            _write_done(w, buffer);
+    }
+    __atomic_store_n(w->cq_head, head, __ATOMIC_RELEASE);
+}
+
+/* Sleep until at least one more write completes */
+static void _uring_wait(async_writer_t *w)
+{
+    int ret = 0;
+
+    if(w->nb_inflight == 0)
+        return;
+
+    do {
+        ret = _io_uring_enter(w->ring_fd, 0, 1, IORING_ENTER_GETEVENTS);
+    } while(ret < 0 && errno == EINTR);
+    if(ret < 0)
+        ERR("%s : cannot wait for write completions : %s", w->name, strerror(errno));
+    _uring_reap(w);
+}
+
+static void *_io_thread(void *arg)
+{
+    async_writer_t *w = arg;
+    async_buffer *buffer = NULL;
+    size_t done = 0;
+    ssize_t ret = 0;
+
+    pthread_mutex_lock(&w->lock);
+    while(1)
+    {
+        while(w->nb_queued == 0 && !w->closing)
+            pthread_cond_wait(&w->cond, &w->lock);
+        if(w->nb_queued == 0)
+            break;
+
+        buffer = &w->buffers[w->queue[w->queue_head]];
+        w->queue_head = (w->queue_head + 1) % w->nb_buffers;
+        w->nb_queued--;
+        pthread_mutex_unlock(&w->lock);
+
+        for(done = 0; done < buffer->size; done += ret)
+        {
+            ret = pwrite(buffer->fd, buffer->data + done, buffer->size - done, buffer->offset + done);
+            if(ret < 0 && errno == EINTR)
+            {
+                ret = 0;
+                continue;
+            }
+            if(ret <= 0)
+            {
+                ERR("%s : write of %zu bytes at offset %lu failed : %s", w->name, buffer->size,
+                        (unsigned long)buffer->offset, ret < 0 ? strerror(errno) : "short write");
+                buffer->failed = 1;
+                break;
+            }
+        }
+        if(!buffer->failed && buffer->drop_cache)
+        {
+            sync_file_range(buffer->fd, buffer->offset, buffer->size,
+                    SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE | SYNC_FILE_RANGE_WAIT_AFTER);
+        }
+
+        pthread_mutex_lock(&w->lock);
+        _write_done(w, buffer);
+        pthread_cond_broadcast(&w->cond);
+    }
+    pthread_mutex_unlock(&w->lock);
+
+    return NULL;
+}
+
+static int _threads_init(async_writer_t *w)
+{
+    unsigned int i = 0;
+
+    w->queue = calloc(w->nb_buffers, sizeof(unsigned int));
+    if(!w->queue)
+    {
+        ERR("%s : cannot allocate write queue", w->name);
+        return -1;
+    }
+
+    for(i = 0; i < ASYNC_WRITER_THREADS; i++)
+    {
+        if(pthread_create(&w->threads[i], NULL, _io_thread, w) != 0)
+        {
+            ERR("%s : cannot create I/O thread", w->name);
+            return -1;
+        }
+        w->nb_threads++;
+    }
+    return 0;
+}
+
+async_writer_t *async_writer_create(const char *name, unsigned int nb_buffers, size_t buffer_size)
+{
+    async_writer_t *w = NULL;
+    unsigned int i = 0;
+
+    if(nb_buffers == 0 || buffer_size == 0 || buffer_size % ASYNC_WRITER_ALIGN != 0)
+    {
+        ERR("Cannot create async writer : invalid dimensions");
+        return NULL;
+    }
+
+    w = calloc(1, sizeof(async_writer_t));
+    if(!w)
+    {
+        ERR("Cannot allocate async writer");
+        return NULL;
+    }
+
+    snprintf(w->name, DEVICE_NAME_MAX_SIZE, "%s", name);
+    pthread_mutex_init(&w->lock, NULL);
+    pthread_cond_init(&w->cond, NULL);
+    w->ring_fd = -1;
+    w->nb_buffers = nb_buffers;
+    w->buffer_size = buffer_size;
+    w->buffers = calloc(nb_buffers, sizeof(async_buffer));
+    w->free_list = calloc(nb_buffers, sizeof(unsigned int));
+    w->order = calloc(nb_buffers, sizeof(unsigned int));
+    if(!w->buffers || !w->free_list || !w->order)
+    {
+        ERR("%s : cannot allocate async writer buffers", name);
+        async_writer_destroy(w);
+        return NULL;
+    }
+
+    for(i = 0; i < nb_buffers; i++)
+    {
+        if(posix_memalign((void **)&w->buffers[i].data, ASYNC_WRITER_ALIGN, buffer_size) != 0)
+        {
+            ERR("%s : cannot allocate %u write buffers of %zu bytes", name, nb_buffers, buffer_size);
+            async_writer_destroy(w);
+            return NULL;
+        }
+        w->free_list[i] = nb_buffers - 1 - i;
+    }
+    w->nb_free = nb_buffers;
+
+    if(_uring_init(w) != 0 && _threads_init(w) != 0)
+    {
+        async_writer_destroy(w);
+        return NULL;
+    }
+
+    return w;
+}
+
+void async_writer_destroy(async_writer_t *w)
+{
+    unsigned int i = 0;
+
+    if(!w)
+        return;
+
+    if(w->ring_fd >= 0)
+    {
+        async_writer_drain(w);
+        _uring_close(w);
+    }
+
+    pthread_mutex_lock(&w->lock);
+    w->closing = 1;
+    pthread_cond_broadcast(&w->cond);
+    pthread_mutex_unlock(&w->lock);
+    for(i = 0; i < w->nb_threads; i++)
+        pthread_join(w->threads[i], NULL);
+
+    pthread_mutex_destroy(&w->lock);
+    pthread_cond_destroy(&w->cond);
+    for(i = 0; w->buffers && i < w->nb_buffers; i++)
+        free(w->buffers[i].data);
+    free(w->queue);
+    free(w->order);
+    free(w->free_list);
+    free(w->buffers);
+    free(w);
+}
+
+/* Blocks while every buffer is in flight */
+uint8_t *async_writer_get_buffer(async_writer_t *w)
+{
+    async_buffer *buffer = NULL;
+
+    if(w->ring_fd >= 0)
+    {
+        _uring_reap(w);
+        while(w->nb_free == 0)
+            _uring_wait(w);
+        buffer = &w->buffers[w->free_list[--w->nb_free]];
+    }
+    else
+    {
+        pthread_mutex_lock(&w->lock);
+        while(w->nb_free == 0)
+            pthread_cond_wait(&w->cond, &w->lock);
+        buffer = &w->buffers[w->free_list[--w->nb_free]];
+        pthread_mutex_unlock(&w->lock);
+    }
+
+    return buffer->data;
+}
+
+/* Size and offset must be aligned for files opened with O_DIRECT */
+int async_writer_submit(async_writer_t *w, uint8_t *buf, int fd, size_t size, uint64_t offset,
+        int drop_cache, uint64_t tag)
+{
+    async_buffer *buffer = NULL;
+    unsigned int i = 0;
+
+    for(i = 0; i < w->nb_buffers && w->buffers[i].data != buf; i++);
+    if(i == w->nb_buffers || size > w->buffer_size)
+    {
+        ERR("%s : invalid write buffer", w->name);
+        return -1;
+    }
+
+    buffer = &w->buffers[i];
+    buffer->fd = fd;
+    buffer->size = size;
+    buffer->offset = offset;
+    buffer->drop_cache = drop_cache;
+    buffer->tag = tag;
+    buffer->failed = 0;
+
+    if(w->ring_fd >= 0)
+    {
+        w->order[(w->order_head + w->nb_inflight) % w->nb_buffers] = i;
+        w->nb_inflight++;
+        if(_uring_submit(w, buffer) != 0)
+        {
+            buffer->failed = 1;
+            _write_done(w, buffer);
+            return -1;
+        }
+        return 0;
+    }
+
+    pthread_mutex_lock(&w->lock);
+    w->order[(w->order_head + w->nb_inflight) % w->nb_buffers] = i;
+    w->nb_inflight++;
+    w->queue[(w->queue_head + w->nb_queued) % w->nb_buffers] = i;
+    w->nb_queued++;
+    pthread_cond_broadcast(&w->cond);
+    pthread_mutex_unlock(&w->lock);
+    return 0;
+}
+
+/* Must be called before the first write */
+void async_writer_set_done_callback(async_writer_t *w, async_writer_done_cb cb, void *arg)
+{
+    w->done_cb = cb;
+    w->done_arg = arg;
+}
+
+int async_writer_drain(async_writer_t *w)
+{
+    int failed = 0;
+
+    if(w->ring_fd >= 0)
+    {
+        _uring_reap(w);
+        while(w->nb_inflight > 0)
+            _uring_wait(w);
+        failed = w->failed;
+        /* Release the registered file : the caller is about to close it, and
+         * its descriptor number may be reused for the next one */
+        _uring_register_file(w, -1);
+    }
+    else
+    {
+        pthread_mutex_lock(&w->lock);
+        while(w->nb_inflight > 0)
+            pthread_cond_wait(&w->cond, &w->lock);
+        failed = w->failed;
+        pthread_mutex_unlock(&w->lock);
+    }
+
+    w->failed = 0;
+    return failed ? -1 : 0;
+}
+
+const char *async_writer_get_backend(async_writer_t *w)
+{
+    if(w->ring_fd < 0)
+        return "thread pool";
+    return w->fixed_buffers ? "io_uring, registered buffers" : "io_uring";
+}
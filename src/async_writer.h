@@ -0,0 +1,28 @@
+#ifndef ASYNC_WRITER_H
+#define ASYNC_WRITER_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+typedef struct async_writer async_writer_t;
+
+/* Called once buffers have been written, with the tag of the last one : every
+ * buffer submitted up to it is on disk. Not called anymore once a write has
+ * failed. May be called from an I/O thread */
+typedef void (*async_writer_done_cb)(void *arg, uint64_t tag);
+
+/* Write buffers belong to the writer : get one, fill it, submit it, and it
+ * comes back to the pool once written. At most nb_buffers * buffer_size bytes
+ * are in flight. Must be used by one thread at a time */
+async_writer_t *async_writer_create(const char *name, unsigned int nb_buffers, size_t buffer_size);
+void async_writer_destroy(async_writer_t *w);
+uint8_t *async_writer_get_buffer(async_writer_t *w);
+int async_writer_submit(async_writer_t *w, uint8_t *buf, int fd, size_t size, uint64_t offset,
+        int drop_cache, uint64_t tag);
+void async_writer_set_done_callback(async_writer_t *w, async_writer_done_cb cb, void *arg);
+/* Wait for every submitted write. Must be called before closing a file written
+ * through the writer. Returns -1 if any write failed since the last drain */
+int async_writer_drain(async_writer_t *w);
+const char *async_writer_get_backend(async_writer_t *w);
+
+#endif
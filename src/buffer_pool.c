@@ -0,0 +1,181 @@
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/mman.h>
+
+#include "utils.h"
+#include "buffer_pool.h"
+
+#define HUGEPAGE_SIZE           (2 * 1024 * 1024)
+#define ALIGN_HUGEPAGE(x)       (((x) + HUGEPAGE_SIZE - 1) & ~((size_t)HUGEPAGE_SIZE - 1))
+#define MPOL_BIND               2
+#define MAX_NUMA_NODES          64
+
+/* Application owned frame buffers, for USERPTR capture. Every buffer starts on
+ * a 2 MB boundary and spans whole huge pages, so a frame is covered by a
+ * handful of TLB entries */
+struct buffer_pool
+{
+    uint8_t *base;
+    size_t map_size;
+    size_t buffer_size;
+    unsigned int nb_buffers;
+    int locked;
+    void **buffers;
+};
+
+/* Explicit huge pages first, then transparent huge pages on a 2 MB aligned
+ * anonymous mapping */
+static uint8_t *_map_memory(size_t size, int flags, size_t *map_size)
+{
+    uint8_t *mem = MAP_FAILED;
+    uint8_t *aligned = NULL;
+    size_t head = 0;
+
+    if(flags & BUFFER_POOL_HUGEPAGES)
+    {
+        mem = mmap(NULL, size, PROT_READ | PROT_WRITE,
+                MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB | MAP_HUGE_2MB, -1, 0);
+        if(mem != MAP_FAILED)
+        {
+            *map_size = size;
+            return mem;
+        }
+        INF("No 2 MB huge pages available (%s), falling back to transparent huge pages", strerror(errno));
+    }
+
+    mem = mmap(NULL, size + HUGEPAGE_SIZE, PROT_READ | PROT_WRITE,
+            MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if(mem == MAP_FAILED)
+        return NULL;
+
+    /* Trim the mapping to a 2 MB aligned range */
+    aligned = (uint8_t *)ALIGN_HUGEPAGE((uintptr_t)mem);
+    head = aligned - mem;
+    if(head)
+        munmap(mem, head);
+    munmap(aligned + size, HUGEPAGE_SIZE - head);
+
+    if((flags & BUFFER_POOL_HUGEPAGES) && madvise(aligned, size, MADV_HUGEPAGE) == -1)
+    {
+        DBG("Cannot enable transparent huge pages : %s", strerror(errno));
+    }
+
+    *map_size = size;
+    return aligned;
+}
+
+/* Bind pool pages to the NUMA node of the CPU currently running the caller,
+ * i.e. the node processing the frames if the caller thread is pinned */
+static void _bind_local_node(uint8_t *mem, size_t size)
+{
+    unsigned long nodemask[MAX_NUMA_NODES / (8 * sizeof(unsigned long))] = {0};
+    unsigned int cpu = 0, node = 0;
+
+    if(syscall(SYS_getcpu, &cpu, &node, NULL) == -1 || node >= MAX_NUMA_NODES)
+    {
+        INF("Cannot get current NUMA node, buffers not bound");
+        return;
+    }
+
+    nodemask[node / (8 * sizeof(unsigned long))] |= 1UL << (node % (8 * sizeof(unsigned long)));
+    if(syscall(SYS_mbind, mem, size, MPOL_BIND, nodemask, MAX_NUMA_NODES + 1, 0) == -1)
+    {
+        INF("Cannot bind buffers to NUMA node %u : %s", node, strerror(errno));
+        return;
+    }
+    INF("Buffers bound to NUMA node %u", node);
+}
+
+buffer_pool_t *buffer_pool_create(unsigned int nb_buffers, size_t buffer_size, int flags)
+{
+    buffer_pool_t *pool = NULL;
+    unsigned int i = 0;
+
+    if(nb_buffers == 0 || buffer_size == 0)
+    {
+        ERR("Cannot create buffer pool : invalid dimensions");
+        return NULL;
+    }
+
+    pool = calloc(1, sizeof(buffer_pool_t));
+    if(!pool)
+    {
+        ERR("Cannot allocate buffer pool");
+        return NULL;
+    }
+
+    pool->nb_buffers = nb_buffers;
+    pool->buffer_size = ALIGN_HUGEPAGE(buffer_size);
+    pool->buffers = calloc(nb_buffers, sizeof(void *));
+    pool->base = _map_memory(pool->buffer_size * nb_buffers, flags, &pool->map_size);
+    if(!pool->buffers || !pool->base)
+    {
+        ERR("Cannot allocate %u buffers of %zu bytes", nb_buffers, pool->buffer_size);
+        buffer_pool_destroy(pool);
+        return NULL;
+    }
+
+    if(flags & BUFFER_POOL_NUMA_LOCAL)
+        _bind_local_node(pool->base, pool->map_size);
+
+    if(flags & BUFFER_POOL_MLOCK)
+    {
+        if(mlock(pool->base, pool->map_size) == -1)
+        {
+            INF("Cannot lock buffers in memory : %s", strerror(errno));
+        }
+        else
+        {
+            pool->locked = 1;
+        }
+    }
+
+    /* Fault every page in now rather than during capture */
+    memset(pool->base, 0, pool->map_size);
+
+    for(i = 0; i < nb_buffers; i++)
+        pool->buffers[i] = pool->base + i * pool->buffer_size;
+
+    INF("Buffer pool of %u x %zu bytes ready at %p", nb_buffers, pool->buffer_size, (void *)pool->base);
+    return pool;
+}
+
+void buffer_pool_destroy(buffer_pool_t *pool)
+{
+    if(!pool)
+        return;
+
+    if(pool->base)
+    {
+        if(pool->locked)
+            munlock(pool->base, pool->map_size);
+        munmap(pool->base, pool->map_size);
+    }
+    free(pool->buffers);
+    free(pool);
+}
+
+void *buffer_pool_get(buffer_pool_t *pool, unsigned int index)
+{
+    return index < pool->nb_buffers ? pool->buffers[index] : NULL;
+}
+
+void * const *buffer_pool_get_all(buffer_pool_t *pool)
+{
+    return pool->buffers;
+}
+
+unsigned int buffer_pool_get_count(buffer_pool_t *pool)
+{
+    return pool->nb_buffers;
+}
+
+size_t buffer_pool_get_buffer_size(buffer_pool_t *pool)
+{
+    return pool->buffer_size;
+}
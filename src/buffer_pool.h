@@ -0,0 +1,19 @@
+#ifndef BUFFER_POOL_H
+#define BUFFER_POOL_H
+
+#include <stddef.h>
+
+#define BUFFER_POOL_HUGEPAGES       (1 << 0)    /* Back buffers with 2 MB pages */
+#define BUFFER_POOL_MLOCK           (1 << 1)    /* Lock buffers in RAM */
+#define BUFFER_POOL_NUMA_LOCAL      (1 << 2)    /* Bind buffers to the caller NUMA node */
+
+typedef struct buffer_pool buffer_pool_t;
+
+buffer_pool_t *buffer_pool_create(unsigned int nb_buffers, size_t buffer_size, int flags);
+void buffer_pool_destroy(buffer_pool_t *pool);
+void *buffer_pool_get(buffer_pool_t *pool, unsigned int index);
+void * const *buffer_pool_get_all(buffer_pool_t *pool);
+unsigned int buffer_pool_get_count(buffer_pool_t *pool);
+size_t buffer_pool_get_buffer_size(buffer_pool_t *pool);
+
+#endif
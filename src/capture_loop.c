@@ -0,0 +1,320 @@
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <signal.h>
+#include <time.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "utils.h"
+#include "capture_loop.h"
+
+#define MAX_EVENTS              (MAX_DEVICES + 2)
+
+typedef struct
+{
+    yuv_fetcher_t *fetcher;
+    long long last_frame_ms;
+    int timed_out;
+    unsigned long nb_timeouts;
+} capture_device;
+
+/* Single epoll loop servicing every started fetcher : each device is handled
+ * as soon as it has a frame ready, whatever the state of the other ones.
+ * Stop requests go through an eventfd, so they wake the loop up immediately,
+ * even if no camera delivers frames anymore */
+struct capture_loop
+{
+    int epoll_fd;
+    int stop_fd;
+    int trigger_fd;
+    struct sockaddr_un trigger_addr;
+    capture_device devices[MAX_DEVICES];
+    int nb_fetchers;
+    int timeout_ms;
+    volatile sig_atomic_t run;
+};
+
+static long long _now_ms(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+capture_loop_t *capture_loop_create(void)
+{
+    capture_loop_t *loop = calloc(1, sizeof(capture_loop_t));
+    struct epoll_event event;
+
+    if(!loop)
+    {
+        ERR("Cannot allocate capture loop");
+        return NULL;
+    }
+
+    loop->timeout_ms = FRAME_TIMEOUT_MS;
+    loop->stop_fd = -1;
+    loop->trigger_fd = -1;
+    loop->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if(loop->epoll_fd < 0)
+    {
+        ERR("Cannot create capture loop epoll instance : %s", strerror(errno));
+        free(loop);
+        return NULL;
+    }
+
+    loop->stop_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    memset(&event, 0, sizeof(event));
+    event.events = EPOLLIN;
+    event.data.ptr = NULL;
+    if(loop->stop_fd < 0 ||
+       epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, loop->stop_fd, &event) == -1)
+    {
+        ERR("Cannot setup capture loop stop event : %s", strerror(errno));
+        capture_loop_destroy(loop);
+        return NULL;
+    }
+
+    return loop;
+}
+
+void capture_loop_destroy(capture_loop_t *loop)
+{
+    if(!loop)
+        return;
+
+    if(loop->stop_fd >= 0)
+        close(loop->stop_fd);
+    if(loop->trigger_fd >= 0)
+    {
+        close(loop->trigger_fd);
+        unlink(loop->trigger_addr.sun_path);
+    }
+    close(loop->epoll_fd);
+    free(loop);
+}
+
+int capture_loop_add(capture_loop_t *loop, yuv_fetcher_t *f)
+{
+    capture_device *device = NULL;
+    struct epoll_event event;
+
+    if(loop->nb_fetchers >= MAX_DEVICES)
+    {
+        ERR("Cannot add %s to capture loop : too many devices", yuv_fetcher_get_name(f));
+        return -1;
+    }
+    device = &loop->devices[loop->nb_fetchers];
+    memset(device, 0, sizeof(capture_device));
+    device->fetcher = f;
+
+    memset(&event, 0, sizeof(event));
+    event.events = EPOLLIN;
+    event.data.ptr = device;
+    if(epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, yuv_fetcher_get_fd(f), &event) == -1)
+    {
+        ERR("Cannot add %s to capture loop : %s", yuv_fetcher_get_name(f), strerror(errno));
+        return -1;
+    }
+    loop->nb_fetchers++;
+
+    return 0;
+}
+
+/* Any datagram received on the socket triggers every device, e.g. :
+ * echo | socat - UNIX-SENDTO:<path> */
+int capture_loop_set_trigger_socket(capture_loop_t *loop, const char *path)
+{
+    struct epoll_event event;
+
+    memset(&loop->trigger_addr, 0, sizeof(loop->trigger_addr));
+    loop->trigger_addr.sun_family = AF_UNIX;
+    snprintf(loop->trigger_addr.sun_path, sizeof(loop->trigger_addr.sun_path), "%s", path);
+    unlink(path);
+
+    loop->trigger_fd = socket(AF_UNIX, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if(loop->trigger_fd < 0 ||
+       bind(loop->trigger_fd, (struct sockaddr *)&loop->trigger_addr, sizeof(loop->trigger_addr)) == -1)
+    {
+        ERR("Cannot create trigger socket %s : %s", path, strerror(errno));
+        goto socket_fail;
+    }
+
+    memset(&event, 0, sizeof(event));
+    event.events = EPOLLIN;
+    event.data.ptr = &loop->trigger_fd;
+    if(epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, loop->trigger_fd, &event) == -1)
+    {
+        ERR("Cannot add trigger socket to capture loop : %s", strerror(errno));
+        unlink(path);
+        goto socket_fail;
+    }
+
+    INF("Waiting for triggers on %s", path);
+    return 0;
+
+socket_fail:
+    if(loop->trigger_fd >= 0)
+        close(loop->trigger_fd);
+    loop->trigger_fd = -1;
+    return -1;
+}
+
+static void _process_trigger(capture_loop_t *loop)
+{
+    char buf[64];
+
+    while(recv(loop->trigger_fd, buf, sizeof(buf), 0) >= 0);
+    INF("Trigger received");
+    capture_loop_trigger(loop);
+}
+
+/* Report devices which did not deliver any frame for too long, and return the
+ * delay until the next device may time out */
+static int _check_timeouts(capture_loop_t *loop, long long now)
+{
+    capture_device *device = NULL;
+    long long remaining = 0;
+    int next_ms = loop->timeout_ms;
+    int i = 0;
+
+    for(i = 0; i < loop->nb_fetchers; i++)
+    {
+        device = &loop->devices[i];
+        remaining = device->last_frame_ms + loop->timeout_ms - now;
+        if(remaining <= 0)
+        {
+            if(!device->timed_out)
+            {
+                ERR("%s : no frame received for %d ms", yuv_fetcher_get_name(device->fetcher), loop->timeout_ms);
+                device->timed_out = 1;
+                device->nb_timeouts++;
+            }
+        }
+        else if(remaining < next_ms)
+        {
+            next_ms = remaining;
+        }
+    }
+
+    return next_ms;
+}
+
+static void _process_device(capture_loop_t *loop, capture_device *device,
+        uint32_t events, long long now)
+{
+    int nb_frames = yuv_fetcher_process(device->fetcher);
+
+    /* Device is gone (e.g. unplugged) : stop polling it instead of spinning */
+    if(nb_frames < 0 && (events & (EPOLLERR | EPOLLHUP)))
+    {
+        ERR("%s : device error, removed from capture loop", yuv_fetcher_get_name(device->fetcher));
+        epoll_ctl(loop->epoll_fd, EPOLL_CTL_DEL, yuv_fetcher_get_fd(device->fetcher), NULL);
+        return;
+    }
+
+    if(nb_frames <= 0)
+        return;
+
+    if(device->timed_out)
+    {
+        INF("%s : frames received again", yuv_fetcher_get_name(device->fetcher));
+        device->timed_out = 0;
+    }
+    device->last_frame_ms = now;
+}
+
+/* Blocking call, returns once capture_loop_stop() has been called. Stop latency
+ * does not depend on the cameras state */
+int capture_loop_run(capture_loop_t *loop)
+{
+    struct epoll_event events[MAX_EVENTS];
+    uint64_t value = 0;
+    long long now = _now_ms();
+    int wait_ms = 0;
+    int nb_events = 0;
+    int i = 0;
+
+    INF("Capture loop started with %d devices (frame timeout : %d ms)", loop->nb_fetchers, loop->timeout_ms);
+    for(i = 0; i < loop->nb_fetchers; i++)
+        loop->devices[i].last_frame_ms = now;
+
+    loop->run = 1;
+    while(loop->run)
+    {
+        wait_ms = _check_timeouts(loop, _now_ms());
+        nb_events = epoll_wait(loop->epoll_fd, events, MAX_EVENTS, wait_ms);
+        if(nb_events < 0)
+        {
+            if(errno == EINTR)
+                continue;
+            ERR("Error while waiting for frames : %s", strerror(errno));
+            return -1;
+        }
+
+        now = _now_ms();
+        for(i = 0; i < nb_events; i++)
+        {
+            if(events[i].data.ptr == NULL)
+            {
+                /* Stop event */
+                if(read(loop->stop_fd, &value, sizeof(value)) < 0 && errno != EAGAIN)
+                    ERR("Cannot read capture loop stop event : %s", strerror(errno));
+                continue;
+            }
+            if(events[i].data.ptr == &loop->trigger_fd)
+            {
+                _process_trigger(loop);
+                continue;
+            }
+            _process_device(loop, events[i].data.ptr, events[i].events, now);
+        }
+    }
+    INF("Capture loop stopped");
+
+    for(i = 0; i < loop->nb_fetchers; i++)
+    {
+        if(loop->devices[i].nb_timeouts)
+            INF("%s : %lu frame timeouts", yuv_fetcher_get_name(loop->devices[i].fetcher),
+                    loop->devices[i].nb_timeouts);
+    }
+
+    return 0;
+}
+
+/* Async-signal-safe : can be called from a signal handler */
+void capture_loop_stop(capture_loop_t *loop)
+{
+    uint64_t value = 1;
+
+    loop->run = 0;
+    if(write(loop->stop_fd, &value, sizeof(value)) < 0)
+    {
+        /* Counter overflow only, the loop is already being woken up */
+    }
+}
+
+/* Async-signal-safe : can be called from a signal handler */
+void capture_loop_trigger(capture_loop_t *loop)
+{
+    int i = 0;
+
+    for(i = 0; i < loop->nb_fetchers; i++)
+        yuv_fetcher_trigger(loop->devices[i].fetcher);
+}
+
+int capture_loop_set_timeout(capture_loop_t *loop, int timeout_ms)
+{
+    if(timeout_ms <= 0)
+    {
+        ERR("Invalid frame timeout %d ms", timeout_ms);
+        return -1;
+    }
+    loop->timeout_ms = timeout_ms;
+    return 0;
+}
@@ -0,0 +1,17 @@
+#ifndef CAPTURE_LOOP_H
+#define CAPTURE_LOOP_H
+
+#include "yuv_fetcher.h"
+
+typedef struct capture_loop capture_loop_t;
+
+capture_loop_t *capture_loop_create(void);
+void capture_loop_destroy(capture_loop_t *loop);
+int capture_loop_add(capture_loop_t *loop, yuv_fetcher_t *f);
+int capture_loop_run(capture_loop_t *loop);
+void capture_loop_stop(capture_loop_t *loop);
+int capture_loop_set_timeout(capture_loop_t *loop, int timeout_ms);
+int capture_loop_set_trigger_socket(capture_loop_t *loop, const char *path);
+void capture_loop_trigger(capture_loop_t *loop);
+
+#endif
@@ -0,0 +1,594 @@
+#include <string.h>
+
+#include "utils.h"
+#include "convert.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#define CONVERT_HAVE_X86
+#include <immintrin.h>
+#endif
+
+#if defined(__aarch64__) || defined(__ARM_NEON)
+#define CONVERT_HAVE_NEON
+#include <arm_neon.h>
+#endif
+
+/* Full range BT.601 (JFIF) YCbCr to RGB conversion in fixed point.
+ * Chroma and luma are scaled by 64, and every product is computed as
+ * (a * k) >> 16, which maps to a single signed 16-bit multiply-high on every
+ * SIMD instruction set. Coefficients above 0.5 are split so that k fits in a
+ * signed 16-bit lane :
+ *   R = Y + Cr + 0.402 Cr
+ *   G = Y - 0.344 Cb - Cr + 0.286 Cr
+ *   B = Y + 2 Cb - 0.228 Cb
+ * All kernels implement exactly this arithmetic, so every kernel output is
+ * bit-exact with the scalar reference */
+#define K_R_CR          26345
+#define K_G_CB          22554
+#define K_G_CR          18734
+#define K_B_CB          14942
+#define FIX_SHIFT       6
+#define FIX_ROUND       (1 << (FIX_SHIFT - 1))
+
+typedef void (*convert_row_fn)(convert_src_fmt src_fmt, convert_dst_fmt dst_fmt,
+        const uint8_t *y_row, const uint8_t *c_row, uint8_t *dst, int width);
+
+static inline int _mulhi(int a, int k)
+{
+    return (a * k) >> 16;
+}
+
+static inline uint8_t _clamp(int v)
+{
+    return v < 0 ? 0 : (v > 255 ? 255 : v);
+}
+
+static inline void _store_pixel(convert_dst_fmt dst_fmt, uint8_t *dst,
+        int y, int u, int v, int rc, int gc, int bc)
+{
+    int ys = y << FIX_SHIFT;
+
+    switch(dst_fmt)
+    {
+        case CONVERT_DST_YCBCR:
+            dst[0] = y;
+            dst[1] = u;
+            dst[2] = v;
+            break;
+        case CONVERT_DST_RGBA:
+            dst[3] = 0xFF;
+            /* fall through */
+        case CONVERT_DST_RGB:
+            dst[0] = _clamp((ys + rc + FIX_ROUND) >> FIX_SHIFT);
+            dst[1] = _clamp((ys + gc + FIX_ROUND) >> FIX_SHIFT);
+            dst[2] = _clamp((ys + bc + FIX_ROUND) >> FIX_SHIFT);
+            break;
+    }
+}
+
+/* Reference implementation, also used for the tail of every SIMD row */
+static void _row_scalar(convert_src_fmt src_fmt, convert_dst_fmt dst_fmt,
+        const uint8_t *y_row, const uint8_t *c_row, uint8_t *dst, int width)
+{
+    int bpp = dst_fmt == CONVERT_DST_RGBA ? 4 : 3;
+    int x, y0, y1, u, v, c, d, rc, gc, bc;
+
+    for(x = 0; x + 1 < width; x += 2)
+    {
+        switch(src_fmt)
+        {
+            case CONVERT_SRC_NV21:
+                y0 = y_row[x];
+                y1 = y_row[x + 1];
+                v = c_row[x];
+                u = c_row[x + 1];
+                break;
+            case CONVERT_SRC_NV12:
+                y0 = y_row[x];
+                y1 = y_row[x + 1];
+                u = c_row[x];
+                v = c_row[x + 1];
+                break;
+            case CONVERT_SRC_YUYV:
+            default:
+                y0 = y_row[2 * x];
+                u = y_row[2 * x + 1];
+                y1 = y_row[2 * x + 2];
+                v = y_row[2 * x + 3];
+                break;
+        }
+
+        c = (v - 128) << FIX_SHIFT;
+        d = (u - 128) << FIX_SHIFT;
+        rc = c + _mulhi(c, K_R_CR);
+        gc = -_mulhi(d, K_G_CB) - c + _mulhi(c, K_G_CR);
+        bc = (d << 1) - _mulhi(d, K_B_CB);
+
+        _store_pixel(dst_fmt, dst + x * bpp, y0, u, v, rc, gc, bc);
+        _store_pixel(dst_fmt, dst + (x + 1) * bpp, y1, u, v, rc, gc, bc);
+    }
+}
+
+#ifdef CONVERT_HAVE_X86
+
+/* Convert 8 chroma pairs and their 16 luma samples, split in even and odd
+ * pixels, into 16 bytes of each output channel in pixel order */
+__attribute__((target("sse2")))
+static inline void _yuv_to_rgb_sse2(__m128i y_e, __m128i y_o, __m128i u, __m128i v,
+        __m128i *r, __m128i *g, __m128i *b)
+{
+    const __m128i bias = _mm_set1_epi16(128);
+    const __m128i round = _mm_set1_epi16(FIX_ROUND);
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i max = _mm_set1_epi16(255);
+    __m128i c = _mm_slli_epi16(_mm_sub_epi16(v, bias), FIX_SHIFT);
+    __m128i d = _mm_slli_epi16(_mm_sub_epi16(u, bias), FIX_SHIFT);
+    __m128i rc = _mm_add_epi16(c, _mm_mulhi_epi16(c, _mm_set1_epi16(K_R_CR)));
+    __m128i gc = _mm_sub_epi16(_mm_mulhi_epi16(c, _mm_set1_epi16(K_G_CR)),
+            _mm_add_epi16(_mm_mulhi_epi16(d, _mm_set1_epi16(K_G_CB)), c));
+    __m128i bc = _mm_sub_epi16(_mm_slli_epi16(d, 1), _mm_mulhi_epi16(d, _mm_set1_epi16(K_B_CB)));
+    __m128i ys_e = _mm_add_epi16(_mm_slli_epi16(y_e, FIX_SHIFT), round);
+    __m128i ys_o = _mm_add_epi16(_mm_slli_epi16(y_o, FIX_SHIFT), round);
+    __m128i e, o;
+
+#define CHANNEL(out, off) do {\
+    e = _mm_min_epi16(_mm_max_epi16(_mm_srai_epi16(_mm_add_epi16(ys_e, off), FIX_SHIFT), zero), max);\
+    o = _mm_min_epi16(_mm_max_epi16(_mm_srai_epi16(_mm_add_epi16(ys_o, off), FIX_SHIFT), zero), max);\
+    *out = _mm_or_si128(e, _mm_slli_epi16(o, 8));\
+} while(0)
+
+    CHANNEL(r, rc);
+    CHANNEL(g, gc);
+    CHANNEL(b, bc);
+#undef CHANNEL
+}
+
+/* Store 16 pixels given as three or four planar channel vectors */
+__attribute__((target("sse2")))
+static inline void _store_sse2(convert_dst_fmt dst_fmt, uint8_t *dst,
+        __m128i c0, __m128i c1, __m128i c2)
+{
+    __m128i c3 = _mm_set1_epi8((char)0xFF);
+    __m128i lo01 = _mm_unpacklo_epi8(c0, c1);
+    __m128i hi01 = _mm_unpackhi_epi8(c0, c1);
+    __m128i lo23 = _mm_unpacklo_epi8(c2, c3);
+    __m128i hi23 = _mm_unpackhi_epi8(c2, c3);
+    uint8_t tmp[64] __attribute__((aligned(16)));
+    uint8_t *out = dst_fmt == CONVERT_DST_RGBA ? dst : tmp;
+    int i;
+
+    _mm_storeu_si128((__m128i *)(out + 0), _mm_unpacklo_epi16(lo01, lo23));
+    _mm_storeu_si128((__m128i *)(out + 16), _mm_unpackhi_epi16(lo01, lo23));
+    _mm_storeu_si128((__m128i *)(out + 32), _mm_unpacklo_epi16(hi01, hi23));
+    _mm_storeu_si128((__m128i *)(out + 48), _mm_unpackhi_epi16(hi01, hi23));
+
+    if(dst_fmt == CONVERT_DST_RGBA)
+        return;
+
+    /* Drop the fourth byte : overlapping 4-byte stores, last pixel is exact */
+    for(i = 0; i < 15; i++)
+        memcpy(dst + 3 * i, tmp + 4 * i, 4);
+    memcpy(dst + 45, tmp + 60, 3);
+}
+
+__attribute__((target("sse2")))
+static void _row_sse2(convert_src_fmt src_fmt, convert_dst_fmt dst_fmt,
+        const uint8_t *y_row, const uint8_t *c_row, uint8_t *dst, int width)
+{
+    const __m128i mask = _mm_set1_epi16(0xFF);
+    const __m128i mask32 = _mm_set1_epi32(0xFF);
+    int bpp = dst_fmt == CONVERT_DST_RGBA ? 4 : 3;
+    __m128i y, y_e, y_o, u, v, lo, hi, c0, c1, c2;
+    int x;
+
+    for(x = 0; x + 16 <= width; x += 16)
+    {
+        if(src_fmt == CONVERT_SRC_YUYV)
+        {
+            lo = _mm_loadu_si128((const __m128i *)(y_row + 2 * x));
+            hi = _mm_loadu_si128((const __m128i *)(y_row + 2 * x + 16));
+            y_e = _mm_packs_epi32(_mm_and_si128(lo, mask32), _mm_and_si128(hi, mask32));
+            u = _mm_packs_epi32(_mm_and_si128(_mm_srli_epi32(lo, 8), mask32),
+                    _mm_and_si128(_mm_srli_epi32(hi, 8), mask32));
+            y_o = _mm_packs_epi32(_mm_and_si128(_mm_srli_epi32(lo, 16), mask32),
+                    _mm_and_si128(_mm_srli_epi32(hi, 16), mask32));
+            v = _mm_packs_epi32(_mm_srli_epi32(lo, 24), _mm_srli_epi32(hi, 24));
+            y = _mm_or_si128(y_e, _mm_slli_epi16(y_o, 8));
+        }
+        else
+        {
+            y = _mm_loadu_si128((const __m128i *)(y_row + x));
+            lo = _mm_loadu_si128((const __m128i *)(c_row + x));
+            y_e = _mm_and_si128(y, mask);
+            y_o = _mm_srli_epi16(y, 8);
+            if(src_fmt == CONVERT_SRC_NV21)
+            {
+                v = _mm_and_si128(lo, mask);
+                u = _mm_srli_epi16(lo, 8);
+            }
+            else
+            {
+                u = _mm_and_si128(lo, mask);
+                v = _mm_srli_epi16(lo, 8);
+            }
+        }
+
+        if(dst_fmt == CONVERT_DST_YCBCR)
+        {
+            c0 = y;
+            c1 = _mm_or_si128(u, _mm_slli_epi16(u, 8));
+            c2 = _mm_or_si128(v, _mm_slli_epi16(v, 8));
+        }
+        else
+        {
+            _yuv_to_rgb_sse2(y_e, y_o, u, v, &c0, &c1, &c2);
+        }
+        _store_sse2(dst_fmt, dst + x * bpp, c0, c1, c2);
+    }
+
+    if(x < width)
+    {
+        _row_scalar(src_fmt, dst_fmt,
+                y_row + (src_fmt == CONVERT_SRC_YUYV ? 2 * x : x),
+                c_row ? c_row + x : NULL, dst + x * bpp, width - x);
+    }
+}
+
+__attribute__((target("avx2")))
+static inline void _yuv_to_rgb_avx2(__m256i y_e, __m256i y_o, __m256i u, __m256i v,
+        __m256i *r, __m256i *g, __m256i *b)
+{
+    const __m256i bias = _mm256_set1_epi16(128);
+    const __m256i round = _mm256_set1_epi16(FIX_ROUND);
+    const __m256i zero = _mm256_setzero_si256();
+    const __m256i max = _mm256_set1_epi16(255);
+    __m256i c = _mm256_slli_epi16(_mm256_sub_epi16(v, bias), FIX_SHIFT);
+    __m256i d = _mm256_slli_epi16(_mm256_sub_epi16(u, bias), FIX_SHIFT);
+    __m256i rc = _mm256_add_epi16(c, _mm256_mulhi_epi16(c, _mm256_set1_epi16(K_R_CR)));
+    __m256i gc = _mm256_sub_epi16(_mm256_mulhi_epi16(c, _mm256_set1_epi16(K_G_CR)),
+            _mm256_add_epi16(_mm256_mulhi_epi16(d, _mm256_set1_epi16(K_G_CB)), c));
+    __m256i bc = _mm256_sub_epi16(_mm256_slli_epi16(d, 1),
+            _mm256_mulhi_epi16(d, _mm256_set1_epi16(K_B_CB)));
+    __m256i ys_e = _mm256_add_epi16(_mm256_slli_epi16(y_e, FIX_SHIFT), round);
+    __m256i ys_o = _mm256_add_epi16(_mm256_slli_epi16(y_o, FIX_SHIFT), round);
+    __m256i e, o;
+
+#define CHANNEL(out, off) do {\
+    e = _mm256_min_epi16(_mm256_max_epi16(_mm256_srai_epi16(_mm256_add_epi16(ys_e, off), FIX_SHIFT), zero), max);\
+    o = _mm256_min_epi16(_mm256_max_epi16(_mm256_srai_epi16(_mm256_add_epi16(ys_o, off), FIX_SHIFT), zero), max);\
+    *out = _mm256_or_si256(e, _mm256_slli_epi16(o, 8));\
+} while(0)
+
+    CHANNEL(r, rc);
+    CHANNEL(g, gc);
+    CHANNEL(b, bc);
+#undef CHANNEL
+}
+
+/* 32 pixels per iteration. Every AVX2 operation used here works within 128-bit
+ * lanes, so each lane holds 16 consecutive pixels and is stored with the SSE2
+ * helper */
+__attribute__((target("avx2")))
+static void _row_avx2(convert_src_fmt src_fmt, convert_dst_fmt dst_fmt,
+        const uint8_t *y_row, const uint8_t *c_row, uint8_t *dst, int width)
+{
+    const __m256i mask = _mm256_set1_epi16(0xFF);
+    const __m256i mask32 = _mm256_set1_epi32(0xFF);
+    int bpp = dst_fmt == CONVERT_DST_RGBA ? 4 : 3;
+    __m256i y, y_e, y_o, u, v, a, b, lo, hi, c0, c1, c2;
+    int x;
+
+    for(x = 0; x + 32 <= width; x += 32)
+    {
+        if(src_fmt == CONVERT_SRC_YUYV)
+        {
+            a = _mm256_loadu_si256((const __m256i *)(y_row + 2 * x));
+            b = _mm256_loadu_si256((const __m256i *)(y_row + 2 * x + 32));
+            /* Regroup so that each lane holds 16 consecutive pixels once packed */
+            lo = _mm256_permute2x128_si256(a, b, 0x20);
+            hi = _mm256_permute2x128_si256(a, b, 0x31);
+            y_e = _mm256_packs_epi32(_mm256_and_si256(lo, mask32), _mm256_and_si256(hi, mask32));
+            u = _mm256_packs_epi32(_mm256_and_si256(_mm256_srli_epi32(lo, 8), mask32),
+                    _mm256_and_si256(_mm256_srli_epi32(hi, 8), mask32));
+            y_o = _mm256_packs_epi32(_mm256_and_si256(_mm256_srli_epi32(lo, 16), mask32),
+                    _mm256_and_si256(_mm256_srli_epi32(hi, 16), mask32));
+            v = _mm256_packs_epi32(_mm256_srli_epi32(lo, 24), _mm256_srli_epi32(hi, 24));
+            y = _mm256_or_si256(y_e, _mm256_slli_epi16(y_o, 8));
+        }
+        else
+        {
+            y = _mm256_loadu_si256((const __m256i *)(y_row + x));
+            a = _mm256_loadu_si256((const __m256i *)(c_row + x));
+            y_e = _mm256_and_si256(y, mask);
+            y_o = _mm256_srli_epi16(y, 8);
+            if(src_fmt == CONVERT_SRC_NV21)
+            {
+                v = _mm256_and_si256(a, mask);
+                u = _mm256_srli_epi16(a, 8);
+            }
+            else
+            {
+                u = _mm256_and_si256(a, mask);
+                v = _mm256_srli_epi16(a, 8);
+            }
+        }
+
+        if(dst_fmt == CONVERT_DST_YCBCR)
+        {
+            c0 = y;
+            c1 = _mm256_or_si256(u, _mm256_slli_epi16(u, 8));
+            c2 = _mm256_or_si256(v, _mm256_slli_epi16(v, 8));
+        }
+        else
+        {
+            _yuv_to_rgb_avx2(y_e, y_o, u, v, &c0, &c1, &c2);
+        }
+        _store_sse2(dst_fmt, dst + x * bpp,
+                _mm256_castsi256_si128(c0),
+                _mm256_castsi256_si128(c1),
+                _mm256_castsi256_si128(c2));
+        _store_sse2(dst_fmt, dst + (x + 16) * bpp,
+                _mm256_extracti128_si256(c0, 1),
+                _mm256_extracti128_si256(c1, 1),
+                _mm256_extracti128_si256(c2, 1));
+    }
+
+    if(x < width)
+    {
+        _row_sse2(src_fmt, dst_fmt,
+                y_row + (src_fmt == CONVERT_SRC_YUYV ? 2 * x : x),
+                c_row ? c_row + x : NULL, dst + x * bpp, width - x);
+    }
+}
+
+#endif /* CONVERT_HAVE_X86 */
+
+#ifdef CONVERT_HAVE_NEON
+
+static inline int16x8_t _mulhi_neon(int16x8_t a, int16_t k)
+{
+    int16x4_t kk = vdup_n_s16(k);
+    int32x4_t lo = vmull_s16(vget_low_s16(a), kk);
+    int32x4_t hi = vmull_s16(vget_high_s16(a), kk);
+
+    return vcombine_s16(vshrn_n_s32(lo, 16), vshrn_n_s32(hi, 16));
+}
+
+/* 8 chroma pairs to 8 even and 8 odd pixels of each channel */
+static inline void _yuv_to_rgb_neon(int16x8_t y_e, int16x8_t y_o, int16x8_t u, int16x8_t v,
+        uint8x8_t r[2], uint8x8_t g[2], uint8x8_t b[2])
+{
+    int16x8_t c = vshlq_n_s16(vsubq_s16(v, vdupq_n_s16(128)), FIX_SHIFT);
+    int16x8_t d = vshlq_n_s16(vsubq_s16(u, vdupq_n_s16(128)), FIX_SHIFT);
+    int16x8_t rc = vaddq_s16(c, _mulhi_neon(c, K_R_CR));
+    int16x8_t gc = vsubq_s16(_mulhi_neon(c, K_G_CR), vaddq_s16(_mulhi_neon(d, K_G_CB), c));
+    int16x8_t bc = vsubq_s16(vshlq_n_s16(d, 1), _mulhi_neon(d, K_B_CB));
+    int16x8_t ys_e = vaddq_s16(vshlq_n_s16(y_e, FIX_SHIFT), vdupq_n_s16(FIX_ROUND));
+    int16x8_t ys_o = vaddq_s16(vshlq_n_s16(y_o, FIX_SHIFT), vdupq_n_s16(FIX_ROUND));
+
+    /* Saturating narrow clamps to [0, 255] like the reference */
+    r[0] = vqmovun_s16(vshrq_n_s16(vaddq_s16(ys_e, rc), FIX_SHIFT));
+    r[1] = vqmovun_s16(vshrq_n_s16(vaddq_s16(ys_o, rc), FIX_SHIFT));
+    g[0] = vqmovun_s16(vshrq_n_s16(vaddq_s16(ys_e, gc), FIX_SHIFT));
+    g[1] = vqmovun_s16(vshrq_n_s16(vaddq_s16(ys_o, gc), FIX_SHIFT));
+    b[0] = vqmovun_s16(vshrq_n_s16(vaddq_s16(ys_e, bc), FIX_SHIFT));
+    b[1] = vqmovun_s16(vshrq_n_s16(vaddq_s16(ys_o, bc), FIX_SHIFT));
+}
+
+static inline int16x8_t _widen(uint8x8_t v)
+{
+    return vreinterpretq_s16_u16(vmovl_u8(v));
+}
+
+/* 32 pixels per iteration, using structure loads/stores to (de)interleave */
+static void _row_neon(convert_src_fmt src_fmt, convert_dst_fmt dst_fmt,
+        const uint8_t *y_row, const uint8_t *c_row, uint8_t *dst, int width)
+{
+    int bpp = dst_fmt == CONVERT_DST_RGBA ? 4 : 3;
+    uint8x16_t y_e, y_o, u, v, c0_e, c0_o, c1_e, c1_o, c2_e, c2_o;
+    uint8x16x2_t c0, c1, c2;
+    uint8x8_t r[2], g[2], b[2];
+    int x, half;
+
+    for(x = 0; x + 32 <= width; x += 32)
+    {
+        if(src_fmt == CONVERT_SRC_YUYV)
+        {
+            uint8x16x4_t yuyv = vld4q_u8(y_row + 2 * x);
+            y_e = yuyv.val[0];
+            u = yuyv.val[1];
+            y_o = yuyv.val[2];
+            v = yuyv.val[3];
+        }
+        else
+        {
+            uint8x16x2_t yy = vld2q_u8(y_row + x);
+            uint8x16x2_t cc = vld2q_u8(c_row + x);
+            y_e = yy.val[0];
+            y_o = yy.val[1];
+            u = src_fmt == CONVERT_SRC_NV21 ? cc.val[1] : cc.val[0];
+            v = src_fmt == CONVERT_SRC_NV21 ? cc.val[0] : cc.val[1];
+        }
+
+        if(dst_fmt == CONVERT_DST_YCBCR)
+        {
+            c0_e = y_e;
+            c0_o = y_o;
+            c1_e = c1_o = u;
+            c2_e = c2_o = v;
+        }
+        else
+        {
+            uint8x8_t re[2], ro[2], ge[2], go[2], be[2], bo[2];
+
+            for(half = 0; half < 2; half++)
+            {
+                uint8x8_t ye8 = half ? vget_high_u8(y_e) : vget_low_u8(y_e);
+                uint8x8_t yo8 = half ? vget_high_u8(y_o) : vget_low_u8(y_o);
+                uint8x8_t u8 = half ? vget_high_u8(u) : vget_low_u8(u);
+                uint8x8_t v8 = half ? vget_high_u8(v) : vget_low_u8(v);
+
+                _yuv_to_rgb_neon(_widen(ye8), _widen(yo8), _widen(u8), _widen(v8), r, g, b);
+                re[half] = r[0];
+                ro[half] = r[1];
+                ge[half] = g[0];
+                go[half] = g[1];
+                be[half] = b[0];
+                bo[half] = b[1];
+            }
+            c0_e = vcombine_u8(re[0], re[1]);
+            c0_o = vcombine_u8(ro[0], ro[1]);
+            c1_e = vcombine_u8(ge[0], ge[1]);
+            c1_o = vcombine_u8(go[0], go[1]);
+            c2_e = vcombine_u8(be[0], be[1]);
+            c2_o = vcombine_u8(bo[0], bo[1]);
+        }
+
+        /* Back to pixel order */
+        c0 = vzipq_u8(c0_e, c0_o);
+        c1 = vzipq_u8(c1_e, c1_o);
+        c2 = vzipq_u8(c2_e, c2_o);
+
+        for(half = 0; half < 2; half++)
+        {
+            if(dst_fmt == CONVERT_DST_RGBA)
+            {
+                uint8x16x4_t px = { { c0.val[half], c1.val[half], c2.val[half], vdupq_n_u8(0xFF) } };
+                vst4q_u8(dst + (x + 16 * half) * bpp, px);
+            }
+            else
+            {
+                uint8x16x3_t px = { { c0.val[half], c1.val[half], c2.val[half] } };
+                vst3q_u8(dst + (x + 16 * half) * bpp, px);
+            }
+        }
+    }
+
+    if(x < width)
+    {
+        _row_scalar(src_fmt, dst_fmt,
+                y_row + (src_fmt == CONVERT_SRC_YUYV ? 2 * x : x),
+                c_row ? c_row + x : NULL, dst + x * bpp, width - x);
+    }
+}
+
+#endif /* CONVERT_HAVE_NEON */
+
+static convert_row_fn _get_row_fn(convert_isa isa)
+{
+    switch(isa)
+    {
+#ifdef CONVERT_HAVE_X86
+        case CONVERT_ISA_SSE2:
+            return _row_sse2;
+        case CONVERT_ISA_AVX2:
+            return _row_avx2;
+#endif
+#ifdef CONVERT_HAVE_NEON
+        case CONVERT_ISA_NEON:
+            return _row_neon;
+#endif
+        case CONVERT_ISA_SCALAR:
+            return _row_scalar;
+        default:
+            return NULL;
+    }
+}
+
+int convert_isa_supported(convert_isa isa)
+{
+    switch(isa)
+    {
+        case CONVERT_ISA_SCALAR:
+            return 1;
+#ifdef CONVERT_HAVE_X86
+        case CONVERT_ISA_SSE2:
+            return __builtin_cpu_supports("sse2");
+        case CONVERT_ISA_AVX2:
+            return __builtin_cpu_supports("avx2");
+#endif
+#ifdef CONVERT_HAVE_NEON
+        case CONVERT_ISA_NEON:
+            return 1;
+#endif
+        default:
+            return 0;
+    }
+}
+
+/* Best kernel for the running CPU, detected once */
+convert_isa convert_get_isa(void)
+{
+    static int isa = -1;
+
+    if(isa < 0)
+    {
+        if(convert_isa_supported(CONVERT_ISA_AVX2))
+            isa = CONVERT_ISA_AVX2;
+        else if(convert_isa_supported(CONVERT_ISA_NEON))
+            isa = CONVERT_ISA_NEON;
+        else if(convert_isa_supported(CONVERT_ISA_SSE2))
+            isa = CONVERT_ISA_SSE2;
+        else
+            isa = CONVERT_ISA_SCALAR;
+        DBG("Using %s pixel conversion kernels", convert_isa_name(isa));
+    }
+
+    return isa;
+}
+
+const char *convert_isa_name(convert_isa isa)
+{
+    switch(isa)
+    {
+        case CONVERT_ISA_SCALAR:
+            return "scalar";
+        case CONVERT_ISA_SSE2:
+            return "sse2";
+        case CONVERT_ISA_AVX2:
+            return "avx2";
+        case CONVERT_ISA_NEON:
+            return "neon";
+        default:
+            return "unknown";
+    }
+}
+
+int convert_frame_isa(convert_isa isa, convert_src_fmt src_fmt, const uint8_t *src, int src_stride,
+        convert_dst_fmt dst_fmt, uint8_t *dst, int dst_stride, int width, int height)
+{
+    convert_row_fn row_fn = NULL;
+    const uint8_t *chroma = NULL;
+    int y;
+
+    if(!src || !dst || width <= 0 || height <= 0 || (width & 1))
+    {
+        ERR("Cannot convert frame : invalid parameters");
+        return -1;
+    }
+
+    if(!convert_isa_supported(isa) || (row_fn = _get_row_fn(isa)) == NULL)
+    {
+        ERR("Cannot convert frame : %s kernels not supported", convert_isa_name(isa));
+        return -1;
+    }
+
+    if(src_fmt != CONVERT_SRC_YUYV)
+        chroma = src + src_stride * height;
+
+    for(y = 0; y < height; y++)
+    {
+        row_fn(src_fmt, dst_fmt, src + y * src_stride,
+                chroma ? chroma + (y >> 1) * src_stride : NULL,
+                dst + y * dst_stride, width);
+    }
+
+    return 0;
+}
+
+int convert_frame(convert_src_fmt src_fmt, const uint8_t *src, int src_stride,
+        convert_dst_fmt dst_fmt, uint8_t *dst, int dst_stride, int width, int height)
+{
+    return convert_frame_isa(convert_get_isa(), src_fmt, src, src_stride,
+            dst_fmt, dst, dst_stride, width, height);
+}
@@ -0,0 +1,37 @@
+#ifndef CONVERT_H
+#define CONVERT_H
+
+#include <stdint.h>
+
+typedef enum
+{
+    CONVERT_SRC_NV21,   /* Y plane, then interleaved VU plane at half resolution */
+    CONVERT_SRC_NV12,   /* Y plane, then interleaved UV plane at half resolution */
+    CONVERT_SRC_YUYV,   /* Packed Y0 U Y1 V macropixels */
+} convert_src_fmt;
+
+typedef enum
+{
+    CONVERT_DST_RGB,    /* 3 bytes per pixel */
+    CONVERT_DST_RGBA,   /* 4 bytes per pixel, alpha set to 0xFF */
+    CONVERT_DST_YCBCR,  /* 3 bytes per pixel, chroma upsampled by replication */
+} convert_dst_fmt;
+
+typedef enum
+{
+    CONVERT_ISA_SCALAR,
+    CONVERT_ISA_SSE2,
+    CONVERT_ISA_AVX2,
+    CONVERT_ISA_NEON,
+    CONVERT_ISA_COUNT,
+} convert_isa;
+
+int convert_frame(convert_src_fmt src_fmt, const uint8_t *src, int src_stride,
+        convert_dst_fmt dst_fmt, uint8_t *dst, int dst_stride, int width, int height);
+int convert_frame_isa(convert_isa isa, convert_src_fmt src_fmt, const uint8_t *src, int src_stride,
+        convert_dst_fmt dst_fmt, uint8_t *dst, int dst_stride, int width, int height);
+int convert_isa_supported(convert_isa isa);
+convert_isa convert_get_isa(void);
+const char *convert_isa_name(convert_isa isa);
+
+#endif
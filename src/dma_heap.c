@@ -0,0 +1,37 @@
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <linux/dma-heap.h>
+
+#include "utils.h"
+#include "dma_heap.h"
+
+/* Allocate a dmabuf from a kernel DMA heap. Returns the dmabuf file
+ * descriptor, to be closed by the caller, or -1 on error */
+int dma_heap_alloc(const char *heap, size_t size)
+{
+    struct dma_heap_allocation_data data;
+    int heap_fd = -1;
+
+    heap_fd = open(heap ? heap : DMA_HEAP_DEFAULT, O_RDWR | O_CLOEXEC);
+    if(heap_fd < 0)
+    {
+        ERR("Cannot open DMA heap %s : %s", heap ? heap : DMA_HEAP_DEFAULT, strerror(errno));
+        return -1;
+    }
+
+    memset(&data, 0, sizeof(data));
+    data.len = size;
+    data.fd_flags = O_RDWR | O_CLOEXEC;
+    if(ioctl(heap_fd, DMA_HEAP_IOCTL_ALLOC, &data) == -1)
+    {
+        ERR("Cannot allocate %zu bytes from DMA heap : %s", size, strerror(errno));
+        close(heap_fd);
+        return -1;
+    }
+    close(heap_fd);
+
+    return data.fd;
+}
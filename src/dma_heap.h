@@ -0,0 +1,10 @@
+#ifndef DMA_HEAP_H
+#define DMA_HEAP_H
+
+#include <stddef.h>
+
+#define DMA_HEAP_DEFAULT            "/dev/dma_heap/system"
+
+int dma_heap_alloc(const char *heap, size_t size);
+
+#endif
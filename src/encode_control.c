@@ -0,0 +1,241 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "utils.h"
+#include "encode_control.h"
+
+/* Load is evaluated over periods of at least this length */
+#define CONTROL_PERIOD_NS       (500 * 1000 * 1000ULL)
+/* Percent of the budget above which settings are lowered, and below which they
+ * can be raised back */
+#define LOAD_HIGH               90
+#define LOAD_LOW                60
+/* Calm periods needed before raising settings back. Doubled each time raised
+ * settings had to be lowered again soon after, so that the controller does not
+ * keep oscillating around a level the box cannot hold */
+#define RESTORE_HOLD            4
+#define RESTORE_HOLD_MAX        64
+#define QUALITY_STEP            10
+
+/* Levels go from the best settings to the cheapest ones : first the knobs
+ * costing time for little visible gain (Huffman optimisation pass, accurate
+ * DCT, 4:2:2 chroma of packed inputs) then quality, one step at a time */
+struct encode_control
+{
+    char name[DEVICE_NAME_MAX_SIZE];
+    metrics_t *metrics;
+    encode_control_config config;
+    int nb_knobs;
+    int nb_levels;
+
+    pthread_mutex_t lock;
+    int level;
+    unsigned int generation;
+    jpeg_encoder_settings settings;
+
+    /* Current period */
+    uint64_t period_start_ns;
+    uint64_t busy_ns;
+    unsigned long frames;
+    unsigned int max_pending;
+    uint64_t dropped;
+
+    unsigned int calm_periods;
+    unsigned int restore_hold;
+    unsigned int periods_since_restore;
+};
+
+static void _get_level_settings(encode_control_t *c, int level, jpeg_encoder_settings *s)
+{
+    int quality = c->config.max_quality;
+
+    memset(s, 0, sizeof(jpeg_encoder_settings));
+    if(c->nb_levels == 1)
+    {
+        /* Fixed quality, libjpeg default settings */
+        s->quality = quality;
+        return;
+    }
+
+    s->optimize_coding = level < 1;
+    s->fast_dct = level >= 2;
+    s->chroma_420 = c->config.packed_input && level >= 3;
+    if(level >= c->nb_knobs)
+        quality -= (level - c->nb_knobs + 1) * QUALITY_STEP;
+    s->quality = quality > c->config.min_quality ? quality : c->config.min_quality;
+}
+
+static void _publish(encode_control_t *c)
+{
+    metrics_set(c->metrics, METRICS_GAUGE_ENCODER_QUALITY, c->settings.quality);
+    metrics_set(c->metrics, METRICS_GAUGE_ENCODER_FAST_DCT, c->settings.fast_dct);
+    metrics_set(c->metrics, METRICS_GAUGE_ENCODER_OPTIMIZED, c->settings.optimize_coding);
+    metrics_set(c->metrics, METRICS_GAUGE_ENCODER_CHROMA_420,
+            c->settings.chroma_420 || !c->config.packed_input);
+}
+
+encode_control_t *encode_control_create(const char *name, metrics_t *metrics,
+        const encode_control_config *config)
+{
+    encode_control_t *c = NULL;
+
+    if(config->min_quality < 1 || config->max_quality > 100 || config->min_quality > config->max_quality)
+    {
+        ERR("Invalid JPEG quality range %d-%d (must be within 1-100)", config->min_quality, config->max_quality);
+        return NULL;
+    }
+
+    c = calloc(1, sizeof(encode_control_t));
+    if(!c)
+    {
+        ERR("Cannot allocate encoder control");
+        return NULL;
+    }
+
+    snprintf(c->name, DEVICE_NAME_MAX_SIZE, "%s", name);
+    c->metrics = metrics;
+    c->config = *config;
+    if(c->config.nb_writers == 0)
+        c->config.nb_writers = 1;
+    pthread_mutex_init(&c->lock, NULL);
+
+    c->nb_knobs = config->packed_input ? 4 : 3;
+    c->nb_levels = 1;
+    if(config->min_quality < config->max_quality)
+        c->nb_levels = c->nb_knobs + (config->max_quality - config->min_quality + QUALITY_STEP - 1) / QUALITY_STEP;
+    c->restore_hold = RESTORE_HOLD;
+    c->periods_since_restore = RESTORE_HOLD_MAX;
+    c->period_start_ns = metrics_now_ns();
+    c->dropped = metrics_get_counter(metrics, METRICS_COUNTER_RING_FULL);
+    _get_level_settings(c, 0, &c->settings);
+    _publish(c);
+
+    if(c->nb_levels > 1 && config->cpu_budget)
+    {
+        INF("%s : JPEG quality adapted between %d and %d, to use at most %u %% of a CPU", c->name,
+                config->min_quality, config->max_quality, config->cpu_budget);
+    }
+    else if(c->nb_levels > 1)
+    {
+        INF("%s : JPEG quality adapted between %d and %d, to keep up with the capture", c->name,
+                config->min_quality, config->max_quality);
+    }
+    return c;
+}
+
+void encode_control_destroy(encode_control_t *c)
+{
+    if(!c)
+        return;
+
+    pthread_mutex_destroy(&c->lock);
+    free(c);
+}
+
+unsigned int encode_control_get_settings(encode_control_t *c, jpeg_encoder_settings *settings)
+{
+    unsigned int generation = 0;
+
+    pthread_mutex_lock(&c->lock);
+    *settings = c->settings;
+    generation = c->generation;
+    pthread_mutex_unlock(&c->lock);
+
+    return generation;
+}
+
+static void _set_level(encode_control_t *c, int level, unsigned int load, uint64_t dropped)
+{
+    int degraded = level > c->level;
+
+    c->level = level;
+    c->generation++;
+    _get_level_settings(c, level, &c->settings);
+    _publish(c);
+    metrics_add(c->metrics, degraded ? METRICS_COUNTER_ENCODER_DEGRADED : METRICS_COUNTER_ENCODER_RESTORED, 1);
+    INF("%s : encoder %s to quality %d%s%s%s (load %u %%, %u frames queued, %lu dropped)", c->name,
+            degraded ? "degraded" : "restored", c->settings.quality,
+            c->settings.fast_dct ? ", fast DCT" : "",
+            c->settings.optimize_coding ? ", optimized Huffman tables" : "",
+            c->settings.chroma_420 ? ", 4:2:0 chroma" : "",
+            load, c->max_pending, (unsigned long)dropped);
+}
+
+/* Load is the share of the budget used : the frame interval of each writer
+ * and the CPU budget, whichever is the tightest. Frames queued or dropped
+ * mean writers are late whatever the load, e.g. for sources without a rate */
+static void _evaluate(encode_control_t *c, uint64_t now_ns)
+{
+    uint64_t elapsed_ns = now_ns - c->period_start_ns;
+    uint64_t dropped = metrics_get_counter(c->metrics, METRICS_COUNTER_RING_FULL);
+    uint64_t cpu_load = 0;
+    uint64_t load = 0;
+    int late = 0;
+
+    if(c->config.target_fps)
+        load = c->busy_ns * c->config.target_fps * 100 / c->frames / (c->config.nb_writers * 1000000000ULL);
+    if(c->config.cpu_budget)
+    {
+        cpu_load = c->busy_ns * 100 * 100 / elapsed_ns / c->config.cpu_budget;
+        if(cpu_load > load)
+            load = cpu_load;
+    }
+    metrics_set(c->metrics, METRICS_GAUGE_ENCODER_LOAD, load);
+    late = dropped > c->dropped || c->max_pending > c->config.queue_size / 2;
+
+    if(c->periods_since_restore < RESTORE_HOLD_MAX)
+        c->periods_since_restore++;
+    if(late || load > LOAD_HIGH)
+    {
+        c->calm_periods = 0;
+        if(c->level < c->nb_levels - 1)
+        {
+            /* Raised settings did not hold */
+            if(c->periods_since_restore <= c->restore_hold && c->restore_hold < RESTORE_HOLD_MAX)
+                c->restore_hold *= 2;
+            _set_level(c, c->level + 1, load, dropped - c->dropped);
+        }
+    }
+    else if(load < LOAD_LOW && c->max_pending <= 1)
+    {
+        if(++c->calm_periods >= c->restore_hold && c->level > 0)
+        {
+            c->calm_periods = 0;
+            c->periods_since_restore = 0;
+            _set_level(c, c->level - 1, load, 0);
+        }
+        /* Settings held for long : allow quicker restores again */
+        if(c->periods_since_restore >= RESTORE_HOLD_MAX)
+            c->restore_hold = RESTORE_HOLD;
+    }
+    else
+    {
+        c->calm_periods = 0;
+    }
+
+    c->period_start_ns = now_ns;
+    c->busy_ns = 0;
+    c->frames = 0;
+    c->max_pending = 0;
+    c->dropped = dropped;
+}
+
+void encode_control_report(encode_control_t *c, uint64_t busy_ns, unsigned int pending)
+{
+    uint64_t now_ns = 0;
+
+    if(c->nb_levels == 1)
+        return;
+
+    now_ns = metrics_now_ns();
+    pthread_mutex_lock(&c->lock);
+    c->busy_ns += busy_ns;
+    c->frames++;
+    if(pending > c->max_pending)
+        c->max_pending = pending;
+    if(now_ns - c->period_start_ns >= CONTROL_PERIOD_NS)
+        _evaluate(c, now_ns);
+    pthread_mutex_unlock(&c->lock);
+}
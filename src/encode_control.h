@@ -0,0 +1,36 @@
+#ifndef ENCODE_CONTROL_H
+#define ENCODE_CONTROL_H
+
+#include <stdint.h>
+
+#include "jpeg_encoder.h"
+#include "metrics.h"
+
+typedef struct
+{
+    int min_quality;
+    int max_quality;            /* Equal to min_quality : fixed settings */
+    int packed_input;           /* 4:2:2 input, which can be encoded as 4:2:0 */
+    unsigned int target_fps;    /* Recorded frame rate to keep up with, 0 if unknown */
+    unsigned int cpu_budget;    /* Percent of one CPU for all writers, 0 : no limit */
+    unsigned int nb_writers;
+    unsigned int queue_size;    /* Frames the writers can be late by before drops */
+} encode_control_config;
+
+/* Encoder settings of one device, shared by its writers. With a quality range,
+ * settings are lowered one step at a time when encoding falls behind the
+ * frame rate, uses more than its CPU budget, or lets frames pile up, and
+ * raised back once it has kept up for a while. Every change is counted in
+ * metrics, and the current settings exported as gauges */
+typedef struct encode_control encode_control_t;
+
+encode_control_t *encode_control_create(const char *name, metrics_t *metrics,
+        const encode_control_config *config);
+void encode_control_destroy(encode_control_t *c);
+/* Returns a generation number, which changes along with the settings */
+unsigned int encode_control_get_settings(encode_control_t *c, jpeg_encoder_settings *settings);
+/* Called by the writers after each frame, with the time spent on it and the
+ * number of frames still waiting for a writer */
+void encode_control_report(encode_control_t *c, uint64_t busy_ns, unsigned int pending);
+
+#endif
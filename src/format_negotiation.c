@@ -0,0 +1,250 @@
+#include <string.h>
+#include <errno.h>
+#include <sys/ioctl.h>
+#include <linux/videodev2.h>
+
+#include "utils.h"
+#include "format_negotiation.h"
+
+/* Relative CPU cost of producing the requested output from each pixel format
+ * the pipeline can handle, in tenths of a unit per pixel. A unit is roughly
+ * one byte touched by the capture or writer threads : frame copy to the writer
+ * ring, plus JPEG encoding of every luma and chroma sample (~10 units per
+ * sample). 0 means the pipeline cannot produce that output from this format */
+typedef struct
+{
+    uint32_t pixelformat;
+    unsigned int cost[FORMAT_OUTPUT_COUNT];
+    const char *reason[FORMAT_OUTPUT_COUNT];
+} format_pipeline;
+
+static const format_pipeline _pipelines[] = {
+    {
+        V4L2_PIX_FMT_MJPEG, { 180, 2 },
+        { "decoded to NV12 by the writers", "JPEG pass-through, no encoding" }
+    },
+    {
+        V4L2_PIX_FMT_NV12, { 15, 165 },
+        { "1.5 bytes per pixel", "4:2:0 encoding, luma read in place" }
+    },
+    {
+        V4L2_PIX_FMT_NV21, { 15, 165 },
+        { "1.5 bytes per pixel", "4:2:0 encoding, luma read in place" }
+    },
+    {
+        V4L2_PIX_FMT_YUYV, { 20, 240 },
+        { "2 bytes per pixel", "4:2:2 encoding, planes deinterleaved" }
+    },
+};
+
+#define NB_PIPELINES    (sizeof(_pipelines) / sizeof(_pipelines[0]))
+
+static int xioctl(int fh, int request, void *arg)
+{
+    int r;
+
+    do {
+        r = ioctl(fh, request, arg);
+    } while (-1 == r && EINTR == errno);
+
+    return r;
+}
+
+static const format_pipeline *_get_pipeline(uint32_t pixelformat)
+{
+    unsigned int i = 0;
+
+    for(i = 0; i < NB_PIPELINES; i++)
+    {
+        if(_pipelines[i].pixelformat == pixelformat)
+            return &_pipelines[i];
+    }
+    return NULL;
+}
+
+static unsigned int _clamp_step(unsigned int value, unsigned int min, unsigned int max, unsigned int step)
+{
+    if(value <= min)
+        return min;
+    if(value >= max)
+        return max;
+    if(step > 1)
+        value = min + (value - min) / step * step;
+    return value;
+}
+
+/* Requested size if the device supports it, else the smallest one covering it,
+ * else the largest one */
+static void _pick_size(int fd, uint32_t pixelformat, unsigned int width, unsigned int height,
+        unsigned int *out_width, unsigned int *out_height)
+{
+    struct v4l2_frmsizeenum size;
+    unsigned long area = 0, best_area = 0;
+    int covering = 0;
+
+    *out_width = width;
+    *out_height = height;
+
+    memset(&size, 0, sizeof(size));
+    size.pixel_format = pixelformat;
+    if(xioctl(fd, VIDIOC_ENUM_FRAMESIZES, &size) == -1)
+    {
+        /* Driver will adjust the size itself when setting the format */
+        return;
+    }
+
+    if(size.type != V4L2_FRMSIZE_TYPE_DISCRETE)
+    {
+        *out_width = _clamp_step(width, size.stepwise.min_width,
+                size.stepwise.max_width, size.stepwise.step_width);
+        *out_height = _clamp_step(height, size.stepwise.min_height,
+                size.stepwise.max_height, size.stepwise.step_height);
+        return;
+    }
+
+    do {
+        if(size.discrete.width == width && size.discrete.height == height)
+            return;
+
+        area = (unsigned long)size.discrete.width * size.discrete.height;
+        if(size.discrete.width >= width && size.discrete.height >= height)
+        {
+            if(!covering || area < best_area)
+            {
+                covering = 1;
+                best_area = area;
+                *out_width = size.discrete.width;
+                *out_height = size.discrete.height;
+            }
+        }
+        else if(!covering && area > best_area)
+        {
+            best_area = area;
+            *out_width = size.discrete.width;
+            *out_height = size.discrete.height;
+        }
+        size.index++;
+    } while(xioctl(fd, VIDIOC_ENUM_FRAMESIZES, &size) == 0);
+}
+
+/* Slowest rate at least as fast as requested, else the fastest one */
+static unsigned int _pick_frame_rate(int fd, uint32_t pixelformat, unsigned int width,
+        unsigned int height, unsigned int frame_rate)
+{
+    struct v4l2_frmivalenum ival;
+    unsigned int rate = 0, best = 0;
+    unsigned int min_rate = 0, max_rate = 0;
+    int covering = 0;
+
+    memset(&ival, 0, sizeof(ival));
+    ival.pixel_format = pixelformat;
+    ival.width = width;
+    ival.height = height;
+    if(xioctl(fd, VIDIOC_ENUM_FRAMEINTERVALS, &ival) == -1)
+        return frame_rate;
+
+    if(ival.type != V4L2_FRMIVAL_TYPE_DISCRETE)
+    {
+        /* Shortest interval is the fastest rate */
+        if(ival.stepwise.min.numerator == 0 || ival.stepwise.max.numerator == 0)
+            return frame_rate;
+        max_rate = ival.stepwise.min.denominator / ival.stepwise.min.numerator;
+        min_rate = ival.stepwise.max.denominator / ival.stepwise.max.numerator;
+        return _clamp_step(frame_rate, min_rate, max_rate, 1);
+    }
+
+    do {
+        if(ival.discrete.numerator != 0)
+        {
+            rate = ival.discrete.denominator / ival.discrete.numerator;
+            if(rate >= frame_rate)
+            {
+                if(!covering || rate < best)
+                {
+                    covering = 1;
+                    best = rate;
+                }
+            }
+            else if(!covering && rate > best)
+            {
+                best = rate;
+            }
+        }
+        ival.index++;
+    } while(xioctl(fd, VIDIOC_ENUM_FRAMEINTERVALS, &ival) == 0);
+
+    return best ? best : frame_rate;
+}
+
+/* Enumerate every format, size and frame interval the device offers, and pick
+ * the cheapest pipeline producing the requested output. Candidates matching
+ * the requested size and rate always win over the ones that do not, then the
+ * lowest estimated cost, then the driver preference order */
+int format_negotiate(int fd, const char *name, format_output output,
+        unsigned int width, unsigned int height, unsigned int frame_rate,
+        format_choice *choice)
+{
+    struct v4l2_fmtdesc fmt_desc;
+    const format_pipeline *pipeline = NULL;
+    const char *reason = NULL;
+    format_choice candidate;
+    int matches = 0, best_matches = 0;
+    int found = 0;
+
+    memset(&fmt_desc, 0, sizeof(fmt_desc));
+    fmt_desc.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+    while(xioctl(fd, VIDIOC_ENUM_FMT, &fmt_desc) == 0)
+    {
+        fmt_desc.index++;
+        pipeline = _get_pipeline(fmt_desc.pixelformat);
+        if(!pipeline || pipeline->cost[output] == 0)
+        {
+            INF("%s : skipping %c%c%c%c, not supported for this output", name,
+                    fmt_desc.pixelformat & 0xFF,
+                    (fmt_desc.pixelformat >> 8) & 0xFF,
+                    (fmt_desc.pixelformat >> 16) & 0xFF,
+                    (fmt_desc.pixelformat >> 24) & 0xFF);
+            continue;
+        }
+
+        candidate.pixelformat = fmt_desc.pixelformat;
+        _pick_size(fd, candidate.pixelformat, width, height, &candidate.width, &candidate.height);
+        candidate.frame_rate = _pick_frame_rate(fd, candidate.pixelformat,
+                candidate.width, candidate.height, frame_rate);
+        candidate.cost = (unsigned long)pipeline->cost[output] * candidate.width *
+            candidate.height / 10 * candidate.frame_rate / 1000;
+        matches = candidate.width == width && candidate.height == height &&
+            candidate.frame_rate >= frame_rate;
+
+        INF("%s : candidate %c%c%c%c %ux%u@%u, cost %lu (%s%s)", name,
+                candidate.pixelformat & 0xFF,
+                (candidate.pixelformat >> 8) & 0xFF,
+                (candidate.pixelformat >> 16) & 0xFF,
+                (candidate.pixelformat >> 24) & 0xFF,
+                candidate.width, candidate.height, candidate.frame_rate, candidate.cost,
+                pipeline->reason[output], matches ? "" : ", does not match request");
+
+        if(!found || matches > best_matches ||
+           (matches == best_matches && candidate.cost < choice->cost))
+        {
+            *choice = candidate;
+            best_matches = matches;
+            reason = pipeline->reason[output];
+            found = 1;
+        }
+    }
+
+    if(!found)
+    {
+        ERR("%s : no supported pixel format for the requested output", name);
+        return -1;
+    }
+
+    INF("%s : selected %c%c%c%c %ux%u@%u : %s", name,
+            choice->pixelformat & 0xFF,
+            (choice->pixelformat >> 8) & 0xFF,
+            (choice->pixelformat >> 16) & 0xFF,
+            (choice->pixelformat >> 24) & 0xFF,
+            choice->width, choice->height, choice->frame_rate, reason);
+    return 0;
+}
@@ -0,0 +1,26 @@
+#ifndef FORMAT_NEGOTIATION_H
+#define FORMAT_NEGOTIATION_H
+
+#include <stdint.h>
+
+typedef enum
+{
+    FORMAT_OUTPUT_RAW,      /* Uncompressed frames : callbacks, frame bus, raw dumps */
+    FORMAT_OUTPUT_JPEG,     /* JPEG files */
+    FORMAT_OUTPUT_COUNT,
+} format_output;
+
+typedef struct
+{
+    uint32_t pixelformat;
+    unsigned int width;
+    unsigned int height;
+    unsigned int frame_rate;
+    unsigned long cost;     /* Estimated CPU cost per second, arbitrary units */
+} format_choice;
+
+int format_negotiate(int fd, const char *name, format_output output,
+        unsigned int width, unsigned int height, unsigned int frame_rate,
+        format_choice *choice);
+
+#endif
@@ -0,0 +1,414 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+
+#include "utils.h"
+#include "frame_bus.h"
+
+/* Frames are published in a POSIX shared memory object (tmpfs, like a memfd,
+ * but with a name so that unrelated processes can attach without passing file
+ * descriptors around). Layout :
+ *
+ *   | header | slot headers | slot 0 data | slot 1 data | ... |
+ *
+ * There is a single writer and no lock : each slot is protected by a sequence
+ * counter (seqlock). The counter is odd while the producer writes the slot, and
+ * equals 2 * (frame sequence + 1) once the frame is complete. Readers map the
+ * bus read-only, read frames in place and check the counter did not move while
+ * they were using the data, so the producer never waits for anybody. Only the
+ * header is also mapped writable by readers, to count themselves as waiters :
+ * the producer skips the wake-up syscall while nobody waits. */
+#define FRAME_BUS_MAGIC         0x53554246  /* "FBUS" */
+#define FRAME_BUS_VERSION       2
+#define CACHE_LINE_SIZE         64
+
+struct frame_bus_slot_header
+{
+    uint64_t seq;
+    uint64_t frame_seq;
+    uint64_t timestamp_us;
+    uint64_t size;
+    uint64_t offset;
+} __attribute__((aligned(CACHE_LINE_SIZE)));
+
+struct frame_bus_header
+{
+    uint32_t magic;
+    uint32_t version;
+    uint32_t nb_slots;
+    uint32_t closed;
+    uint64_t slot_size;
+    uint64_t map_size;
+    uint32_t width;
+    uint32_t height;
+    uint32_t stride;
+    uint32_t pixelformat;
+
+    /* Number of frames published so far, futex word bumped on each of them
+     * and number of readers sleeping on it */
+    uint64_t write_seq __attribute__((aligned(CACHE_LINE_SIZE)));
+    uint32_t futex;
+    uint32_t waiters;
+
+    struct frame_bus_slot_header slots[];
+};
+
+struct frame_bus
+{
+    char name[FRAME_BUS_NAME_MAX_SIZE];
+    int fd;
+    struct frame_bus_header *hdr;
+    size_t map_size;
+    unsigned long nb_oversized;
+};
+
+struct frame_bus_reader
+{
+    int fd;
+    const struct frame_bus_header *hdr;
+    size_t map_size;
+    /* Writable mapping of the header page, for the waiters count only */
+    struct frame_bus_header *waiters_hdr;
+    size_t waiters_map_size;
+    uint64_t next_seq;
+    uint64_t lost;
+};
+
+static size_t _round_up(size_t size, size_t align)
+{
+    return (size + align - 1) / align * align;
+}
+
+/* shm_open() wants a single leading slash */
+static void _shm_name(char *dst, const char *name)
+{
+    snprintf(dst, FRAME_BUS_NAME_MAX_SIZE, "%s%s", name[0] == '/' ? "" : "/", name);
+}
+
+static int _futex(const uint32_t *addr, int op, uint32_t val, const struct timespec *timeout)
+{
+    return syscall(SYS_futex, addr, op, val, timeout, NULL, 0);
+}
+
+frame_bus_t *frame_bus_create(const char *name, unsigned int nb_slots, size_t slot_size,
+        uint32_t width, uint32_t height, uint32_t stride, uint32_t pixelformat)
+{
+    frame_bus_t *bus = NULL;
+    struct frame_bus_header *hdr = NULL;
+    size_t page_size = sysconf(_SC_PAGESIZE);
+    size_t header_size = 0;
+    unsigned int i = 0;
+
+    if(!name || nb_slots == 0 || slot_size == 0)
+    {
+        ERR("Cannot create frame bus : invalid parameters");
+        return NULL;
+    }
+
+    bus = calloc(1, sizeof(frame_bus_t));
+    if(!bus)
+    {
+        ERR("Cannot allocate frame bus");
+        return NULL;
+    }
+    _shm_name(bus->name, name);
+
+    slot_size = _round_up(slot_size, page_size);
+    header_size = _round_up(sizeof(struct frame_bus_header) +
+            nb_slots * sizeof(struct frame_bus_slot_header), page_size);
+    bus->map_size = header_size + nb_slots * slot_size;
+
+    /* A previous producer may have died without removing its bus. Readers
+     * still attached to it keep their own mapping */
+    shm_unlink(bus->name);
+    bus->fd = shm_open(bus->name, O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, 0644);
+    if(bus->fd < 0)
+    {
+        ERR("Cannot create frame bus %s : %s", bus->name, strerror(errno));
+        free(bus);
+        return NULL;
+    }
+
+    if(ftruncate(bus->fd, bus->map_size) != 0)
+    {
+        ERR("Cannot size frame bus %s to %zu bytes : %s", bus->name, bus->map_size, strerror(errno));
+        goto error;
+    }
+
+    hdr = mmap(NULL, bus->map_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, bus->fd, 0);
+    if(hdr == MAP_FAILED)
+    {
+        ERR("Cannot map frame bus %s : %s", bus->name, strerror(errno));
+        goto error;
+    }
+    bus->hdr = hdr;
+
+    hdr->version = FRAME_BUS_VERSION;
+    hdr->nb_slots = nb_slots;
+    hdr->slot_size = slot_size;
+    hdr->map_size = bus->map_size;
+    hdr->width = width;
+    hdr->height = height;
+    hdr->stride = stride;
+    hdr->pixelformat = pixelformat;
+    for(i = 0; i < nb_slots; i++)
+        hdr->slots[i].offset = header_size + i * slot_size;
+
+    /* Readers attaching meanwhile only trust a header carrying the magic */
+    __atomic_store_n(&hdr->magic, FRAME_BUS_MAGIC, __ATOMIC_RELEASE);
+
+    INF("Frame bus %s created : %u slots of %zu bytes", bus->name, nb_slots, slot_size);
+    return bus;
+
+error:
+    close(bus->fd);
+    shm_unlink(bus->name);
+    free(bus);
+    return NULL;
+}
+
+void frame_bus_destroy(frame_bus_t *bus)
+{
+    if(!bus)
+        return;
+
+    if(bus->hdr)
+    {
+        /* Let blocked readers notice the producer is gone */
+        __atomic_store_n(&bus->hdr->closed, 1, __ATOMIC_RELEASE);
+        __atomic_add_fetch(&bus->hdr->futex, 1, __ATOMIC_RELEASE);
+        _futex(&bus->hdr->futex, FUTEX_WAKE, INT_MAX, NULL);
+        munmap(bus->hdr, bus->map_size);
+    }
+    if(bus->nb_oversized)
+        INF("Frame bus %s : %lu frames larger than the slots not published", bus->name, bus->nb_oversized);
+    close(bus->fd);
+    shm_unlink(bus->name);
+    free(bus);
+}
+
+/* Producer side, called from the capture thread. Never blocks : the oldest
+ * slot is overwritten whatever the readers are doing. Frames larger than a
+ * slot are not published rather than truncated */
+void frame_bus_publish(frame_bus_t *bus, const void *data, size_t size, uint64_t timestamp_us)
+{
+    struct frame_bus_header *hdr = bus->hdr;
+    uint64_t n = hdr->write_seq;
+    struct frame_bus_slot_header *slot = &hdr->slots[n % hdr->nb_slots];
+
+    if(size > hdr->slot_size)
+    {
+        if(bus->nb_oversized++ == 0)
+            ERR("Frame bus %s : %zu bytes frames do not fit in %lu bytes slots, not published", bus->name,
+                    size, (unsigned long)hdr->slot_size);
+        return;
+    }
+
+    __atomic_store_n(&slot->seq, 2 * n + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+
+    memcpy((uint8_t *)hdr + slot->offset, data, size);
+    __atomic_store_n(&slot->frame_seq, n, __ATOMIC_RELAXED);
+    __atomic_store_n(&slot->timestamp_us, timestamp_us, __ATOMIC_RELAXED);
+    __atomic_store_n(&slot->size, size, __ATOMIC_RELAXED);
+
+    __atomic_store_n(&slot->seq, 2 * n + 2, __ATOMIC_RELEASE);
+    __atomic_store_n(&hdr->write_seq, n + 1, __ATOMIC_RELEASE);
+
+    /* Readers count themselves before sleeping, and FUTEX_WAIT returns at once
+     * if the futex moved since : either they see this frame or it wakes them */
+    __atomic_add_fetch(&hdr->futex, 1, __ATOMIC_SEQ_CST);
+    if(__atomic_load_n(&hdr->waiters, __ATOMIC_SEQ_CST))
+        _futex(&hdr->futex, FUTEX_WAKE, INT_MAX, NULL);
+}
+
+frame_bus_reader_t *frame_bus_reader_attach(const char *name)
+{
+    frame_bus_reader_t *reader = NULL;
+    char shm_name[FRAME_BUS_NAME_MAX_SIZE] = {0};
+    struct stat st;
+    const struct frame_bus_header *hdr = NULL;
+
+    reader = calloc(1, sizeof(frame_bus_reader_t));
+    if(!reader)
+    {
+        ERR("Cannot allocate frame bus reader");
+        return NULL;
+    }
+
+    _shm_name(shm_name, name);
+    reader->fd = shm_open(shm_name, O_RDWR | O_CLOEXEC, 0);
+    if(reader->fd < 0)
+    {
+        ERR("Cannot open frame bus %s : %s", shm_name, strerror(errno));
+        free(reader);
+        return NULL;
+    }
+
+    if(fstat(reader->fd, &st) != 0 || st.st_size < (off_t)sizeof(struct frame_bus_header))
+    {
+        ERR("Frame bus %s is not ready", shm_name);
+        goto error;
+    }
+
+    reader->map_size = st.st_size;
+    hdr = mmap(NULL, reader->map_size, PROT_READ, MAP_SHARED, reader->fd, 0);
+    if(hdr == MAP_FAILED)
+    {
+        ERR("Cannot map frame bus %s : %s", shm_name, strerror(errno));
+        goto error;
+    }
+    reader->hdr = hdr;
+
+    if(__atomic_load_n(&hdr->magic, __ATOMIC_ACQUIRE) != FRAME_BUS_MAGIC ||
+       hdr->version != FRAME_BUS_VERSION ||
+       hdr->map_size != reader->map_size)
+    {
+        ERR("Frame bus %s has an unsupported layout", shm_name);
+        goto error;
+    }
+
+    reader->waiters_map_size = sysconf(_SC_PAGESIZE);
+    reader->waiters_hdr = mmap(NULL, reader->waiters_map_size, PROT_READ | PROT_WRITE, MAP_SHARED, reader->fd, 0);
+    if(reader->waiters_hdr == MAP_FAILED)
+    {
+        reader->waiters_hdr = NULL;
+        ERR("Cannot map frame bus %s header : %s", shm_name, strerror(errno));
+        goto error;
+    }
+
+    /* Start with the next published frame */
+    reader->next_seq = __atomic_load_n(&hdr->write_seq, __ATOMIC_ACQUIRE);
+
+    INF("Attached to frame bus %s : %ux%u, %u slots", shm_name, hdr->width, hdr->height, hdr->nb_slots);
+    return reader;
+
+error:
+    frame_bus_reader_detach(reader);
+    return NULL;
+}
+
+void frame_bus_reader_detach(frame_bus_reader_t *reader)
+{
+    if(!reader)
+        return;
+
+    if(reader->waiters_hdr)
+        munmap(reader->waiters_hdr, reader->waiters_map_size);
+    if(reader->hdr)
+        munmap((void *)reader->hdr, reader->map_size);
+    close(reader->fd);
+    free(reader);
+}
+
+/* Fill frame with frame n if its slot still holds it. Returns 0 on success,
+ * -1 if it has been (or is being) overwritten */
+static int _read_slot(frame_bus_reader_t *reader, uint64_t n, frame_bus_frame *frame)
+{
+    const struct frame_bus_header *hdr = reader->hdr;
+    unsigned int index = n % hdr->nb_slots;
+    const struct frame_bus_slot_header *slot = &hdr->slots[index];
+    uint64_t seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+
+    if(seq != 2 * n + 2)
+        return -1;
+
+    frame->seq = __atomic_load_n(&slot->frame_seq, __ATOMIC_RELAXED);
+    frame->timestamp_us = __atomic_load_n(&slot->timestamp_us, __ATOMIC_RELAXED);
+    frame->size = __atomic_load_n(&slot->size, __ATOMIC_RELAXED);
+    frame->data = (const uint8_t *)hdr + slot->offset;
+    frame->width = hdr->width;
+    frame->height = hdr->height;
+    frame->stride = hdr->stride;
+    frame->pixelformat = hdr->pixelformat;
+    frame->slot = index;
+    frame->slot_seq = seq;
+
+    return frame_bus_reader_validate(reader, frame);
+}
+
+/* Frame data is read in place : once done with it, the caller must check with
+ * this function that the producer did not reuse the slot meanwhile. Returns 0
+ * if the data read was consistent */
+int frame_bus_reader_validate(frame_bus_reader_t *reader, const frame_bus_frame *frame)
+{
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    if(__atomic_load_n(&reader->hdr->slots[frame->slot].seq, __ATOMIC_RELAXED) != frame->slot_seq)
+        return -1;
+    return 0;
+}
+
+/* Most recent complete frame. Returns 0 on success, 1 if nothing has been
+ * published yet */
+int frame_bus_reader_latest(frame_bus_reader_t *reader, frame_bus_frame *frame)
+{
+    uint64_t w = 0;
+
+    do {
+        w = __atomic_load_n(&reader->hdr->write_seq, __ATOMIC_ACQUIRE);
+        if(w == 0)
+            return 1;
+    } while(_read_slot(reader, w - 1, frame) != 0);
+
+    reader->next_seq = w;
+    return 0;
+}
+
+/* Next frame after the last one read, waiting for it up to timeout_ms (-1 to
+ * wait forever). Frames the producer overwrote before we got to them are
+ * skipped and accounted as lost. Returns 0 on success, 1 on timeout, -1 once
+ * the producer is gone */
+int frame_bus_reader_next(frame_bus_reader_t *reader, frame_bus_frame *frame, int timeout_ms)
+{
+    const struct frame_bus_header *hdr = reader->hdr;
+    struct timespec timeout;
+    uint64_t w = 0;
+    uint32_t futex = 0;
+    int ret = 0;
+
+    timeout.tv_sec = timeout_ms / 1000;
+    timeout.tv_nsec = (timeout_ms % 1000) * 1000000L;
+
+    while(1)
+    {
+        futex = __atomic_load_n(&hdr->futex, __ATOMIC_ACQUIRE);
+        w = __atomic_load_n(&hdr->write_seq, __ATOMIC_ACQUIRE);
+
+        while(reader->next_seq < w)
+        {
+            /* The slot of the oldest frame may be rewritten right now */
+            if(w - reader->next_seq >= hdr->nb_slots)
+            {
+                reader->lost += w - hdr->nb_slots + 1 - reader->next_seq;
+                reader->next_seq = w - hdr->nb_slots + 1;
+            }
+
+            if(_read_slot(reader, reader->next_seq++, frame) == 0)
+                return 0;
+            reader->lost++;
+        }
+
+        if(__atomic_load_n(&hdr->closed, __ATOMIC_ACQUIRE))
+            return -1;
+
+        __atomic_add_fetch(&reader->waiters_hdr->waiters, 1, __ATOMIC_SEQ_CST);
+        ret = _futex(&hdr->futex, FUTEX_WAIT, futex, timeout_ms < 0 ? NULL : &timeout);
+        __atomic_sub_fetch(&reader->waiters_hdr->waiters, 1, __ATOMIC_SEQ_CST);
+        if(ret != 0 && errno == ETIMEDOUT)
+            return 1;
+    }
+}
+
+uint64_t frame_bus_reader_get_lost(frame_bus_reader_t *reader)
+{
+    return reader->lost;
+}
@@ -0,0 +1,41 @@
+#ifndef FRAME_BUS_H
+#define FRAME_BUS_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#define FRAME_BUS_NAME_MAX_SIZE     128
+
+typedef struct
+{
+    const uint8_t *data;
+    size_t size;
+    uint64_t seq;
+    uint64_t timestamp_us;
+    uint32_t width;
+    uint32_t height;
+    uint32_t stride;
+    uint32_t pixelformat;
+    /* Private : used to check the frame was not overwritten while read */
+    unsigned int slot;
+    uint64_t slot_seq;
+} frame_bus_frame;
+
+typedef struct frame_bus frame_bus_t;
+typedef struct frame_bus_reader frame_bus_reader_t;
+
+/* Producer side */
+frame_bus_t *frame_bus_create(const char *name, unsigned int nb_slots, size_t slot_size,
+        uint32_t width, uint32_t height, uint32_t stride, uint32_t pixelformat);
+void frame_bus_destroy(frame_bus_t *bus);
+void frame_bus_publish(frame_bus_t *bus, const void *data, size_t size, uint64_t timestamp_us);
+
+/* Reader side */
+frame_bus_reader_t *frame_bus_reader_attach(const char *name);
+void frame_bus_reader_detach(frame_bus_reader_t *reader);
+int frame_bus_reader_latest(frame_bus_reader_t *reader, frame_bus_frame *frame);
+int frame_bus_reader_next(frame_bus_reader_t *reader, frame_bus_frame *frame, int timeout_ms);
+int frame_bus_reader_validate(frame_bus_reader_t *reader, const frame_bus_frame *frame);
+uint64_t frame_bus_reader_get_lost(frame_bus_reader_t *reader);
+
+#endif
@@ -0,0 +1,245 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "utils.h"
+#include "frame_history.h"
+
+/* History frames written for every new frame while catching up after a
+ * trigger : the backlog goes to disk faster than real time, without holding
+ * the writer long enough to fill the frame ring */
+#define HISTORY_FLUSH_BATCH     4
+
+typedef struct
+{
+    size_t offset;
+    size_t size;
+    unsigned long seq;
+    uint64_t timestamp_us;
+} history_entry;
+
+/* Frames are stored back to back in a fixed byte ring, oldest first. Entry ids
+ * only grow : entries [first, next) are in the ring, and [flush, next) still
+ * have to be written for the event being recorded */
+struct frame_history
+{
+    char name[DEVICE_NAME_MAX_SIZE];
+    uint64_t pre_us;
+    uint64_t post_us;
+    frame_history_write_t write_cb;
+    void *ctx;
+
+    uint8_t *storage;
+    size_t size;
+    size_t tail;
+
+    history_entry *entries;
+    unsigned long nb_entries;
+    unsigned long first;
+    unsigned long next;
+    unsigned long flush;
+
+    int triggered;
+    int recording;
+    uint64_t until_us;
+    unsigned long nb_events;
+    unsigned long nb_dropped;
+};
+
+#define ENTRY(h, id)    (&(h)->entries[(id) % (h)->nb_entries])
+
+static int _write_entry(frame_history_t *h, unsigned long id)
+{
+    history_entry *entry = ENTRY(h, id);
+    struct iovec iov;
+
+    iov.iov_base = h->storage + entry->offset;
+    iov.iov_len = entry->size;
+    return h->write_cb(h->ctx, &iov, 1, entry->seq, entry->timestamp_us);
+}
+
+/* An event frame is never lost : if it has to make room before being written,
+ * it is written right away */
+static void _drop_oldest(frame_history_t *h)
+{
+    if(h->recording && h->first >= h->flush)
+    {
+        _write_entry(h, h->first);
+        h->flush = h->first + 1;
+    }
+    h->first++;
+}
+
+static int _get_space(frame_history_t *h, size_t size, size_t *offset)
+{
+    size_t head = 0;
+
+    if(h->first == h->next)
+    {
+        *offset = 0;
+        return 1;
+    }
+    if(h->next - h->first >= h->nb_entries)
+        return 0;
+
+    head = ENTRY(h, h->first)->offset;
+    if(h->tail > head)
+    {
+        /* Used : [head, tail) */
+        if(h->size - h->tail >= size)
+            *offset = h->tail;
+        else if(head >= size)
+            *offset = 0;
+        else
+            return 0;
+        return 1;
+    }
+
+    /* Used : [head, size) and [0, tail) */
+    if(head - h->tail < size)
+        return 0;
+    *offset = h->tail;
+    return 1;
+}
+
+frame_history_t *frame_history_create(const char *name, unsigned int pre_s, unsigned int post_s,
+        size_t budget, unsigned int frame_rate, frame_history_write_t write_cb, void *ctx)
+{
+    frame_history_t *h = NULL;
+
+    if(budget == 0 || !write_cb)
+    {
+        ERR("Cannot create frame history : invalid parameters");
+        return NULL;
+    }
+
+    h = calloc(1, sizeof(frame_history_t));
+    if(!h)
+    {
+        ERR("Cannot allocate frame history");
+        return NULL;
+    }
+
+    snprintf(h->name, DEVICE_NAME_MAX_SIZE, "%s", name);
+    h->pre_us = (uint64_t)pre_s * 1000000;
+    h->post_us = (uint64_t)post_s * 1000000;
+    h->write_cb = write_cb;
+    h->ctx = ctx;
+    h->size = budget;
+    /* Room for the pre-trigger window at twice the nominal rate */
+    h->nb_entries = (unsigned long)(pre_s + 1) * (frame_rate ? frame_rate : DEFAULT_FRAME_RATE) * 2;
+
+    h->storage = malloc(budget);
+    h->entries = calloc(h->nb_entries, sizeof(history_entry));
+    if(!h->storage || !h->entries)
+    {
+        ERR("%s : cannot allocate %zu bytes of frame history", name, budget);
+        frame_history_destroy(h);
+        return NULL;
+    }
+    /* Pages are touched now, not while capturing */
+    memset(h->storage, 0, budget);
+
+    INF("%s : keeping the last %u s of frames (%zu MB), %u s recorded after each trigger",
+            name, pre_s, budget / (1024 * 1024), post_s);
+    return h;
+}
+
+/* An event being recorded is completed with the frames already received */
+void frame_history_destroy(frame_history_t *h)
+{
+    if(!h)
+        return;
+
+    if(h->recording)
+    {
+        while(h->flush < h->next)
+            _write_entry(h, h->flush++);
+        INF("%s : event %lu recorded, cut short", h->name, h->nb_events);
+    }
+    if(h->nb_dropped)
+        INF("%s : %lu frames too large for the frame history", h->name, h->nb_dropped);
+
+    free(h->entries);
+    free(h->storage);
+    free(h);
+}
+
+int frame_history_write(frame_history_t *h, const struct iovec *iov, int nb_iov,
+        unsigned long seq, uint64_t timestamp_us)
+{
+    history_entry *entry = NULL;
+    size_t size = 0, offset = 0;
+    int ret = 0;
+    int i = 0;
+
+    for(i = 0; i < nb_iov; i++)
+        size += iov[i].iov_len;
+
+    /* Frames out of the pre-trigger window are not needed anymore */
+    while(h->first != h->next && ENTRY(h, h->first)->timestamp_us + h->pre_us < timestamp_us &&
+          (!h->recording || h->first < h->flush))
+        h->first++;
+
+    if(__atomic_exchange_n(&h->triggered, 0, __ATOMIC_ACQ_REL))
+    {
+        if(!h->recording)
+        {
+            h->nb_events++;
+            INF("%s : event %lu triggered", h->name, h->nb_events);
+            if(h->flush < h->first)
+                h->flush = h->first;
+        }
+        h->recording = 1;
+        h->until_us = timestamp_us + h->post_us;
+    }
+
+    if(size > 0 && size <= h->size)
+    {
+        while(!_get_space(h, size, &offset))
+            _drop_oldest(h);
+
+        entry = ENTRY(h, h->next);
+        entry->offset = offset;
+        entry->size = size;
+        entry->seq = seq;
+        entry->timestamp_us = timestamp_us;
+        for(i = 0; i < nb_iov; i++)
+        {
+            memcpy(h->storage + offset, iov[i].iov_base, iov[i].iov_len);
+            offset += iov[i].iov_len;
+        }
+        h->tail = offset;
+        h->next++;
+    }
+    else if(size > 0)
+    {
+        h->nb_dropped++;
+        if(h->recording)
+        {
+            /* Written in order, without being kept */
+            while(h->flush < h->next)
+                _write_entry(h, h->flush++);
+            ret = h->write_cb(h->ctx, iov, nb_iov, seq, timestamp_us);
+        }
+    }
+
+    if(!h->recording)
+        return ret;
+
+    for(i = 0; i < HISTORY_FLUSH_BATCH && h->flush < h->next; i++)
+    {
+        if(_write_entry(h, h->flush++) != 0)
+            ret = -1;
+    }
+    if(h->flush == h->next && timestamp_us >= h->until_us)
+    {
+        h->recording = 0;
+        INF("%s : event %lu recorded", h->name, h->nb_events);
+    }
+    return ret;
+}
+
+void frame_history_trigger(frame_history_t *h)
+{
+    __atomic_store_n(&h->triggered, 1, __ATOMIC_RELEASE);
+}
@@ -0,0 +1,25 @@
+#ifndef FRAME_HISTORY_H
+#define FRAME_HISTORY_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <sys/uio.h>
+
+typedef int (*frame_history_write_t)(void *ctx, const struct iovec *iov, int nb_iov,
+        unsigned long seq, uint64_t timestamp_us);
+
+typedef struct frame_history frame_history_t;
+
+/* Keeps the last pre_s seconds of frames within budget bytes. Once triggered,
+ * they are handed to write_cb, followed by the frames of the next post_s
+ * seconds. Everything is allocated here : no allocation once capturing */
+frame_history_t *frame_history_create(const char *name, unsigned int pre_s, unsigned int post_s,
+        size_t budget, unsigned int frame_rate, frame_history_write_t write_cb, void *ctx);
+void frame_history_destroy(frame_history_t *h);
+/* Frames are given in capture order, by one thread at a time */
+int frame_history_write(frame_history_t *h, const struct iovec *iov, int nb_iov,
+        unsigned long seq, uint64_t timestamp_us);
+/* Async-signal-safe : can be called from any thread or signal handler */
+void frame_history_trigger(frame_history_t *h);
+
+#endif
@@ -0,0 +1,178 @@
+#include <stdlib.h>
+#include <pthread.h>
+
+#include "utils.h"
+#include "frame_ring.h"
+
+/* Bounded pool of preallocated frame slots shared between the capture thread
+ * (producer) and the writer threads (consumers). The producer never blocks :
+ * when no slot is free the frame is counted as an overflow and dropped, so the
+ * V4L2 buffer can be requeued right away. */
+struct frame_ring
+{
+    frame_slot *slots;
+    uint8_t *storage;
+    unsigned int nb_slots;
+
+    /* Free slots, used as a stack */
+    unsigned int *free_list;
+    unsigned int nb_free;
+
+    /* Committed slots waiting for a consumer, used as a FIFO */
+    unsigned int *ready;
+    unsigned int ready_head;
+    unsigned int nb_ready;
+
+    unsigned long next_seq;
+    unsigned long overflows;
+    int closed;
+
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+};
+
+frame_ring_t *frame_ring_create(unsigned int nb_slots, size_t slot_size)
+{
+    frame_ring_t *ring = NULL;
+    unsigned int i = 0;
+
+    if(nb_slots == 0 || slot_size == 0)
+    {
+        ERR("Cannot create frame ring : invalid dimensions");
+        return NULL;
+    }
+
+    ring = calloc(1, sizeof(frame_ring_t));
+    if(!ring)
+    {
+        ERR("Cannot allocate frame ring");
+        return NULL;
+    }
+
+    pthread_mutex_init(&ring->lock, NULL);
+    pthread_cond_init(&ring->cond, NULL);
+
+    ring->nb_slots = nb_slots;
+    ring->slots = calloc(nb_slots, sizeof(frame_slot));
+    ring->storage = calloc(nb_slots, slot_size);
+    ring->free_list = calloc(nb_slots, sizeof(unsigned int));
+    ring->ready = calloc(nb_slots, sizeof(unsigned int));
+    if(!ring->slots || !ring->storage || !ring->free_list || !ring->ready)
+    {
+        ERR("Cannot allocate %u frame ring slots of %zu bytes", nb_slots, slot_size);
+        frame_ring_destroy(ring);
+        return NULL;
+    }
+
+    for(i = 0; i < nb_slots; i++)
+    {
+        ring->slots[i].data = ring->storage + i * slot_size;
+        ring->slots[i].size = slot_size;
+        ring->free_list[i] = nb_slots - 1 - i;
+    }
+    ring->nb_free = nb_slots;
+
+    return ring;
+}
+
+void frame_ring_destroy(frame_ring_t *ring)
+{
+    if(!ring)
+        return;
+
+    pthread_mutex_destroy(&ring->lock);
+    pthread_cond_destroy(&ring->cond);
+    free(ring->ready);
+    free(ring->free_list);
+    free(ring->storage);
+    free(ring->slots);
+    free(ring);
+}
+
+/* Producer side : grab a free slot, or return NULL and account an overflow */
+frame_slot *frame_ring_acquire(frame_ring_t *ring)
+{
+    frame_slot *slot = NULL;
+
+    pthread_mutex_lock(&ring->lock);
+    if(ring->closed)
+        slot = NULL;
+    else if(ring->nb_free > 0)
+        slot = &ring->slots[ring->free_list[--ring->nb_free]];
+    else
+        ring->overflows++;
+    pthread_mutex_unlock(&ring->lock);
+
+    return slot;
+}
+
+void frame_ring_commit(frame_ring_t *ring, frame_slot *slot)
+{
+    unsigned int index = slot - ring->slots;
+
+    pthread_mutex_lock(&ring->lock);
+    slot->seq = ring->next_seq++;
+    ring->ready[(ring->ready_head + ring->nb_ready) % ring->nb_slots] = index;
+    ring->nb_ready++;
+    pthread_cond_signal(&ring->cond);
+    pthread_mutex_unlock(&ring->lock);
+}
+
+/* Consumer side : block until a frame is available. Returns NULL once the ring
+ * has been closed and fully drained */
+frame_slot *frame_ring_pop(frame_ring_t *ring)
+{
+    frame_slot *slot = NULL;
+
+    pthread_mutex_lock(&ring->lock);
+    while(ring->nb_ready == 0 && !ring->closed)
+        pthread_cond_wait(&ring->cond, &ring->lock);
+
+    if(ring->nb_ready > 0)
+    {
+        slot = &ring->slots[ring->ready[ring->ready_head]];
+        ring->ready_head = (ring->ready_head + 1) % ring->nb_slots;
+        ring->nb_ready--;
+    }
+    pthread_mutex_unlock(&ring->lock);
+
+    return slot;
+}
+
+void frame_ring_release(frame_ring_t *ring, frame_slot *slot)
+{
+    pthread_mutex_lock(&ring->lock);
+    ring->free_list[ring->nb_free++] = slot - ring->slots;
+    pthread_mutex_unlock(&ring->lock);
+}
+
+void frame_ring_close(frame_ring_t *ring)
+{
+    pthread_mutex_lock(&ring->lock);
+    ring->closed = 1;
+    pthread_cond_broadcast(&ring->cond);
+    pthread_mutex_unlock(&ring->lock);
+}
+
+unsigned long frame_ring_get_overflows(frame_ring_t *ring)
+{
+    unsigned long overflows = 0;
+
+    pthread_mutex_lock(&ring->lock);
+    overflows = ring->overflows;
+    pthread_mutex_unlock(&ring->lock);
+
+    return overflows;
+}
+
+/* Committed frames no consumer has taken yet */
+unsigned int frame_ring_get_pending(frame_ring_t *ring)
+{
+    unsigned int pending = 0;
+
+    pthread_mutex_lock(&ring->lock);
+    pending = ring->nb_ready;
+    pthread_mutex_unlock(&ring->lock);
+
+    return pending;
+}
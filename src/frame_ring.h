@@ -0,0 +1,30 @@
+#ifndef FRAME_RING_H
+#define FRAME_RING_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+typedef struct
+{
+    uint8_t *data;
+    size_t size;
+    size_t bytesused;
+    uint64_t timestamp_us;
+    uint64_t capture_ns;    /* CLOCK_MONOTONIC driver timestamp, 0 if unknown */
+    uint64_t dequeue_ns;
+    unsigned long seq;
+} frame_slot;
+
+typedef struct frame_ring frame_ring_t;
+
+frame_ring_t *frame_ring_create(unsigned int nb_slots, size_t slot_size);
+void frame_ring_destroy(frame_ring_t *ring);
+frame_slot *frame_ring_acquire(frame_ring_t *ring);
+void frame_ring_commit(frame_ring_t *ring, frame_slot *slot);
+frame_slot *frame_ring_pop(frame_ring_t *ring);
+void frame_ring_release(frame_ring_t *ring, frame_slot *slot);
+void frame_ring_close(frame_ring_t *ring);
+unsigned long frame_ring_get_overflows(frame_ring_t *ring);
+unsigned int frame_ring_get_pending(frame_ring_t *ring);
+
+#endif
@@ -0,0 +1,180 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "utils.h"
+#include "frame_sink.h"
+#include "segment_sink.h"
+#include "frame_history.h"
+
+#define FILE_NAME_MAX_SIZE      256
+
+struct frame_sink
+{
+    frame_sink_type type;
+    char dir[OUTPUT_DIR_NAME_MAX_SIZE];
+    char name[DEVICE_NAME_MAX_SIZE];
+    char ext[FORMAT_MAX_SIZE];
+    segment_sink_t *segments;
+    /* Pre-trigger history, frames only reach the disk around events */
+    frame_history_t *history;
+    void (*durable_cb)(void *arg, uint64_t seq);
+    void *durable_arg;
+};
+
+/* Last NB_DUMP_FRAME frames are kept, each in its own file */
+static int _write_file(frame_sink_t *sink, const struct iovec *iov, int nb_iov, unsigned long seq)
+{
+    int frame_num = seq % NB_DUMP_FRAME;
+    char file_name[FILE_NAME_MAX_SIZE] = {0};
+    size_t frame_size = 0;
+    ssize_t ret = 0;
+    int fd = -1;
+    int i = 0;
+
+    for(i = 0; i < nb_iov; i++)
+        frame_size += iov[i].iov_len;
+
+    snprintf(file_name, FILE_NAME_MAX_SIZE, "%s/%s_frame_%d.%s", sink->dir, sink->name, frame_num, sink->ext);
+    fd = open(file_name, O_WRONLY|O_CREAT|O_TRUNC, S_IWUSR|S_IRUSR);
+    if(fd < 0)
+    {
+        ERR("Cannot open file %s to dump frame %d", file_name, frame_num);
+        return -1;
+    }
+
+    ret = writev(fd, iov, nb_iov);
+    if(ret < 0)
+    {
+        ERR("Did not manage to write data to file %s : %s", file_name, strerror(errno));
+    }
+    else if(ret != (ssize_t)frame_size)
+    {
+        INF("Did not manage to dump complete frame : dumped %zd/%zu bytes", ret, frame_size);
+    }
+    else
+    {
+        DBG("Frame %s has been dumped", file_name);
+    }
+
+    /* Only traced sinks report durability : the frame is synced first, so
+     * that it is measured up to the disk and not to the page cache */
+    if(ret == (ssize_t)frame_size && sink->durable_cb && fdatasync(fd) != 0)
+    {
+        ERR("Cannot sync file %s : %s", file_name, strerror(errno));
+        ret = -1;
+    }
+    close(fd);
+
+    return ret == (ssize_t)frame_size ? 0 : -1;
+}
+
+static const muxer_type _muxers[] = {
+    [FRAME_SINK_SEGMENTS] = MUXER_RAW,
+    [FRAME_SINK_AVI] = MUXER_AVI,
+    [FRAME_SINK_MKV] = MUXER_MKV,
+};
+
+frame_sink_t *frame_sink_create(frame_sink_type type, const char *dir, const char *name, const char *ext,
+        const muxer_stream *stream, size_t segment_size, unsigned int segment_duration_s)
+{
+    frame_sink_t *sink = calloc(1, sizeof(frame_sink_t));
+
+    if(!sink)
+    {
+        ERR("Cannot allocate frame sink");
+        return NULL;
+    }
+
+    sink->type = type;
+    snprintf(sink->dir, OUTPUT_DIR_NAME_MAX_SIZE, "%s", dir);
+    snprintf(sink->name, DEVICE_NAME_MAX_SIZE, "%s", name);
+    snprintf(sink->ext, FORMAT_MAX_SIZE, "%s", ext);
+
+    if(type != FRAME_SINK_FILES)
+    {
+        sink->segments = segment_sink_create(dir, name, _muxers[type], stream,
+                segment_size, segment_duration_s);
+        if(!sink->segments)
+        {
+            free(sink);
+            return NULL;
+        }
+    }
+
+    return sink;
+}
+
+void frame_sink_destroy(frame_sink_t *sink)
+{
+    if(!sink)
+        return;
+
+    frame_history_destroy(sink->history);
+    segment_sink_destroy(sink->segments);
+    free(sink);
+}
+
+static int _write_frame(void *ctx, const struct iovec *iov, int nb_iov,
+        unsigned long seq, uint64_t timestamp_us)
+{
+    frame_sink_t *sink = ctx;
+
+    switch(sink->type)
+    {
+        case FRAME_SINK_SEGMENTS:
+        case FRAME_SINK_AVI:
+        case FRAME_SINK_MKV:
+            return segment_sink_write(sink->segments, iov, nb_iov, seq, timestamp_us);
+        default:
+            if(_write_file(sink, iov, nb_iov, seq) != 0)
+                return -1;
+            if(sink->durable_cb)
+                sink->durable_cb(sink->durable_arg, seq);
+            return 0;
+    }
+}
+
+int frame_sink_write(frame_sink_t *sink, const struct iovec *iov, int nb_iov,
+        unsigned long seq, uint64_t timestamp_us)
+{
+    if(sink->history)
+        return frame_history_write(sink->history, iov, nb_iov, seq, timestamp_us);
+    return _write_frame(sink, iov, nb_iov, seq, timestamp_us);
+}
+
+/* Must be called before the first frame is written */
+int frame_sink_set_history(frame_sink_t *sink, unsigned int pre_s, unsigned int post_s,
+        size_t budget, unsigned int frame_rate)
+{
+    /* Events are recorded without allocating : the container index is sized
+     * for a whole event, at twice the nominal rate */
+    if(sink->segments && segment_sink_reserve_frames(sink->segments,
+                (unsigned long)(pre_s + post_s + 1) * (frame_rate ? frame_rate : DEFAULT_FRAME_RATE) * 2) != 0)
+        return -1;
+
+    sink->history = frame_history_create(sink->name, pre_s, post_s, budget, frame_rate,
+            _write_frame, sink);
+    return sink->history ? 0 : -1;
+}
+
+/* Must be called before the first frame is written. Files are reported once
+ * written and synced, segments once their staging buffer has reached the disk */
+void frame_sink_set_durable_callback(frame_sink_t *sink, void (*cb)(void *arg, uint64_t seq), void *arg)
+{
+    sink->durable_cb = cb;
+    sink->durable_arg = arg;
+    if(sink->segments)
+        segment_sink_set_durable_callback(sink->segments, cb, arg);
+}
+
+/* Async-signal-safe */
+void frame_sink_trigger(frame_sink_t *sink)
+{
+    if(sink->history)
+        frame_history_trigger(sink->history);
+}
@@ -0,0 +1,36 @@
+#ifndef FRAME_SINK_H
+#define FRAME_SINK_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <sys/uio.h>
+
+#include "muxer.h"
+
+typedef enum
+{
+    FRAME_SINK_FILES,       /* One file per frame, <name>_frame_<n>.<ext> */
+    FRAME_SINK_SEGMENTS,    /* Frames appended to large segment files, with an index */
+    FRAME_SINK_AVI,         /* Segments as AVI files */
+    FRAME_SINK_MKV,         /* Segments as Matroska files */
+} frame_sink_type;
+
+typedef struct frame_sink frame_sink_t;
+
+/* Frames are given in capture order, by one thread at a time. ext is used by
+ * the files sink, stream and segment limits by the other ones */
+frame_sink_t *frame_sink_create(frame_sink_type type, const char *dir, const char *name, const char *ext,
+        const muxer_stream *stream, size_t segment_size, unsigned int segment_duration_s);
+void frame_sink_destroy(frame_sink_t *sink);
+int frame_sink_write(frame_sink_t *sink, const struct iovec *iov, int nb_iov,
+        unsigned long seq, uint64_t timestamp_us);
+/* With a history, frames are only written around triggers : the last pre_s
+ * seconds before, and the post_s seconds after */
+int frame_sink_set_history(frame_sink_t *sink, unsigned int pre_s, unsigned int post_s,
+        size_t budget, unsigned int frame_rate);
+void frame_sink_trigger(frame_sink_t *sink);
+/* cb is called once every frame up to seq is durable, possibly from an I/O
+ * thread. The files sink then syncs every frame before reporting it */
+void frame_sink_set_durable_callback(frame_sink_t *sink, void (*cb)(void *arg, uint64_t seq), void *arg);
+
+#endif
@@ -0,0 +1,582 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <libgen.h>
+#include <time.h>
+#include <sys/stat.h>
+#include <sys/timerfd.h>
+#include <sys/eventfd.h>
+#include <linux/videodev2.h>
+
+#include "utils.h"
+#include "frame_source.h"
+#include "segment_sink.h"
+
+#define SOURCE_PATH_MAX_SIZE    256
+/* Noise frames are windows at random offsets in a slightly larger buffer */
+#define NOISE_EXTRA_SIZE        (64 * 1024)
+#define NB_BARS                 8
+
+typedef enum
+{
+    SOURCE_BARS,
+    SOURCE_NOISE,
+    SOURCE_MOVING,
+    SOURCE_REPLAY,
+} source_type;
+
+struct frame_source
+{
+    source_type type;
+    char name[DEVICE_NAME_MAX_SIZE];
+    frame_source_format format;
+    /* timerfd when paced, otherwise an eventfd that stays readable */
+    int fd;
+    int running;
+    uint32_t sequence;
+    uint64_t start_ns;
+    uint64_t nb_ticks;
+
+    /* Synthetic frames are copied from a pattern rendered once */
+    uint8_t *pattern;
+    size_t pattern_size;
+    uint64_t random;
+
+    /* Replay */
+    char path[SOURCE_PATH_MAX_SIZE];
+    int file_fd;
+    segment_index_entry *entries;
+    size_t nb_entries;
+    size_t next_entry;
+    uint64_t loop_offset_ns;
+    uint64_t loop_duration_ns;
+};
+
+/* BT.601 limited range : white, yellow, cyan, green, magenta, red, blue, black */
+static const uint8_t _bars[NB_BARS][3] = {
+    { 235, 128, 128 }, { 210, 16, 146 }, { 170, 166, 16 }, { 145, 54, 34 },
+    { 106, 202, 222 }, { 81, 90, 240 }, { 41, 240, 110 }, { 16, 128, 128 },
+};
+
+static uint64_t _now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static uint64_t _next_random(frame_source_t *s)
+{
+    /* xorshift64 */
+    s->random ^= s->random << 13;
+    s->random ^= s->random >> 7;
+    s->random ^= s->random << 17;
+    return s->random;
+}
+
+static int _is_semi_planar(uint32_t pixelformat)
+{
+    return pixelformat == V4L2_PIX_FMT_NV12 || pixelformat == V4L2_PIX_FMT_NV21;
+}
+
+/* Rectangles start and end on even coordinates, to hold whole chroma samples */
+static void _fill_rect(const frame_source_format *format, uint8_t *buf, unsigned int x, unsigned int y,
+        unsigned int width, unsigned int height, const uint8_t *yuv)
+{
+    uint8_t u = yuv[1], v = yuv[2];
+    uint8_t *line = NULL;
+    unsigned int i = 0, j = 0;
+
+    if(format->pixelformat == V4L2_PIX_FMT_YUYV)
+    {
+        for(j = y; j < y + height; j++)
+        {
+            line = buf + (size_t)j * format->stride + x * 2;
+            for(i = 0; i < width; i += 2, line += 4)
+            {
+                line[0] = yuv[0];
+                line[1] = u;
+                line[2] = yuv[0];
+                line[3] = v;
+            }
+        }
+        return;
+    }
+
+    for(j = y; j < y + height; j++)
+        memset(buf + (size_t)j * format->stride + x, yuv[0], width);
+    if(format->pixelformat == V4L2_PIX_FMT_NV21)
+    {
+        u = yuv[2];
+        v = yuv[1];
+    }
+    buf += (size_t)format->stride * format->height;
+    for(j = y / 2; j < (y + height) / 2; j++)
+    {
+        line = buf + (size_t)j * format->stride + x;
+        for(i = 0; i < width; i += 2, line += 2)
+        {
+            line[0] = u;
+            line[1] = v;
+        }
+    }
+}
+
+static int _render_pattern(frame_source_t *s)
+{
+    const frame_source_format *format = &s->format;
+    unsigned int bar_width = format->width / NB_BARS & ~1U;
+    size_t i = 0;
+    int b = 0;
+
+    free(s->pattern);
+    s->pattern_size = format->frame_size + (s->type == SOURCE_NOISE ? NOISE_EXTRA_SIZE : 0);
+    s->pattern = malloc(s->pattern_size);
+    if(!s->pattern)
+    {
+        ERR("%s : cannot allocate %zu bytes of test pattern", s->name, s->pattern_size);
+        return -1;
+    }
+
+    if(s->type == SOURCE_NOISE)
+    {
+        for(i = 0; i + sizeof(uint64_t) <= s->pattern_size; i += sizeof(uint64_t))
+            *(uint64_t *)(s->pattern + i) = _next_random(s);
+        return 0;
+    }
+
+    for(b = 0; b < NB_BARS; b++)
+    {
+        _fill_rect(format, s->pattern, b * bar_width, 0,
+                b == NB_BARS - 1 ? format->width - b * bar_width : bar_width, format->height, _bars[b]);
+    }
+    return 0;
+}
+
+/* A white square crossing the bars back and forth in two seconds */
+static void _draw_moving(frame_source_t *s, uint8_t *buf, uint64_t timestamp_ns)
+{
+    const frame_source_format *format = &s->format;
+    unsigned int size = format->height / 4 & ~1U;
+    unsigned int range = format->width - size;
+    uint64_t pos = timestamp_ns / 1000000 * 2 * range / 2000 % (2 * range);
+
+    if(!size || !range)
+        return;
+    if(pos >= range)
+        pos = 2 * range - pos;
+    _fill_rect(format, buf, pos & ~1U, (format->height - size) / 2 & ~1U, size, size, _bars[0]);
+}
+
+static int _synthetic_format(frame_source_t *s, frame_source_format *format)
+{
+    if(format->pixelformat != V4L2_PIX_FMT_NV12 && format->pixelformat != V4L2_PIX_FMT_NV21 &&
+       format->pixelformat != V4L2_PIX_FMT_YUYV)
+        format->pixelformat = V4L2_PIX_FMT_NV12;
+    format->width &= ~1U;
+    format->height &= ~1U;
+    if(format->width == 0 || format->height == 0)
+    {
+        ERR("%s : invalid frame size", s->name);
+        return -1;
+    }
+
+    if(_is_semi_planar(format->pixelformat))
+    {
+        format->stride = format->width;
+        format->frame_size = (size_t)format->stride * format->height * 3 / 2;
+    }
+    else
+    {
+        format->stride = format->width * 2;
+        format->frame_size = (size_t)format->stride * format->height;
+    }
+    s->format = *format;
+
+    return _render_pattern(s);
+}
+
+/* Recordings do not store their geometry : it has to be given, and is checked
+ * against the recorded frame sizes. Pixel format defaults to the segment file
+ * extension */
+static int _replay_format(frame_source_t *s, frame_source_format *format)
+{
+    const char *ext = strrchr(s->path, '.');
+    uint64_t duration_us = 0;
+    size_t i = 0;
+
+    if(format->pixelformat == 0 && ext)
+    {
+        if(strcmp(ext, ".mjpeg") == 0)
+            format->pixelformat = V4L2_PIX_FMT_MJPEG;
+        else if(strcmp(ext, ".nv12") == 0)
+            format->pixelformat = V4L2_PIX_FMT_NV12;
+        else if(strcmp(ext, ".yuyv") == 0)
+            format->pixelformat = V4L2_PIX_FMT_YUYV;
+    }
+    if(format->pixelformat == 0)
+        format->pixelformat = DEFAULT_PIXEL_FORMAT;
+
+    if(format->pixelformat == V4L2_PIX_FMT_MJPEG)
+    {
+        format->stride = 0;
+        format->frame_size = 0;
+        for(i = 0; i < s->nb_entries; i++)
+        {
+            if(s->entries[i].size > format->frame_size)
+                format->frame_size = s->entries[i].size;
+        }
+    }
+    else
+    {
+        if(_is_semi_planar(format->pixelformat))
+        {
+            format->stride = format->width;
+            format->frame_size = (size_t)format->stride * format->height * 3 / 2;
+        }
+        else
+        {
+            format->stride = format->width * 2;
+            format->frame_size = (size_t)format->stride * format->height;
+        }
+        if(s->entries[0].size != format->frame_size)
+        {
+            ERR("%s : recorded frames are %u bytes, not %zu as %ux%u frames", s->name,
+                    s->entries[0].size, format->frame_size, format->width, format->height);
+            return -1;
+        }
+    }
+
+    /* Frames are paced by their recorded timestamps, the measured rate is only
+     * reported. Playback loops, one average interval after the last frame */
+    duration_us = s->entries[s->nb_entries - 1].timestamp_us - s->entries[0].timestamp_us;
+    if(format->frame_rate && s->nb_entries > 1 && duration_us)
+        format->frame_rate = ((s->nb_entries - 1) * 1000000 + duration_us / 2) / duration_us;
+    s->loop_duration_ns = duration_us * 1000 + 1000000000ULL / (format->frame_rate ? format->frame_rate : DEFAULT_FRAME_RATE);
+    s->format = *format;
+
+    return 0;
+}
+
+static int _load_index(frame_source_t *s)
+{
+    char index[SOURCE_PATH_MAX_SIZE] = {0};
+    char *ext = NULL;
+    struct stat st;
+    FILE *file = NULL;
+    int ret = -1;
+
+    snprintf(index, SOURCE_PATH_MAX_SIZE, "%s", s->path);
+    ext = strrchr(index, '.');
+    if(!ext || (size_t)(ext - index) + sizeof(".idx") > SOURCE_PATH_MAX_SIZE)
+    {
+        ERR("%s : %s is not a segment file", s->name, s->path);
+        return -1;
+    }
+    strcpy(ext, ".idx");
+
+    file = fopen(index, "re");
+    if(!file || fstat(fileno(file), &st) != 0)
+    {
+        ERR("%s : cannot open segment index %s : %s", s->name, index, strerror(errno));
+        goto index_end;
+    }
+    s->nb_entries = st.st_size / sizeof(segment_index_entry);
+    if(s->nb_entries == 0)
+    {
+        ERR("%s : segment index %s is empty", s->name, index);
+        goto index_end;
+    }
+    s->entries = malloc(s->nb_entries * sizeof(segment_index_entry));
+    if(!s->entries || fread(s->entries, sizeof(segment_index_entry), s->nb_entries, file) != s->nb_entries)
+    {
+        ERR("%s : cannot read segment index %s", s->name, index);
+        goto index_end;
+    }
+
+    s->file_fd = open(s->path, O_RDONLY | O_CLOEXEC);
+    if(s->file_fd < 0)
+    {
+        ERR("%s : cannot open segment %s : %s", s->name, s->path, strerror(errno));
+        goto index_end;
+    }
+    INF("%s : replaying %zu frames from %s", s->name, s->nb_entries, s->path);
+    ret = 0;
+
+index_end:
+    if(file)
+        fclose(file);
+    return ret;
+}
+
+int frame_source_is_source(const char *device)
+{
+    return device && (strncmp(device, FRAME_SOURCE_SYNTHETIC, strlen(FRAME_SOURCE_SYNTHETIC)) == 0 ||
+            strncmp(device, FRAME_SOURCE_REPLAY, strlen(FRAME_SOURCE_REPLAY)) == 0);
+}
+
+frame_source_t *frame_source_create(const char *device)
+{
+    frame_source_t *s = calloc(1, sizeof(frame_source_t));
+    const char *arg = NULL;
+    char base[SOURCE_PATH_MAX_SIZE] = {0};
+    char *ext = NULL;
+
+    if(!s)
+    {
+        ERR("Cannot allocate frame source");
+        return NULL;
+    }
+    s->fd = -1;
+    s->file_fd = -1;
+    s->random = 0x9E3779B97F4A7C15ULL;
+
+    if(strncmp(device, FRAME_SOURCE_REPLAY, strlen(FRAME_SOURCE_REPLAY)) == 0)
+    {
+        s->type = SOURCE_REPLAY;
+        snprintf(s->path, SOURCE_PATH_MAX_SIZE, "%s", device + strlen(FRAME_SOURCE_REPLAY));
+        snprintf(base, SOURCE_PATH_MAX_SIZE, "%s", s->path);
+        ext = strrchr(basename(base), '.');
+        if(ext)
+            *ext = 0;
+        snprintf(s->name, DEVICE_NAME_MAX_SIZE, "replay_%s", basename(base));
+        if(_load_index(s) != 0)
+            goto error;
+        return s;
+    }
+
+    arg = device + strlen(FRAME_SOURCE_SYNTHETIC);
+    if(*arg == ':')
+        arg++;
+    if(*arg == 0 || strcmp(arg, "bars") == 0)
+        s->type = SOURCE_BARS;
+    else if(strcmp(arg, "noise") == 0)
+        s->type = SOURCE_NOISE;
+    else if(strcmp(arg, "moving") == 0)
+        s->type = SOURCE_MOVING;
+    else
+    {
+        ERR("Unknown synthetic pattern %s (can be 'bars', 'noise' or 'moving')", arg);
+        goto error;
+    }
+    snprintf(s->name, DEVICE_NAME_MAX_SIZE, "synthetic_%s", *arg ? arg : "bars");
+    INF("%s : synthetic frame source", s->name);
+    return s;
+
+error:
+    frame_source_destroy(s);
+    return NULL;
+}
+
+void frame_source_destroy(frame_source_t *s)
+{
+    if(!s)
+        return;
+
+    frame_source_stop(s);
+    if(s->file_fd >= 0)
+        close(s->file_fd);
+    free(s->entries);
+    free(s->pattern);
+    free(s);
+}
+
+const char *frame_source_get_name(frame_source_t *s)
+{
+    return s->name;
+}
+
+/* Valid once started */
+int frame_source_get_fd(frame_source_t *s)
+{
+    return s->fd;
+}
+
+int frame_source_set_format(frame_source_t *s, frame_source_format *format)
+{
+    if(s->running)
+    {
+        ERR("%s : cannot change format while running", s->name);
+        return -1;
+    }
+
+    if(s->type == SOURCE_REPLAY)
+        return _replay_format(s, format);
+    return _synthetic_format(s, format);
+}
+
+/* Replayed frames are due at their recorded time, relative to the first one */
+static uint64_t _replay_due_ns(frame_source_t *s, size_t entry)
+{
+    return s->start_ns + s->loop_offset_ns +
+        (s->entries[entry].timestamp_us - s->entries[0].timestamp_us) * 1000;
+}
+
+static int _arm_timer(frame_source_t *s, uint64_t due_ns)
+{
+    struct itimerspec spec;
+
+    memset(&spec, 0, sizeof(spec));
+    spec.it_value.tv_sec = due_ns / 1000000000ULL;
+    spec.it_value.tv_nsec = due_ns % 1000000000ULL;
+    if(s->type != SOURCE_REPLAY)
+        spec.it_interval.tv_nsec = 1000000000ULL / s->format.frame_rate;
+    if(spec.it_interval.tv_nsec >= 1000000000)
+    {
+        spec.it_interval.tv_sec = 1;
+        spec.it_interval.tv_nsec = 0;
+    }
+
+    if(timerfd_settime(s->fd, TFD_TIMER_ABSTIME, &spec, NULL) != 0)
+    {
+        ERR("%s : cannot arm frame timer : %s", s->name, strerror(errno));
+        return -1;
+    }
+    return 0;
+}
+
+/* The first frame is due right away */
+int frame_source_start(frame_source_t *s)
+{
+    if(s->format.frame_size == 0)
+    {
+        ERR("%s : format must be set before starting", s->name);
+        return -1;
+    }
+
+    s->sequence = 0;
+    s->nb_ticks = 0;
+    s->next_entry = 0;
+    s->loop_offset_ns = 0;
+    s->start_ns = _now_ns();
+
+    if(s->format.frame_rate == 0)
+    {
+        s->fd = eventfd(1, EFD_NONBLOCK | EFD_CLOEXEC);
+        if(s->fd < 0)
+        {
+            ERR("%s : cannot create event : %s", s->name, strerror(errno));
+            return -1;
+        }
+        INF("%s : producing frames as fast as they are consumed", s->name);
+    }
+    else
+    {
+        s->fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+        if(s->fd < 0)
+        {
+            ERR("%s : cannot create frame timer : %s", s->name, strerror(errno));
+            return -1;
+        }
+        if(_arm_timer(s, s->start_ns) != 0)
+        {
+            close(s->fd);
+            s->fd = -1;
+            return -1;
+        }
+    }
+    s->running = 1;
+
+    return 0;
+}
+
+void frame_source_stop(frame_source_t *s)
+{
+    if(s->fd >= 0)
+        close(s->fd);
+    s->fd = -1;
+    s->running = 0;
+}
+
+/* Only the last replayed frame due is produced, as a late reader of a camera
+ * would only get the last one */
+static int _next_replay(frame_source_t *s, uint8_t *buf, size_t size, frame_source_frame *frame)
+{
+    segment_index_entry *entry = NULL;
+    uint64_t now = _now_ns();
+    uint64_t due = 0;
+    ssize_t ret = 0;
+
+    while(1)
+    {
+        entry = &s->entries[s->next_entry];
+        due = _replay_due_ns(s, s->next_entry);
+        if(++s->next_entry == s->nb_entries)
+        {
+            s->next_entry = 0;
+            s->loop_offset_ns += s->loop_duration_ns;
+        }
+        s->sequence++;
+        if(s->format.frame_rate == 0 || _replay_due_ns(s, s->next_entry) > now)
+            break;
+    }
+
+    if(s->format.frame_rate && _arm_timer(s, _replay_due_ns(s, s->next_entry)) != 0)
+        return -1;
+    if(!buf)
+        return 0;
+    if(entry->size > size)
+    {
+        ERR("%s : recorded frame of %u bytes too large for the capture buffers", s->name, entry->size);
+        return 0;
+    }
+
+    ret = pread(s->file_fd, buf, entry->size, entry->offset);
+    if(ret != (ssize_t)entry->size)
+    {
+        ERR("%s : cannot read recorded frame : %s", s->name, ret < 0 ? strerror(errno) : "short read");
+        return -1;
+    }
+    frame->bytesused = entry->size;
+    frame->sequence = s->sequence - 1;
+    frame->timestamp_ns = s->format.frame_rate ? due : now;
+    return 1;
+}
+
+int frame_source_next(frame_source_t *s, uint8_t *buf, size_t size, frame_source_frame *frame)
+{
+    uint64_t expirations = 1;
+    uint64_t timestamp_ns = 0;
+    size_t offset = 0;
+
+    if(!s->running)
+        return 0;
+
+    if(s->format.frame_rate)
+    {
+        if(read(s->fd, &expirations, sizeof(expirations)) != sizeof(expirations))
+            return errno == EAGAIN ? 0 : -1;
+    }
+
+    if(s->type == SOURCE_REPLAY)
+        return _next_replay(s, buf, size, frame);
+
+    /* Frames missed by a late reader are dropped */
+    s->nb_ticks += expirations;
+    s->sequence += expirations;
+    timestamp_ns = _now_ns();
+    if(s->format.frame_rate)
+        timestamp_ns = s->start_ns + (s->nb_ticks - 1) * 1000000000ULL / s->format.frame_rate;
+    if(!buf)
+        return 0;
+    if(size < s->format.frame_size)
+    {
+        ERR("%s : capture buffers too small for %zu bytes frames", s->name, s->format.frame_size);
+        return -1;
+    }
+
+    if(s->type == SOURCE_NOISE)
+        offset = _next_random(s) % (NOISE_EXTRA_SIZE / 4) * 4;
+    memcpy(buf, s->pattern + offset, s->format.frame_size);
+    if(s->type == SOURCE_MOVING)
+        _draw_moving(s, buf, timestamp_ns);
+
+    frame->bytesused = s->format.frame_size;
+    frame->sequence = s->sequence - 1;
+    frame->timestamp_ns = timestamp_ns;
+    return 1;
+}
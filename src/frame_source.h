@@ -0,0 +1,47 @@
+#ifndef FRAME_SOURCE_H
+#define FRAME_SOURCE_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+/* Device names selecting a software frame source instead of a V4L2 device :
+ * synthetic[:bars|noise|moving] generates test patterns, replay:<segment>
+ * plays a recorded segment file back, using its .idx for the timing */
+#define FRAME_SOURCE_SYNTHETIC      "synthetic"
+#define FRAME_SOURCE_REPLAY         "replay:"
+
+typedef struct
+{
+    uint32_t pixelformat;       /* V4L2_PIX_FMT_*, 0 for the source default */
+    unsigned int width;
+    unsigned int height;
+    unsigned int stride;
+    size_t frame_size;
+    unsigned int frame_rate;    /* 0 : frames as fast as they are consumed */
+} frame_source_format;
+
+typedef struct
+{
+    size_t bytesused;
+    uint32_t sequence;          /* Frames due but not produced leave gaps */
+    uint64_t timestamp_ns;      /* When the frame was due, CLOCK_MONOTONIC */
+} frame_source_frame;
+
+/* Stands for a capture device : its file descriptor becomes readable once a
+ * frame is due, and frames are produced in the caller's buffers */
+typedef struct frame_source frame_source_t;
+
+int frame_source_is_source(const char *device);
+frame_source_t *frame_source_create(const char *device);
+void frame_source_destroy(frame_source_t *s);
+const char *frame_source_get_name(frame_source_t *s);
+int frame_source_get_fd(frame_source_t *s);
+/* Adjusts the format to what the source can produce, as a driver would */
+int frame_source_set_format(frame_source_t *s, frame_source_format *format);
+int frame_source_start(frame_source_t *s);
+void frame_source_stop(frame_source_t *s);
+/* Returns 1 if a frame has been produced in buf, 0 if none is due. A frame
+ * due while buf is NULL is dropped */
+int frame_source_next(frame_source_t *s, uint8_t *buf, size_t size, frame_source_frame *frame);
+
+#endif
@@ -0,0 +1,106 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include "utils.h"
+#include "frame_trace.h"
+
+/* Frames encoded but not durable yet. Segment sinks hold up to 20 MB in
+ * staging and in flight buffers, this covers it down to 5 KB frames. Older
+ * frames are dropped from the trace */
+#define FRAME_TRACE_SLOTS   4096
+
+struct frame_trace
+{
+    metrics_t *metrics;
+    FILE *file;
+    frame_trace_entry slots[FRAME_TRACE_SLOTS];
+    uint64_t next_durable;
+    unsigned long nb_missing;
+};
+
+frame_trace_t *frame_trace_create(metrics_t *metrics, const char *file)
+{
+    frame_trace_t *t = calloc(1, sizeof(frame_trace_t));
+
+    if(!t)
+    {
+        ERR("Cannot allocate frame trace");
+        return NULL;
+    }
+    t->metrics = metrics;
+
+    if(file)
+    {
+        t->file = fopen(file, "w");
+        if(!t->file)
+        {
+            ERR("Cannot open frame trace %s : %s", file, strerror(errno));
+            free(t);
+            return NULL;
+        }
+        INF("Frame latencies traced in %s", file);
+    }
+    return t;
+}
+
+void frame_trace_destroy(frame_trace_t *t)
+{
+    if(!t)
+        return;
+
+    if(t->nb_missing)
+        INF("%lu frames missing from the latency trace", t->nb_missing);
+    if(t->file)
+        fclose(t->file);
+    free(t);
+}
+
+void frame_trace_encoded(frame_trace_t *t, uint64_t seq, uint64_t capture_ns, uint64_t dequeue_ns,
+        uint64_t encoded_ns)
+{
+    frame_trace_entry *entry = &t->slots[seq % FRAME_TRACE_SLOTS];
+
+    entry->capture_ns = capture_ns;
+    entry->dequeue_ns = dequeue_ns;
+    entry->encoded_ns = encoded_ns;
+    entry->durable_ns = 0;
+    /* Published last : the slot is only read once seq matches */
+    __atomic_store_n(&entry->seq, seq, __ATOMIC_RELEASE);
+}
+
+/* Frames that failed to be written, or whose slot has been reused, are
+ * skipped */
+void frame_trace_durable(void *trace, uint64_t seq)
+{
+    frame_trace_t *t = trace;
+    frame_trace_entry *entry = NULL;
+    uint64_t now = metrics_now_ns();
+
+    if(seq + 1 > t->next_durable + FRAME_TRACE_SLOTS)
+    {
+        t->nb_missing += seq + 1 - FRAME_TRACE_SLOTS - t->next_durable;
+        t->next_durable = seq + 1 - FRAME_TRACE_SLOTS;
+    }
+
+    for(; t->next_durable <= seq; t->next_durable++)
+    {
+        entry = &t->slots[t->next_durable % FRAME_TRACE_SLOTS];
+        if(__atomic_load_n(&entry->seq, __ATOMIC_ACQUIRE) != t->next_durable || !entry->encoded_ns)
+        {
+            t->nb_missing++;
+            continue;
+        }
+
+        entry->durable_ns = now;
+        metrics_record(t->metrics, METRICS_STAGE_ENCODED_TO_DURABLE, now - entry->encoded_ns);
+        if(t->file && fwrite(entry, sizeof(*entry), 1, t->file) != 1)
+        {
+            ERR("Cannot write frame trace : %s", strerror(errno));
+            fclose(t->file);
+            t->file = NULL;
+        }
+        entry->encoded_ns = 0;
+    }
+}
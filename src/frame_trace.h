@@ -0,0 +1,35 @@
+#ifndef FRAME_TRACE_H
+#define FRAME_TRACE_H
+
+#include <stdint.h>
+
+#include "metrics.h"
+
+#define FRAME_TRACE_NAME_MAX_SIZE   256
+
+/* One entry per recorded frame in trace files (host endianness), in the order
+ * frames become durable. Times are CLOCK_MONOTONIC, in ns. capture_ns is the
+ * driver timestamp, 0 if the driver does not use CLOCK_MONOTONIC */
+typedef struct
+{
+    uint64_t seq;
+    uint64_t capture_ns;
+    uint64_t dequeue_ns;
+    uint64_t encoded_ns;
+    uint64_t durable_ns;
+} frame_trace_entry;
+
+/* Follows recorded frames from the end of their encoding until they are
+ * durable, recording their encode to durable latency in metrics and, if file
+ * is not NULL, every frame timing in it */
+typedef struct frame_trace frame_trace_t;
+
+frame_trace_t *frame_trace_create(metrics_t *metrics, const char *file);
+void frame_trace_destroy(frame_trace_t *t);
+/* Called by the writer threads, each for its own frames */
+void frame_trace_encoded(frame_trace_t *t, uint64_t seq, uint64_t capture_ns, uint64_t dequeue_ns,
+        uint64_t encoded_ns);
+/* Every frame up to seq is durable. Calls must not overlap */
+void frame_trace_durable(void *trace, uint64_t seq);
+
+#endif
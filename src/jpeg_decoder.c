@@ -0,0 +1,211 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <jpeglib.h>
+#include <setjmp.h>
+
+#include "utils.h"
+#include "jpeg_decoder.h"
+
+/* Maximum number of lines returned by libjpeg at once (one 4:2:0 iMCU row) */
+#define MAX_MCU_LINES               (2 * DCTSIZE)
+#define ALIGN_16(x)                 (((x) + 15) & ~15)
+
+/* Decodes MJPEG frames to NV12 for consumers needing raw pixels. Frames come
+ * from the camera and may be corrupted : libjpeg errors are caught instead of
+ * exiting. Planes are read raw, at their native sampling, so that libjpeg does
+ * neither upsampling nor color conversion. Missing Huffman tables are filled
+ * with the default ones by libjpeg-turbo itself */
+struct jpeg_decoder
+{
+    struct jpeg_decompress_struct dinfo;
+    struct jpeg_error_mgr jerr;
+    jmp_buf error_jmp;
+    unsigned int width;
+    unsigned int height;
+
+    /* Scratch planes for one iMCU row */
+    uint8_t *y_buf;
+    uint8_t *cb_buf;
+    uint8_t *cr_buf;
+    JSAMPROW y_rows[MAX_MCU_LINES];
+    JSAMPROW cb_rows[MAX_MCU_LINES];
+    JSAMPROW cr_rows[MAX_MCU_LINES];
+};
+
+static void _error_exit(j_common_ptr cinfo)
+{
+    jpeg_decoder_t *dec = (jpeg_decoder_t *)cinfo;
+
+    (*cinfo->err->output_message)(cinfo);
+    longjmp(dec->error_jmp, 1);
+}
+
+jpeg_decoder_t *jpeg_decoder_create(unsigned int width, unsigned int height)
+{
+    jpeg_decoder_t *dec = NULL;
+    size_t luma_stride = ALIGN_16(width);
+    size_t chroma_stride = luma_stride / 2;
+    int i = 0;
+
+    if(width == 0 || height == 0 || width % 2 != 0)
+    {
+        ERR("Cannot create JPEG decoder for %ux%u frames", width, height);
+        return NULL;
+    }
+
+    dec = calloc(1, sizeof(jpeg_decoder_t));
+    if(!dec)
+    {
+        ERR("Cannot allocate JPEG decoder");
+        return NULL;
+    }
+
+    dec->width = width;
+    dec->height = height;
+    dec->y_buf = malloc(luma_stride * MAX_MCU_LINES);
+    dec->cb_buf = malloc(chroma_stride * MAX_MCU_LINES);
+    dec->cr_buf = malloc(chroma_stride * MAX_MCU_LINES);
+    if(!dec->y_buf || !dec->cb_buf || !dec->cr_buf)
+    {
+        ERR("Cannot allocate JPEG decoder buffers");
+        free(dec->y_buf);
+        free(dec->cb_buf);
+        free(dec->cr_buf);
+        free(dec);
+        return NULL;
+    }
+
+    for(i = 0; i < MAX_MCU_LINES; i++)
+    {
+        dec->y_rows[i] = dec->y_buf + i * luma_stride;
+        dec->cb_rows[i] = dec->cb_buf + i * chroma_stride;
+        dec->cr_rows[i] = dec->cr_buf + i * chroma_stride;
+    }
+
+    dec->dinfo.err = jpeg_std_error(&dec->jerr);
+    dec->jerr.error_exit = _error_exit;
+    jpeg_create_decompress(&dec->dinfo);
+
+    return dec;
+}
+
+void jpeg_decoder_destroy(jpeg_decoder_t *dec)
+{
+    if(!dec)
+        return;
+
+    jpeg_destroy_decompress(&dec->dinfo);
+    free(dec->y_buf);
+    free(dec->cb_buf);
+    free(dec->cr_buf);
+    free(dec);
+}
+
+/* Only the sampling factors UVC cameras use are supported : 4:2:2 and 4:2:0 */
+static int _check_sampling(jpeg_decoder_t *dec)
+{
+    struct jpeg_decompress_struct *dinfo = &dec->dinfo;
+
+    if(dinfo->image_width != dec->width || dinfo->image_height != dec->height)
+    {
+        ERR("Cannot decode %ux%u JPEG frame, expected %ux%u",
+                dinfo->image_width, dinfo->image_height, dec->width, dec->height);
+        return -1;
+    }
+
+    if(dinfo->num_components != 3 ||
+       dinfo->comp_info[0].h_samp_factor != 2 ||
+       (dinfo->comp_info[0].v_samp_factor != 1 && dinfo->comp_info[0].v_samp_factor != 2) ||
+       dinfo->comp_info[1].h_samp_factor != 1 || dinfo->comp_info[1].v_samp_factor != 1 ||
+       dinfo->comp_info[2].h_samp_factor != 1 || dinfo->comp_info[2].v_samp_factor != 1)
+    {
+        ERR("Cannot decode JPEG frame : unsupported chroma subsampling");
+        return -1;
+    }
+    return 0;
+}
+
+/* Copy one decoded iMCU row to the NV12 output. 4:2:2 chroma is dropped to
+ * 4:2:0 by keeping even lines */
+static void _store_rows(jpeg_decoder_t *dec, unsigned int first_line, unsigned int nb_lines,
+        unsigned int v_samp, uint8_t *output_buf, unsigned int stride)
+{
+    uint8_t *chroma_plane = output_buf + stride * dec->height;
+    unsigned int line, chroma_line, x;
+    uint8_t *dst;
+
+    for(line = 0; line < nb_lines && first_line + line < dec->height; line++)
+        memcpy(output_buf + (first_line + line) * stride, dec->y_rows[line], dec->width);
+
+    for(line = 0; line < nb_lines / v_samp; line++)
+    {
+        if(v_samp == 1 && (first_line + line) % 2 != 0)
+            continue;
+        chroma_line = v_samp == 1 ? (first_line + line) / 2 : first_line / 2 + line;
+        if(chroma_line >= (dec->height + 1) / 2)
+            break;
+
+        dst = chroma_plane + chroma_line * stride;
+        for(x = 0; x < dec->width / 2; x++)
+        {
+            dst[2 * x] = dec->cb_rows[line][x];
+            dst[2 * x + 1] = dec->cr_rows[line][x];
+        }
+    }
+}
+
+/* Output is NV12 : luma plane of stride bytes per line, followed by the
+ * interleaved CbCr plane with the same stride. Returns 0 on success, -1 if the
+ * frame is corrupted or not supported */
+int jpeg_decoder_decode_frame(jpeg_decoder_t *dec, const uint8_t *input_buf, size_t input_size,
+        uint8_t *output_buf, unsigned int stride)
+{
+    struct jpeg_decompress_struct *dinfo = NULL;
+    JSAMPARRAY planes[3];
+    unsigned int mcu_lines = 0;
+    unsigned int v_samp = 0;
+    unsigned int first_line = 0;
+
+    if(!dec || !input_buf || !output_buf || input_size == 0 || stride < dec->width)
+    {
+        ERR("Cannot decode JPEG frame : input is invalid");
+        return -1;
+    }
+
+    dinfo = &dec->dinfo;
+    if(setjmp(dec->error_jmp))
+    {
+        jpeg_abort_decompress(dinfo);
+        return -1;
+    }
+
+    jpeg_mem_src(dinfo, input_buf, input_size);
+    jpeg_read_header(dinfo, TRUE);
+    if(_check_sampling(dec) != 0)
+    {
+        jpeg_abort_decompress(dinfo);
+        return -1;
+    }
+
+    dinfo->raw_data_out = TRUE;
+    dinfo->out_color_space = JCS_YCbCr;
+    dinfo->do_fancy_upsampling = FALSE;
+    jpeg_start_decompress(dinfo);
+
+    v_samp = dinfo->comp_info[0].v_samp_factor;
+    mcu_lines = v_samp * DCTSIZE;
+    planes[0] = dec->y_rows;
+    planes[1] = dec->cb_rows;
+    planes[2] = dec->cr_rows;
+    while(dinfo->output_scanline < dinfo->output_height)
+    {
+        first_line = dinfo->output_scanline;
+        if(jpeg_read_raw_data(dinfo, planes, mcu_lines) == 0)
+            break;
+        _store_rows(dec, first_line, mcu_lines, v_samp, output_buf, stride);
+    }
+    jpeg_finish_decompress(dinfo);
+
+    return 0;
+}
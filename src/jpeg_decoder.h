@@ -0,0 +1,14 @@
+#ifndef JPEG_DECODER_H
+#define JPEG_DECODER_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+typedef struct jpeg_decoder jpeg_decoder_t;
+
+jpeg_decoder_t *jpeg_decoder_create(unsigned int width, unsigned int height);
+void jpeg_decoder_destroy(jpeg_decoder_t *dec);
+int jpeg_decoder_decode_frame(jpeg_decoder_t *dec, const uint8_t *input_buf, size_t input_size,
+        uint8_t *output_buf, unsigned int stride);
+
+#endif
@@ -1,72 +1,349 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <jpeglib.h>
+#include <jerror.h>
 #include <setjmp.h>
 
 #include "utils.h"
 #include "jpeg_encoder.h"
 
-#define DEFAULT_QUALITY             50
+/* Maximum number of lines fed to libjpeg at once (one 4:2:0 iMCU row) */
+#define MAX_MCU_LINES               (2 * DCTSIZE)
+#define ALIGN_16(x)                 (((x) + 15) & ~15)
+#define NB_HUFF_TABLES              2   /* Luma and chroma */
 
-unsigned char *jpeg_encoder_encode_frame(uint8_t *input_buf, unsigned long *output_size)
+/* Each encoder owns its compressor, so several encoders can run in parallel
+ * from different threads. Compression parameters, tables, scratch planes
+ * and output buffer are kept across frames, so that steady-state encoding
+ * does not allocate anything.
+ * Frames are fed to libjpeg as raw, already downsampled, planes : luma rows
+ * are read in place whenever possible, and chroma is only deinterleaved at
+ * its native resolution */
+struct jpeg_encoder
 {
     struct jpeg_compress_struct cinfo;
     struct jpeg_error_mgr jerr;
-    JSAMPROW row_pointer[1];
-    uint8_t *rgb = NULL;
-    uint8_t *jpeg = NULL;
-    uint8_t *tmprowbuf;
+    jpeg_encoder_input input;
+    unsigned int stride;
+    unsigned int mcu_lines;
+    int chroma_420;             /* Chroma of packed input averaged over line pairs */
 
-    if(!input_buf)
+    /* Scratch planes for one iMCU row */
+    uint8_t *y_buf;
+    uint8_t *cb_buf;
+    uint8_t *cr_buf;
+    JSAMPROW y_rows[MAX_MCU_LINES];
+    JSAMPROW cb_rows[MAX_MCU_LINES];
+    JSAMPROW cr_rows[MAX_MCU_LINES];
+
+    /* Output buffer, grown by the destination manager when a frame does not
+     * fit, and kept at its allocated size for the next frames */
+    struct jpeg_destination_mgr dest;
+    unsigned char *out_buf;
+    unsigned long out_capacity;
+
+    /* Standard Huffman tables, which optimisation overwrites in the compressor */
+    JHUFF_TBL std_dc_tables[NB_HUFF_TABLES];
+    JHUFF_TBL std_ac_tables[NB_HUFF_TABLES];
+};
+
+static void _init_destination(j_compress_ptr cinfo)
+{
+    jpeg_encoder_t *enc = cinfo->client_data;
+
+    enc->dest.next_output_byte = enc->out_buf;
+    enc->dest.free_in_buffer = enc->out_capacity;
+}
+
+/* Whole buffer is full : double it, the frame goes on after what is written */
+static boolean _empty_output_buffer(j_compress_ptr cinfo)
+{
+    jpeg_encoder_t *enc = cinfo->client_data;
+    unsigned char *buf = realloc(enc->out_buf, enc->out_capacity * 2);
+
+    if(!buf)
+        ERREXIT1(cinfo, JERR_OUT_OF_MEMORY, 10);
+    DBG("JPEG output buffer grown to %lu bytes", enc->out_capacity * 2);
+    enc->out_buf = buf;
+    enc->dest.next_output_byte = buf + enc->out_capacity;
+    enc->dest.free_in_buffer = enc->out_capacity;
+    enc->out_capacity *= 2;
+    return TRUE;
+}
+
+static void _term_destination(j_compress_ptr cinfo)
+{
+    (void)cinfo;
+}
+
+static void _setup_sampling(jpeg_encoder_t *enc)
+{
+    struct jpeg_compress_struct *cinfo = &enc->cinfo;
+
+    jpeg_set_colorspace(cinfo, JCS_YCbCr);
+    cinfo->raw_data_in = TRUE;
+    /* Luma is full resolution, chroma is subsampled horizontally, and also
+     * vertically for semi-planar 4:2:0 inputs, or when asked for packed ones */
+    cinfo->comp_info[0].h_samp_factor = 2;
+    cinfo->comp_info[0].v_samp_factor = enc->input == JPEG_ENCODER_INPUT_YUYV && !enc->chroma_420 ? 1 : 2;
+    cinfo->comp_info[1].h_samp_factor = 1;
+    cinfo->comp_info[1].v_samp_factor = 1;
+    cinfo->comp_info[2].h_samp_factor = 1;
+    cinfo->comp_info[2].v_samp_factor = 1;
+    enc->mcu_lines = cinfo->comp_info[0].v_samp_factor * DCTSIZE;
+}
+
+/* stride is the number of bytes per line of the input, as negotiated with the
+ * driver : luma plane for semi-planar inputs (chroma plane uses the same
+ * stride), packed line for YUYV */
+jpeg_encoder_t *jpeg_encoder_create(jpeg_encoder_input input,
+        unsigned int width, unsigned int height, unsigned int stride)
+{
+    jpeg_encoder_t *enc = NULL;
+    size_t luma_stride = ALIGN_16(width);
+    size_t chroma_stride = luma_stride / 2;
+    int i = 0;
+
+    if(width == 0 || height == 0 || width % 2 != 0 ||
+       stride < (input == JPEG_ENCODER_INPUT_YUYV ? 2 * width : width))
     {
-        ERR("Cannot encode JPEG frame : input is invalid");
+        ERR("Cannot create JPEG encoder for %ux%u frames with %u bytes per line", width, height, stride);
         return NULL;
     }
 
-    if(!output_size)
+    enc = calloc(1, sizeof(jpeg_encoder_t));
+    if(!enc)
     {
-        ERR("Cannot encoder JPEG frame : output variables not properly allocated");
+        ERR("Cannot allocate JPEG encoder");
         return NULL;
     }
 
-    rgb = calloc(3 * FRAME_WIDTH * FRAME_HEIGHT, sizeof(uint8_t));
-
-    cinfo.err = jpeg_std_error(&jerr);
-    jpeg_create_compress(&cinfo);
-    jpeg_mem_dest(&cinfo, (unsigned char **)&jpeg, output_size);
-    cinfo.image_width = FRAME_WIDTH;
-    cinfo.image_height = FRAME_HEIGHT;
-    cinfo.input_components = 3;
-    cinfo.in_color_space = JCS_YCbCr;
-    jpeg_set_defaults(&cinfo);
-    jpeg_set_quality(&cinfo, DEFAULT_QUALITY, TRUE);
-    jpeg_start_compress(&cinfo, TRUE);
-    tmprowbuf = calloc(FRAME_SIZE*3, sizeof(uint8_t));
-    row_pointer[0] = &tmprowbuf[0];
-    while(cinfo.next_scanline < cinfo.image_height)
+    enc->input = input;
+    enc->stride = stride;
+    /* Semi-planar luma is read in place, only packed input needs a Y plane */
+    if(input == JPEG_ENCODER_INPUT_YUYV)
+        enc->y_buf = malloc(luma_stride * MAX_MCU_LINES);
+    else
+        enc->y_buf = malloc(1);
+    enc->cb_buf = malloc(chroma_stride * MAX_MCU_LINES);
+    enc->cr_buf = malloc(chroma_stride * MAX_MCU_LINES);
+    /* Initial output buffer size, large enough for most frames at default quality */
+    enc->out_capacity = width * height;
+    enc->out_buf = malloc(enc->out_capacity);
+    if(!enc->y_buf || !enc->cb_buf || !enc->cr_buf || !enc->out_buf)
+    {
+        ERR("Cannot allocate JPEG encoder buffers");
+        free(enc->y_buf);
+        free(enc->cb_buf);
+        free(enc->cr_buf);
+        free(enc->out_buf);
+        free(enc);
+        return NULL;
+    }
+
+    for(i = 0; i < MAX_MCU_LINES; i++)
+    {
+        if(input == JPEG_ENCODER_INPUT_YUYV)
+            enc->y_rows[i] = enc->y_buf + i * luma_stride;
+        enc->cb_rows[i] = enc->cb_buf + i * chroma_stride;
+        enc->cr_rows[i] = enc->cr_buf + i * chroma_stride;
+    }
+
+    enc->cinfo.err = jpeg_std_error(&enc->jerr);
+    jpeg_create_compress(&enc->cinfo);
+    enc->cinfo.client_data = enc;
+    enc->dest.init_destination = _init_destination;
+    enc->dest.empty_output_buffer = _empty_output_buffer;
+    enc->dest.term_destination = _term_destination;
+    enc->cinfo.dest = &enc->dest;
+    enc->cinfo.image_width = width;
+    enc->cinfo.image_height = height;
+    enc->cinfo.input_components = 3;
+    enc->cinfo.in_color_space = JCS_YCbCr;
+    jpeg_set_defaults(&enc->cinfo);
+    jpeg_set_quality(&enc->cinfo, DEFAULT_JPEG_QUALITY, TRUE);
+    _setup_sampling(enc);
+    for(i = 0; i < NB_HUFF_TABLES; i++)
+    {
+        enc->std_dc_tables[i] = *enc->cinfo.dc_huff_tbl_ptrs[i];
+        enc->std_ac_tables[i] = *enc->cinfo.ac_huff_tbl_ptrs[i];
+    }
+
+    return enc;
+}
+
+void jpeg_encoder_destroy(jpeg_encoder_t *enc)
+{
+    if(!enc)
+        return;
+
+    jpeg_destroy_compress(&enc->cinfo);
+    free(enc->y_buf);
+    free(enc->cb_buf);
+    free(enc->cr_buf);
+    free(enc->out_buf);
+    free(enc);
+}
+
+/* Quality from 1 to 100, applies from the next frame */
+int jpeg_encoder_set_quality(jpeg_encoder_t *enc, int quality)
+{
+    if(quality < 1 || quality > 100)
+    {
+        ERR("Invalid JPEG quality %d (must be 1-100)", quality);
+        return -1;
+    }
+    jpeg_set_quality(&enc->cinfo, quality, TRUE);
+    return 0;
+}
+
+/* Applies from the next frame. Vertical chroma subsampling only changes packed
+ * inputs, semi-planar ones are always 4:2:0 */
+int jpeg_encoder_configure(jpeg_encoder_t *enc, const jpeg_encoder_settings *settings)
+{
+    int i = 0;
+
+    if(settings->quality < 1 || settings->quality > 100)
+    {
+        ERR("Invalid JPEG quality %d (must be 1-100)", settings->quality);
+        return -1;
+    }
+
+    /* Optimisation fits the Huffman tables of the compressor to each frame :
+     * standard ones must be restored without it */
+    if(enc->cinfo.optimize_coding && !settings->optimize_coding)
+    {
+        for(i = 0; i < NB_HUFF_TABLES; i++)
+        {
+            *enc->cinfo.dc_huff_tbl_ptrs[i] = enc->std_dc_tables[i];
+            *enc->cinfo.ac_huff_tbl_ptrs[i] = enc->std_ac_tables[i];
+        }
+    }
+    enc->chroma_420 = enc->input == JPEG_ENCODER_INPUT_YUYV && settings->chroma_420;
+    _setup_sampling(enc);
+    jpeg_set_quality(&enc->cinfo, settings->quality, TRUE);
+    enc->cinfo.dct_method = settings->fast_dct ? JDCT_IFAST : JDCT_ISLOW;
+    enc->cinfo.optimize_coding = settings->optimize_coding ? TRUE : FALSE;
+    return 0;
+}
+
+/* Semi-planar 4:2:0 : luma rows are given to libjpeg in place, chroma pairs are
+ * split into the Cb and Cr scratch planes */
+static void _prepare_semiplanar_rows(jpeg_encoder_t *enc, uint8_t *input_buf,
+        unsigned int first_line, JSAMPARRAY planes[3])
+{
+    unsigned int width = enc->cinfo.image_width;
+    unsigned int height = enc->cinfo.image_height;
+    unsigned int stride = enc->stride;
+    uint8_t *chroma_plane = input_buf + stride * height;
+    int cb_offset = enc->input == JPEG_ENCODER_INPUT_NV12 ? 0 : 1;
+    unsigned int line, chroma_line, x;
+    uint8_t *src;
+
+    for(line = 0; line < enc->mcu_lines; line++)
+    {
+        /* Last iMCU row may go past the image : repeat last line */
+        unsigned int y = first_line + line < height ? first_line + line : height - 1;
+        enc->y_rows[line] = input_buf + y * stride;
+    }
+
+    for(chroma_line = 0; chroma_line < enc->mcu_lines / 2; chroma_line++)
+    {
+        unsigned int y = first_line / 2 + chroma_line;
+        if(y >= (height + 1) / 2)
+            y = (height + 1) / 2 - 1;
+        src = chroma_plane + y * stride;
+        for(x = 0; x < width / 2; x++)
+        {
+            enc->cb_rows[chroma_line][x] = src[2 * x + cb_offset];
+            enc->cr_rows[chroma_line][x] = src[2 * x + 1 - cb_offset];
+        }
+    }
+
+    planes[0] = enc->y_rows;
+    planes[1] = enc->cb_rows;
+    planes[2] = enc->cr_rows;
+}
+
+/* Packed 4:2:2 : Y0 U Y1 V macropixels are split into the three scratch planes.
+ * For 4:2:0 output, chroma of each line pair is averaged */
+static void _prepare_packed_rows(jpeg_encoder_t *enc, uint8_t *input_buf,
+        unsigned int first_line, JSAMPARRAY planes[3])
+{
+    unsigned int width = enc->cinfo.image_width;
+    unsigned int height = enc->cinfo.image_height;
+    unsigned int line, x;
+    uint8_t *src, *next, *y_row, *cb_row, *cr_row;
+
+    for(line = 0; line < enc->mcu_lines; line++)
     {
-        /* Inspired from https://gist.github.com/royshil/fa98604b01787172b270 */
-        unsigned i, j;
-        unsigned offset = cinfo.next_scanline * cinfo.image_width * 2;
-        for (i = 0, j = 0; i < cinfo.image_width * 2; i += 4, j += 6)
+        unsigned int y = first_line + line < height ? first_line + line : height - 1;
+        src = input_buf + y * enc->stride;
+        y_row = enc->y_rows[line];
+        for(x = 0; x < width / 2; x++)
         {
-            tmprowbuf[j + 0] = input_buf[offset + i + 0];
-            tmprowbuf[j + 1] = input_buf[offset + i + 1];
-            tmprowbuf[j + 2] = input_buf[offset + i + 3];
-            tmprowbuf[j + 3] = input_buf[offset + i + 2];
-            tmprowbuf[j + 4] = input_buf[offset + i + 1];
-            tmprowbuf[j + 5] = input_buf[offset + i + 3];
+            y_row[2 * x] = src[4 * x];
+            y_row[2 * x + 1] = src[4 * x + 2];
+        }
+
+        if(!enc->chroma_420)
+        {
+            cb_row = enc->cb_rows[line];
+            cr_row = enc->cr_rows[line];
+            for(x = 0; x < width / 2; x++)
+            {
+                cb_row[x] = src[4 * x + 1];
+                cr_row[x] = src[4 * x + 3];
+            }
+        }
+        else if(line % 2 == 0)
+        {
+            next = y + 1 < height ? src + enc->stride : src;
+            cb_row = enc->cb_rows[line / 2];
+            cr_row = enc->cr_rows[line / 2];
+            for(x = 0; x < width / 2; x++)
+            {
+                cb_row[x] = (src[4 * x + 1] + next[4 * x + 1] + 1) >> 1;
+                cr_row[x] = (src[4 * x + 3] + next[4 * x + 3] + 1) >> 1;
+            }
         }
-        jpeg_write_scanlines(&cinfo, row_pointer, 1);
     }
-    jpeg_finish_compress(&cinfo);
-    jpeg_destroy_compress(&cinfo);
-    if(rgb)
-        free(rgb);
-    if(tmprowbuf)
-        free(tmprowbuf);
-
-    INF("JPEG frame encoded");
-    return jpeg;
+
+    planes[0] = enc->y_rows;
+    planes[1] = enc->cb_rows;
+    planes[2] = enc->cr_rows;
 }
 
+/* Returned buffer belongs to the encoder, and is valid until next call */
+unsigned char *jpeg_encoder_encode_frame(jpeg_encoder_t *enc, uint8_t *input_buf, unsigned long *output_size)
+{
+    struct jpeg_compress_struct *cinfo = NULL;
+    JSAMPARRAY planes[3];
+
+    if(!enc || !input_buf)
+    {
+        ERR("Cannot encode JPEG frame : input is invalid");
+        return NULL;
+    }
+
+    if(!output_size)
+    {
+        ERR("Cannot encoder JPEG frame : output variables not properly allocated");
+        return NULL;
+    }
+
+    cinfo = &enc->cinfo;
+    jpeg_start_compress(cinfo, TRUE);
+    while(cinfo->next_scanline < cinfo->image_height)
+    {
+        if(enc->input == JPEG_ENCODER_INPUT_YUYV)
+            _prepare_packed_rows(enc, input_buf, cinfo->next_scanline, planes);
+        else
+            _prepare_semiplanar_rows(enc, input_buf, cinfo->next_scanline, planes);
+        jpeg_write_raw_data(cinfo, planes, enc->mcu_lines);
+    }
+    jpeg_finish_compress(cinfo);
+
+    *output_size = enc->out_capacity - enc->dest.free_in_buffer;
+    return enc->out_buf;
+}
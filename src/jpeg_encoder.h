@@ -1,7 +1,31 @@
 #ifndef JPEG_ENCODER_H
 #define JPEG_ENCODER_H
 
-unsigned char *jpeg_encoder_encode_frame(uint8_t *input_buf, unsigned long *output_size);
+#include <stdint.h>
 
-#endif
+typedef enum
+{
+    JPEG_ENCODER_INPUT_YUYV,    /* Packed 4:2:2 */
+    JPEG_ENCODER_INPUT_NV21,    /* Semi-planar 4:2:0, VU interleaved */
+    JPEG_ENCODER_INPUT_NV12,    /* Semi-planar 4:2:0, UV interleaved */
+} jpeg_encoder_input;
+
+/* Compression settings, trading quality and size for encoding time */
+typedef struct
+{
+    int quality;                /* 1 to 100 */
+    int fast_dct;               /* Less accurate integer DCT */
+    int optimize_coding;        /* Huffman tables fitted to each frame, in a second pass */
+    int chroma_420;             /* Packed 4:2:2 input also subsampled vertically */
+} jpeg_encoder_settings;
+
+typedef struct jpeg_encoder jpeg_encoder_t;
 
+jpeg_encoder_t *jpeg_encoder_create(jpeg_encoder_input input,
+        unsigned int width, unsigned int height, unsigned int stride);
+void jpeg_encoder_destroy(jpeg_encoder_t *enc);
+int jpeg_encoder_set_quality(jpeg_encoder_t *enc, int quality);
+int jpeg_encoder_configure(jpeg_encoder_t *enc, const jpeg_encoder_settings *settings);
+unsigned char *jpeg_encoder_encode_frame(jpeg_encoder_t *enc, uint8_t *input_buf, unsigned long *output_size);
+
+#endif
@@ -4,44 +4,122 @@
 #include <unistd.h>
 #include <getopt.h>
 #include <string.h>
+#include <linux/videodev2.h>
 
 #include "utils.h"
 #include "yuv_fetcher.h"
+#include "capture_loop.h"
+#include "dma_heap.h"
+#include "buffer_pool.h"
 
 static int _print_cap = 0;
-static char _device[DEVICE_NAME_MAX_SIZE] = {0};
+static char _devices[MAX_DEVICES][DEVICE_NAME_MAX_SIZE] = {{0}};
+static int _nb_devices = 0;
+static yuv_fetcher_t *_fetchers[MAX_DEVICES] = {0};
+static capture_loop_t *_loop = NULL;
 static char _output_dir[OUTPUT_DIR_NAME_MAX_SIZE] = {0};
 static char _format[FORMAT_MAX_SIZE] = {0};
 static int _print_help = 0;
 static int _print_formats = 0;
 static int _print_controls = 0;
+static int _nb_writers = NB_WRITER_THREADS;
+static int _timeout_ms = FRAME_TIMEOUT_MS;
+static int _publish = 0;
+static frame_sink_type _sink = FRAME_SINK_FILES;
+static size_t _segment_size = SEGMENT_SIZE;
+static unsigned int _segment_duration = SEGMENT_DURATION_S;
+static int _events = 0;
+static unsigned int _event_pre_s = 0;
+static unsigned int _event_post_s = 0;
+static size_t _history_budget = (size_t)HISTORY_BUDGET_MB * 1024 * 1024;
+static unsigned int _decimation = 0;
+static unsigned int _record_fps = 0;
+static unsigned int _roi_x = 0;
+static unsigned int _roi_y = 0;
+static unsigned int _roi_width = 0; /* Whole frame */
+static unsigned int _roi_height = 0;
+static unsigned int _scale = 1;
+static unsigned int _thumb_factors[MAX_THUMBNAILS];
+static int _nb_thumbs = 0;
+static int _trace = 0;
+static int _min_quality = DEFAULT_JPEG_QUALITY;
+static int _max_quality = DEFAULT_JPEG_QUALITY;
+static unsigned int _cpu_budget = 0;
+static char _metrics_file[OUTPUT_DIR_NAME_MAX_SIZE] = {0};
+static char _metrics_socket[OUTPUT_DIR_NAME_MAX_SIZE] = {0};
+static yuv_fetcher_memory _memory = YUV_FETCHER_MEMORY_MMAP;
+static unsigned int _width = DEFAULT_FRAME_WIDTH;
+static unsigned int _height = DEFAULT_FRAME_HEIGHT;
+static uint32_t _pixelformat = 0; /* Negotiated */
+static unsigned int _frame_rate = DEFAULT_FRAME_RATE;
+static unsigned int _nb_buffers = DEFAULT_NB_BUF;
+static int _import_fds[MAX_DEVICES][MAX_BUF];
+static buffer_pool_t *_pools[MAX_DEVICES] = {0};
 
 static void _usage(char *progname)
 {
-    fprintf(stderr, "Usage : %s [-c] [-d device] [-o directory [-f format]]\n", progname);
+    fprintf(stderr, "Usage : %s [-c] [-d device [-d device ...]] [-s WxH] [-P pixfmt] [-r fps] [-b buffers] [-m memory] [-o directory [-f format [-q quality[:max] [-u percent]]] [-O sink [-S size] [-D duration]] [-e pre:post [-M budget]] [-n N] [-R fps] [-x WxH+X+Y] [-z factor] [-y factor[,factor]] [-t threads] [-l]] [-p] [-T timeout] [-w file] [-W socket]\n", progname);
     fprintf(stderr, "Options :\n");
+    fprintf(stderr, "  -b           number of capture buffers (default: %d)\n", DEFAULT_NB_BUF);
     fprintf(stderr, "  -c           print video device capabilities and quit\n");
     fprintf(stderr, "  -C           print video controls capabilities and quit\n");
-    fprintf(stderr, "  -d           device to use (default: /dev/video0)\n");
+    fprintf(stderr, "  -D           segment duration in seconds (default: %d = no limit)\n", SEGMENT_DURATION_S);
+    fprintf(stderr, "  -d           device to use, can be repeated up to %d times (default: /dev/video0)\n", MAX_DEVICES);
+    fprintf(stderr, "               or a frame source : synthetic[:bars|noise|moving], or replay:<segment file>\n");
+    fprintf(stderr, "  -e           only record events : pre seconds before and post seconds after each trigger (SIGUSR1 or %s)\n", TRIGGER_SOCKET_PATH);
     fprintf(stderr, "  -f           output format (can be 'raw' or 'jpeg', default = raw)\n");
     fprintf(stderr, "  -F           print device formats and quit\n");
     fprintf(stderr, "  -h           prints this help\n");
+    fprintf(stderr, "  -l           trace the latencies of every recorded frame in <directory>/<device>.trace (not with -e)\n");
+    fprintf(stderr, "  -M           event history memory budget per device in MB (default: %d)\n", HISTORY_BUDGET_MB);
+    fprintf(stderr, "  -m           buffer memory mode (can be 'mmap', 'export', 'import' or 'userptr', default = mmap). Exported and imported dmabufs are only shown to a demo hook, logged in debug builds\n");
+    fprintf(stderr, "  -n           record one frame out of N (default: 1 = every frame)\n");
     fprintf(stderr, "  -o           output directory to use (default: local directory)\n");
+    fprintf(stderr, "  -O           output sink (can be 'files' for the last %d frames, or 'segments', 'avi' or 'mkv' to record every frame, default = files)\n", NB_DUMP_FRAME);
+    fprintf(stderr, "  -P           pixel format (can be 'auto', 'nv21', 'nv12', 'yuyv' or 'mjpeg', default = auto)\n");
+    fprintf(stderr, "  -p           publish frames on a shared memory bus (/dev/shm/%s<device>)\n", BUS_NAME_PREFIX);
+    fprintf(stderr, "  -q           JPEG quality, or min:max range adapted to keep up with the recorded frame rate (default: %d)\n", DEFAULT_JPEG_QUALITY);
+    fprintf(stderr, "  -R           maximum recorded frame rate, following capture timestamps (default: 0 = capture rate)\n");
+    fprintf(stderr, "  -r           frame rate (default: %d, 0 = as fast as possible with frame sources)\n", DEFAULT_FRAME_RATE);
+    fprintf(stderr, "  -S           segment size in MB (default: %d)\n", SEGMENT_SIZE / (1024 * 1024));
+    fprintf(stderr, "  -s           frame size (default: %dx%d)\n", DEFAULT_FRAME_WIDTH, DEFAULT_FRAME_HEIGHT);
+    fprintf(stderr, "  -T           frame timeout in ms before reporting a stalled device (default: %d)\n", FRAME_TIMEOUT_MS);
+    fprintf(stderr, "  -t           number of writer/encoder threads (default: 0 = one per CPU)\n");
+    fprintf(stderr, "  -u           with a quality range, percent of one CPU JPEG encoding may use (default: 0 = no limit)\n");
+    fprintf(stderr, "  -W           serve live metrics on this UNIX socket, in Prometheus text format\n");
+    fprintf(stderr, "  -w           write live metrics to this file every %d ms, in Prometheus text format\n", METRICS_PERIOD_MS);
+    fprintf(stderr, "  -x           only record a region of the frame, cropped by the driver when it can (default: whole frame)\n");
+    fprintf(stderr, "  -y           also record thumbnails, downscaled by 2 or 4 from the recorded frames, up to %d comma separated factors\n", MAX_THUMBNAILS);
+    fprintf(stderr, "  -z           downscale recorded frames by 1, 2 or 4 (default: 1)\n");
 }
 
+/* Only async-signal-safe calls here */
 static void _int_handler(int sig)
 {
-    INF("Main loop interrupted");
-    yuv_fetcher_stop();
+    (void)sig;
+    if(_loop)
+        capture_loop_stop(_loop);
 };
 
+/* Only async-signal-safe calls here */
+static void _trigger_handler(int sig)
+{
+    (void)sig;
+    if(_loop)
+        capture_loop_trigger(_loop);
+}
+
 static int _parse_args(int argc, char *argv[])
 {
+    char *token = NULL;
     int c = 0;
-    while ((c = getopt (argc, argv, "cCd:f:Fho:")) != -1)
+    while ((c = getopt (argc, argv, "b:cCd:D:e:f:Fhlm:M:n:o:O:pP:q:r:R:s:S:t:T:u:w:W:x:y:z:")) != -1)
     {
         switch (c)
         {
+            case 'b':
+                _nb_buffers = atoi(optarg);
+                break;
             case 'c':
                 _print_cap = 1;
                 break;
@@ -49,7 +127,23 @@ static int _parse_args(int argc, char *argv[])
                 _print_controls = 1;
                 break;
             case 'd':
-                strncpy(_device, optarg, DEVICE_NAME_MAX_SIZE);
+                if(_nb_devices >= MAX_DEVICES)
+                {
+                    _usage(argv[0]);
+                    return 1;
+                }
+                strncpy(_devices[_nb_devices++], optarg, DEVICE_NAME_MAX_SIZE - 1);
+                break;
+            case 'D':
+                _segment_duration = atoi(optarg);
+                break;
+            case 'e':
+                if(sscanf(optarg, "%u:%u", &_event_pre_s, &_event_post_s) != 2)
+                {
+                    _usage(argv[0]);
+                    return 1;
+                }
+                _events = 1;
                 break;
             case 'f':
                 strncpy(_format, optarg, FORMAT_MAX_SIZE);
@@ -66,9 +160,129 @@ static int _parse_args(int argc, char *argv[])
             case 'h':
                 _print_help = 1;
                 break;
+            case 'l':
+                _trace = 1;
+                break;
+            case 'm':
+                if(strcmp(optarg, "mmap") == 0)
+                    _memory = YUV_FETCHER_MEMORY_MMAP;
+                else if(strcmp(optarg, "export") == 0)
+                    _memory = YUV_FETCHER_MEMORY_MMAP_EXPORT;
+                else if(strcmp(optarg, "import") == 0)
+                    _memory = YUV_FETCHER_MEMORY_DMABUF_IMPORT;
+                else if(strcmp(optarg, "userptr") == 0)
+                    _memory = YUV_FETCHER_MEMORY_USERPTR;
+                else
+                {
+                    _usage(argv[0]);
+                    return 1;
+                }
+                break;
+            case 'M':
+                _history_budget = (size_t)atoi(optarg) * 1024 * 1024;
+                break;
+            case 'n':
+                _decimation = atoi(optarg);
+                break;
             case 'o':
                 strncpy(_output_dir, optarg, OUTPUT_DIR_NAME_MAX_SIZE);
                 break;
+            case 'O':
+                if(strcmp(optarg, "files") == 0)
+                    _sink = FRAME_SINK_FILES;
+                else if(strcmp(optarg, "segments") == 0)
+                    _sink = FRAME_SINK_SEGMENTS;
+                else if(strcmp(optarg, "avi") == 0)
+                    _sink = FRAME_SINK_AVI;
+                else if(strcmp(optarg, "mkv") == 0)
+                    _sink = FRAME_SINK_MKV;
+                else
+                {
+                    _usage(argv[0]);
+                    return 1;
+                }
+                break;
+            case 'p':
+                _publish = 1;
+                break;
+            case 'P':
+                if(strcmp(optarg, "auto") == 0)
+                    _pixelformat = 0;
+                else if(strcmp(optarg, "nv21") == 0)
+                    _pixelformat = V4L2_PIX_FMT_NV21;
+                else if(strcmp(optarg, "nv12") == 0)
+                    _pixelformat = V4L2_PIX_FMT_NV12;
+                else if(strcmp(optarg, "yuyv") == 0)
+                    _pixelformat = V4L2_PIX_FMT_YUYV;
+                else if(strcmp(optarg, "mjpeg") == 0)
+                    _pixelformat = V4L2_PIX_FMT_MJPEG;
+                else
+                {
+                    _usage(argv[0]);
+                    return 1;
+                }
+                break;
+            case 'q':
+                if(sscanf(optarg, "%d:%d", &_min_quality, &_max_quality) < 1)
+                {
+                    _usage(argv[0]);
+                    return 1;
+                }
+                if(!strchr(optarg, ':'))
+                    _max_quality = _min_quality;
+                break;
+            case 'r':
+                _frame_rate = atoi(optarg);
+                break;
+            case 'R':
+                _record_fps = atoi(optarg);
+                break;
+            case 's':
+                if(sscanf(optarg, "%ux%u", &_width, &_height) != 2)
+                {
+                    _usage(argv[0]);
+                    return 1;
+                }
+                break;
+            case 'S':
+                _segment_size = (size_t)atoi(optarg) * 1024 * 1024;
+                break;
+            case 't':
+                _nb_writers = atoi(optarg);
+                break;
+            case 'T':
+                _timeout_ms = atoi(optarg);
+                break;
+            case 'u':
+                _cpu_budget = atoi(optarg);
+                break;
+            case 'w':
+                strncpy(_metrics_file, optarg, OUTPUT_DIR_NAME_MAX_SIZE - 1);
+                break;
+            case 'W':
+                strncpy(_metrics_socket, optarg, OUTPUT_DIR_NAME_MAX_SIZE - 1);
+                break;
+            case 'x':
+                if(sscanf(optarg, "%ux%u+%u+%u", &_roi_width, &_roi_height, &_roi_x, &_roi_y) != 4)
+                {
+                    _usage(argv[0]);
+                    return 1;
+                }
+                break;
+            case 'y':
+                for(token = strtok(optarg, ","), _nb_thumbs = 0; token; token = strtok(NULL, ","))
+                {
+                    if(_nb_thumbs >= MAX_THUMBNAILS)
+                    {
+                        _usage(argv[0]);
+                        return 1;
+                    }
+                    _thumb_factors[_nb_thumbs++] = atoi(token);
+                }
+                break;
+            case 'z':
+                _scale = atoi(optarg);
+                break;
             default:
                 _usage(argv[0]);
                 return 1;
@@ -86,16 +300,185 @@ static int _parse_args(int argc, char *argv[])
     return 0;
 }
 
+/* Demo hook : this is where the dmabuf of each frame would be handed to a
+ * GPU or hardware encoder. It is only logged, in debug builds */
+static void _dmabuf_ready(const yuv_frame *frame)
+{
+    (void)frame;
+    DBG("%s : frame %u of %zu bytes available in dmabuf fd %d (buffer %u)",
+            yuv_fetcher_get_name(frame->fetcher), frame->sequence, frame->bytesused,
+            frame->dmabuf_fd, frame->index);
+}
 
-static void _start_main_loop()
+/* In import mode, capture buffers are allocated from the system DMA heap, as
+ * an external allocator (GPU, encoder, ...) would do */
+static int _setup_memory(int device_index)
 {
+    yuv_fetcher_t *f = _fetchers[device_index];
+    unsigned int i = 0;
+
+    if(_memory == YUV_FETCHER_MEMORY_DMABUF_IMPORT)
+    {
+        for(i = 0; i < _nb_buffers; i++)
+        {
+            _import_fds[device_index][i] = dma_heap_alloc(DMA_HEAP_DEFAULT, yuv_fetcher_get_frame_size(f));
+            if(_import_fds[device_index][i] < 0)
+                return -1;
+        }
+    }
+
+    /* In userptr mode, frames are captured in a locked, hugepage backed pool
+     * local to the NUMA node running the capture loop */
+    if(_memory == YUV_FETCHER_MEMORY_USERPTR)
+    {
+        _pools[device_index] = buffer_pool_create(_nb_buffers, yuv_fetcher_get_frame_size(f),
+                BUFFER_POOL_HUGEPAGES | BUFFER_POOL_MLOCK | BUFFER_POOL_NUMA_LOCAL);
+        if(!_pools[device_index])
+            return -1;
+        return yuv_fetcher_set_userptr(f, buffer_pool_get_all(_pools[device_index]),
+                buffer_pool_get_count(_pools[device_index]),
+                buffer_pool_get_buffer_size(_pools[device_index]));
+    }
+
+    if(yuv_fetcher_set_memory(f, _memory, _import_fds[device_index], _nb_buffers) != 0)
+        return -1;
+
+    if(_memory != YUV_FETCHER_MEMORY_MMAP)
+        yuv_fetcher_register_frame_callback(f, _dmabuf_ready);
+
+    return 0;
+}
+
+/* Without an explicit pixel format, the cheapest one for the requested output
+ * is picked among the ones the device offers */
+static int _setup_format(int device_index)
+{
+    yuv_fetcher_t *f = _fetchers[device_index];
+    int jpeg_output = strncmp(_format, "jpeg", FORMAT_MAX_SIZE) == 0;
+
+    if(_pixelformat == 0)
+        return yuv_fetcher_negotiate_format(f, jpeg_output, _width, _height, _frame_rate);
+
+    return yuv_fetcher_set_format(f, _width, _height, _pixelformat, _frame_rate);
+}
+
+static void _free_imported_buffers(void)
+{
+    int i = 0, j = 0;
+
+    for(i = 0; i < MAX_DEVICES; i++)
+    {
+        buffer_pool_destroy(_pools[i]);
+        _pools[i] = NULL;
+        for(j = 0; j < MAX_BUF; j++)
+        {
+            if(_import_fds[i][j] >= 0)
+                close(_import_fds[i][j]);
+            _import_fds[i][j] = -1;
+        }
+    }
+}
+
+static int _start_main_loop()
+{
+    metrics_t *metrics[MAX_DEVICES];
+    metrics_exporter_t *exporter = NULL;
+    int i = 0;
+    int ret = 0;
+
+    _loop = capture_loop_create();
+    if(!_loop)
+        return 1;
+
+    if(capture_loop_set_timeout(_loop, _timeout_ms) != 0)
+    {
+        ret = 1;
+        goto loop_end;
+    }
+
+    for(i = 0; i < _nb_devices; i++)
+    {
+        yuv_fetcher_set_publish(_fetchers[i], _publish);
+        yuv_fetcher_set_sink(_fetchers[i], _sink);
+        yuv_fetcher_set_segment_limits(_fetchers[i], _segment_size, _segment_duration);
+        if(_events)
+            yuv_fetcher_set_history(_fetchers[i], _event_pre_s, _event_post_s, _history_budget);
+        yuv_fetcher_set_decimation(_fetchers[i], _decimation, _record_fps);
+        yuv_fetcher_set_trace(_fetchers[i], _trace);
+        if(yuv_fetcher_set_quality(_fetchers[i], _min_quality, _max_quality, _cpu_budget) != 0 ||
+           _setup_format(i) != 0 ||
+           yuv_fetcher_set_roi(_fetchers[i], _roi_x, _roi_y, _roi_width, _roi_height, _scale) != 0 ||
+           yuv_fetcher_set_thumbnails(_fetchers[i], _thumb_factors, _nb_thumbs) != 0 ||
+           yuv_fetcher_set_buffer_count(_fetchers[i], _nb_buffers) != 0 ||
+           _setup_memory(i) != 0 ||
+           yuv_fetcher_set_writer_threads(_fetchers[i], _nb_writers) != 0 ||
+           yuv_fetcher_start(_fetchers[i], _output_dir, _format) != 0 ||
+           capture_loop_add(_loop, _fetchers[i]) != 0)
+        {
+            ERR("Cannot start capture on %s", yuv_fetcher_get_name(_fetchers[i]));
+            ret = 1;
+            goto loop_end;
+        }
+    }
+
+    if(_events)
+    {
+        if(capture_loop_set_trigger_socket(_loop, TRIGGER_SOCKET_PATH) != 0)
+        {
+            ret = 1;
+            goto loop_end;
+        }
+        signal(SIGUSR1, _trigger_handler);
+    }
+
+    if(_metrics_file[0] || _metrics_socket[0])
+    {
+        for(i = 0; i < _nb_devices; i++)
+            metrics[i] = yuv_fetcher_get_metrics(_fetchers[i]);
+        exporter = metrics_exporter_start(metrics, _nb_devices, _metrics_file[0] ? _metrics_file : NULL,
+                _metrics_socket[0] ? _metrics_socket : NULL, METRICS_PERIOD_MS);
+        if(!exporter)
+        {
+            ret = 1;
+            goto loop_end;
+        }
+    }
+
     // Blocking call
-    yuv_fetcher_start(_output_dir, _format);
+    if(capture_loop_run(_loop) != 0)
+        ret = 1;
+
+loop_end:
+    /* Sinks are about to be destroyed */
+    if(_events)
+        signal(SIGUSR1, SIG_IGN);
+    for(i = 0; i < _nb_devices; i++)
+        yuv_fetcher_stop(_fetchers[i]);
+    /* Last values, once writers are done */
+    metrics_exporter_stop(exporter);
+    capture_loop_destroy(_loop);
+    _loop = NULL;
+    return ret;
+}
+
+static void _shutdown_fetchers(void)
+{
+    int i = 0;
+
+    for(i = 0; i < _nb_devices; i++)
+    {
+        yuv_fetcher_shutdown(_fetchers[i]);
+        _fetchers[i] = NULL;
+    }
 }
 
 int main(int argc, char *argv[])
 {
     int run_capture = 0;
+    int ret = 0;
+    int i = 0;
+
+    memset(_import_fds, -1, sizeof(_import_fds));
     if(_parse_args(argc, argv) != 0)
         return 1;
 
@@ -105,6 +488,10 @@ int main(int argc, char *argv[])
         return 0;
     }
 
+    /* Default device is used if none has been given */
+    if(_nb_devices == 0)
+        _nb_devices = 1;
+
     INF("**************************");
     INF("***      V4L2 demo     ***");
     INF("**************************\n");
@@ -117,22 +504,28 @@ int main(int argc, char *argv[])
             _print_formats ||
             _print_controls);
 
-    if(yuv_fetcher_init(run_capture, _device) != 0)
+    for(i = 0; i < _nb_devices; i++)
     {
-        ERR("Cannot initialize YUV fetcher");
-        return 1;
+        _fetchers[i] = yuv_fetcher_init(run_capture, _devices[i]);
+        if(!_fetchers[i])
+        {
+            ERR("Cannot initialize YUV fetcher");
+            _shutdown_fetchers();
+            return 1;
+        }
+
+        if(_print_controls)
+            yuv_fetcher_print_controls(_fetchers[i]);
+        if(_print_formats)
+            yuv_fetcher_print_avail_formats(_fetchers[i]);
+        if(_print_cap)
+            yuv_fetcher_print_capabilities(_fetchers[i]);
     }
-    
-    if(_print_controls)
-        yuv_fetcher_print_controls();
-    if(_print_formats)
-        yuv_fetcher_print_avail_formats();
-    if(_print_cap)
-        yuv_fetcher_print_capabilities();
 
     if(run_capture)
-        _start_main_loop ();
+        ret = _start_main_loop();
 
-    yuv_fetcher_shutdown();
-    return 0;
+    _shutdown_fetchers();
+    _free_imported_buffers();
+    return ret;
 }
@@ -0,0 +1,518 @@
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "utils.h"
+#include "metrics.h"
+
+/* Log-linear buckets, as in HDR histograms : values below 16 ns have their own
+ * bucket, larger ones share a bucket with the values having the same 4 most
+ * significant bits, i.e. within 12.5 % of each other. Values are clamped to
+ * 2^40 ns, about 18 minutes */
+#define HIST_SUB_BITS           3
+#define HIST_SUB_COUNT          (1 << HIST_SUB_BITS)
+#define HIST_MAX_BITS           40
+#define HIST_NB_BUCKETS         ((HIST_MAX_BITS - HIST_SUB_BITS + 1) * HIST_SUB_COUNT)
+
+#define METRICS_PREFIX          "demo_v4l2_"
+#define METRICS_TEXT_MAX_SIZE   (64 * 1024)
+#define METRICS_PATH_MAX_SIZE   256
+
+typedef struct
+{
+    uint64_t buckets[HIST_NB_BUCKETS];
+    uint64_t count;
+    uint64_t sum_ns;
+    uint64_t max_ns;
+} metrics_histogram;
+
+struct metrics
+{
+    char device[DEVICE_NAME_MAX_SIZE];
+    metrics_histogram stages[METRICS_STAGE_COUNT];
+    uint64_t counters[METRICS_COUNTER_COUNT];
+    int64_t gauges[METRICS_GAUGE_COUNT];
+};
+
+struct metrics_exporter
+{
+    pthread_t thread;
+    int stop_fd;
+    int listen_fd;
+    metrics_t *metrics[MAX_DEVICES];
+    int nb_metrics;
+    char file[METRICS_PATH_MAX_SIZE];
+    char socket_path[METRICS_PATH_MAX_SIZE];
+    unsigned int period_ms;
+    char *text;
+};
+
+static const char *_stage_names[METRICS_STAGE_COUNT] = {
+    [METRICS_STAGE_DQBUF_WAIT] = "dqbuf_wait",
+    [METRICS_STAGE_CALLBACK] = "callback",
+    [METRICS_STAGE_ENCODE] = "encode",
+    [METRICS_STAGE_WRITE] = "write",
+    [METRICS_STAGE_CAPTURE_TO_DEQUEUE] = "capture_to_dequeue",
+    [METRICS_STAGE_DEQUEUE_TO_ENCODED] = "dequeue_to_encoded",
+    [METRICS_STAGE_ENCODED_TO_DURABLE] = "encoded_to_durable",
+};
+
+static const struct
+{
+    const char *name;
+    const char *help;
+} _counters[METRICS_COUNTER_COUNT] = {
+    [METRICS_COUNTER_CAPTURED] = {"frames_captured_total", "Frames dequeued from the driver"},
+    [METRICS_COUNTER_LOST] = {"frames_lost_total", "Frames missing from the driver sequence numbers"},
+    [METRICS_COUNTER_CORRUPTED] = {"frames_corrupted_total", "Frames flagged as corrupted by the driver"},
+    [METRICS_COUNTER_SKIPPED] = {"frames_skipped_total", "Frames left out by decimation"},
+    [METRICS_COUNTER_RING_FULL] = {"frames_dropped_total", "Frames dropped because the writers were late"},
+    [METRICS_COUNTER_WRITTEN] = {"frames_written_total", "Frames handed to the output sink"},
+    [METRICS_COUNTER_ENCODER_DEGRADED] = {"encoder_degradations_total", "Encoder settings lowered to keep up with the capture"},
+    [METRICS_COUNTER_ENCODER_RESTORED] = {"encoder_restorations_total", "Encoder settings raised back once encoding kept up"},
+};
+
+static const struct
+{
+    const char *name;
+    const char *help;
+} _gauges[METRICS_GAUGE_COUNT] = {
+    [METRICS_GAUGE_ENCODER_QUALITY] = {"encoder_quality", "JPEG quality of the recorded frames"},
+    [METRICS_GAUGE_ENCODER_FAST_DCT] = {"encoder_fast_dct", "1 if the recorded frames use the fast, less accurate, DCT"},
+    [METRICS_GAUGE_ENCODER_OPTIMIZED] = {"encoder_optimized_huffman", "1 if the recorded frames have their own Huffman tables"},
+    [METRICS_GAUGE_ENCODER_CHROMA_420] = {"encoder_chroma_420", "1 if the recorded frames have 4:2:0 chroma"},
+    [METRICS_GAUGE_ENCODER_LOAD] = {"encoder_load_percent", "Share of the encoding budget used over the last control period"},
+};
+
+static const double _quantiles[] = {0.5, 0.9, 0.99, 0.999};
+
+static unsigned int _get_bucket(uint64_t ns)
+{
+    unsigned int shift = 0;
+
+    if(ns < 2 * HIST_SUB_COUNT)
+        return ns;
+    if(ns >> HIST_MAX_BITS)
+        ns = (1ULL << HIST_MAX_BITS) - 1;
+    shift = 63 - __builtin_clzll(ns) - HIST_SUB_BITS;
+    return shift * HIST_SUB_COUNT + (ns >> shift);
+}
+
+/* Highest value of the bucket */
+static uint64_t _get_bucket_value(unsigned int bucket)
+{
+    unsigned int shift = 0;
+
+    if(bucket < 2 * HIST_SUB_COUNT)
+        return bucket;
+    shift = bucket / HIST_SUB_COUNT - 1;
+    return ((uint64_t)(bucket % HIST_SUB_COUNT + HIST_SUB_COUNT + 1) << shift) - 1;
+}
+
+uint64_t metrics_now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+metrics_t *metrics_create(const char *device)
+{
+    metrics_t *m = calloc(1, sizeof(metrics_t));
+
+    if(!m)
+    {
+        ERR("Cannot allocate metrics");
+        return NULL;
+    }
+    snprintf(m->device, DEVICE_NAME_MAX_SIZE, "%s", device);
+    return m;
+}
+
+void metrics_destroy(metrics_t *m)
+{
+    free(m);
+}
+
+void metrics_record(metrics_t *m, metrics_stage stage, uint64_t ns)
+{
+    metrics_histogram *h = &m->stages[stage];
+    uint64_t max = __atomic_load_n(&h->max_ns, __ATOMIC_RELAXED);
+
+    __atomic_fetch_add(&h->buckets[_get_bucket(ns)], 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&h->sum_ns, ns, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&h->count, 1, __ATOMIC_RELAXED);
+    while(ns > max && !__atomic_compare_exchange_n(&h->max_ns, &max, ns, 1,
+                __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+}
+
+void metrics_add(metrics_t *m, metrics_counter counter, uint64_t value)
+{
+    __atomic_fetch_add(&m->counters[counter], value, __ATOMIC_RELAXED);
+}
+
+void metrics_set(metrics_t *m, metrics_gauge gauge, int64_t value)
+{
+    __atomic_store_n(&m->gauges[gauge], value, __ATOMIC_RELAXED);
+}
+
+static size_t _append(char *buf, size_t size, size_t len, const char *format, ...)
+{
+    va_list args;
+    int ret = 0;
+
+    va_start(args, format);
+    ret = vsnprintf(len < size ? buf + len : NULL, len < size ? size - len : 0, format, args);
+    va_end(args);
+    return ret > 0 ? len + ret : len;
+}
+
+/* Quantiles come from a snapshot of the buckets : a value being recorded
+ * meanwhile may be missing from it, never counted twice */
+static uint64_t _snapshot(const metrics_histogram *h, uint64_t *buckets)
+{
+    uint64_t total = 0;
+    unsigned int b = 0;
+
+    for(b = 0; b < HIST_NB_BUCKETS; b++)
+    {
+        buckets[b] = __atomic_load_n(&h->buckets[b], __ATOMIC_RELAXED);
+        total += buckets[b];
+    }
+    return total;
+}
+
+static uint64_t _get_quantile(const metrics_histogram *h, const uint64_t *buckets, uint64_t total,
+        double quantile)
+{
+    uint64_t max = __atomic_load_n(&h->max_ns, __ATOMIC_RELAXED);
+    uint64_t rank = quantile * total + 0.5, seen = 0;
+    unsigned int b = 0;
+
+    if(total == 0)
+        return 0;
+    if(rank < 1)
+        rank = 1;
+    while(b < HIST_NB_BUCKETS - 1 && seen + buckets[b] < rank)
+        seen += buckets[b++];
+    return _get_bucket_value(b) < max ? _get_bucket_value(b) : max;
+}
+
+uint64_t metrics_get_count(metrics_t *m, metrics_stage stage)
+{
+    return __atomic_load_n(&m->stages[stage].count, __ATOMIC_RELAXED);
+}
+
+uint64_t metrics_get_quantile(metrics_t *m, metrics_stage stage, double quantile)
+{
+    uint64_t buckets[HIST_NB_BUCKETS];
+    uint64_t total = _snapshot(&m->stages[stage], buckets);
+
+    return _get_quantile(&m->stages[stage], buckets, total, quantile);
+}
+
+uint64_t metrics_get_counter(metrics_t *m, metrics_counter counter)
+{
+    return __atomic_load_n(&m->counters[counter], __ATOMIC_RELAXED);
+}
+
+int64_t metrics_get_gauge(metrics_t *m, metrics_gauge gauge)
+{
+    return __atomic_load_n(&m->gauges[gauge], __ATOMIC_RELAXED);
+}
+
+const char *metrics_get_stage_name(metrics_stage stage)
+{
+    return _stage_names[stage];
+}
+
+static size_t _format_histogram(const metrics_t *m, metrics_stage stage, char *buf, size_t size, size_t len)
+{
+    const metrics_histogram *h = &m->stages[stage];
+    uint64_t buckets[HIST_NB_BUCKETS];
+    uint64_t total = _snapshot(h, buckets);
+    unsigned int i = 0;
+
+    for(i = 0; i < sizeof(_quantiles) / sizeof(_quantiles[0]) && total; i++)
+    {
+        len = _append(buf, size, len, METRICS_PREFIX "stage_seconds{device=\"%s\",stage=\"%s\",quantile=\"%g\"} %.9f\n",
+                m->device, _stage_names[stage], _quantiles[i],
+                _get_quantile(h, buckets, total, _quantiles[i]) / 1e9);
+    }
+    len = _append(buf, size, len, METRICS_PREFIX "stage_seconds_sum{device=\"%s\",stage=\"%s\"} %.9f\n",
+            m->device, _stage_names[stage], __atomic_load_n(&h->sum_ns, __ATOMIC_RELAXED) / 1e9);
+    len = _append(buf, size, len, METRICS_PREFIX "stage_seconds_count{device=\"%s\",stage=\"%s\"} %llu\n",
+            m->device, _stage_names[stage], (unsigned long long)__atomic_load_n(&h->count, __ATOMIC_RELAXED));
+    return len;
+}
+
+size_t metrics_format(metrics_t * const *metrics, int nb_metrics, char *buf, size_t size)
+{
+    size_t len = 0;
+    int c = 0, g = 0, s = 0, i = 0;
+
+    if(size)
+        buf[0] = 0;
+
+    len = _append(buf, size, len, "# HELP " METRICS_PREFIX "stage_seconds Time spent in each frame processing stage, and frame age between stages\n");
+    len = _append(buf, size, len, "# TYPE " METRICS_PREFIX "stage_seconds summary\n");
+    for(i = 0; i < nb_metrics; i++)
+        for(s = 0; s < METRICS_STAGE_COUNT; s++)
+            len = _format_histogram(metrics[i], s, buf, size, len);
+
+    len = _append(buf, size, len, "# HELP " METRICS_PREFIX "stage_max_seconds Longest time spent in each frame processing stage\n");
+    len = _append(buf, size, len, "# TYPE " METRICS_PREFIX "stage_max_seconds gauge\n");
+    for(i = 0; i < nb_metrics; i++)
+        for(s = 0; s < METRICS_STAGE_COUNT; s++)
+            len = _append(buf, size, len, METRICS_PREFIX "stage_max_seconds{device=\"%s\",stage=\"%s\"} %.9f\n",
+                    metrics[i]->device, _stage_names[s],
+                    __atomic_load_n(&metrics[i]->stages[s].max_ns, __ATOMIC_RELAXED) / 1e9);
+
+    for(c = 0; c < METRICS_COUNTER_COUNT; c++)
+    {
+        len = _append(buf, size, len, "# HELP " METRICS_PREFIX "%s %s\n", _counters[c].name, _counters[c].help);
+        len = _append(buf, size, len, "# TYPE " METRICS_PREFIX "%s counter\n", _counters[c].name);
+        for(i = 0; i < nb_metrics; i++)
+            len = _append(buf, size, len, METRICS_PREFIX "%s{device=\"%s\"} %llu\n", _counters[c].name,
+                    metrics[i]->device,
+                    (unsigned long long)__atomic_load_n(&metrics[i]->counters[c], __ATOMIC_RELAXED));
+    }
+
+    for(g = 0; g < METRICS_GAUGE_COUNT; g++)
+    {
+        len = _append(buf, size, len, "# HELP " METRICS_PREFIX "%s %s\n", _gauges[g].name, _gauges[g].help);
+        len = _append(buf, size, len, "# TYPE " METRICS_PREFIX "%s gauge\n", _gauges[g].name);
+        for(i = 0; i < nb_metrics; i++)
+            len = _append(buf, size, len, METRICS_PREFIX "%s{device=\"%s\"} %lld\n", _gauges[g].name,
+                    metrics[i]->device,
+                    (long long)__atomic_load_n(&metrics[i]->gauges[g], __ATOMIC_RELAXED));
+    }
+
+    return len;
+}
+
+static size_t _format_text(metrics_exporter_t *e)
+{
+    size_t len = metrics_format(e->metrics, e->nb_metrics, e->text, METRICS_TEXT_MAX_SIZE);
+
+    return len < METRICS_TEXT_MAX_SIZE ? len : METRICS_TEXT_MAX_SIZE - 1;
+}
+
+static int _write_all(int fd, const char *data, size_t size, int flags)
+{
+    ssize_t ret = 0;
+
+    while(size)
+    {
+        ret = flags ? send(fd, data, size, flags) : write(fd, data, size);
+        if(ret < 0 && errno == EINTR)
+            continue;
+        if(ret <= 0)
+            return -1;
+        data += ret;
+        size -= ret;
+    }
+    return 0;
+}
+
+/* Written aside then renamed, so that readers never see a partial file */
+static void _write_file(metrics_exporter_t *e)
+{
+    char tmp[METRICS_PATH_MAX_SIZE + 4];
+    size_t len = _format_text(e);
+    int fd = -1;
+
+    snprintf(tmp, sizeof(tmp), "%s.tmp", e->file);
+    fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if(fd < 0)
+    {
+        ERR("Cannot open metrics file %s : %s", tmp, strerror(errno));
+        return;
+    }
+    if(_write_all(fd, e->text, len, 0) != 0)
+        ERR("Cannot write metrics file %s : %s", tmp, strerror(errno));
+    close(fd);
+    if(rename(tmp, e->file) != 0)
+        ERR("Cannot rename metrics file to %s : %s", e->file, strerror(errno));
+}
+
+static void _serve_client(metrics_exporter_t *e)
+{
+    size_t len = 0;
+    int fd = accept4(e->listen_fd, NULL, NULL, SOCK_CLOEXEC);
+
+    if(fd < 0)
+        return;
+    len = _format_text(e);
+    _write_all(fd, e->text, len, MSG_NOSIGNAL);
+    close(fd);
+}
+
+static void *_exporter_thread(void *arg)
+{
+    metrics_exporter_t *e = arg;
+    struct pollfd fds[2];
+    uint64_t now = metrics_now_ns() / 1000000;
+    uint64_t next_ms = now + e->period_ms;
+    int timeout_ms = -1;
+    int nb_fds = 1;
+
+    fds[0].fd = e->stop_fd;
+    fds[0].events = POLLIN;
+    if(e->listen_fd >= 0)
+    {
+        fds[1].fd = e->listen_fd;
+        fds[1].events = POLLIN;
+        nb_fds = 2;
+    }
+
+    for(;;)
+    {
+        if(e->file[0])
+            timeout_ms = next_ms > now ? next_ms - now : 0;
+        if(poll(fds, nb_fds, timeout_ms) < 0 && errno != EINTR)
+        {
+            ERR("Error while waiting for metrics clients : %s", strerror(errno));
+            break;
+        }
+        if(fds[0].revents)
+            break;
+        if(nb_fds > 1 && (fds[1].revents & POLLIN))
+            _serve_client(e);
+
+        now = metrics_now_ns() / 1000000;
+        if(e->file[0] && now >= next_ms)
+        {
+            _write_file(e);
+            next_ms += e->period_ms;
+            if(next_ms <= now)
+                next_ms = now + e->period_ms;
+        }
+    }
+
+    /* Final values */
+    if(e->file[0])
+        _write_file(e);
+    return NULL;
+}
+
+static int _listen(metrics_exporter_t *e)
+{
+    struct sockaddr_un addr;
+
+    /* A truncated path would bind, and unlink, another file */
+    if(strlen(e->socket_path) >= sizeof(addr.sun_path))
+    {
+        ERR("Metrics socket path %s is too long (at most %zu characters)", e->socket_path,
+                sizeof(addr.sun_path) - 1);
+        return -1;
+    }
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    memcpy(addr.sun_path, e->socket_path, strlen(e->socket_path));
+    unlink(e->socket_path);
+
+    e->listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if(e->listen_fd < 0 ||
+       bind(e->listen_fd, (struct sockaddr *)&addr, sizeof(addr)) == -1 ||
+       listen(e->listen_fd, 4) == -1)
+    {
+        ERR("Cannot create metrics socket %s : %s", e->socket_path, strerror(errno));
+        return -1;
+    }
+    INF("Metrics available on %s", e->socket_path);
+    return 0;
+}
+
+metrics_exporter_t *metrics_exporter_start(metrics_t * const *metrics, int nb_metrics,
+        const char *file, const char *socket_path, unsigned int period_ms)
+{
+    metrics_exporter_t *e = NULL;
+    int i = 0;
+
+    if(nb_metrics < 1 || nb_metrics > MAX_DEVICES || period_ms == 0)
+    {
+        ERR("Cannot export metrics of %d devices every %u ms", nb_metrics, period_ms);
+        return NULL;
+    }
+
+    e = calloc(1, sizeof(metrics_exporter_t));
+    if(!e)
+    {
+        ERR("Cannot allocate metrics exporter");
+        return NULL;
+    }
+    e->listen_fd = -1;
+    e->period_ms = period_ms;
+    e->nb_metrics = nb_metrics;
+    for(i = 0; i < nb_metrics; i++)
+        e->metrics[i] = metrics[i];
+    if(file)
+        snprintf(e->file, METRICS_PATH_MAX_SIZE, "%s", file);
+    if(socket_path)
+        snprintf(e->socket_path, METRICS_PATH_MAX_SIZE, "%s", socket_path);
+
+    e->text = malloc(METRICS_TEXT_MAX_SIZE);
+    e->stop_fd = eventfd(0, EFD_CLOEXEC);
+    if(!e->text || e->stop_fd < 0)
+    {
+        ERR("Cannot setup metrics exporter");
+        goto start_fail;
+    }
+    if(e->socket_path[0] && _listen(e) != 0)
+        goto start_fail;
+
+    if(pthread_create(&e->thread, NULL, _exporter_thread, e) != 0)
+    {
+        ERR("Cannot start metrics exporter thread");
+        goto start_fail;
+    }
+    if(e->file[0])
+        INF("Metrics written to %s every %u ms", e->file, period_ms);
+    return e;
+
+start_fail:
+    if(e->listen_fd >= 0)
+    {
+        close(e->listen_fd);
+        unlink(e->socket_path);
+    }
+    if(e->stop_fd >= 0)
+        close(e->stop_fd);
+    free(e->text);
+    free(e);
+    return NULL;
+}
+
+void metrics_exporter_stop(metrics_exporter_t *e)
+{
+    uint64_t value = 1;
+
+    if(!e)
+        return;
+
+    if(write(e->stop_fd, &value, sizeof(value)) < 0)
+        ERR("Cannot stop metrics exporter : %s", strerror(errno));
+    pthread_join(e->thread, NULL);
+
+    if(e->listen_fd >= 0)
+    {
+        close(e->listen_fd);
+        unlink(e->socket_path);
+    }
+    close(e->stop_fd);
+    free(e->text);
+    free(e);
+}
@@ -0,0 +1,72 @@
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+typedef enum
+{
+    METRICS_STAGE_DQBUF_WAIT,   /* Capture thread back to waiting, until the next frame is dequeued */
+    METRICS_STAGE_CALLBACK,     /* Frame callback */
+    METRICS_STAGE_ENCODE,       /* Decoding, scaling and encoding by a writer */
+    METRICS_STAGE_WRITE,        /* Sink write, once the writer's turn has come */
+    /* Frame age between stages, from the driver timestamp to the disk */
+    METRICS_STAGE_CAPTURE_TO_DEQUEUE,
+    METRICS_STAGE_DEQUEUE_TO_ENCODED,
+    METRICS_STAGE_ENCODED_TO_DURABLE,
+    METRICS_STAGE_COUNT,
+} metrics_stage;
+
+typedef enum
+{
+    METRICS_COUNTER_CAPTURED,   /* Frames dequeued */
+    METRICS_COUNTER_LOST,       /* Gaps in the driver sequence numbers */
+    METRICS_COUNTER_CORRUPTED,  /* Frames flagged with V4L2_BUF_FLAG_ERROR */
+    METRICS_COUNTER_SKIPPED,    /* Frames left out by decimation */
+    METRICS_COUNTER_RING_FULL,  /* Frames dropped because writers were late */
+    METRICS_COUNTER_WRITTEN,    /* Frames handed to the sink */
+    METRICS_COUNTER_ENCODER_DEGRADED,   /* Encoder settings lowered to keep up */
+    METRICS_COUNTER_ENCODER_RESTORED,   /* Encoder settings raised back */
+    METRICS_COUNTER_COUNT,
+} metrics_counter;
+
+typedef enum
+{
+    METRICS_GAUGE_ENCODER_QUALITY,
+    METRICS_GAUGE_ENCODER_FAST_DCT,
+    METRICS_GAUGE_ENCODER_OPTIMIZED,
+    METRICS_GAUGE_ENCODER_CHROMA_420,
+    METRICS_GAUGE_ENCODER_LOAD,         /* Percent of the encoding budget used */
+    METRICS_GAUGE_COUNT,
+} metrics_gauge;
+
+/* Timing histograms and counters of one device. Recording is lock-free, and
+ * can be done from any thread */
+typedef struct metrics metrics_t;
+
+metrics_t *metrics_create(const char *device);
+void metrics_destroy(metrics_t *m);
+uint64_t metrics_now_ns(void);
+void metrics_record(metrics_t *m, metrics_stage stage, uint64_t ns);
+void metrics_add(metrics_t *m, metrics_counter counter, uint64_t value);
+void metrics_set(metrics_t *m, metrics_gauge gauge, int64_t value);
+uint64_t metrics_get_count(metrics_t *m, metrics_stage stage);
+uint64_t metrics_get_counter(metrics_t *m, metrics_counter counter);
+int64_t metrics_get_gauge(metrics_t *m, metrics_gauge gauge);
+/* Within 12.5 %, 0 if nothing has been recorded */
+uint64_t metrics_get_quantile(metrics_t *m, metrics_stage stage, double quantile);
+const char *metrics_get_stage_name(metrics_stage stage);
+/* Prometheus text exposition format. Returns the length of the text, which is
+ * truncated if it does not fit in size */
+size_t metrics_format(metrics_t * const *metrics, int nb_metrics, char *buf, size_t size);
+
+/* Exports metrics in the background : the file, if any, is rewritten every
+ * period_ms, and every connection to the UNIX socket, if any, gets the current
+ * values before being closed */
+typedef struct metrics_exporter metrics_exporter_t;
+
+metrics_exporter_t *metrics_exporter_start(metrics_t * const *metrics, int nb_metrics,
+        const char *file, const char *socket_path, unsigned int period_ms);
+void metrics_exporter_stop(metrics_exporter_t *e);
+
+#endif
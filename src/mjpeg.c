@@ -0,0 +1,152 @@
+#include "mjpeg.h"
+
+#define MARKER_SOI      0xD8
+#define MARKER_EOI      0xD9
+#define MARKER_SOS      0xDA
+#define MARKER_DHT      0xC4
+#define MARKER_TEM      0x01
+#define MARKER_RST0     0xD0
+#define MARKER_RST7     0xD7
+
+/* UVC cameras usually strip the Huffman tables from their MJPEG frames (as the
+ * AVI1 MJPEG format allows) : the standard tables are implied */
+const uint8_t mjpeg_default_dht[] = {
+    0xFF, MARKER_DHT, 0x01, 0xA2,
+    /* Luminance DC */
+    0x00,
+    0x00, 0x01, 0x05, 0x01, 0x01, 0x01, 0x01, 0x01,
+    0x01, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+    0x00, 0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07,
+    0x08, 0x09, 0x0A, 0x0B,
+    /* Luminance AC */
+    0x10,
+    0x00, 0x02, 0x01, 0x03, 0x03, 0x02, 0x04, 0x03,
+    0x05, 0x05, 0x04, 0x04, 0x00, 0x00, 0x01, 0x7D,
+    0x01, 0x02, 0x03, 0x00, 0x04, 0x11, 0x05, 0x12,
+    0x21, 0x31, 0x41, 0x06, 0x13, 0x51, 0x61, 0x07,
+    0x22, 0x71, 0x14, 0x32, 0x81, 0x91, 0xA1, 0x08,
+    0x23, 0x42, 0xB1, 0xC1, 0x15, 0x52, 0xD1, 0xF0,
+    0x24, 0x33, 0x62, 0x72, 0x82, 0x09, 0x0A, 0x16,
+    0x17, 0x18, 0x19, 0x1A, 0x25, 0x26, 0x27, 0x28,
+    0x29, 0x2A, 0x34, 0x35, 0x36, 0x37, 0x38, 0x39,
+    0x3A, 0x43, 0x44, 0x45, 0x46, 0x47, 0x48, 0x49,
+    0x4A, 0x53, 0x54, 0x55, 0x56, 0x57, 0x58, 0x59,
+    0x5A, 0x63, 0x64, 0x65, 0x66, 0x67, 0x68, 0x69,
+    0x6A, 0x73, 0x74, 0x75, 0x76, 0x77, 0x78, 0x79,
+    0x7A, 0x83, 0x84, 0x85, 0x86, 0x87, 0x88, 0x89,
+    0x8A, 0x92, 0x93, 0x94, 0x95, 0x96, 0x97, 0x98,
+    0x99, 0x9A, 0xA2, 0xA3, 0xA4, 0xA5, 0xA6, 0xA7,
+    0xA8, 0xA9, 0xAA, 0xB2, 0xB3, 0xB4, 0xB5, 0xB6,
+    0xB7, 0xB8, 0xB9, 0xBA, 0xC2, 0xC3, 0xC4, 0xC5,
+    0xC6, 0xC7, 0xC8, 0xC9, 0xCA, 0xD2, 0xD3, 0xD4,
+    0xD5, 0xD6, 0xD7, 0xD8, 0xD9, 0xDA, 0xE1, 0xE2,
+    0xE3, 0xE4, 0xE5, 0xE6, 0xE7, 0xE8, 0xE9, 0xEA,
+    0xF1, 0xF2, 0xF3, 0xF4, 0xF5, 0xF6, 0xF7, 0xF8,
+    0xF9, 0xFA,
+    /* Chrominance DC */
+    0x01,
+    0x00, 0x03, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01,
+    0x01, 0x01, 0x01, 0x00, 0x00, 0x00, 0x00, 0x00,
+    0x00, 0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07,
+    0x08, 0x09, 0x0A, 0x0B,
+    /* Chrominance AC */
+    0x11,
+    0x00, 0x02, 0x01, 0x02, 0x04, 0x04, 0x03, 0x04,
+    0x07, 0x05, 0x04, 0x04, 0x00, 0x01, 0x02, 0x77,
+    0x00, 0x01, 0x02, 0x03, 0x11, 0x04, 0x05, 0x21,
+    0x31, 0x06, 0x12, 0x41, 0x51, 0x07, 0x61, 0x71,
+    0x13, 0x22, 0x32, 0x81, 0x08, 0x14, 0x42, 0x91,
+    0xA1, 0xB1, 0xC1, 0x09, 0x23, 0x33, 0x52, 0xF0,
+    0x15, 0x62, 0x72, 0xD1, 0x0A, 0x16, 0x24, 0x34,
+    0xE1, 0x25, 0xF1, 0x17, 0x18, 0x19, 0x1A, 0x26,
+    0x27, 0x28, 0x29, 0x2A, 0x35, 0x36, 0x37, 0x38,
+    0x39, 0x3A, 0x43, 0x44, 0x45, 0x46, 0x47, 0x48,
+    0x49, 0x4A, 0x53, 0x54, 0x55, 0x56, 0x57, 0x58,
+    0x59, 0x5A, 0x63, 0x64, 0x65, 0x66, 0x67, 0x68,
+    0x69, 0x6A, 0x73, 0x74, 0x75, 0x76, 0x77, 0x78,
+    0x79, 0x7A, 0x82, 0x83, 0x84, 0x85, 0x86, 0x87,
+    0x88, 0x89, 0x8A, 0x92, 0x93, 0x94, 0x95, 0x96,
+    0x97, 0x98, 0x99, 0x9A, 0xA2, 0xA3, 0xA4, 0xA5,
+    0xA6, 0xA7, 0xA8, 0xA9, 0xAA, 0xB2, 0xB3, 0xB4,
+    0xB5, 0xB6, 0xB7, 0xB8, 0xB9, 0xBA, 0xC2, 0xC3,
+    0xC4, 0xC5, 0xC6, 0xC7, 0xC8, 0xC9, 0xCA, 0xD2,
+    0xD3, 0xD4, 0xD5, 0xD6, 0xD7, 0xD8, 0xD9, 0xDA,
+    0xE2, 0xE3, 0xE4, 0xE5, 0xE6, 0xE7, 0xE8, 0xE9,
+    0xEA, 0xF2, 0xF3, 0xF4, 0xF5, 0xF6, 0xF7, 0xF8,
+    0xF9, 0xFA,
+};
+
+const size_t mjpeg_default_dht_size = sizeof(mjpeg_default_dht);
+
+/* Walk the markers up to the first start of scan. Returns its offset, or 0 if
+ * the frame cannot be parsed. has_dht is set if tables are defined before it */
+static size_t _find_sos(const uint8_t *data, size_t size, int *has_dht)
+{
+    size_t i = 2;
+    uint8_t marker = 0;
+
+    *has_dht = 0;
+    if(size < 4 || data[0] != 0xFF || data[1] != MARKER_SOI)
+        return 0;
+
+    while(i + 1 < size)
+    {
+        if(data[i] != 0xFF)
+            return 0;
+
+        /* Markers may be preceded by any number of fill bytes */
+        while(i + 1 < size && data[i + 1] == 0xFF)
+            i++;
+        if(i + 1 >= size)
+            return 0;
+
+        marker = data[i + 1];
+        if(marker == MARKER_DHT)
+            *has_dht = 1;
+        if(marker == MARKER_SOS)
+            return i;
+
+        if(marker == MARKER_TEM || (marker >= MARKER_RST0 && marker <= MARKER_RST7))
+        {
+            i += 2;
+            continue;
+        }
+
+        /* Segment length includes its own two bytes */
+        if(i + 3 >= size)
+            return 0;
+        i += 2 + ((data[i + 2] << 8) | data[i + 3]);
+    }
+    return 0;
+}
+
+/* Some drivers report the whole buffer as used, or pad the frame : the buffer
+ * may then still hold the end of an earlier, larger frame past this one. The
+ * frame ends with the first EOI marker after the start of scan, which
+ * entropy-coded data cannot contain (0xFF bytes are stuffed with 0x00) */
+size_t mjpeg_get_frame_size(const uint8_t *data, size_t bytesused)
+{
+    int has_dht = 0;
+    size_t i = _find_sos(data, bytesused, &has_dht);
+
+    if(i == 0 || i + 3 >= bytesused)
+        return bytesused;
+
+    for(i += 2 + ((data[i + 2] << 8) | data[i + 3]); i + 1 < bytesused; i++)
+    {
+        if(data[i] == 0xFF && data[i + 1] == MARKER_EOI)
+            return i + 2;
+    }
+    return bytesused;
+}
+
+/* Returns the offset at which the default DHT segment has to be inserted, or 0
+ * if the frame defines its own tables or cannot be parsed (it is then left
+ * untouched) */
+size_t mjpeg_get_dht_offset(const uint8_t *data, size_t size)
+{
+    int has_dht = 0;
+    size_t sos = _find_sos(data, size, &has_dht);
+
+    return has_dht ? 0 : sos;
+}
@@ -0,0 +1,15 @@
+#ifndef MJPEG_H
+#define MJPEG_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+/* Default Huffman tables (ITU T.81 K.3) as a complete DHT segment, for MJPEG
+ * frames that rely on them implicitly */
+extern const uint8_t mjpeg_default_dht[];
+extern const size_t mjpeg_default_dht_size;
+
+size_t mjpeg_get_frame_size(const uint8_t *data, size_t bytesused);
+size_t mjpeg_get_dht_offset(const uint8_t *data, size_t size);
+
+#endif
@@ -0,0 +1,558 @@
+#include <stdlib.h>
+#include <string.h>
+#include <linux/videodev2.h>
+
+#include "utils.h"
+#include "muxer.h"
+
+#define AVIF_HASINDEX           0x10
+#define AVIIF_KEYFRAME          0x10
+#define AVI_INDEX_ENTRY_SIZE    16
+/* Offset of the 'movi' tag, the base of idx1 offsets */
+#define AVI_MOVI_OFFSET         (MUXER_HEADER_SIZE - 4)
+
+/* Matroska timestamps are in ms. A new cluster is started every second, well
+ * within the 16 bits block timestamps relative to the cluster */
+#define MKV_TIMESTAMP_SCALE     1000000
+#define MKV_CLUSTER_MS          1000
+#define MKV_APP_NAME            "demo_v4l2"
+
+/* EBML element IDs */
+#define MKV_EBML                0x1A45DFA3
+#define MKV_EBML_VERSION        0x4286
+#define MKV_EBML_READ_VERSION   0x42F7
+#define MKV_EBML_MAX_ID_LENGTH  0x42F2
+#define MKV_EBML_MAX_SIZE_LENGTH 0x42F3
+#define MKV_DOC_TYPE            0x4282
+#define MKV_DOC_TYPE_VERSION    0x4287
+#define MKV_DOC_TYPE_READ_VERSION 0x4285
+#define MKV_SEGMENT             0x18538067
+#define MKV_INFO                0x1549A966
+#define MKV_TIMESTAMP_SCALE_ID  0x2AD7B1
+#define MKV_MUXING_APP          0x4D80
+#define MKV_WRITING_APP         0x5741
+#define MKV_DURATION            0x4489
+#define MKV_TRACKS              0x1654AE6B
+#define MKV_TRACK_ENTRY         0xAE
+#define MKV_TRACK_NUMBER        0xD7
+#define MKV_TRACK_UID           0x73C5
+#define MKV_TRACK_TYPE          0x83
+#define MKV_FLAG_LACING         0x9C
+#define MKV_CODEC_ID            0x86
+#define MKV_DEFAULT_DURATION    0x23E383
+#define MKV_VIDEO               0xE0
+#define MKV_PIXEL_WIDTH         0xB0
+#define MKV_PIXEL_HEIGHT        0xBA
+#define MKV_COLOUR_SPACE        0x2EB524
+#define MKV_VOID                0xEC
+#define MKV_CLUSTER             0x1F43B675
+#define MKV_CLUSTER_TIMESTAMP   0xE7
+#define MKV_SIMPLE_BLOCK        0xA3
+#define MKV_UNKNOWN_SIZE        0x00FFFFFFFFFFFFFFULL
+
+typedef struct
+{
+    uint32_t pixelformat;
+    /* AVI and Matroska V_UNCOMPRESSED fourcc */
+    const char *tag;
+    unsigned int bpp;
+    const char *extension;
+} muxer_format;
+
+static const muxer_format _formats[] = {
+    { V4L2_PIX_FMT_MJPEG, "MJPG", 24, "mjpeg" },
+    { V4L2_PIX_FMT_NV12, "NV12", 12, "nv12" },
+    { V4L2_PIX_FMT_NV21, "NV21", 12, "nv21" },
+    { V4L2_PIX_FMT_YUYV, "YUY2", 16, "yuyv" },
+};
+
+#define NB_FORMATS  (sizeof(_formats) / sizeof(_formats[0]))
+
+/* Containers only add a few bytes around every frame, computed from the V4L2
+ * timestamps. Whatever depends on the whole file (sizes, frame count, measured
+ * frame rate, AVI index) is written once the file is complete */
+struct muxer
+{
+    muxer_type type;
+    muxer_stream stream;
+    const muxer_format *format;
+
+    /* Current file */
+    unsigned long nb_frames;
+    uint64_t first_timestamp_us;
+    uint64_t last_timestamp_us;
+    size_t max_frame_size;
+    uint64_t data_end;
+
+    /* AVI idx1 chunk, chunk header included */
+    uint8_t *index;
+    size_t index_size;
+    size_t index_alloc;
+    /* Preallocated : never grown, files are closed once it is full */
+    int index_reserved;
+
+    /* Matroska cluster being written */
+    int has_cluster;
+    uint64_t cluster_ms;
+};
+
+static uint8_t *_put_tag(uint8_t *p, const char *tag)
+{
+    memcpy(p, tag, 4);
+    return p + 4;
+}
+
+static uint8_t *_put_le16(uint8_t *p, uint16_t value)
+{
+    *p++ = value;
+    *p++ = value >> 8;
+    return p;
+}
+
+static uint8_t *_put_le32(uint8_t *p, uint32_t value)
+{
+    *p++ = value;
+    *p++ = value >> 8;
+    *p++ = value >> 16;
+    *p++ = value >> 24;
+    return p;
+}
+
+static uint8_t *_ebml_id(uint8_t *p, uint32_t id)
+{
+    if(id > 0xFFFFFF)
+        *p++ = id >> 24;
+    if(id > 0xFFFF)
+        *p++ = id >> 16;
+    if(id > 0xFF)
+        *p++ = id >> 8;
+    *p++ = id;
+    return p;
+}
+
+/* Sizes are always coded on 8 bytes, so that they can be filled in later */
+static uint8_t *_ebml_size(uint8_t *p, uint64_t size)
+{
+    int i = 0;
+
+    *p++ = 0x01;
+    for(i = 6; i >= 0; i--)
+        *p++ = size >> (i * 8);
+    return p;
+}
+
+static uint8_t *_ebml_uint(uint8_t *p, uint32_t id, uint64_t value)
+{
+    int i = 0;
+
+    p = _ebml_id(p, id);
+    *p++ = 0x88;
+    for(i = 7; i >= 0; i--)
+        *p++ = value >> (i * 8);
+    return p;
+}
+
+static uint8_t *_ebml_float(uint8_t *p, uint32_t id, double value)
+{
+    union { double d; uint64_t u; } bits;
+
+    bits.d = value;
+    return _ebml_uint(p, id, bits.u);
+}
+
+/* Strings and binaries shorter than 127 bytes */
+static uint8_t *_ebml_binary(uint8_t *p, uint32_t id, const void *data, size_t size)
+{
+    p = _ebml_id(p, id);
+    *p++ = 0x80 | size;
+    memcpy(p, data, size);
+    return p + size;
+}
+
+static uint8_t *_ebml_string(uint8_t *p, uint32_t id, const char *str)
+{
+    return _ebml_binary(p, id, str, strlen(str));
+}
+
+/* Master elements : the size is written once the children are */
+static uint8_t *_ebml_master_begin(uint8_t *p, uint32_t id, uint8_t **size)
+{
+    *size = _ebml_id(p, id);
+    return *size + 8;
+}
+
+static void _ebml_master_end(uint8_t *size, uint8_t *end)
+{
+    _ebml_size(size, end - size - 8);
+}
+
+/* Average interval between frames of the file, 0 until it is known */
+static uint64_t _get_frame_interval_us(muxer_t *m)
+{
+    if(m->nb_frames < 2 || m->last_timestamp_us <= m->first_timestamp_us)
+        return 0;
+    return (m->last_timestamp_us - m->first_timestamp_us) / (m->nb_frames - 1);
+}
+
+static size_t _avi_header(muxer_t *m, uint8_t *buf, uint64_t file_size)
+{
+    uint32_t scale = 1, rate = m->stream.frame_rate;
+    uint32_t image_size = m->stream.width * m->stream.height * m->format->bpp / 8;
+    uint32_t buffer_size = m->max_frame_size ? m->max_frame_size + 8 : image_size;
+    uint8_t *p = buf;
+
+    /* Measured frame rate, from the V4L2 timestamps */
+    if(_get_frame_interval_us(m) > 0)
+    {
+        scale = _get_frame_interval_us(m);
+        rate = 1000000;
+    }
+    if(rate == 0)
+        rate = 1;
+
+    memset(buf, 0, MUXER_HEADER_SIZE);
+    p = _put_tag(p, "RIFF");
+    p = _put_le32(p, file_size ? file_size - 8 : 0);
+    p = _put_tag(p, "AVI ");
+
+    p = _put_tag(p, "LIST");
+    p = _put_le32(p, 4 + 8 + 56 + 12 + 8 + 56 + 8 + 40);
+    p = _put_tag(p, "hdrl");
+
+    p = _put_tag(p, "avih");
+    p = _put_le32(p, 56);
+    p = _put_le32(p, (uint64_t)scale * 1000000 / rate);
+    p = _put_le32(p, (uint64_t)buffer_size * rate / scale);
+    p = _put_le32(p, 0);
+    p = _put_le32(p, AVIF_HASINDEX);
+    p = _put_le32(p, m->nb_frames);
+    p = _put_le32(p, 0);
+    p = _put_le32(p, 1);
+    p = _put_le32(p, buffer_size);
+    p = _put_le32(p, m->stream.width);
+    p = _put_le32(p, m->stream.height);
+    p += 16;
+
+    p = _put_tag(p, "LIST");
+    p = _put_le32(p, 4 + 8 + 56 + 8 + 40);
+    p = _put_tag(p, "strl");
+
+    p = _put_tag(p, "strh");
+    p = _put_le32(p, 56);
+    p = _put_tag(p, "vids");
+    p = _put_tag(p, m->format->tag);
+    p = _put_le32(p, 0);
+    p = _put_le16(p, 0);
+    p = _put_le16(p, 0);
+    p = _put_le32(p, 0);
+    p = _put_le32(p, scale);
+    p = _put_le32(p, rate);
+    p = _put_le32(p, 0);
+    p = _put_le32(p, m->nb_frames);
+    p = _put_le32(p, buffer_size);
+    p = _put_le32(p, 0xFFFFFFFF);
+    p = _put_le32(p, 0);
+    p = _put_le16(p, 0);
+    p = _put_le16(p, 0);
+    p = _put_le16(p, m->stream.width);
+    p = _put_le16(p, m->stream.height);
+
+    /* BITMAPINFOHEADER */
+    p = _put_tag(p, "strf");
+    p = _put_le32(p, 40);
+    p = _put_le32(p, 40);
+    p = _put_le32(p, m->stream.width);
+    p = _put_le32(p, m->stream.height);
+    p = _put_le16(p, 1);
+    p = _put_le16(p, m->format->bpp);
+    p = _put_tag(p, m->format->tag);
+    p = _put_le32(p, image_size);
+    p += 16;
+
+    /* Padding up to the movi list, which ends the header */
+    p = _put_tag(p, "JUNK");
+    p = _put_le32(p, buf + MUXER_HEADER_SIZE - 12 - p - 4);
+
+    p = buf + MUXER_HEADER_SIZE - 12;
+    p = _put_tag(p, "LIST");
+    p = _put_le32(p, file_size ? m->data_end - AVI_MOVI_OFFSET : 0);
+    p = _put_tag(p, "movi");
+
+    return MUXER_HEADER_SIZE;
+}
+
+static size_t _avi_begin_frame(muxer_t *m, uint8_t *prefix, uint64_t offset, size_t size)
+{
+    const char *chunk = m->stream.pixelformat == V4L2_PIX_FMT_MJPEG ? "00dc" : "00db";
+    uint8_t *index = NULL;
+    size_t alloc = 0;
+
+    if(m->index_size + AVI_INDEX_ENTRY_SIZE > m->index_alloc && !m->index_reserved)
+    {
+        alloc = m->index_alloc ? m->index_alloc * 2 : 64 * 1024;
+        index = realloc(m->index, alloc);
+        if(index)
+        {
+            m->index = index;
+            m->index_alloc = alloc;
+        }
+    }
+    if(m->index_size + AVI_INDEX_ENTRY_SIZE <= m->index_alloc)
+    {
+        index = m->index + m->index_size;
+        index = _put_tag(index, chunk);
+        index = _put_le32(index, AVIIF_KEYFRAME);
+        index = _put_le32(index, offset - AVI_MOVI_OFFSET);
+        _put_le32(index, size);
+        m->index_size += AVI_INDEX_ENTRY_SIZE;
+    }
+    else
+    {
+        ERR("Cannot grow AVI index, frame at %lu will not be indexed", (unsigned long)offset);
+    }
+
+    m->data_end = offset + 8 + size + (size & 1);
+    _put_le32(_put_tag(prefix, chunk), size);
+    return 8;
+}
+
+static size_t _mkv_header(muxer_t *m, uint8_t *buf, uint64_t file_size)
+{
+    uint64_t interval_us = _get_frame_interval_us(m);
+    uint8_t *p = buf, *size = NULL, *segment = NULL, *end = buf + MUXER_HEADER_SIZE;
+    uint8_t *info = NULL, *tracks = NULL, *entry = NULL, *video = NULL;
+
+    if(interval_us == 0 && m->stream.frame_rate > 0)
+        interval_us = 1000000 / m->stream.frame_rate;
+
+    memset(buf, 0, MUXER_HEADER_SIZE);
+    p = _ebml_master_begin(p, MKV_EBML, &size);
+    p = _ebml_uint(p, MKV_EBML_VERSION, 1);
+    p = _ebml_uint(p, MKV_EBML_READ_VERSION, 1);
+    p = _ebml_uint(p, MKV_EBML_MAX_ID_LENGTH, 4);
+    p = _ebml_uint(p, MKV_EBML_MAX_SIZE_LENGTH, 8);
+    p = _ebml_string(p, MKV_DOC_TYPE, "matroska");
+    p = _ebml_uint(p, MKV_DOC_TYPE_VERSION, 4);
+    p = _ebml_uint(p, MKV_DOC_TYPE_READ_VERSION, 2);
+    _ebml_master_end(size, p);
+
+    /* Clusters have an unknown size, the segment one is known at the end */
+    segment = _ebml_id(p, MKV_SEGMENT);
+    p = _ebml_size(segment, file_size ? file_size - (segment + 8 - buf) : MKV_UNKNOWN_SIZE);
+
+    p = _ebml_master_begin(p, MKV_INFO, &info);
+    p = _ebml_uint(p, MKV_TIMESTAMP_SCALE_ID, MKV_TIMESTAMP_SCALE);
+    p = _ebml_string(p, MKV_MUXING_APP, MKV_APP_NAME);
+    p = _ebml_string(p, MKV_WRITING_APP, MKV_APP_NAME);
+    if(file_size && m->nb_frames > 0)
+    {
+        p = _ebml_float(p, MKV_DURATION,
+                (double)(m->last_timestamp_us - m->first_timestamp_us + interval_us) / 1000);
+    }
+    _ebml_master_end(info, p);
+
+    p = _ebml_master_begin(p, MKV_TRACKS, &tracks);
+    p = _ebml_master_begin(p, MKV_TRACK_ENTRY, &entry);
+    p = _ebml_uint(p, MKV_TRACK_NUMBER, 1);
+    p = _ebml_uint(p, MKV_TRACK_UID, 1);
+    p = _ebml_uint(p, MKV_TRACK_TYPE, 1);
+    p = _ebml_uint(p, MKV_FLAG_LACING, 0);
+    p = _ebml_string(p, MKV_CODEC_ID,
+            m->stream.pixelformat == V4L2_PIX_FMT_MJPEG ? "V_MJPEG" : "V_UNCOMPRESSED");
+    if(interval_us)
+        p = _ebml_uint(p, MKV_DEFAULT_DURATION, interval_us * 1000);
+    p = _ebml_master_begin(p, MKV_VIDEO, &video);
+    p = _ebml_uint(p, MKV_PIXEL_WIDTH, m->stream.width);
+    p = _ebml_uint(p, MKV_PIXEL_HEIGHT, m->stream.height);
+    if(m->stream.pixelformat != V4L2_PIX_FMT_MJPEG)
+        p = _ebml_binary(p, MKV_COLOUR_SPACE, m->format->tag, 4);
+    _ebml_master_end(video, p);
+    _ebml_master_end(entry, p);
+    _ebml_master_end(tracks, p);
+
+    /* Padding up to the first cluster */
+    p = _ebml_id(p, MKV_VOID);
+    _ebml_size(p, end - p - 8);
+
+    return MUXER_HEADER_SIZE;
+}
+
+static size_t _mkv_begin_frame(muxer_t *m, uint8_t *prefix, size_t size, uint64_t timestamp_us)
+{
+    uint64_t ms = 0;
+    uint8_t *p = prefix;
+
+    if(timestamp_us > m->first_timestamp_us)
+        ms = (timestamp_us - m->first_timestamp_us) / 1000;
+
+    if(!m->has_cluster || ms < m->cluster_ms || ms - m->cluster_ms >= MKV_CLUSTER_MS)
+    {
+        p = _ebml_id(p, MKV_CLUSTER);
+        p = _ebml_size(p, MKV_UNKNOWN_SIZE);
+        p = _ebml_uint(p, MKV_CLUSTER_TIMESTAMP, ms);
+        m->cluster_ms = ms;
+        m->has_cluster = 1;
+    }
+
+    /* Track 1, timestamp relative to the cluster, keyframe */
+    p = _ebml_id(p, MKV_SIMPLE_BLOCK);
+    p = _ebml_size(p, 4 + size);
+    *p++ = 0x81;
+    *p++ = (ms - m->cluster_ms) >> 8;
+    *p++ = ms - m->cluster_ms;
+    *p++ = 0x80;
+
+    return p - prefix;
+}
+
+muxer_t *muxer_create(muxer_type type, const muxer_stream *stream)
+{
+    muxer_t *m = NULL;
+    unsigned int i = 0;
+
+    for(i = 0; i < NB_FORMATS && _formats[i].pixelformat != stream->pixelformat; i++);
+    if(i == NB_FORMATS)
+    {
+        ERR("Cannot store %c%c%c%c frames in a container",
+                stream->pixelformat & 0xFF,
+                (stream->pixelformat >> 8) & 0xFF,
+                (stream->pixelformat >> 16) & 0xFF,
+                (stream->pixelformat >> 24) & 0xFF);
+        return NULL;
+    }
+
+    m = calloc(1, sizeof(muxer_t));
+    if(!m)
+    {
+        ERR("Cannot allocate muxer");
+        return NULL;
+    }
+
+    m->type = type;
+    m->stream = *stream;
+    m->format = &_formats[i];
+    return m;
+}
+
+void muxer_destroy(muxer_t *m)
+{
+    if(!m)
+        return;
+
+    free(m->index);
+    free(m);
+}
+
+const char *muxer_get_extension(muxer_t *m)
+{
+    switch(m->type)
+    {
+        case MUXER_AVI:
+            return "avi";
+        case MUXER_MKV:
+            return "mkv";
+        default:
+            return m->format->extension;
+    }
+}
+
+int muxer_reserve_index(muxer_t *m, unsigned long nb_frames)
+{
+    size_t alloc = 8 + (size_t)nb_frames * AVI_INDEX_ENTRY_SIZE;
+    uint8_t *index = NULL;
+
+    if(m->type != MUXER_AVI)
+        return 0;
+
+    index = realloc(m->index, alloc);
+    if(!index)
+    {
+        ERR("Cannot allocate AVI index of %lu frames", nb_frames);
+        return -1;
+    }
+    /* Pages are touched now, not while capturing */
+    memset(index, 0, alloc);
+    m->index = index;
+    m->index_alloc = alloc;
+    m->index_reserved = 1;
+    return 0;
+}
+
+int muxer_index_full(muxer_t *m)
+{
+    return m->index_reserved && m->index_size + AVI_INDEX_ENTRY_SIZE > m->index_alloc;
+}
+
+size_t muxer_begin_file(muxer_t *m, uint8_t *header)
+{
+    m->nb_frames = 0;
+    m->first_timestamp_us = 0;
+    m->last_timestamp_us = 0;
+    m->max_frame_size = 0;
+    m->data_end = MUXER_HEADER_SIZE;
+    m->index_size = 8;
+    m->has_cluster = 0;
+
+    return muxer_end_file(m, header, 0);
+}
+
+size_t muxer_begin_frame(muxer_t *m, uint8_t *prefix, uint64_t offset, size_t size, uint64_t timestamp_us)
+{
+    if(m->nb_frames == 0)
+        m->first_timestamp_us = timestamp_us;
+    m->last_timestamp_us = timestamp_us;
+    m->nb_frames++;
+    if(size > m->max_frame_size)
+        m->max_frame_size = size;
+
+    switch(m->type)
+    {
+        case MUXER_AVI:
+            return _avi_begin_frame(m, prefix, offset, size);
+        case MUXER_MKV:
+            return _mkv_begin_frame(m, prefix, size, timestamp_us);
+        default:
+            return 0;
+    }
+}
+
+/* RIFF chunks are word aligned */
+size_t muxer_end_frame(muxer_t *m, uint8_t *suffix, size_t size)
+{
+    if(m->type != MUXER_AVI || !(size & 1))
+        return 0;
+
+    suffix[0] = 0;
+    return 1;
+}
+
+const uint8_t *muxer_get_trailer(muxer_t *m, size_t *size)
+{
+    *size = 0;
+    if(m->type != MUXER_AVI || !m->index)
+        return NULL;
+
+    _put_le32(_put_tag(m->index, "idx1"), m->index_size - 8);
+    *size = m->index_size;
+    return m->index;
+}
+
+size_t muxer_get_trailer_size(muxer_t *m, unsigned long nb_frames)
+{
+    if(m->type != MUXER_AVI)
+        return 0;
+    return 8 + (size_t)nb_frames * AVI_INDEX_ENTRY_SIZE;
+}
+
+size_t muxer_end_file(muxer_t *m, uint8_t *header, uint64_t file_size)
+{
+    switch(m->type)
+    {
+        case MUXER_AVI:
+            return _avi_header(m, header, file_size);
+        case MUXER_MKV:
+            return _mkv_header(m, header, file_size);
+        default:
+            return 0;
+    }
+}
@@ -0,0 +1,51 @@
+#ifndef MUXER_H
+#define MUXER_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+/* Container headers are padded to this size, so that frame data stays aligned
+ * for direct I/O and the final header can be written over the first one */
+#define MUXER_HEADER_SIZE       4096
+#define MUXER_MAX_PREFIX_SIZE   64
+#define MUXER_MAX_SUFFIX_SIZE   1
+
+typedef enum
+{
+    MUXER_RAW,  /* Frames back to back, e.g. a .nv21 or .mjpeg stream */
+    MUXER_AVI,  /* AVI 1.0, with an idx1 index */
+    MUXER_MKV,  /* Matroska, one video track, no cues */
+} muxer_type;
+
+typedef struct
+{
+    uint32_t pixelformat;   /* V4L2 fourcc of the stored frames */
+    unsigned int width;
+    unsigned int height;
+    unsigned int frame_rate;
+} muxer_stream;
+
+typedef struct muxer muxer_t;
+
+muxer_t *muxer_create(muxer_type type, const muxer_stream *stream);
+void muxer_destroy(muxer_t *m);
+const char *muxer_get_extension(muxer_t *m);
+/* Allocates the AVI index for nb_frames per file up front, so that frames are
+ * muxed without allocating. The index is then never grown : files must be
+ * ended once muxer_index_full() */
+int muxer_reserve_index(muxer_t *m, unsigned long nb_frames);
+int muxer_index_full(muxer_t *m);
+
+/* A file is written as : header, then for every frame prefix, data and
+ * suffix, then the trailer. Once complete, the header is written again with
+ * the final sizes and frame count. Headers are 0 or MUXER_HEADER_SIZE bytes */
+size_t muxer_begin_file(muxer_t *m, uint8_t *header);
+size_t muxer_begin_frame(muxer_t *m, uint8_t *prefix, uint64_t offset, size_t size, uint64_t timestamp_us);
+size_t muxer_end_frame(muxer_t *m, uint8_t *suffix, size_t size);
+const uint8_t *muxer_get_trailer(muxer_t *m, size_t *size);
+/* Upper bound of the trailer of a file holding nb_frames frames, which must
+ * be left room for when filling files up to a size */
+size_t muxer_get_trailer_size(muxer_t *m, unsigned long nb_frames);
+size_t muxer_end_file(muxer_t *m, uint8_t *header, uint64_t file_size);
+
+#endif
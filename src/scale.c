@@ -0,0 +1,489 @@
+#include <string.h>
+
+#include "utils.h"
+#include "scale.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#define SCALE_HAVE_X86
+#include <immintrin.h>
+#endif
+
+#if defined(__aarch64__) || defined(__ARM_NEON)
+#define SCALE_HAVE_NEON
+#include <arm_neon.h>
+#endif
+
+/* Source lines processed for every output before moving on : a multiple of
+ * twice the largest factor, so that bands hold whole chroma lines of every
+ * output */
+#define SCALE_BAND_LINES    8
+
+/* How the bytes of a line are grouped into components */
+typedef enum
+{
+    LAYOUT_PLANE,   /* One component : luma plane */
+    LAYOUT_PAIRS,   /* Two interleaved components : NV12/NV21 chroma plane */
+    LAYOUT_YUYV,    /* Y0 U Y1 V macropixels, Y at twice the chroma rate */
+} scale_layout;
+
+/* Box filter over factor lines, src_stride bytes apart, producing size output
+ * bytes of the same layout. factor is 2 or 4 */
+typedef void (*scale_row_fn)(scale_layout layout, const uint8_t *src, unsigned int src_stride,
+        uint8_t *dst, unsigned int size, unsigned int factor);
+
+/* Reference implementation, also used for the tail of every SIMD row : every
+ * output sample is the rounded average of factor x factor source samples */
+static void _row_scalar(scale_layout layout, const uint8_t *src, unsigned int src_stride,
+        uint8_t *dst, unsigned int size, unsigned int factor)
+{
+    unsigned int shift = factor == 4 ? 4 : 2;
+    unsigned int i, j, k, start, step, sum;
+    const uint8_t *s = NULL;
+
+    for(i = 0; i < size; i++)
+    {
+        switch(layout)
+        {
+            case LAYOUT_PAIRS:
+                start = (i >> 1) * 2 * factor + (i & 1);
+                step = 2;
+                break;
+            case LAYOUT_YUYV:
+                if(i & 1)
+                {
+                    /* Chroma : one sample per macropixel */
+                    start = (i >> 2) * 4 * factor + (i & 3);
+                    step = 4;
+                }
+                else
+                {
+                    /* Luma : output pixel 2 * macropixel + (0 or 1) */
+                    start = ((i >> 2) * 2 + ((i >> 1) & 1)) * 2 * factor;
+                    step = 2;
+                }
+                break;
+            case LAYOUT_PLANE:
+            default:
+                start = i * factor;
+                step = 1;
+                break;
+        }
+
+        sum = 0;
+        s = src + start;
+        for(j = 0; j < factor; j++)
+        {
+            for(k = 0; k < factor; k++)
+                sum += s[k * step];
+            s += src_stride;
+        }
+        dst[i] = (sum + (1 << (shift - 1))) >> shift;
+    }
+}
+
+#ifdef SCALE_HAVE_X86
+
+/* Byte shuffles bringing the samples to add together next to each other, in
+ * each 128-bit lane. The same permutation is applied to bytes for the first
+ * horizontal step, and to 16-bit sums for the second one, as a halved line
+ * keeps the layout of the source one */
+__attribute__((target("avx2")))
+static __m256i _get_mask_avx2(scale_layout layout, int sums)
+{
+    __m128i mask;
+
+    switch(layout)
+    {
+        case LAYOUT_PAIRS:
+            mask = sums ? _mm_setr_epi8(0, 1, 4, 5, 2, 3, 6, 7, 8, 9, 12, 13, 10, 11, 14, 15)
+                        : _mm_setr_epi8(0, 2, 1, 3, 4, 6, 5, 7, 8, 10, 9, 11, 12, 14, 13, 15);
+            break;
+        case LAYOUT_YUYV:
+            mask = sums ? _mm_setr_epi8(0, 1, 4, 5, 2, 3, 10, 11, 8, 9, 12, 13, 6, 7, 14, 15)
+                        : _mm_setr_epi8(0, 2, 1, 5, 4, 6, 3, 7, 8, 10, 9, 13, 12, 14, 11, 15);
+            break;
+        case LAYOUT_PLANE:
+        default:
+            mask = _mm_setr_epi8(0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15);
+            break;
+    }
+    return _mm256_broadcastsi128_si256(mask);
+}
+
+/* Adds horizontal pairs of factor lines, 32 source bytes, into 16 sums */
+__attribute__((target("avx2")))
+static inline __m256i _sum_pairs_avx2(const uint8_t *src, unsigned int src_stride,
+        unsigned int factor, __m256i mask)
+{
+    const __m256i ones = _mm256_set1_epi8(1);
+    __m256i sum = _mm256_setzero_si256(), v;
+    unsigned int j;
+
+    for(j = 0; j < factor; j++)
+    {
+        v = _mm256_shuffle_epi8(_mm256_loadu_si256((const __m256i *)(src + (size_t)j * src_stride)), mask);
+        sum = _mm256_add_epi16(sum, _mm256_maddubs_epi16(v, ones));
+    }
+    return sum;
+}
+
+/* 32 output bytes per iteration when halving, 16 when quartering. Packs work
+ * within 128-bit lanes, so the results are put back in order with a final
+ * permutation */
+__attribute__((target("avx2")))
+static void _row_avx2(scale_layout layout, const uint8_t *src, unsigned int src_stride,
+        uint8_t *dst, unsigned int size, unsigned int factor)
+{
+    const __m256i mask8 = _get_mask_avx2(layout, 0);
+    const __m256i mask16 = _get_mask_avx2(layout, 1);
+    const __m256i ones = _mm256_set1_epi16(1);
+    const __m256i order = _mm256_setr_epi32(0, 4, 1, 5, 2, 6, 3, 7);
+    __m256i a, b;
+    unsigned int x = 0;
+
+    if(factor == 2)
+    {
+        for(; x + 32 <= size; x += 32)
+        {
+            a = _sum_pairs_avx2(src + 2 * x, src_stride, 2, mask8);
+            b = _sum_pairs_avx2(src + 2 * x + 32, src_stride, 2, mask8);
+            a = _mm256_srli_epi16(_mm256_add_epi16(a, _mm256_set1_epi16(2)), 2);
+            b = _mm256_srli_epi16(_mm256_add_epi16(b, _mm256_set1_epi16(2)), 2);
+            _mm256_storeu_si256((__m256i *)(dst + x),
+                    _mm256_permute4x64_epi64(_mm256_packus_epi16(a, b), 0xD8));
+        }
+    }
+    else
+    {
+        for(; x + 16 <= size; x += 16)
+        {
+            a = _sum_pairs_avx2(src + 4 * x, src_stride, 4, mask8);
+            b = _sum_pairs_avx2(src + 4 * x + 32, src_stride, 4, mask8);
+            a = _mm256_madd_epi16(_mm256_shuffle_epi8(a, mask16), ones);
+            b = _mm256_madd_epi16(_mm256_shuffle_epi8(b, mask16), ones);
+            a = _mm256_srli_epi32(_mm256_add_epi32(a, _mm256_set1_epi32(8)), 4);
+            b = _mm256_srli_epi32(_mm256_add_epi32(b, _mm256_set1_epi32(8)), 4);
+            a = _mm256_packs_epi32(a, b);
+            a = _mm256_permutevar8x32_epi32(_mm256_packus_epi16(a, a), order);
+            _mm_storeu_si128((__m128i *)(dst + x), _mm256_castsi256_si128(a));
+        }
+    }
+
+    if(x < size)
+        _row_scalar(layout, src + x * factor, src_stride, dst + x, size - x, factor);
+}
+
+#endif /* SCALE_HAVE_X86 */
+
+#ifdef SCALE_HAVE_NEON
+
+/* Pairwise add of two vectors of sums, available on 32-bit ARM too */
+static inline uint16x8_t _padd_neon(uint16x8_t a, uint16x8_t b)
+{
+    return vcombine_u16(vpadd_u16(vget_low_u16(a), vget_high_u16(a)),
+            vpadd_u16(vget_low_u16(b), vget_high_u16(b)));
+}
+
+/* Structure loads deinterleave the components, so that every layout is
+ * handled with pairwise adds of whole vectors */
+static void _row_neon(scale_layout layout, const uint8_t *src, unsigned int src_stride,
+        uint8_t *dst, unsigned int size, unsigned int factor)
+{
+    const uint8_t *s = NULL;
+    uint16x8_t a, b, c, d, e, f, g, h;
+    uint16x8x2_t y;
+    uint8x16x2_t p, q;
+    uint8x16x4_t m, n;
+    uint8x8x2_t o2;
+    uint8x8x4_t o4;
+    unsigned int x = 0, j;
+
+    switch(layout)
+    {
+        case LAYOUT_PLANE:
+            for(; x + 16 <= size && factor == 2; x += 16)
+            {
+                a = b = vdupq_n_u16(0);
+                for(j = 0, s = src + 2 * x; j < 2; j++, s += src_stride)
+                {
+                    a = vpadalq_u8(a, vld1q_u8(s));
+                    b = vpadalq_u8(b, vld1q_u8(s + 16));
+                }
+                vst1q_u8(dst + x, vcombine_u8(vrshrn_n_u16(a, 2), vrshrn_n_u16(b, 2)));
+            }
+            for(; x + 8 <= size && factor == 4; x += 8)
+            {
+                a = b = vdupq_n_u16(0);
+                for(j = 0, s = src + 4 * x; j < 4; j++, s += src_stride)
+                {
+                    a = vpadalq_u8(a, vld1q_u8(s));
+                    b = vpadalq_u8(b, vld1q_u8(s + 16));
+                }
+                vst1_u8(dst + x, vrshrn_n_u16(_padd_neon(a, b), 4));
+            }
+            break;
+
+        case LAYOUT_PAIRS:
+            for(; x + 16 <= size && factor == 2; x += 16)
+            {
+                a = b = vdupq_n_u16(0);
+                for(j = 0, s = src + 2 * x; j < 2; j++, s += src_stride)
+                {
+                    p = vld2q_u8(s);
+                    a = vpadalq_u8(a, p.val[0]);
+                    b = vpadalq_u8(b, p.val[1]);
+                }
+                o2.val[0] = vrshrn_n_u16(a, 2);
+                o2.val[1] = vrshrn_n_u16(b, 2);
+                vst2_u8(dst + x, o2);
+            }
+            for(; x + 16 <= size && factor == 4; x += 16)
+            {
+                a = b = c = d = vdupq_n_u16(0);
+                for(j = 0, s = src + 4 * x; j < 4; j++, s += src_stride)
+                {
+                    p = vld2q_u8(s);
+                    q = vld2q_u8(s + 32);
+                    a = vpadalq_u8(a, p.val[0]);
+                    b = vpadalq_u8(b, p.val[1]);
+                    c = vpadalq_u8(c, q.val[0]);
+                    d = vpadalq_u8(d, q.val[1]);
+                }
+                o2.val[0] = vrshrn_n_u16(_padd_neon(a, c), 4);
+                o2.val[1] = vrshrn_n_u16(_padd_neon(b, d), 4);
+                vst2_u8(dst + x, o2);
+            }
+            break;
+
+        case LAYOUT_YUYV:
+            /* a and b : sums of horizontal pairs of pixels, c : U, d : V */
+            for(; x + 32 <= size && factor == 2; x += 32)
+            {
+                a = b = c = d = vdupq_n_u16(0);
+                for(j = 0, s = src + 2 * x; j < 2; j++, s += src_stride)
+                {
+                    m = vld4q_u8(s);
+                    a = vaddq_u16(a, vaddl_u8(vget_low_u8(m.val[0]), vget_low_u8(m.val[2])));
+                    b = vaddq_u16(b, vaddl_u8(vget_high_u8(m.val[0]), vget_high_u8(m.val[2])));
+                    c = vpadalq_u8(c, m.val[1]);
+                    d = vpadalq_u8(d, m.val[3]);
+                }
+                y = vuzpq_u16(a, b);
+                o4.val[0] = vrshrn_n_u16(y.val[0], 2);
+                o4.val[1] = vrshrn_n_u16(c, 2);
+                o4.val[2] = vrshrn_n_u16(y.val[1], 2);
+                o4.val[3] = vrshrn_n_u16(d, 2);
+                vst4_u8(dst + x, o4);
+            }
+            for(; x + 32 <= size && factor == 4; x += 32)
+            {
+                a = b = c = d = e = f = g = h = vdupq_n_u16(0);
+                for(j = 0, s = src + 4 * x; j < 4; j++, s += src_stride)
+                {
+                    m = vld4q_u8(s);
+                    n = vld4q_u8(s + 64);
+                    a = vaddq_u16(a, vaddl_u8(vget_low_u8(m.val[0]), vget_low_u8(m.val[2])));
+                    b = vaddq_u16(b, vaddl_u8(vget_high_u8(m.val[0]), vget_high_u8(m.val[2])));
+                    c = vpadalq_u8(c, m.val[1]);
+                    d = vpadalq_u8(d, m.val[3]);
+                    e = vaddq_u16(e, vaddl_u8(vget_low_u8(n.val[0]), vget_low_u8(n.val[2])));
+                    f = vaddq_u16(f, vaddl_u8(vget_high_u8(n.val[0]), vget_high_u8(n.val[2])));
+                    g = vpadalq_u8(g, n.val[1]);
+                    h = vpadalq_u8(h, n.val[3]);
+                }
+                y = vuzpq_u16(_padd_neon(a, b), _padd_neon(e, f));
+                o4.val[0] = vrshrn_n_u16(y.val[0], 4);
+                o4.val[1] = vrshrn_n_u16(_padd_neon(c, g), 4);
+                o4.val[2] = vrshrn_n_u16(y.val[1], 4);
+                o4.val[3] = vrshrn_n_u16(_padd_neon(d, h), 4);
+                vst4_u8(dst + x, o4);
+            }
+            break;
+    }
+
+    if(x < size)
+        _row_scalar(layout, src + x * factor, src_stride, dst + x, size - x, factor);
+}
+
+#endif /* SCALE_HAVE_NEON */
+
+static scale_row_fn _get_row_fn(convert_isa isa)
+{
+    switch(isa)
+    {
+#ifdef SCALE_HAVE_X86
+        case CONVERT_ISA_AVX2:
+            return _row_avx2;
+#endif
+#ifdef SCALE_HAVE_NEON
+        case CONVERT_ISA_NEON:
+            return _row_neon;
+#endif
+        case CONVERT_ISA_SCALAR:
+            return _row_scalar;
+        default:
+            return NULL;
+    }
+}
+
+/* Output lines of one output whose source lines start within the band
+ * [band, band + SCALE_BAND_LINES) of rect */
+static void _scale_band(scale_row_fn row_fn, scale_fmt fmt, const uint8_t *src, unsigned int src_stride,
+        unsigned int src_height, const scale_rect *rect, const scale_output *out, unsigned int band)
+{
+    unsigned int factor = out->factor;
+    unsigned int width = 0, height = 0, stride = 0, y = 0, end = 0;
+    scale_layout layout = fmt == SCALE_FMT_YUYV ? LAYOUT_YUYV : LAYOUT_PLANE;
+    const uint8_t *s = NULL;
+    uint8_t *d = NULL;
+
+    scale_get_output_size(rect, factor, &width, &height);
+    stride = scale_get_stride(fmt, width);
+
+    s = src + (size_t)rect->y * src_stride + (fmt == SCALE_FMT_YUYV ? rect->x * 2 : rect->x);
+    end = (band + SCALE_BAND_LINES) / factor;
+    for(y = band / factor; y < end && y < height; y++)
+    {
+        if(factor == 1)
+            memcpy(out->dst + (size_t)y * stride, s + (size_t)y * src_stride, stride);
+        else
+            row_fn(layout, s + (size_t)y * factor * src_stride, src_stride,
+                    out->dst + (size_t)y * stride, stride, factor);
+    }
+
+    if(fmt == SCALE_FMT_YUYV)
+        return;
+
+    /* Chroma lines hold width / 2 pairs, as many bytes as the luma ones */
+    s = src + (size_t)src_stride * src_height + (size_t)rect->y / 2 * src_stride + rect->x;
+    d = out->dst + (size_t)stride * height;
+    end = (band + SCALE_BAND_LINES) / 2 / factor;
+    for(y = band / 2 / factor; y < end && y < height / 2; y++)
+    {
+        if(factor == 1)
+            memcpy(d + (size_t)y * stride, s + (size_t)y * src_stride, stride);
+        else
+            row_fn(LAYOUT_PAIRS, s + (size_t)y * factor * src_stride, src_stride,
+                    d + (size_t)y * stride, stride, factor);
+    }
+}
+
+unsigned int scale_get_stride(scale_fmt fmt, unsigned int width)
+{
+    return fmt == SCALE_FMT_YUYV ? width * 2 : width;
+}
+
+size_t scale_get_frame_size(scale_fmt fmt, unsigned int width, unsigned int height)
+{
+    if(fmt == SCALE_FMT_YUYV)
+        return (size_t)width * height * 2;
+    return (size_t)width * height * 3 / 2;
+}
+
+void scale_get_output_size(const scale_rect *rect, unsigned int factor,
+        unsigned int *width, unsigned int *height)
+{
+    *width = rect->width / (2 * factor) * 2;
+    *height = rect->height / (2 * factor) * 2;
+}
+
+int scale_isa_supported(convert_isa isa)
+{
+    switch(isa)
+    {
+        case CONVERT_ISA_SCALAR:
+            return 1;
+#ifdef SCALE_HAVE_X86
+        case CONVERT_ISA_AVX2:
+            return __builtin_cpu_supports("avx2");
+#endif
+#ifdef SCALE_HAVE_NEON
+        case CONVERT_ISA_NEON:
+            return 1;
+#endif
+        default:
+            return 0;
+    }
+}
+
+/* Best kernel for the running CPU, detected once. The box filter needs byte
+ * shuffles, so there is no SSE2 kernel */
+convert_isa scale_get_isa(void)
+{
+    static int isa = -1;
+
+    if(isa < 0)
+    {
+        if(scale_isa_supported(CONVERT_ISA_AVX2))
+            isa = CONVERT_ISA_AVX2;
+        else if(scale_isa_supported(CONVERT_ISA_NEON))
+            isa = CONVERT_ISA_NEON;
+        else
+            isa = CONVERT_ISA_SCALAR;
+        DBG("Using %s scaling kernels", convert_isa_name(isa));
+    }
+
+    return isa;
+}
+
+int scale_frame_multi_isa(convert_isa isa, scale_fmt fmt, const uint8_t *src, unsigned int src_stride,
+        unsigned int src_height, const scale_rect *rect, const scale_output *outputs, int nb_outputs)
+{
+    scale_row_fn row_fn = NULL;
+    unsigned int width = 0, height = 0, lines = 0, band = 0;
+    int i;
+
+    if(nb_outputs < 1 || nb_outputs > SCALE_MAX_OUTPUTS || rect->x % 2 || rect->y % 2)
+    {
+        ERR("Cannot scale %ux%u+%u+%u to %d outputs", rect->width, rect->height, rect->x, rect->y,
+                nb_outputs);
+        return -1;
+    }
+
+    for(i = 0; i < nb_outputs; i++)
+    {
+        if(outputs[i].factor != 1 && outputs[i].factor != 2 && outputs[i].factor != 4)
+            width = height = 0;
+        else
+            scale_get_output_size(rect, outputs[i].factor, &width, &height);
+        if(width == 0 || height == 0 || !outputs[i].dst)
+        {
+            ERR("Cannot scale %ux%u+%u+%u by %u", rect->width, rect->height, rect->x, rect->y,
+                    outputs[i].factor);
+            return -1;
+        }
+        if(height * outputs[i].factor > lines)
+            lines = height * outputs[i].factor;
+    }
+
+    if(!scale_isa_supported(isa) || (row_fn = _get_row_fn(isa)) == NULL)
+    {
+        ERR("Cannot scale frame : %s kernels not supported", convert_isa_name(isa));
+        return -1;
+    }
+
+    for(band = 0; band < lines; band += SCALE_BAND_LINES)
+    {
+        for(i = 0; i < nb_outputs; i++)
+            _scale_band(row_fn, fmt, src, src_stride, src_height, rect, &outputs[i], band);
+    }
+
+    return 0;
+}
+
+int scale_frame_multi(scale_fmt fmt, const uint8_t *src, unsigned int src_stride, unsigned int src_height,
+        const scale_rect *rect, const scale_output *outputs, int nb_outputs)
+{
+    return scale_frame_multi_isa(scale_get_isa(), fmt, src, src_stride, src_height,
+            rect, outputs, nb_outputs);
+}
+
+int scale_frame(scale_fmt fmt, const uint8_t *src, unsigned int src_stride, unsigned int src_height,
+        const scale_rect *rect, unsigned int factor, uint8_t *dst)
+{
+    scale_output out;
+
+    out.factor = factor;
+    out.dst = dst;
+    return scale_frame_multi(fmt, src, src_stride, src_height, rect, &out, 1);
+}
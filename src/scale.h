@@ -0,0 +1,53 @@
+#ifndef SCALE_H
+#define SCALE_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include "convert.h"
+
+#define SCALE_MAX_OUTPUTS   4
+
+typedef enum
+{
+    SCALE_FMT_YUV420SP, /* NV12 or NV21 : Y plane, then interleaved chroma plane at half resolution */
+    SCALE_FMT_YUYV,     /* Packed Y0 U Y1 V macropixels */
+} scale_fmt;
+
+typedef struct
+{
+    unsigned int x;
+    unsigned int y;
+    unsigned int width;
+    unsigned int height;
+} scale_rect;
+
+typedef struct
+{
+    unsigned int factor;    /* 1, 2 or 4 */
+    uint8_t *dst;
+} scale_output;
+
+/* Output frames are packed : lines are not padded */
+unsigned int scale_get_stride(scale_fmt fmt, unsigned int width);
+size_t scale_get_frame_size(scale_fmt fmt, unsigned int width, unsigned int height);
+/* Output size is rounded down to whole chroma samples : the right and bottom
+ * edges of rect may be left out */
+void scale_get_output_size(const scale_rect *rect, unsigned int factor,
+        unsigned int *width, unsigned int *height);
+
+/* Crops rect out of src and shrinks it by factor (1, 2 or 4), averaging
+ * factor x factor samples of every component. rect must start on even
+ * coordinates */
+int scale_frame(scale_fmt fmt, const uint8_t *src, unsigned int src_stride, unsigned int src_height,
+        const scale_rect *rect, unsigned int factor, uint8_t *dst);
+/* Several outputs of the same rect in a single pass : source lines are read
+ * from memory once, while in cache for every output */
+int scale_frame_multi(scale_fmt fmt, const uint8_t *src, unsigned int src_stride, unsigned int src_height,
+        const scale_rect *rect, const scale_output *outputs, int nb_outputs);
+int scale_frame_multi_isa(convert_isa isa, scale_fmt fmt, const uint8_t *src, unsigned int src_stride,
+        unsigned int src_height, const scale_rect *rect, const scale_output *outputs, int nb_outputs);
+int scale_isa_supported(convert_isa isa);
+convert_isa scale_get_isa(void);
+
+#endif
@@ -0,0 +1,365 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "utils.h"
+#include "segment_sink.h"
+#include "async_writer.h"
+
+/* O_DIRECT needs buffers, sizes and file offsets aligned on the logical
+ * block size : 4096 covers every device we care about */
+#define SEGMENT_ALIGN           4096
+#define SEGMENT_BUFFER_SIZE     (4 * 1024 * 1024)
+/* Bytes written to disk in the background before the writers have to wait */
+#define SEGMENT_INFLIGHT_SIZE   (16 * 1024 * 1024)
+#define SEGMENT_NAME_MAX_SIZE   256
+/* AVI 1.0 offsets and sizes are 32 bits, and most readers stop at 1 GB */
+#define SEGMENT_AVI_MAX_SIZE    (1024 * 1024 * 1024)
+
+/* Frames are appended back to back in preallocated segment files, bypassing
+ * the page cache. They are gathered in aligned staging buffers, each handed
+ * to the async writer once full : a raw 720p frame costs a memcpy, and the
+ * writer threads never wait for the disk unless it falls behind */
+struct segment_sink
+{
+    char dir[OUTPUT_DIR_NAME_MAX_SIZE];
+    char name[DEVICE_NAME_MAX_SIZE];
+    size_t segment_size;
+    uint64_t segment_duration_us;
+    muxer_t *muxer;
+    uint8_t header[MUXER_HEADER_SIZE];
+    size_t header_size;
+
+    int fd;
+    FILE *index;
+    unsigned int segment;
+    int direct;
+    unsigned long nb_frames;
+    uint64_t first_timestamp_us;
+    unsigned long nb_oversized;
+
+    async_writer_t *writer;
+    /* Staging buffer being filled, NULL until the first byte is copied */
+    uint8_t *buf;
+    size_t buf_used;
+    /* File offset of the start of the staging buffer */
+    uint64_t buf_offset;
+
+    /* Last frame fully copied to the staging buffers, plus one, 0 if none */
+    uint64_t last_tag;
+    void (*durable_cb)(void *arg, uint64_t seq);
+    void *durable_arg;
+};
+
+static size_t _round_up(size_t size, size_t align)
+{
+    return (size + align - 1) / align * align;
+}
+
+/* Without O_DIRECT, written pages are pushed to disk and dropped right away so
+ * that the page cache does not grow with the recording */
+static int _write_buffer(segment_sink_t *sink, size_t size)
+{
+    uint8_t *buf = sink->buf;
+
+    sink->buf = NULL;
+    if(async_writer_submit(sink->writer, buf, sink->fd, size, sink->buf_offset, !sink->direct,
+                sink->last_tag) != 0)
+    {
+        ERR("Cannot write %zu bytes to segment %u", size, sink->segment);
+        return -1;
+    }
+    return 0;
+}
+
+static int _append(segment_sink_t *sink, const void *data, size_t size)
+{
+    size_t done = 0, chunk = 0;
+    int ret = 0;
+
+    for(done = 0; done < size; done += chunk)
+    {
+        if(!sink->buf)
+        {
+            sink->buf = async_writer_get_buffer(sink->writer);
+            if(!sink->buf)
+                return -1;
+        }
+
+        chunk = size - done;
+        if(chunk > SEGMENT_BUFFER_SIZE - sink->buf_used)
+            chunk = SEGMENT_BUFFER_SIZE - sink->buf_used;
+        memcpy(sink->buf + sink->buf_used, (const uint8_t *)data + done, chunk);
+        sink->buf_used += chunk;
+
+        if(sink->buf_used == SEGMENT_BUFFER_SIZE)
+        {
+            ret = _write_buffer(sink, SEGMENT_BUFFER_SIZE);
+            sink->buf_offset += SEGMENT_BUFFER_SIZE;
+            sink->buf_used = 0;
+            if(ret != 0)
+                return -1;
+        }
+    }
+    return 0;
+}
+
+static void _close_segment(segment_sink_t *sink)
+{
+    const uint8_t *trailer = NULL;
+    size_t trailer_size = 0;
+    uint64_t used = 0;
+
+    if(sink->fd < 0)
+        return;
+
+    trailer = muxer_get_trailer(sink->muxer, &trailer_size);
+    if(trailer && _append(sink, trailer, trailer_size) != 0)
+        ERR("%s : cannot write trailer of segment %u", sink->name, sink->segment);
+    used = sink->buf_offset + sink->buf_used;
+
+    /* Last block is padded for O_DIRECT, then the file is cut to its content */
+    if(sink->buf_used > 0)
+    {
+        memset(sink->buf + sink->buf_used, 0,
+                _round_up(sink->buf_used, SEGMENT_ALIGN) - sink->buf_used);
+        _write_buffer(sink, _round_up(sink->buf_used, SEGMENT_ALIGN));
+    }
+
+    /* Container header is written again, now that sizes are known */
+    if(sink->header_size > 0)
+    {
+        sink->buf_offset = 0;
+        sink->buf = async_writer_get_buffer(sink->writer);
+        if(sink->buf)
+        {
+            muxer_end_file(sink->muxer, sink->buf, used);
+            _write_buffer(sink, sink->header_size);
+        }
+    }
+
+    if(async_writer_drain(sink->writer) != 0)
+        ERR("%s : segment %u is incomplete", sink->name, sink->segment);
+    if(ftruncate(sink->fd, used) != 0)
+        ERR("Cannot truncate segment %u : %s", sink->segment, strerror(errno));
+    close(sink->fd);
+    sink->fd = -1;
+
+    if(sink->index)
+        fclose(sink->index);
+    sink->index = NULL;
+
+    INF("%s : segment %u closed, %lu frames, %lu bytes", sink->name, sink->segment,
+            sink->nb_frames, (unsigned long)used);
+    sink->segment++;
+}
+
+static int _open_segment(segment_sink_t *sink)
+{
+    char file_name[SEGMENT_NAME_MAX_SIZE] = {0};
+    int ret = 0;
+
+    snprintf(file_name, SEGMENT_NAME_MAX_SIZE, "%s/%s_%04u.%s", sink->dir, sink->name, sink->segment,
+            muxer_get_extension(sink->muxer));
+    sink->fd = open(file_name, O_WRONLY | O_CREAT | O_TRUNC | O_DIRECT | O_CLOEXEC, S_IWUSR | S_IRUSR);
+    sink->direct = 1;
+    if(sink->fd < 0 && errno == EINVAL)
+    {
+        /* tmpfs and a few other file systems do not support direct I/O */
+        INF("%s : direct I/O not supported for %s, using buffered writes", sink->name, file_name);
+        sink->fd = open(file_name, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, S_IWUSR | S_IRUSR);
+        sink->direct = 0;
+    }
+    if(sink->fd < 0)
+    {
+        ERR("Cannot open segment %s : %s", file_name, strerror(errno));
+        return -1;
+    }
+
+    /* Reserve the whole segment at once : no block allocation nor metadata
+     * update while recording */
+    ret = posix_fallocate(sink->fd, 0, sink->segment_size);
+    if(ret != 0)
+    {
+        DBG("Cannot preallocate segment %s : %s", file_name, strerror(ret));
+    }
+
+    snprintf(file_name, SEGMENT_NAME_MAX_SIZE, "%s/%s_%04u.idx", sink->dir, sink->name, sink->segment);
+    sink->index = fopen(file_name, "we");
+    if(!sink->index)
+    {
+        ERR("Cannot open segment index %s : %s", file_name, strerror(errno));
+        close(sink->fd);
+        sink->fd = -1;
+        return -1;
+    }
+
+    sink->buf_used = 0;
+    sink->buf_offset = 0;
+    sink->nb_frames = 0;
+    sink->header_size = muxer_begin_file(sink->muxer, sink->header);
+    if(_append(sink, sink->header, sink->header_size) != 0)
+        return -1;
+
+    INF("%s : segment %u opened", sink->name, sink->segment);
+    return 0;
+}
+
+segment_sink_t *segment_sink_create(const char *dir, const char *name, muxer_type type,
+        const muxer_stream *stream, size_t segment_size, unsigned int segment_duration_s)
+{
+    segment_sink_t *sink = NULL;
+
+    if(segment_size < SEGMENT_BUFFER_SIZE)
+    {
+        ERR("Segment size must be at least %d bytes", SEGMENT_BUFFER_SIZE);
+        return NULL;
+    }
+    if(type == MUXER_AVI && segment_size > SEGMENT_AVI_MAX_SIZE)
+    {
+        INF("%s : AVI segments limited to %d bytes", name, SEGMENT_AVI_MAX_SIZE);
+        segment_size = SEGMENT_AVI_MAX_SIZE;
+    }
+
+    sink = calloc(1, sizeof(segment_sink_t));
+    if(!sink)
+    {
+        ERR("Cannot allocate segment sink");
+        return NULL;
+    }
+
+    snprintf(sink->dir, OUTPUT_DIR_NAME_MAX_SIZE, "%s", dir);
+    snprintf(sink->name, DEVICE_NAME_MAX_SIZE, "%s", name);
+    sink->segment_size = _round_up(segment_size, SEGMENT_ALIGN);
+    sink->segment_duration_us = (uint64_t)segment_duration_s * 1000000;
+    sink->fd = -1;
+
+    sink->muxer = muxer_create(type, stream);
+    if(!sink->muxer)
+    {
+        free(sink);
+        return NULL;
+    }
+
+    sink->writer = async_writer_create(name, SEGMENT_INFLIGHT_SIZE / SEGMENT_BUFFER_SIZE, SEGMENT_BUFFER_SIZE);
+    if(!sink->writer)
+    {
+        muxer_destroy(sink->muxer);
+        free(sink);
+        return NULL;
+    }
+    INF("%s : writing %s segments with %s", name, muxer_get_extension(sink->muxer),
+            async_writer_get_backend(sink->writer));
+
+    return sink;
+}
+
+void segment_sink_destroy(segment_sink_t *sink)
+{
+    if(!sink)
+        return;
+
+    _close_segment(sink);
+    if(sink->nb_oversized)
+        INF("%s : %lu frames too large for the segments dropped", sink->name, sink->nb_oversized);
+    async_writer_destroy(sink->writer);
+    muxer_destroy(sink->muxer);
+    free(sink);
+}
+
+int segment_sink_write(segment_sink_t *sink, const struct iovec *iov, int nb_iov,
+        uint64_t seq, uint64_t timestamp_us)
+{
+    segment_index_entry entry;
+    uint8_t prefix[MUXER_MAX_PREFIX_SIZE];
+    uint8_t suffix[MUXER_MAX_SUFFIX_SIZE];
+    uint64_t offset = 0;
+    size_t size = 0, prefix_size = 0, suffix_size = 0;
+    int i = 0;
+
+    for(i = 0; i < nb_iov; i++)
+        size += iov[i].iov_len;
+
+    /* A frame that would not fit in an empty segment would be appended past
+     * its preallocated end */
+    if(MUXER_HEADER_SIZE + MUXER_MAX_PREFIX_SIZE + size + MUXER_MAX_SUFFIX_SIZE +
+       muxer_get_trailer_size(sink->muxer, 1) > sink->segment_size)
+    {
+        if(sink->nb_oversized++ == 0)
+            ERR("%s : %zu bytes frames do not fit in %zu bytes segments, dropped", sink->name, size,
+                    sink->segment_size);
+        return -1;
+    }
+
+    /* A frame never spans two segments, which are closed once full (room
+     * being kept for the trailer indexing this frame too), once their index
+     * is, or once they cover the requested duration */
+    if(sink->fd >= 0 && sink->nb_frames > 0 &&
+       (muxer_index_full(sink->muxer) ||
+        sink->buf_offset + sink->buf_used + MUXER_MAX_PREFIX_SIZE + size + MUXER_MAX_SUFFIX_SIZE +
+        muxer_get_trailer_size(sink->muxer, sink->nb_frames + 1) > sink->segment_size ||
+        (sink->segment_duration_us &&
+         timestamp_us - sink->first_timestamp_us >= sink->segment_duration_us)))
+        _close_segment(sink);
+    if(sink->fd < 0 && _open_segment(sink) != 0)
+        return -1;
+
+    if(sink->nb_frames++ == 0)
+        sink->first_timestamp_us = timestamp_us;
+
+    offset = sink->buf_offset + sink->buf_used;
+    prefix_size = muxer_begin_frame(sink->muxer, prefix, offset, size, timestamp_us);
+    if(_append(sink, prefix, prefix_size) != 0)
+        return -1;
+
+    memset(&entry, 0, sizeof(entry));
+    entry.seq = seq;
+    entry.timestamp_us = timestamp_us;
+    entry.offset = offset + prefix_size;
+    entry.size = size;
+
+    for(i = 0; i < nb_iov; i++)
+    {
+        if(_append(sink, iov[i].iov_base, iov[i].iov_len) != 0)
+            return -1;
+    }
+
+    suffix_size = muxer_end_frame(sink->muxer, suffix, size);
+    if(_append(sink, suffix, suffix_size) != 0)
+        return -1;
+
+    sink->last_tag = seq + 1;
+
+    if(fwrite(&entry, sizeof(entry), 1, sink->index) != 1)
+    {
+        ERR("Cannot write index of frame %lu", (unsigned long)seq);
+        return -1;
+    }
+    return 0;
+}
+
+int segment_sink_reserve_frames(segment_sink_t *sink, unsigned long nb_frames)
+{
+    return muxer_reserve_index(sink->muxer, nb_frames);
+}
+
+/* Buffers are tagged with the last frame they complete, and reported once
+ * every buffer before them is written too : every frame up to it is on disk */
+static void _buffer_written(void *arg, uint64_t tag)
+{
+    segment_sink_t *sink = arg;
+
+    if(tag)
+        sink->durable_cb(sink->durable_arg, tag - 1);
+}
+
+void segment_sink_set_durable_callback(segment_sink_t *sink, void (*cb)(void *arg, uint64_t seq), void *arg)
+{
+    sink->durable_cb = cb;
+    sink->durable_arg = arg;
+    async_writer_set_done_callback(sink->writer, cb ? _buffer_written : NULL, sink);
+}
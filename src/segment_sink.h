@@ -0,0 +1,38 @@
+#ifndef SEGMENT_SINK_H
+#define SEGMENT_SINK_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <sys/uio.h>
+
+#include "muxer.h"
+
+/* Each segment <name>_<n>.<ext> comes with <name>_<n>.idx, an array of these
+ * entries (host endianness), one per frame stored in the segment. Offsets
+ * point to the frame data, past any container framing */
+typedef struct
+{
+    uint64_t seq;
+    uint64_t timestamp_us;
+    uint64_t offset;
+    uint32_t size;
+    uint32_t reserved;
+} segment_index_entry;
+
+typedef struct segment_sink segment_sink_t;
+
+/* Segments are closed once segment_size bytes long, or once they cover
+ * segment_duration_s seconds of capture if not 0 */
+segment_sink_t *segment_sink_create(const char *dir, const char *name, muxer_type type,
+        const muxer_stream *stream, size_t segment_size, unsigned int segment_duration_s);
+void segment_sink_destroy(segment_sink_t *sink);
+int segment_sink_write(segment_sink_t *sink, const struct iovec *iov, int nb_iov,
+        uint64_t seq, uint64_t timestamp_us);
+/* Container state is allocated for nb_frames per segment up front, segments
+ * holding more are closed early. Must be called before the first frame */
+int segment_sink_reserve_frames(segment_sink_t *sink, unsigned long nb_frames);
+/* cb is called once every frame up to seq has reached the disk, possibly
+ * from an I/O thread. Must be set before the first frame is written */
+void segment_sink_set_durable_callback(segment_sink_t *sink, void (*cb)(void *arg, uint64_t seq), void *arg);
+
+#endif
@@ -26,14 +26,29 @@
 
 #define DEVICE_NAME_MAX_SIZE        64
 #define DEVICE_NAME_DEFAULT         "/dev/video0"
+#define MAX_DEVICES                 8
 #define OUTPUT_DIR_NAME_MAX_SIZE    64
 #define FORMAT_MAX_SIZE             16
-#define FRAME_WIDTH                 1280
-#define FRAME_HEIGHT                720
-#define FRAME_SIZE                  (FRAME_WIDTH * FRAME_HEIGHT * 2)
-#define NB_BUF                      9
-#define FRAME_RATE                  30
+#define DEFAULT_FRAME_WIDTH         1280
+#define DEFAULT_FRAME_HEIGHT        720
+#define DEFAULT_PIXEL_FORMAT        V4L2_PIX_FMT_NV21
+#define DEFAULT_FRAME_RATE          30
+#define DEFAULT_JPEG_QUALITY        50
+#define DEFAULT_NB_BUF              9
+#define MAX_BUF                     32
+#define FRAME_TIMEOUT_MS            2000
 #define NB_DUMP_FRAME               10
+#define SEGMENT_SIZE                (512 * 1024 * 1024)
+#define SEGMENT_DURATION_S          0 /* No limit */
+#define HISTORY_BUDGET_MB           256
+#define TRIGGER_SOCKET_PATH         "/tmp/demo_v4l2.trigger"
+#define NB_RING_SLOTS               16
+#define NB_BUS_SLOTS                8
+#define BUS_NAME_PREFIX             "demo_v4l2_"
+#define NB_WRITER_THREADS           0 /* One per online CPU */
+#define MAX_WRITER_THREADS          16
+#define MAX_THUMBNAILS              3
+#define METRICS_PERIOD_MS           1000
 
 void yuv2rgb(uint8_t in[], uint8_t out[], int width, int height);
 
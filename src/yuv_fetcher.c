@@ -11,26 +11,134 @@
 #include <string.h>
 #include <libgen.h>
 #include <sys/mman.h>
+#include <sys/uio.h>
+#include <pthread.h>
+#include <linux/dma-buf.h>
 
 #include "yuv_fetcher.h"
 #include "jpeg_encoder.h"
+#include "jpeg_decoder.h"
+#include "mjpeg.h"
+#include "frame_ring.h"
+#include "frame_bus.h"
+#include "format_negotiation.h"
+#include "frame_sink.h"
+#include "scale.h"
+#include "metrics.h"
+#include "frame_trace.h"
+#include "frame_source.h"
+#include "encode_control.h"
 #include "utils.h"
 
-#define FILE_NAME_MAX_SIZE      128
 
 typedef struct
 {
     void *start;
     size_t length;
+    int dmabuf_fd;
+    int refcount;
+    yuv_frame frame;
 } nv21_buffer;
 
-static int _webcam_fd = -1;
-static int _error = 0;
-static nv21_buffer *buffers = NULL;
-static uint8_t  loop_run = 0;
-static yuv_data_callback_t _data_cb = NULL;
-static char _output_dir[OUTPUT_DIR_NAME_MAX_SIZE] = {0};
-static char _format[FORMAT_MAX_SIZE] = {0};
+typedef struct
+{
+    pthread_t thread;
+    jpeg_encoder_t *enc;
+    jpeg_decoder_t *dec;
+    uint8_t *decoded;
+    uint8_t *scaled;
+    uint8_t *thumbs[MAX_THUMBNAILS];
+    jpeg_encoder_t *thumb_encs[MAX_THUMBNAILS];
+    unsigned int settings_generation;   /* Encoder settings in use */
+    yuv_fetcher_t *fetcher;
+} yuv_writer;
+
+/* All the state of one capture device, so that a single process can drive
+ * several of them */
+struct yuv_fetcher
+{
+    int fd;
+    char name[DEVICE_NAME_MAX_SIZE];
+    /* Software source standing for the device, fd is then -1 */
+    frame_source_t *source;
+    nv21_buffer *buffers;
+    unsigned int nb_buffers;
+    yuv_fetcher_memory memory;
+    int import_fds[MAX_BUF];
+    void *userptrs[MAX_BUF];
+    size_t userptr_length;
+    int streaming;
+    yuv_frame_callback_t frame_cb;
+    char output_dir[OUTPUT_DIR_NAME_MAX_SIZE];
+    char format[FORMAT_MAX_SIZE];
+    __u32 pixelformat;
+    __u32 width;
+    __u32 height;
+    __u32 stride;
+    __u32 frame_size;
+    unsigned int frame_rate;
+
+    /* Recorded frames : decimation is done by the capture thread, crop and
+     * downscale left by the driver by the writers */
+    unsigned int decimation;
+    unsigned int record_fps;
+    unsigned long nb_captured;
+    uint64_t next_record_us;
+    scale_rect roi;             /* Empty if writers do not crop */
+    unsigned int scale;
+    uint32_t raw_format;        /* Format of the frames writers crop and encode */
+    unsigned int out_width;
+    unsigned int out_height;
+    int passthrough;            /* MJPEG captures written as is */
+
+    /* Thumbnails of the recorded frames, scaled in the same pass as them and
+     * written to their own sinks */
+    unsigned int thumb_factors[MAX_THUMBNAILS];     /* Relative to the recorded frames */
+    int nb_thumbs;
+    unsigned int thumb_scales[MAX_THUMBNAILS];      /* Relative to the frames writers get */
+    unsigned int thumb_width[MAX_THUMBNAILS];
+    unsigned int thumb_height[MAX_THUMBNAILS];
+    frame_sink_t *thumb_sinks[MAX_THUMBNAILS];
+
+    /* JPEG settings, adapted to the load within the quality range */
+    int min_quality;
+    int max_quality;
+    unsigned int cpu_budget;
+    encode_control_t *encode_control;
+
+    frame_ring_t *ring;
+    yuv_writer writers[MAX_WRITER_THREADS];
+    int nb_writers;
+    unsigned long next_write_seq;
+    pthread_mutex_t order_lock;
+    pthread_cond_t order_cond;
+
+    int publish;
+    frame_bus_t *bus;
+    frame_sink_type sink_type;
+    frame_sink_t *sink;
+    size_t segment_size;
+    unsigned int segment_duration_s;
+    int history;
+    unsigned int history_pre_s;
+    unsigned int history_post_s;
+    size_t history_budget;
+
+    metrics_t *metrics;
+    uint64_t wait_start_ns;     /* Capture thread done with the last frame */
+    uint32_t last_sequence;
+    int has_sequence;
+    unsigned int next_source_buffer;
+
+    /* Latencies from the driver timestamps, only comparable to ours when they
+     * are CLOCK_MONOTONIC */
+    int timestamp_checked;
+    int monotonic;
+    uint64_t capture_ns;        /* Frame being processed */
+    uint64_t dequeue_ns;
+    int trace_file;
+    frame_trace_t *trace;       /* Recorded frames, until durable */
+};
 
 static int xioctl(int fh, int request, void *arg)
 {
@@ -43,21 +151,22 @@ static int xioctl(int fh, int request, void *arg)
     return r;
 }
 
-static int _open_device(char *device)
+static int _open_device(yuv_fetcher_t *f, char *device)
 {
     int error = 0;
-    if(device[0] != 0)
-    {
-        INF("Opening device %s", device);
-        _webcam_fd = open(device, O_RDWR);
-    }
+    char path[DEVICE_NAME_MAX_SIZE] = {0};
+
+    if(device && device[0] != 0)
+        snprintf(path, DEVICE_NAME_MAX_SIZE, "%s", device);
     else
-    {
-        INF("Opening device %s", DEVICE_NAME_DEFAULT);
-        _webcam_fd = open(DEVICE_NAME_DEFAULT, O_RDWR);
-    }
+        snprintf(path, DEVICE_NAME_MAX_SIZE, "%s", DEVICE_NAME_DEFAULT);
 
-    if(_webcam_fd < 0)
+    /* Device is non-blocking, frames are dequeued when it is reported ready */
+    INF("Opening device %s", path);
+    f->fd = open(path, O_RDWR | O_NONBLOCK);
+    snprintf(f->name, DEVICE_NAME_MAX_SIZE, "%s", basename(path));
+
+    if(f->fd < 0)
     {
         ERR("Cannot open video device");
         error = -1;
@@ -65,7 +174,7 @@ static int _open_device(char *device)
     return error;
 }
 
-static void _enumerate_menu(struct v4l2_queryctrl *queryctrl)
+static void _enumerate_menu(yuv_fetcher_t *f, struct v4l2_queryctrl *queryctrl)
 {
     struct v4l2_querymenu querymenu;
 
@@ -76,14 +185,14 @@ static void _enumerate_menu(struct v4l2_queryctrl *queryctrl)
          querymenu.index <= (__u32)queryctrl->maximum;
          querymenu.index++)
     {
-        if (0 == xioctl(_webcam_fd, VIDIOC_QUERYMENU, &querymenu))
+        if (0 == xioctl(f->fd, VIDIOC_QUERYMENU, &querymenu))
         {
             INF("\t* %s", querymenu.name);
         }
     }
 }
 
-static int _enumerate_controls(void)
+static int _enumerate_controls(yuv_fetcher_t *f)
 {
     struct v4l2_queryctrl queryctrl;
 
@@ -91,14 +200,14 @@ static int _enumerate_controls(void)
 
     INF("Starting controls enumeration");
     queryctrl.id = V4L2_CTRL_FLAG_NEXT_CTRL;
-    while (0 == xioctl(_webcam_fd, VIDIOC_QUERYCTRL, &queryctrl))
+    while (0 == xioctl(f->fd, VIDIOC_QUERYCTRL, &queryctrl))
     {
         if ((queryctrl.flags & V4L2_CTRL_FLAG_DISABLED) == 0)
         {
             INF("Found control : %s", queryctrl.name);
 
             if (queryctrl.type == V4L2_CTRL_TYPE_MENU)
-                _enumerate_menu(&queryctrl);
+                _enumerate_menu(f, &queryctrl);
         }
 
         queryctrl.id |= V4L2_CTRL_FLAG_NEXT_CTRL;
@@ -249,11 +358,11 @@ static void _print_format_parameters(struct v4l2_format format)
     INF("> Color space  : %s", _get_fmt_colorspace_string(format.fmt.pix.colorspace));
 }
 
-static void _print_general_info(void)
+static void _print_general_info(yuv_fetcher_t *f)
 {
     struct v4l2_capability cap;
     /* Ask for V4L2 device capabilities */
-    if(xioctl(_webcam_fd, VIDIOC_QUERYCAP, &cap) == -1)
+    if(xioctl(f->fd, VIDIOC_QUERYCAP, &cap) == -1)
     {
         ERR("Cannot query video capture device capabilities : %s", strerror(errno));
         return;
@@ -273,401 +382,1867 @@ static void _print_general_info(void)
 }
 
 
-static int _setup_video_cap(void)
+static int _setup_video_cap(yuv_fetcher_t *f)
 {
     struct v4l2_input input;
-    struct v4l2_format format;
-    struct v4l2_streamparm params;
-
-    int error = 0;
 
     /* Set video input (0 by default for the demo */
     memset(&input, 0, sizeof(input));
     input.index=0;
-    if(xioctl(_webcam_fd, VIDIOC_S_INPUT, &input) == -1)
+    if(xioctl(f->fd, VIDIOC_S_INPUT, &input) == -1)
     {
         ERR("Cannot set current video input data : %s", strerror(errno));
-        error = -1;
-        goto setup_end;
+        return -1;
     }
-    /* Get framerate */
+    return 0;
+}
+
+static int _set_frame_rate(yuv_fetcher_t *f, unsigned int frame_rate)
+{
+    struct v4l2_streamparm params;
+
+    memset(&params, 0, sizeof(params));
     params.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
-    if(xioctl(_webcam_fd, VIDIOC_G_PARM, &params) == -1)
+    if(xioctl(f->fd, VIDIOC_G_PARM, &params) == -1)
     {
         ERR("Cannot get capture input parameters : %s", strerror(errno));
-        error = -1;
-        goto setup_end;
+        return -1;
     }
     INF("Current framerate : %d/%d", params.parm.capture.timeperframe.numerator, params.parm.capture.timeperframe.denominator);
-    params.parm.capture.timeperframe.numerator = 1;
-    params.parm.capture.timeperframe.numerator = FRAME_RATE;
-    if(xioctl(_webcam_fd, VIDIOC_S_PARM, &params) == -1)
+
+    if(!(params.parm.capture.capability & V4L2_CAP_TIMEPERFRAME))
     {
-        ERR("Cannot set capture input parameters : %s", strerror(errno));
-        error = -1;
-        goto setup_end;
+        INF("%s : frame rate cannot be changed", f->name);
+    }
+    else
+    {
+        params.parm.capture.timeperframe.numerator = 1;
+        params.parm.capture.timeperframe.denominator = frame_rate;
+        if(xioctl(f->fd, VIDIOC_S_PARM, &params) == -1)
+        {
+            ERR("Cannot set capture input parameters : %s", strerror(errno));
+            return -1;
+        }
     }
-    /* Select YUV format */
+
+    /* Driver rounds to the closest interval it supports */
+    if(params.parm.capture.timeperframe.numerator != 0)
+        f->frame_rate = params.parm.capture.timeperframe.denominator /
+            params.parm.capture.timeperframe.numerator;
+    INF("Negotiated framerate : %d/%d", params.parm.capture.timeperframe.numerator, params.parm.capture.timeperframe.denominator);
+    return 0;
+}
+
+/* Frame geometry used by every stride and size computation is the one the
+ * driver answers, not the one requested */
+static int _set_format(yuv_fetcher_t *f, __u32 width, __u32 height, __u32 pixelformat)
+{
+    struct v4l2_format format;
+
     memset(&format, 0, sizeof(format));
     format.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
-    if(xioctl(_webcam_fd, VIDIOC_G_FMT, &format) == -1)
+    if(xioctl(f->fd, VIDIOC_G_FMT, &format) == -1)
     {
         ERR("Cannot get current format parameters : %s", strerror(errno));
-        error = -1;
-        goto setup_end;
+        return -1;
     }
 
-    INF("Setting image format to %dx%d", FRAME_WIDTH, FRAME_HEIGHT);
-    format.fmt.pix.width = FRAME_WIDTH;
-    format.fmt.pix.height = FRAME_HEIGHT;
-    format.fmt.pix.pixelformat = V4L2_PIX_FMT_NV21;
+    INF("Setting image format to %dx%d", width, height);
+    format.fmt.pix.width = width;
+    format.fmt.pix.height = height;
+    format.fmt.pix.pixelformat = pixelformat;
     format.fmt.pix.field = V4L2_FIELD_ANY;
-    format.fmt.pix.bytesperline = FRAME_WIDTH;
-    if(xioctl(_webcam_fd, VIDIOC_S_FMT, &format) == -1)
+    /* Let the driver pick its own line alignment */
+    format.fmt.pix.bytesperline = 0;
+    if(xioctl(f->fd, VIDIOC_S_FMT, &format) == -1)
     {
         ERR("Error while setting YUV format : %s", strerror(errno));
-        error = -1;
-        goto setup_end;
+        return -1;
     }
 
+    /* Driver may have picked another format than the requested one */
+    f->pixelformat = format.fmt.pix.pixelformat;
+    f->width = format.fmt.pix.width;
+    f->height = format.fmt.pix.height;
+    f->stride = format.fmt.pix.bytesperline;
+    f->frame_size = format.fmt.pix.sizeimage;
+    if(f->frame_size == 0)
+    {
+        if(f->pixelformat == V4L2_PIX_FMT_NV21 || f->pixelformat == V4L2_PIX_FMT_NV12)
+            f->frame_size = f->stride * f->height * 3 / 2;
+        else if(f->pixelformat == V4L2_PIX_FMT_MJPEG)
+            f->frame_size = f->width * f->height * 2;
+        else
+            f->frame_size = f->stride * f->height;
+    }
     _print_format_parameters(format);
 
-    INF("Allocating frame buffer");
+    return 0;
+}
 
-setup_end:
-    return error;
+static int _get_crop(yuv_fetcher_t *f, struct v4l2_rect *rect)
+{
+    struct v4l2_selection sel;
+
+    memset(&sel, 0, sizeof(sel));
+    sel.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+    sel.target = V4L2_SEL_TGT_CROP;
+    if(xioctl(f->fd, VIDIOC_G_SELECTION, &sel) == -1)
+        return -1;
+    *rect = sel.r;
+    return 0;
 }
 
-static int _configure_buffers(void)
+static int _set_crop(yuv_fetcher_t *f, const struct v4l2_rect *rect)
 {
-    struct v4l2_requestbuffers reqbuf;
-    struct v4l2_buffer buffer;
-    __u32 i = 0;
-    int error = 0;
+    struct v4l2_selection sel;
 
-    INF("Configuring buffers");
-    memset(&reqbuf, 0, sizeof(reqbuf));
-    reqbuf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
-    reqbuf.memory = V4L2_MEMORY_MMAP;
-    reqbuf.count = NB_BUF;
+    memset(&sel, 0, sizeof(sel));
+    sel.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+    sel.target = V4L2_SEL_TGT_CROP;
+    sel.r = *rect;
+    return xioctl(f->fd, VIDIOC_S_SELECTION, &sel);
+}
 
-    if(xioctl(_webcam_fd, VIDIOC_REQBUFS, &reqbuf) == -1)
-    {
-        ERR("Cannot request buffers to driver : %s", strerror(errno));
+static int _same_rect(const struct v4l2_rect *a, const struct v4l2_rect *b)
+{
+    return a->left == b->left && a->top == b->top && a->width == b->width && a->height == b->height;
+}
+
+/* Sources adjust the format as a driver would */
+static int _set_source_format(yuv_fetcher_t *f, __u32 width, __u32 height, __u32 pixelformat,
+        unsigned int frame_rate)
+{
+    frame_source_format format;
+
+    memset(&format, 0, sizeof(format));
+    format.pixelformat = pixelformat;
+    format.width = width;
+    format.height = height;
+    format.frame_rate = frame_rate;
+    if(frame_source_set_format(f->source, &format) != 0)
         return -1;
-    }
 
-    if(reqbuf.count != NB_BUF)
+    f->pixelformat = format.pixelformat;
+    f->width = format.width;
+    f->height = format.height;
+    f->stride = format.stride;
+    f->frame_size = format.frame_size;
+    f->frame_rate = format.frame_rate;
+    INF("%s : %ux%u %c%c%c%c frames at %u fps", f->name, f->width, f->height,
+            f->pixelformat & 0xFF, (f->pixelformat >> 8) & 0xFF,
+            (f->pixelformat >> 16) & 0xFF, (f->pixelformat >> 24) & 0xFF, f->frame_rate);
+    return 0;
+}
+
+/* Crop rectangles are in sensor coordinates, the region of interest in frame
+ * coordinates. The driver is then asked for the downscaled size : with a
+ * scaler, it delivers exactly the output, otherwise frames of the cropped size
+ * that writers downscale. Anything else, e.g. a rounded crop, is undone and
+ * left to the writers. Returns 0 if the driver crops */
+static int _crop_in_hardware(yuv_fetcher_t *f, const scale_rect *roi, unsigned int scale)
+{
+    struct v4l2_rect initial, rect, actual;
+    __u32 width = f->width, height = f->height, pixelformat = f->pixelformat;
+    int scaled = 0;
+
+    if(_get_crop(f, &initial) != 0 || initial.width == 0 || initial.height == 0)
     {
-        ERR("Driver did not give as many buffer as requested (wanted : %d, got %d)",
-                NB_BUF, reqbuf.count);
+        INF("%s : driver cannot crop (%s)", f->name, strerror(errno));
         return -1;
     }
 
-    buffers = calloc(reqbuf.count, sizeof(nv21_buffer));
-    if(!buffers)
+    rect.left = initial.left + (__s32)((uint64_t)roi->x * initial.width / width);
+    rect.top = initial.top + (__s32)((uint64_t)roi->y * initial.height / height);
+    rect.width = (uint64_t)roi->width * initial.width / width;
+    rect.height = (uint64_t)roi->height * initial.height / height;
+    if(_set_crop(f, &rect) != 0)
     {
-        ERR("Error allocating buffer structures");
-        error = 1;
-        goto buf_end;
+        INF("%s : driver cannot crop (%s)", f->name, strerror(errno));
+        return -1;
     }
 
-    INF("Starting configuration of %d buffers", reqbuf.count);
-    for (i=0; i<reqbuf.count; i++)
+    if(_set_format(f, roi->width / scale, roi->height / scale, pixelformat) == 0 &&
+       _get_crop(f, &actual) == 0 && _same_rect(&actual, &rect) && f->pixelformat == pixelformat)
     {
-        memset(&buffer, 0, sizeof(buffer));
-        buffer.type = reqbuf.type;
-        buffer.memory = V4L2_MEMORY_MMAP;
-        buffer.index = i;
-
-        INF("Configuring buffer %d", i);
-        if(xioctl(_webcam_fd, VIDIOC_QUERYBUF, &buffer) < 0)
-        {
-            ERR("Cannot claim buffer %d", i);
-            error = -1;
-            goto buf_end;
-        }
-        buffers[i].length = buffer.length;
-        buffers[i].start = mmap(NULL, buffer.length,
-                PROT_READ | PROT_WRITE,
-                MAP_SHARED,
-                _webcam_fd, buffer.m.offset);
-        if(buffers[i].start == MAP_FAILED)
+        scaled = f->width == roi->width / scale && f->height == roi->height / scale;
+        if(scaled || (f->width == roi->width && f->height == roi->height))
         {
-            ERR("Failed to mmap buffer %d : %s", i, strerror(errno));
-            error = -1;
-            goto buf_end;
+            INF("%s : driver crops to %ux%u+%d+%d, frames are %ux%u", f->name,
+                    rect.width, rect.height, rect.left, rect.top, f->width, f->height);
+            if(!scaled)
+            {
+                f->roi.width = f->width;
+                f->roi.height = f->height;
+            }
+            /* Some drivers reset the frame interval with the format */
+            if(f->frame_rate && _set_frame_rate(f, f->frame_rate) != 0)
+                return -2;
+            return 0;
         }
-        INF("Buffer %d mapped to %p - size %d", i, (void *)buffers[i].start, FRAME_SIZE);
-
     }
 
-buf_end:
-        return error;
+    INF("%s : driver cannot crop to %ux%u+%d+%d exactly, restoring full frame", f->name,
+            rect.width, rect.height, rect.left, rect.top);
+    if(_set_crop(f, &initial) != 0 || _set_format(f, width, height, pixelformat) != 0 ||
+       f->width != width || f->height != height)
+    {
+        ERR("%s : cannot restore the capture format", f->name);
+        return -2;
+    }
+    return -1;
 }
 
-static void _free_buffers(void)
+static __u32 _v4l2_memory(yuv_fetcher_t *f)
 {
-    int i = 0;
-    if(buffers)
+    switch(f->memory)
     {
-       for(i = 0; i < NB_BUF; i++)
-       {
-           munmap(buffers[i].start, buffers[i].length);
-       }
-
+        case YUV_FETCHER_MEMORY_DMABUF_IMPORT:
+            return V4L2_MEMORY_DMABUF;
+        case YUV_FETCHER_MEMORY_USERPTR:
+            return V4L2_MEMORY_USERPTR;
+        default:
+            return V4L2_MEMORY_MMAP;
     }
 }
 
-static void _dump_frame(void *data)
+/* Driver allocated buffers, mapped for CPU access and optionally exported as
+ * dmabuf file descriptors for zero-copy consumers */
+static int _configure_mmap_buffer(yuv_fetcher_t *f, __u32 i)
 {
-    static int frame_num;
-    int fd = -1;
-    char file_name[FILE_NAME_MAX_SIZE] = {0};
-    int ret = 0;
-    uint8_t *dest_buf = NULL;
-    unsigned long frame_size = 0;
-
-    if(!data)
-    {
-        ERR("Cannot dump empty data");
-        return;
-    }
+    struct v4l2_buffer buffer;
+    struct v4l2_exportbuffer expbuf;
 
-    snprintf(file_name, FILE_NAME_MAX_SIZE, "%s/frame_%d.%s", _output_dir, frame_num, _format);
-    fd = open(file_name, O_WRONLY|O_CREAT, S_IWUSR|S_IRUSR);
-    if(fd < 0)
-    {
-        ERR("Cannot open file %s to dump frame %d", file_name, frame_num);
-    }
+    memset(&buffer, 0, sizeof(buffer));
+    buffer.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+    buffer.memory = V4L2_MEMORY_MMAP;
+    buffer.index = i;
 
-    if(strncmp(_format, "jpeg", FORMAT_MAX_SIZE) == 0)
+    INF("Configuring buffer %d", i);
+    if(xioctl(f->fd, VIDIOC_QUERYBUF, &buffer) < 0)
     {
-        dest_buf = jpeg_encoder_encode_frame((uint8_t *)data, &frame_size);
-        if(!dest_buf)
-        {
-            ERR("Error encountered while encoding jpeg, abort frame dump");
-            return;
-        }
+        ERR("Cannot claim buffer %d", i);
+        return -1;
     }
-    else // Dealing with RAW image
+    f->buffers[i].length = buffer.length;
+    f->buffers[i].start = mmap(NULL, buffer.length,
+            PROT_READ | PROT_WRITE,
+            MAP_SHARED,
+            f->fd, buffer.m.offset);
+    if(f->buffers[i].start == MAP_FAILED)
     {
-        dest_buf = data;
-        frame_size = FRAME_SIZE;
+        ERR("Failed to mmap buffer %d : %s", i, strerror(errno));
+        return -1;
     }
+    INF("Buffer %d mapped to %p - size %zu", i, (void *)f->buffers[i].start, f->buffers[i].length);
+
+    if(f->memory != YUV_FETCHER_MEMORY_MMAP_EXPORT)
+        return 0;
 
-    ret = write(fd, dest_buf, frame_size);
-    if(ret < 0)
+    memset(&expbuf, 0, sizeof(expbuf));
+    expbuf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+    expbuf.index = i;
+    expbuf.flags = O_CLOEXEC | O_RDONLY;
+    if(xioctl(f->fd, VIDIOC_EXPBUF, &expbuf) == -1)
     {
-        ERR("Did not manage to write data to file %s : %s", file_name, strerror(errno));
+        ERR("Cannot export buffer %d as dmabuf : %s", i, strerror(errno));
+        return -1;
     }
-    else if(ret != frame_size)
+    f->buffers[i].dmabuf_fd = expbuf.fd;
+    INF("Buffer %d exported as dmabuf fd %d", i, expbuf.fd);
+
+    return 0;
+}
+
+/* Externally allocated dmabufs : the driver captures directly into them. They
+ * are also mapped, if the exporter allows it, for the CPU consumers */
+static int _configure_dmabuf_buffer(yuv_fetcher_t *f, __u32 i)
+{
+    off_t size = lseek(f->import_fds[i], 0, SEEK_END);
+
+    if(size <= 0)
     {
-        INF("Did not manage to dump complete frame : dumped %d/%ld bytes", ret, frame_size);
+        ERR("Cannot get size of imported dmabuf %d : %s", i, strerror(errno));
+        return -1;
     }
-    else
+
+    f->buffers[i].dmabuf_fd = f->import_fds[i];
+    f->buffers[i].length = size;
+    f->buffers[i].start = mmap(NULL, size, PROT_READ, MAP_SHARED, f->import_fds[i], 0);
+    if(f->buffers[i].start == MAP_FAILED)
     {
-        INF("Frame %s has been dumped", file_name);
+        INF("Imported dmabuf %d cannot be mapped, CPU consumers disabled for it", i);
+        f->buffers[i].start = NULL;
     }
-    close(fd);
+    INF("Buffer %d imported from dmabuf fd %d - size %zu", i, f->import_fds[i], f->buffers[i].length);
 
-    if(++frame_num >= NB_DUMP_FRAME)
-        frame_num = 0;
-    if(strncmp(_format, "jpeg", FORMAT_MAX_SIZE) == 0 && dest_buf)
-        free(dest_buf);
+    return 0;
 }
 
-static int _start_capture_loop()
+/* Caller owned memory : the driver captures directly into it */
+static int _configure_userptr_buffer(yuv_fetcher_t *f, __u32 i)
 {
-    struct v4l2_buffer buffer;
-    enum v4l2_buf_type type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
-    int index;
-    int ret = 0;
+    f->buffers[i].start = f->userptrs[i];
+    f->buffers[i].length = f->userptr_length;
+    INF("Buffer %d uses user memory %p - size %zu", i, f->buffers[i].start, f->buffers[i].length);
 
-    INF("Enqueuing all buffers");
-    for(index = 0; index < NB_BUF; index++)
-    {
-        memset(&buffer, 0, sizeof(buffer));
-        buffer.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
-        buffer.memory = V4L2_MEMORY_MMAP;
-        buffer.index = index;
-        if(xioctl(_webcam_fd, VIDIOC_QBUF, &buffer) == -1)
-        {
-            ERR("Cannot enqueue buffer %d : %s", index, strerror(errno));
-        }
-        INF("Buffer %d enqueued for capture", index);
-    }
+    return 0;
+}
+
+/* Sources produce frames in anonymous memory, or in caller owned memory */
+static int _configure_source_buffers(yuv_fetcher_t *f)
+{
+    __u32 i = 0;
 
-    if(xioctl(_webcam_fd, VIDIOC_STREAMON, &type) == -1)
+    f->buffers = calloc(f->nb_buffers, sizeof(nv21_buffer));
+    if(!f->buffers)
     {
-        ERR("Cannot start capture : %s", strerror(errno));
+        ERR("Error allocating buffer structures");
         return -1;
     }
-
-    while(loop_run)
+    for(i = 0; i < f->nb_buffers; i++)
     {
-        memset(&buffer, 0, sizeof(struct v4l2_buffer));
-        buffer.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
-        buffer.memory = V4L2_MEMORY_MMAP;
-        ret = xioctl(_webcam_fd, VIDIOC_DQBUF, &buffer);
-        if(ret == -1 && errno == EINTR)
+        f->buffers[i].dmabuf_fd = -1;
+        if(f->memory == YUV_FETCHER_MEMORY_USERPTR)
         {
-            if(xioctl(_webcam_fd, VIDIOC_QBUF, &buffer) == -1)
-            {
-                ERR("Did not manage to put buffer %d back in queue : %s",
-                        buffer.index, strerror(errno));
-                return -1;
-            }
+            _configure_userptr_buffer(f, i);
             continue;
         }
-        else if(ret != 0)
-        {
-            ERR("Did not manage to retrieve frame : %s", strerror(errno));
-        }
-        else
+        f->buffers[i].length = f->frame_size;
+        f->buffers[i].start = mmap(NULL, f->frame_size, PROT_READ | PROT_WRITE,
+                MAP_PRIVATE | MAP_ANONYMOUS | MAP_POPULATE, -1, 0);
+        if(f->buffers[i].start == MAP_FAILED)
         {
-            DBG("Fetched full frame from buffer %d - %d bytes", buffer.index, FRAME_SIZE);
+            ERR("Failed to allocate buffer %d : %s", i, strerror(errno));
+            return -1;
         }
+    }
+    INF("%s : %u buffers of %u bytes allocated", f->name, f->nb_buffers, f->frame_size);
 
-        /* Call YUV consumer callback */
-        if(_data_cb)
-            _data_cb(buffers[buffer.index].start);
+    return 0;
+}
 
-        /* If output directory has been provided, dump data */
-        if(_output_dir[0] != 0)
-        {
-            _dump_frame(buffers[buffer.index].start);
-        }
+static int _configure_buffers(yuv_fetcher_t *f)
+{
+    struct v4l2_requestbuffers reqbuf;
+    __u32 i = 0;
+    int error = 0;
 
+    if(f->source)
+        return _configure_source_buffers(f);
 
-        if(xioctl(_webcam_fd, VIDIOC_QBUF, &buffer) == -1)
-        {
-            ERR("Did not manage to put buffer %d back in queue : %s",
-                    buffer.index, strerror(errno));
-            return -1;
-        }
+    INF("Configuring buffers");
+    memset(&reqbuf, 0, sizeof(reqbuf));
+    reqbuf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+    reqbuf.memory = _v4l2_memory(f);
+    reqbuf.count = f->nb_buffers;
+
+    if(xioctl(f->fd, VIDIOC_REQBUFS, &reqbuf) == -1)
+    {
+        ERR("Cannot request buffers to driver : %s", strerror(errno));
+        return -1;
     }
 
-    if(xioctl(_webcam_fd, VIDIOC_STREAMOFF, &type) == -1)
+    /* Driver allocated buffers may be adjusted to the driver constraints,
+     * caller provided memory has to be used as is */
+    if(reqbuf.count != f->nb_buffers &&
+       (reqbuf.count == 0 || f->memory == YUV_FETCHER_MEMORY_DMABUF_IMPORT ||
+        f->memory == YUV_FETCHER_MEMORY_USERPTR))
     {
-        ERR("Cannot stop capture : %s", strerror(errno));
+        ERR("Driver did not give as many buffer as requested (wanted : %d, got %d)",
+                f->nb_buffers, reqbuf.count);
         return -1;
     }
-    INF("Capture stopped");
+    if(reqbuf.count != f->nb_buffers)
+        INF("%s : driver adjusted buffer count from %u to %u", f->name, f->nb_buffers, reqbuf.count);
+    f->nb_buffers = reqbuf.count;
 
-    return 0;
+    f->buffers = calloc(reqbuf.count, sizeof(nv21_buffer));
+    if(!f->buffers)
+    {
+        ERR("Error allocating buffer structures");
+        error = -1;
+        goto buf_end;
+    }
+    for (i=0; i<reqbuf.count; i++)
+        f->buffers[i].dmabuf_fd = -1;
+
+    INF("Starting configuration of %d buffers", reqbuf.count);
+    for (i=0; i<reqbuf.count; i++)
+    {
+        if(f->memory == YUV_FETCHER_MEMORY_DMABUF_IMPORT)
+            error = _configure_dmabuf_buffer(f, i);
+        else if(f->memory == YUV_FETCHER_MEMORY_USERPTR)
+            error = _configure_userptr_buffer(f, i);
+        else
+            error = _configure_mmap_buffer(f, i);
+        if(error)
+            goto buf_end;
+    }
+
+buf_end:
+        return error;
 }
 
-int yuv_fetcher_init(int full_init, char *device)
+static void _free_buffers(yuv_fetcher_t *f)
 {
-    /* Open device */
-    if(_open_device(device) == -1)
+    unsigned int i = 0;
+    if(f->buffers)
     {
-        _error = -1;
-        goto end;
+       for(i = 0; i < f->nb_buffers; i++)
+       {
+           if(f->buffers[i].refcount > 0)
+               ERR("%s : buffer %u freed while a consumer still holds it", f->name, i);
+           /* User memory belongs to the caller */
+           if(f->memory != YUV_FETCHER_MEMORY_USERPTR &&
+              f->buffers[i].start && f->buffers[i].start != MAP_FAILED)
+               munmap(f->buffers[i].start, f->buffers[i].length);
+           /* Imported dmabufs belong to the caller */
+           if(f->memory == YUV_FETCHER_MEMORY_MMAP_EXPORT && f->buffers[i].dmabuf_fd >= 0)
+               close(f->buffers[i].dmabuf_fd);
+       }
+       free(f->buffers);
+       f->buffers = NULL;
     }
+}
 
-    _print_general_info();
+static int _queue_buffer(yuv_fetcher_t *f, unsigned int index)
+{
+    struct v4l2_buffer buffer;
 
-    if(!full_init)
+    /* Source buffers are free again once released */
+    if(f->source)
         return 0;
 
-    /* Video capture setup */
-    if(_setup_video_cap() == -1)
+    memset(&buffer, 0, sizeof(buffer));
+    buffer.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+    buffer.memory = _v4l2_memory(f);
+    buffer.index = index;
+    if(f->memory == YUV_FETCHER_MEMORY_DMABUF_IMPORT)
     {
-        _error = -1;
-        goto end;
+        buffer.m.fd = f->buffers[index].dmabuf_fd;
+        buffer.length = f->buffers[index].length;
     }
-
-    // If init has been called only to print capabilities, stop there
-    if(_configure_buffers() == -1)
+    else if(f->memory == YUV_FETCHER_MEMORY_USERPTR)
     {
-        _error = -1;
-        goto end;
+        buffer.m.userptr = (unsigned long)f->buffers[index].start;
+        buffer.length = f->buffers[index].length;
     }
 
-    return 0;
-end:
-    _free_buffers();
-    if(_webcam_fd >= 0)
-        close(_webcam_fd);
-    return _error;
+    return xioctl(f->fd, VIDIOC_QBUF, &buffer);
 }
 
-int yuv_fetcher_start(char * output_dir, char *format)
+/* Imported dmabufs may not be cache coherent with the CPU */
+static void _sync_dmabuf(yuv_fetcher_t *f, unsigned int index, __u64 flags)
 {
-    loop_run = 1;
-    strncpy(_output_dir, output_dir, OUTPUT_DIR_NAME_MAX_SIZE);
-    strncpy(_format, format, FORMAT_MAX_SIZE);
+    struct dma_buf_sync sync;
 
-    if(_output_dir[0] != 0 && access(basename(_output_dir), W_OK) != 0)
-    {
-        ERR("Cannot start capture : output directory %s invalid", _output_dir);
-        return 1;
-    }
+    if(f->memory != YUV_FETCHER_MEMORY_DMABUF_IMPORT)
+        return;
 
-    if(_start_capture_loop() == -1)
+    sync.flags = flags | DMA_BUF_SYNC_READ;
+    if(xioctl(f->buffers[index].dmabuf_fd, DMA_BUF_IOCTL_SYNC, &sync) == -1)
     {
-        return 1;
+        DBG("Cannot sync dmabuf %d : %s", index, strerror(errno));
     }
-    return 0;
 }
 
-void yuv_fetcher_stop(void)
+/* Frames are encoded in parallel by the writer threads, but written in capture
+ * order : each writer waits for its sequence number before touching the disk */
+static void _wait_write_turn(yuv_fetcher_t *f, unsigned long seq)
 {
-    loop_run = 0; /* Will interrupt the QBUF/DQBUF loop */
+    pthread_mutex_lock(&f->order_lock);
+    while(f->next_write_seq != seq)
+        pthread_cond_wait(&f->order_cond, &f->order_lock);
+    pthread_mutex_unlock(&f->order_lock);
 }
 
-void yuv_fetcher_shutdown(void)
+static void _end_write_turn(yuv_fetcher_t *f)
 {
-    INF("Closing capture device");
-    close(_webcam_fd);
-    _webcam_fd = -1;
+    pthread_mutex_lock(&f->order_lock);
+    f->next_write_seq++;
+    pthread_cond_broadcast(&f->order_cond);
+    pthread_mutex_unlock(&f->order_lock);
 }
 
-void yuv_fetcher_register_data_callback(yuv_data_callback_t cb)
+static scale_fmt _get_scale_fmt(uint32_t pixelformat)
 {
-    _data_cb = cb;
+    return pixelformat == V4L2_PIX_FMT_YUYV ? SCALE_FMT_YUYV : SCALE_FMT_YUV420SP;
 }
 
-void yuv_fetcher_print_avail_formats()
+/* Settings changed by the controller are applied by each writer to its own
+ * encoders, between two frames */
+static void _configure_encoders(yuv_writer *writer)
 {
-    struct v4l2_fmtdesc fmt_desc;
+    yuv_fetcher_t *f = writer->fetcher;
+    jpeg_encoder_settings settings;
+    unsigned int generation = encode_control_get_settings(f->encode_control, &settings);
+    int i = 0;
+
+    if(generation == writer->settings_generation)
+        return;
+    writer->settings_generation = generation;
+    if(writer->enc)
+        jpeg_encoder_configure(writer->enc, &settings);
+    for(i = 0; i < f->nb_thumbs; i++)
+    {
+        if(writer->thumb_encs[i])
+            jpeg_encoder_configure(writer->thumb_encs[i], &settings);
+    }
+}
+
+/* A frame goes through up to four stages : MJPEG decoding, crop and
+ * downscale, JPEG encoding, then the sink. Thumbnails are scaled along with
+ * the recorded frame, and written right after it */
+static void _dump_frame(yuv_writer *writer, frame_slot *slot)
+{
+    yuv_fetcher_t *f = writer->fetcher;
+    scale_fmt fmt = _get_scale_fmt(f->raw_format);
+    scale_output outputs[SCALE_MAX_OUTPUTS];
+    scale_rect rect = f->roi;
+    struct iovec iov[3];
+    struct iovec thumb_iov[MAX_THUMBNAILS];
+    int nb_iov = 1;
+    int nb_outputs = 0;
+    size_t size = slot->bytesused;
+    size_t dht_offset = 0;
+    unsigned long frame_size = 0;
+    uint8_t *raw = slot->data;
+    unsigned int stride = f->stride;
+    uint64_t start_ns = metrics_now_ns();
+    uint64_t end_ns = 0;
+    int i = 0;
 
-    if(_webcam_fd != -1)
+    if(writer->dec)
     {
-        memset(&fmt_desc, 0, sizeof(fmt_desc));
-        fmt_desc.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
-        while(xioctl(_webcam_fd, VIDIOC_ENUM_FMT, &fmt_desc) == 0)
+        /* Compressed capture, for raw output or to be scaled : decode to NV12 */
+        if(jpeg_decoder_decode_frame(writer->dec, slot->data, size, writer->decoded, f->width) != 0)
         {
-            INF("Supported format : %s (code %c%c%c%c)", fmt_desc.description,
-                    fmt_desc.pixelformat & 0xFF,
-                    (fmt_desc.pixelformat >> 8) & 0xFF,
-                    (fmt_desc.pixelformat >> 16) & 0xFF,
-                    (fmt_desc.pixelformat >> 24) & 0xFF);
-            fmt_desc.index++;
+            ERR("Error encountered while decoding jpeg, abort frame dump");
+            goto dump_end;
         }
+        raw = writer->decoded;
+        stride = f->width;
+    }
 
-        if(errno != EINVAL)
+    if(writer->scaled)
+    {
+        outputs[nb_outputs].factor = f->scale;
+        outputs[nb_outputs++].dst = writer->scaled;
+    }
+    for(i = 0; i < f->nb_thumbs; i++)
+    {
+        outputs[nb_outputs].factor = f->thumb_scales[i];
+        outputs[nb_outputs++].dst = writer->thumbs[i];
+    }
+    if(nb_outputs)
+    {
+        if(!rect.width)
         {
-            ERR("Error while enumerating formats : %s", strerror(errno));
+            rect.width = f->width;
+            rect.height = f->height;
+        }
+        if(scale_frame_multi(fmt, raw, stride, f->height, &rect, outputs, nb_outputs) != 0)
+            goto dump_end;
+    }
+    if(writer->scaled)
+        raw = writer->scaled;
+    else if(f->passthrough)
+        raw = slot->data;
+    if(f->encode_control)
+        _configure_encoders(writer);
+
+    /* A thumbnail that cannot be encoded is skipped */
+    for(i = 0; i < f->nb_thumbs; i++)
+    {
+        thumb_iov[i].iov_base = writer->thumbs[i];
+        thumb_iov[i].iov_len = scale_get_frame_size(fmt, f->thumb_width[i], f->thumb_height[i]);
+        if(writer->thumb_encs[i])
+        {
+            thumb_iov[i].iov_base = jpeg_encoder_encode_frame(writer->thumb_encs[i], writer->thumbs[i],
+                    &frame_size);
+            thumb_iov[i].iov_len = frame_size;
+            if(!thumb_iov[i].iov_base)
+                ERR("Error encountered while encoding jpeg thumbnail");
+        }
+    }
+
+    iov[0].iov_base = raw;
+    iov[0].iov_len = size;
+    if(writer->enc)
+    {
+        iov[0].iov_base = jpeg_encoder_encode_frame(writer->enc, raw, &frame_size);
+        iov[0].iov_len = frame_size;
+        if(!iov[0].iov_base)
+        {
+            ERR("Error encountered while encoding jpeg, abort frame dump");
+            goto dump_end;
+        }
+    }
+    else if(raw != slot->data)
+    {
+        iov[0].iov_len = scale_get_frame_size(fmt, f->out_width, f->out_height);
+    }
+    else if(f->pixelformat == V4L2_PIX_FMT_MJPEG)
+    {
+        /* Compressed payload is written as is, with the Huffman tables
+         * inserted before the scan if the camera omitted them */
+        size = mjpeg_get_frame_size(slot->data, size);
+        iov[0].iov_len = size;
+        dht_offset = mjpeg_get_dht_offset(slot->data, size);
+        if(dht_offset)
+        {
+            iov[0].iov_len = dht_offset;
+            iov[1].iov_base = (void *)mjpeg_default_dht;
+            iov[1].iov_len = mjpeg_default_dht_size;
+            iov[2].iov_base = slot->data + dht_offset;
+            iov[2].iov_len = size - dht_offset;
+            nb_iov = 3;
         }
     }
+
+    end_ns = metrics_now_ns();
+    metrics_record(f->metrics, METRICS_STAGE_ENCODE, end_ns - start_ns);
+    if(f->encode_control)
+        encode_control_report(f->encode_control, end_ns - start_ns, frame_ring_get_pending(f->ring));
+    metrics_record(f->metrics, METRICS_STAGE_DEQUEUE_TO_ENCODED, end_ns - slot->dequeue_ns);
+    if(f->trace)
+        frame_trace_encoded(f->trace, slot->seq, slot->capture_ns, slot->dequeue_ns, end_ns);
+
+    _wait_write_turn(f, slot->seq);
+    start_ns = metrics_now_ns();
+    if(frame_sink_write(f->sink, iov, nb_iov, slot->seq, slot->timestamp_us) == 0)
+        metrics_add(f->metrics, METRICS_COUNTER_WRITTEN, 1);
+    for(i = 0; i < f->nb_thumbs; i++)
+    {
+        if(thumb_iov[i].iov_base)
+            frame_sink_write(f->thumb_sinks[i], &thumb_iov[i], 1, slot->seq, slot->timestamp_us);
+    }
+    metrics_record(f->metrics, METRICS_STAGE_WRITE, metrics_now_ns() - start_ns);
+
+dump_end:
+    /* A frame that could not be dumped must not block the following ones */
+    _wait_write_turn(f, slot->seq);
+    _end_write_turn(f);
 }
 
-void yuv_fetcher_print_controls()
+static void *_writer_thread(void *arg)
 {
-    /* List all available controls */
-    if(_enumerate_controls() != 0)
+    yuv_writer *writer = arg;
+    yuv_fetcher_t *f = writer->fetcher;
+    frame_slot *slot = NULL;
+
+    while((slot = frame_ring_pop(f->ring)) != NULL)
     {
-        ERR("Cannot display all available controls");
+        _dump_frame(writer, slot);
+        frame_ring_release(f->ring, slot);
     }
+
+    return NULL;
 }
 
-void yuv_fetcher_print_capabilities(void)
+static int _get_encoder_input(uint32_t pixelformat, jpeg_encoder_input *input)
+{
+    switch(pixelformat)
+    {
+        case V4L2_PIX_FMT_YUYV:
+            *input = JPEG_ENCODER_INPUT_YUYV;
+            break;
+        case V4L2_PIX_FMT_NV21:
+            *input = JPEG_ENCODER_INPUT_NV21;
+            break;
+        case V4L2_PIX_FMT_NV12:
+            *input = JPEG_ENCODER_INPUT_NV12;
+            break;
+        default:
+            ERR("Cannot encode JPEG from pixel format %c%c%c%c",
+                    pixelformat & 0xFF,
+                    (pixelformat >> 8) & 0xFF,
+                    (pixelformat >> 16) & 0xFF,
+                    (pixelformat >> 24) & 0xFF);
+            return -1;
+    }
+    return 0;
+}
+
+static void _free_writer(yuv_writer *writer)
+{
+    int i = 0;
+
+    jpeg_encoder_destroy(writer->enc);
+    writer->enc = NULL;
+    jpeg_decoder_destroy(writer->dec);
+    writer->dec = NULL;
+    free(writer->decoded);
+    writer->decoded = NULL;
+    free(writer->scaled);
+    writer->scaled = NULL;
+    for(i = 0; i < MAX_THUMBNAILS; i++)
+    {
+        jpeg_encoder_destroy(writer->thumb_encs[i]);
+        writer->thumb_encs[i] = NULL;
+        free(writer->thumbs[i]);
+        writer->thumbs[i] = NULL;
+    }
+}
+
+/* Each writer encodes or decodes with its own codecs, and crops in its own
+ * buffers */
+static int _setup_writer(yuv_fetcher_t *f, yuv_writer *writer, int encode, int decode,
+        int encode_thumbs, jpeg_encoder_input input)
+{
+    scale_fmt fmt = _get_scale_fmt(f->raw_format);
+    int i = 0;
+
+    writer->fetcher = f;
+    /* Encoders start with the defaults, the first frame applies the settings */
+    writer->settings_generation = (unsigned int)-1;
+
+    if(encode)
+    {
+        if(f->roi.width)
+            writer->enc = jpeg_encoder_create(input, f->out_width, f->out_height,
+                    scale_get_stride(fmt, f->out_width));
+        else
+            writer->enc = jpeg_encoder_create(input, f->width, f->height, f->stride);
+        if(!writer->enc)
+            return -1;
+    }
+
+    if(decode)
+    {
+        writer->dec = jpeg_decoder_create(f->width, f->height);
+        writer->decoded = malloc(f->width * f->height * 3 / 2);
+        if(!writer->dec || !writer->decoded)
+        {
+            ERR("Cannot allocate JPEG decoding buffers");
+            _free_writer(writer);
+            return -1;
+        }
+    }
+
+    if(f->roi.width)
+    {
+        writer->scaled = malloc(scale_get_frame_size(fmt, f->out_width, f->out_height));
+        if(!writer->scaled)
+        {
+            ERR("Cannot allocate scaling buffer");
+            _free_writer(writer);
+            return -1;
+        }
+    }
+
+    for(i = 0; i < f->nb_thumbs; i++)
+    {
+        writer->thumbs[i] = malloc(scale_get_frame_size(fmt, f->thumb_width[i], f->thumb_height[i]));
+        if(encode_thumbs)
+            writer->thumb_encs[i] = jpeg_encoder_create(input, f->thumb_width[i], f->thumb_height[i],
+                    scale_get_stride(fmt, f->thumb_width[i]));
+        if(!writer->thumbs[i] || (encode_thumbs && !writer->thumb_encs[i]))
+        {
+            ERR("Cannot allocate thumbnail buffers");
+            _free_writer(writer);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/* Thumbnails are scaled from the region writers crop, or the whole frame, in
+ * a single step : the recorded frame downscale and their own one must add up
+ * to at most 4 */
+static int _setup_thumbnails(yuv_fetcher_t *f, const muxer_stream *stream)
+{
+    muxer_stream thumb_stream = *stream;
+    char name[DEVICE_NAME_MAX_SIZE];
+    scale_rect rect = f->roi;
+    int i = 0;
+
+    if(f->nb_thumbs == 0)
+        return 0;
+
+    if(f->raw_format != V4L2_PIX_FMT_NV12 && f->raw_format != V4L2_PIX_FMT_NV21 &&
+       f->raw_format != V4L2_PIX_FMT_YUYV)
+    {
+        ERR("%s : cannot produce thumbnails from this pixel format", f->name);
+        return -1;
+    }
+
+    if(!rect.width)
+    {
+        rect.width = f->width;
+        rect.height = f->height;
+    }
+
+    for(i = 0; i < f->nb_thumbs; i++)
+    {
+        f->thumb_scales[i] = f->thumb_factors[i] * (f->roi.width ? f->scale : 1);
+        if(f->thumb_scales[i] > 4)
+        {
+            ERR("%s : cannot downscale by %u, thumbnails and recorded frames are limited to 4 in total",
+                    f->name, f->thumb_scales[i]);
+            return -1;
+        }
+        scale_get_output_size(&rect, f->thumb_scales[i], &f->thumb_width[i], &f->thumb_height[i]);
+        if(f->thumb_width[i] == 0 || f->thumb_height[i] == 0)
+        {
+            ERR("%s : frames are too small for thumbnails downscaled by %u", f->name, f->thumb_factors[i]);
+            return -1;
+        }
+
+        if(snprintf(name, DEVICE_NAME_MAX_SIZE, "%s_thumb%u", f->name, f->thumb_factors[i]) >=
+           DEVICE_NAME_MAX_SIZE)
+        {
+            ERR("%s : device name too long for thumbnails", f->name);
+            return -1;
+        }
+        thumb_stream.width = f->thumb_width[i];
+        thumb_stream.height = f->thumb_height[i];
+        f->thumb_sinks[i] = frame_sink_create(f->sink_type, f->output_dir, name, f->format,
+                &thumb_stream, f->segment_size, f->segment_duration_s);
+        if(!f->thumb_sinks[i])
+            return -1;
+        if(f->history && frame_sink_set_history(f->thumb_sinks[i], f->history_pre_s, f->history_post_s,
+                    f->history_budget / (f->thumb_factors[i] * f->thumb_factors[i]),
+                    stream->frame_rate) != 0)
+            return -1;
+        INF("%s : %ux%u thumbnails written as %s", f->name, f->thumb_width[i], f->thumb_height[i], name);
+    }
+    return 0;
+}
+
+/* Only the main sink is traced. Pre-trigger history is not : its frames reach
+ * the disk long after they are encoded, if ever */
+static int _setup_trace(yuv_fetcher_t *f)
+{
+    char file[FRAME_TRACE_NAME_MAX_SIZE] = {0};
+
+    if(f->trace_file)
+        snprintf(file, FRAME_TRACE_NAME_MAX_SIZE, "%s/%s.trace", f->output_dir, f->name);
+    f->trace = frame_trace_create(f->metrics, f->trace_file ? file : NULL);
+    if(!f->trace)
+        return -1;
+    frame_sink_set_durable_callback(f->sink, frame_trace_durable, f->trace);
+    return 0;
+}
+
+static void _print_latencies(yuv_fetcher_t *f)
+{
+    metrics_stage stages[] = {METRICS_STAGE_CAPTURE_TO_DEQUEUE, METRICS_STAGE_DEQUEUE_TO_ENCODED,
+        METRICS_STAGE_ENCODED_TO_DURABLE};
+    uint64_t p50 = 0, p99 = 0;
+    unsigned int i = 0;
+
+    for(i = 0; i < sizeof(stages) / sizeof(stages[0]); i++)
+    {
+        if(!metrics_get_count(f->metrics, stages[i]))
+            continue;
+        p50 = metrics_get_quantile(f->metrics, stages[i], 0.5);
+        p99 = metrics_get_quantile(f->metrics, stages[i], 0.99);
+        INF("%s : %s latency p50 %.3f ms, p99 %.3f ms, max %.3f ms, jitter %.3f ms", f->name,
+                metrics_get_stage_name(stages[i]), p50 / 1e6, p99 / 1e6,
+                metrics_get_quantile(f->metrics, stages[i], 1.0) / 1e6, (p99 - p50) / 1e6);
+    }
+}
+
+/* Writers encode raw frames for jpeg output, and decode compressed frames for
+ * raw output. Compressed frames for jpeg output are written as is, unless they
+ * have to be cropped : they are then decoded and encoded again. They are also
+ * decoded for thumbnails */
+static int _start_writers(yuv_fetcher_t *f)
+{
+    jpeg_encoder_input input = JPEG_ENCODER_INPUT_YUYV;
+    yuv_writer *writer = NULL;
+    int jpeg_output = strncmp(f->format, "jpeg", FORMAT_MAX_SIZE) == 0;
+    int compressed = f->pixelformat == V4L2_PIX_FMT_MJPEG;
+    int decode = compressed && (!jpeg_output || f->roi.width || f->nb_thumbs);
+    int encode = jpeg_output && (!compressed || f->roi.width);
+    encode_control_config control;
+    muxer_stream stream;
+    int i = 0;
+
+    f->raw_format = decode ? V4L2_PIX_FMT_NV12 : f->pixelformat;
+    f->out_width = f->roi.width ? f->roi.width / f->scale : f->width;
+    f->out_height = f->roi.width ? f->roi.height / f->scale : f->height;
+    f->passthrough = compressed && jpeg_output && !encode;
+    if((encode || (jpeg_output && f->nb_thumbs)) && _get_encoder_input(f->raw_format, &input) != 0)
+        return -1;
+    if(compressed && jpeg_output && f->roi.width)
+        INF("%s : MJPEG frames are decoded and encoded again to be cropped", f->name);
+
+    /* What writers hand to the sink */
+    stream.pixelformat = jpeg_output ? V4L2_PIX_FMT_MJPEG : f->raw_format;
+    stream.width = f->out_width;
+    stream.height = f->out_height;
+    stream.frame_rate = f->frame_rate;
+    if(f->decimation > 1)
+        stream.frame_rate = f->frame_rate / f->decimation;
+    if(f->record_fps && f->record_fps < stream.frame_rate)
+        stream.frame_rate = f->record_fps;
+    if(stream.frame_rate == 0)
+        stream.frame_rate = 1;
+
+    f->sink = frame_sink_create(f->sink_type, f->output_dir, f->name, f->format,
+            &stream, f->segment_size, f->segment_duration_s);
+    if(!f->sink)
+        return -1;
+    if(f->history && frame_sink_set_history(f->sink, f->history_pre_s, f->history_post_s,
+                f->history_budget, stream.frame_rate) != 0)
+        return -1;
+    if(_setup_thumbnails(f, &stream) != 0)
+        return -1;
+    if(!f->history && _setup_trace(f) != 0)
+        return -1;
+
+    f->ring = frame_ring_create(NB_RING_SLOTS, f->frame_size);
+    if(!f->ring)
+        return -1;
+    f->next_write_seq = 0;
+    f->nb_captured = 0;
+    f->next_record_us = 0;
+
+    if(f->nb_writers == 0)
+    {
+        f->nb_writers = sysconf(_SC_NPROCESSORS_ONLN);
+        if(f->nb_writers < 1)
+            f->nb_writers = 1;
+        else if(f->nb_writers > MAX_WRITER_THREADS)
+            f->nb_writers = MAX_WRITER_THREADS;
+    }
+
+    if(encode || (jpeg_output && f->nb_thumbs))
+    {
+        control.min_quality = f->min_quality;
+        control.max_quality = f->max_quality;
+        control.packed_input = input == JPEG_ENCODER_INPUT_YUYV;
+        control.target_fps = f->frame_rate ? stream.frame_rate : 0;
+        control.cpu_budget = f->cpu_budget;
+        control.nb_writers = f->nb_writers;
+        control.queue_size = NB_RING_SLOTS;
+        f->encode_control = encode_control_create(f->name, f->metrics, &control);
+        if(!f->encode_control)
+            return -1;
+    }
+
+    for(i = 0; i < f->nb_writers; i++)
+    {
+        writer = &f->writers[i];
+        if(_setup_writer(f, writer, encode, decode, jpeg_output, input) != 0)
+        {
+            f->nb_writers = i;
+            return -1;
+        }
+
+        if(pthread_create(&writer->thread, NULL, _writer_thread, writer) != 0)
+        {
+            ERR("Cannot start writer thread %d", i);
+            _free_writer(writer);
+            f->nb_writers = i;
+            return -1;
+        }
+    }
+    INF("%s : started %d writer threads on a %d frames ring", f->name, f->nb_writers, NB_RING_SLOTS);
+
+    return 0;
+}
+
+static void _stop_writers(yuv_fetcher_t *f)
+{
+    int i = 0;
+
+    if(!f->ring)
+        return;
+
+    /* Writers drain the remaining frames before exiting */
+    frame_ring_close(f->ring);
+    for(i = 0; i < f->nb_writers; i++)
+    {
+        pthread_join(f->writers[i].thread, NULL);
+        _free_writer(&f->writers[i]);
+    }
+
+    INF("%s : %lu frames dropped because of full frame ring", f->name, frame_ring_get_overflows(f->ring));
+    frame_ring_destroy(f->ring);
+    f->ring = NULL;
+    /* Sink flushes its last buffers before the trace goes away */
+    frame_sink_destroy(f->sink);
+    f->sink = NULL;
+    for(i = 0; i < f->nb_thumbs; i++)
+    {
+        frame_sink_destroy(f->thumb_sinks[i]);
+        f->thumb_sinks[i] = NULL;
+    }
+    frame_trace_destroy(f->trace);
+    f->trace = NULL;
+    encode_control_destroy(f->encode_control);
+    f->encode_control = NULL;
+    _print_latencies(f);
+}
+
+/* Decimation is decided before the frame is copied to the ring, so that
+ * skipped frames cost nothing. The rate limit follows the driver timestamps,
+ * with half a capture interval of tolerance for their jitter */
+static int _keep_frame(yuv_fetcher_t *f, uint64_t timestamp_us)
+{
+    uint64_t interval_us = 0, jitter_us = 0;
+
+    if(f->decimation > 1 && f->nb_captured++ % f->decimation != 0)
+        goto skip;
+    if(f->record_fps == 0)
+        return 1;
+
+    interval_us = 1000000 / f->record_fps;
+    jitter_us = 500000 / (f->frame_rate ? f->frame_rate : DEFAULT_FRAME_RATE);
+    if(timestamp_us + jitter_us < f->next_record_us)
+        goto skip;
+
+    /* After a gap, frames are paced from this one instead of catching up */
+    f->next_record_us += interval_us;
+    if(f->next_record_us <= timestamp_us)
+        f->next_record_us = timestamp_us + interval_us;
+    return 1;
+
+skip:
+    metrics_add(f->metrics, METRICS_COUNTER_SKIPPED, 1);
+    return 0;
+}
+
+/* Capture thread only copies the frame to the ring, and immediately gives the
+ * buffer back to the driver. Encoding and writing are done by writer threads */
+static void _queue_frame(yuv_fetcher_t *f, const void *data, size_t size, uint64_t timestamp_us)
+{
+    frame_slot *slot = frame_ring_acquire(f->ring);
+
+    if(!slot)
+    {
+        DBG("Frame ring full, dropping frame");
+        metrics_add(f->metrics, METRICS_COUNTER_RING_FULL, 1);
+        return;
+    }
+
+    slot->bytesused = size < slot->size ? size : slot->size;
+    slot->timestamp_us = timestamp_us;
+    slot->capture_ns = f->capture_ns;
+    slot->dequeue_ns = f->dequeue_ns;
+    memcpy(slot->data, data, slot->bytesused);
+    frame_ring_commit(f->ring, slot);
+}
+
+/* Frames are published on a shared memory bus named after the device, e.g.
+ * /dev/shm/demo_v4l2_video0 */
+static int _start_bus(yuv_fetcher_t *f)
+{
+    char name[FRAME_BUS_NAME_MAX_SIZE] = {0};
+
+    snprintf(name, FRAME_BUS_NAME_MAX_SIZE, "%s%s", BUS_NAME_PREFIX, f->name);
+    f->bus = frame_bus_create(name, NB_BUS_SLOTS, f->frame_size,
+            f->width, f->height, f->stride, f->pixelformat);
+    if(!f->bus)
+        return -1;
+    return 0;
+}
+
+static void _stop_bus(yuv_fetcher_t *f)
+{
+    frame_bus_destroy(f->bus);
+    f->bus = NULL;
+}
+
+static int _start_source(yuv_fetcher_t *f)
+{
+    unsigned int index;
+
+    for(index = 0; index < f->nb_buffers; index++)
+        f->buffers[index].refcount = 0;
+    if(frame_source_start(f->source) != 0)
+        return -1;
+    f->streaming = 1;
+    f->has_sequence = 0;
+    f->next_source_buffer = 0;
+    f->wait_start_ns = metrics_now_ns();
+
+    return 0;
+}
+
+static int _start_streaming(yuv_fetcher_t *f)
+{
+    enum v4l2_buf_type type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+    unsigned int index;
+
+    if(f->source)
+        return _start_source(f);
+
+    INF("Enqueuing all buffers");
+    for(index = 0; index < f->nb_buffers; index++)
+    {
+        f->buffers[index].refcount = 0;
+        if(_queue_buffer(f, index) == -1)
+        {
+            ERR("Cannot enqueue buffer %d : %s", index, strerror(errno));
+        }
+        INF("Buffer %d enqueued for capture", index);
+    }
+
+    if(xioctl(f->fd, VIDIOC_STREAMON, &type) == -1)
+    {
+        ERR("Cannot start capture : %s", strerror(errno));
+        return -1;
+    }
+    f->streaming = 1;
+    f->has_sequence = 0;
+    f->wait_start_ns = metrics_now_ns();
+
+    return 0;
+}
+
+yuv_fetcher_t *yuv_fetcher_init(int full_init, char *device)
+{
+    yuv_fetcher_t *f = calloc(1, sizeof(yuv_fetcher_t));
+
+    if(!f)
+    {
+        ERR("Cannot allocate YUV fetcher");
+        return NULL;
+    }
+    f->nb_writers = NB_WRITER_THREADS;
+    f->nb_buffers = DEFAULT_NB_BUF;
+    f->memory = YUV_FETCHER_MEMORY_MMAP;
+    f->segment_size = SEGMENT_SIZE;
+    f->segment_duration_s = SEGMENT_DURATION_S;
+    f->scale = 1;
+    f->min_quality = DEFAULT_JPEG_QUALITY;
+    f->max_quality = DEFAULT_JPEG_QUALITY;
+    pthread_mutex_init(&f->order_lock, NULL);
+    pthread_cond_init(&f->order_cond, NULL);
+
+    if(frame_source_is_source(device))
+    {
+        f->fd = -1;
+        f->source = frame_source_create(device);
+        if(!f->source)
+            goto end;
+        snprintf(f->name, DEVICE_NAME_MAX_SIZE, "%s", frame_source_get_name(f->source));
+    }
+    else
+    {
+        /* Open device */
+        if(_open_device(f, device) == -1)
+            goto end;
+
+        _print_general_info(f);
+    }
+
+    f->metrics = metrics_create(f->name);
+    if(!f->metrics)
+        goto end;
+
+    if(!full_init || f->source)
+        return f;
+
+    /* Video capture setup. Format is negotiated by yuv_fetcher_set_format(),
+     * and buffers are configured when starting capture, once the memory mode
+     * is known */
+    if(_setup_video_cap(f) == -1)
+        goto end;
+
+    return f;
+end:
+    yuv_fetcher_shutdown(f);
+    return NULL;
+}
+
+int yuv_fetcher_start(yuv_fetcher_t *f, char * output_dir, char *format)
+{
+    snprintf(f->output_dir, OUTPUT_DIR_NAME_MAX_SIZE, "%s", output_dir);
+    snprintf(f->format, FORMAT_MAX_SIZE, "%s", format);
+
+    if(f->output_dir[0] != 0 && access(f->output_dir, W_OK) != 0)
+    {
+        ERR("Cannot start capture : output directory %s invalid", f->output_dir);
+        return 1;
+    }
+
+    if(f->frame_size == 0 &&
+       yuv_fetcher_set_format(f, DEFAULT_FRAME_WIDTH, DEFAULT_FRAME_HEIGHT,
+           DEFAULT_PIXEL_FORMAT, DEFAULT_FRAME_RATE) != 0)
+    {
+        ERR("Cannot start capture : format negotiation failed");
+        return 1;
+    }
+
+    if(!f->buffers && _configure_buffers(f) == -1)
+    {
+        ERR("Cannot start capture : buffers setup failed");
+        _free_buffers(f);
+        return 1;
+    }
+
+    if(f->output_dir[0] != 0 && _start_writers(f) == -1)
+    {
+        ERR("Cannot start capture : writer threads setup failed");
+        _stop_writers(f);
+        return 1;
+    }
+
+    if(f->publish && _start_bus(f) == -1)
+    {
+        ERR("Cannot start capture : frame bus setup failed");
+        _stop_writers(f);
+        return 1;
+    }
+
+    if(_start_streaming(f) == -1)
+    {
+        _stop_writers(f);
+        _stop_bus(f);
+        return 1;
+    }
+    return 0;
+}
+
+/* Frame handle of a dequeued buffer, valid until the buffer is requeued */
+static yuv_frame *_fill_frame(yuv_fetcher_t *f, const struct v4l2_buffer *buffer)
+{
+    yuv_frame *frame = &f->buffers[buffer->index].frame;
+
+    frame->fetcher = f;
+    frame->index = buffer->index;
+    frame->data = f->buffers[buffer->index].start;
+    frame->dmabuf_fd = f->buffers[buffer->index].dmabuf_fd;
+    frame->bytesused = buffer->bytesused;
+    frame->width = f->width;
+    frame->height = f->height;
+    frame->stride = f->stride;
+    frame->pixelformat = f->pixelformat;
+    frame->sequence = buffer->sequence;
+    frame->flags = buffer->flags;
+    frame->timestamp_us = buffer->timestamp.tv_sec * 1000000ULL + buffer->timestamp.tv_usec;
+
+    return frame;
+}
+
+/* Sources produce a frame in the next buffer nobody holds, with what the
+ * driver would report. Without a free buffer the frame is dropped, as a driver
+ * would */
+static int _dequeue_source_frame(yuv_fetcher_t *f, struct v4l2_buffer *buffer)
+{
+    frame_source_frame frame;
+    nv21_buffer *free_buffer = NULL;
+    unsigned int i = 0, index = 0;
+    int ret = 0;
+
+    for(i = 0; i < f->nb_buffers && !free_buffer; i++)
+    {
+        index = (f->next_source_buffer + i) % f->nb_buffers;
+        if(__atomic_load_n(&f->buffers[index].refcount, __ATOMIC_ACQUIRE) == 0)
+            free_buffer = &f->buffers[index];
+    }
+
+    ret = frame_source_next(f->source, free_buffer ? free_buffer->start : NULL,
+            free_buffer ? free_buffer->length : 0, &frame);
+    if(ret <= 0)
+    {
+        errno = ret == 0 ? EAGAIN : EIO;
+        return -1;
+    }
+
+    f->next_source_buffer = index + 1;
+    buffer->index = index;
+    buffer->bytesused = frame.bytesused;
+    buffer->sequence = frame.sequence;
+    buffer->flags = V4L2_BUF_FLAG_TIMESTAMP_MONOTONIC | V4L2_BUF_FLAG_TSTAMP_SRC_EOF;
+    buffer->timestamp.tv_sec = frame.timestamp_ns / 1000000000ULL;
+    buffer->timestamp.tv_usec = frame.timestamp_ns % 1000000000ULL / 1000;
+    return 0;
+}
+
+static int _dequeue_buffer(yuv_fetcher_t *f, struct v4l2_buffer *buffer)
+{
+    if(f->source)
+        return _dequeue_source_frame(f, buffer);
+    return xioctl(f->fd, VIDIOC_DQBUF, buffer);
+}
+
+/* Drivers stamp buffers at the start or at the end of the exposure, most of
+ * them with CLOCK_MONOTONIC like us */
+static void _check_timestamps(yuv_fetcher_t *f, const struct v4l2_buffer *buffer)
+{
+    f->timestamp_checked = 1;
+    f->monotonic = (buffer->flags & V4L2_BUF_FLAG_TIMESTAMP_MASK) == V4L2_BUF_FLAG_TIMESTAMP_MONOTONIC;
+    if(!f->monotonic)
+    {
+        ERR("%s : driver timestamps are not monotonic, capture latency is not measured", f->name);
+        return;
+    }
+    INF("%s : frames timestamped at the %s of exposure", f->name,
+            (buffer->flags & V4L2_BUF_FLAG_TSTAMP_SRC_MASK) == V4L2_BUF_FLAG_TSTAMP_SRC_SOE ? "start" : "end");
+}
+
+/* Drops are counted from the gaps in the driver sequence numbers, and from
+ * the frames the driver flags as corrupted */
+static void _account_frame(yuv_fetcher_t *f, const struct v4l2_buffer *buffer)
+{
+    f->dequeue_ns = metrics_now_ns();
+    f->capture_ns = 0;
+    if(!f->timestamp_checked)
+        _check_timestamps(f, buffer);
+    if(f->monotonic)
+    {
+        f->capture_ns = buffer->timestamp.tv_sec * 1000000000ULL + buffer->timestamp.tv_usec * 1000ULL;
+        if(f->capture_ns <= f->dequeue_ns)
+            metrics_record(f->metrics, METRICS_STAGE_CAPTURE_TO_DEQUEUE, f->dequeue_ns - f->capture_ns);
+    }
+
+    metrics_record(f->metrics, METRICS_STAGE_DQBUF_WAIT, f->dequeue_ns - f->wait_start_ns);
+    metrics_add(f->metrics, METRICS_COUNTER_CAPTURED, 1);
+    if(buffer->flags & V4L2_BUF_FLAG_ERROR)
+        metrics_add(f->metrics, METRICS_COUNTER_CORRUPTED, 1);
+    if(f->has_sequence && buffer->sequence - f->last_sequence - 1 < UINT32_MAX / 2)
+        metrics_add(f->metrics, METRICS_COUNTER_LOST, buffer->sequence - f->last_sequence - 1);
+    f->last_sequence = buffer->sequence;
+    f->has_sequence = 1;
+}
+
+/* Dequeue every frame the driver has ready. Called by the capture loop when
+ * the device file descriptor is reported readable. Returns the number of
+ * frames dequeued */
+int yuv_fetcher_process(yuv_fetcher_t *f)
+{
+    struct v4l2_buffer buffer;
+    yuv_frame *frame = NULL;
+    uint64_t start_ns = 0;
+    int nb_frames = 0;
+
+    while(f->streaming)
+    {
+        memset(&buffer, 0, sizeof(struct v4l2_buffer));
+        buffer.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+        buffer.memory = _v4l2_memory(f);
+        if(_dequeue_buffer(f, &buffer) == -1)
+        {
+            if(errno == EAGAIN)
+                return nb_frames;
+            ERR("%s : did not manage to retrieve frame : %s", f->name, strerror(errno));
+            return -1;
+        }
+        DBG("Fetched full frame from buffer %d - %d bytes", buffer.index, buffer.bytesused);
+        nb_frames++;
+        _account_frame(f, &buffer);
+
+        /* Fetcher holds the buffer while consumers run, they may take their
+         * own reference to keep it out of the driver queue */
+        frame = _fill_frame(f, &buffer);
+        f->buffers[buffer.index].refcount = 1;
+        _sync_dmabuf(f, buffer.index, DMA_BUF_SYNC_START);
+
+        if(f->frame_cb)
+        {
+            start_ns = metrics_now_ns();
+            f->frame_cb(frame);
+            metrics_record(f->metrics, METRICS_STAGE_CALLBACK, metrics_now_ns() - start_ns);
+        }
+
+        if(frame->data)
+        {
+            /* If output directory has been provided, hand data to writers */
+            if(f->ring && _keep_frame(f, frame->timestamp_us))
+            {
+                _queue_frame(f, frame->data, frame->bytesused, frame->timestamp_us);
+            }
+
+            /* Local readers attached to the bus get their own copy */
+            if(f->bus)
+            {
+                frame_bus_publish(f->bus, frame->data, frame->bytesused, frame->timestamp_us);
+            }
+        }
+
+        if(yuv_frame_release(frame) == -1)
+            return -1;
+        f->wait_start_ns = metrics_now_ns();
+
+        /* Sources have at most one frame due each time they are ready */
+        if(f->source)
+            break;
+    }
+
+    return nb_frames;
+}
+
+void yuv_frame_acquire(const yuv_frame *frame)
+{
+    __atomic_add_fetch(&frame->fetcher->buffers[frame->index].refcount, 1, __ATOMIC_ACQ_REL);
+}
+
+/* Buffer goes back to the driver once its last holder releases it. Can be
+ * called from any thread */
+int yuv_frame_release(const yuv_frame *frame)
+{
+    yuv_fetcher_t *f = frame->fetcher;
+    unsigned int index = frame->index;
+
+    if(__atomic_sub_fetch(&f->buffers[index].refcount, 1, __ATOMIC_ACQ_REL) > 0)
+        return 0;
+
+    /* After STREAMOFF every buffer is already back to userspace */
+    if(!f->streaming)
+        return 0;
+
+    _sync_dmabuf(f, index, DMA_BUF_SYNC_END);
+    if(_queue_buffer(f, index) == -1)
+    {
+        ERR("Did not manage to put buffer %d back in queue : %s",
+                index, strerror(errno));
+        return -1;
+    }
+    return 0;
+}
+
+int yuv_fetcher_set_memory(yuv_fetcher_t *f, yuv_fetcher_memory memory,
+        const int *dmabuf_fds, unsigned int nb_fds)
+{
+    unsigned int i = 0;
+
+    if(f->buffers)
+    {
+        ERR("Cannot change memory mode once buffers are configured");
+        return -1;
+    }
+
+    if(f->source && memory != YUV_FETCHER_MEMORY_MMAP)
+    {
+        ERR("%s : frame sources only support mmap and userptr memory", f->name);
+        return -1;
+    }
+
+    if(memory == YUV_FETCHER_MEMORY_DMABUF_IMPORT)
+    {
+        if(!dmabuf_fds || nb_fds == 0 || nb_fds > MAX_BUF)
+        {
+            ERR("Invalid dmabufs to import (got %u, max %d)", nb_fds, MAX_BUF);
+            return -1;
+        }
+        for(i = 0; i < nb_fds; i++)
+            f->import_fds[i] = dmabuf_fds[i];
+        f->nb_buffers = nb_fds;
+    }
+    else if(memory == YUV_FETCHER_MEMORY_USERPTR)
+    {
+        ERR("User memory must be given with yuv_fetcher_set_userptr()");
+        return -1;
+    }
+    f->memory = memory;
+
+    return 0;
+}
+
+/* Capture directly into caller owned buffers (e.g. a hugepage backed pool),
+ * which must stay valid until the fetcher is shut down */
+int yuv_fetcher_set_userptr(yuv_fetcher_t *f, void * const *buffers, unsigned int nb_buffers, size_t length)
+{
+    unsigned int i = 0;
+
+    if(f->buffers)
+    {
+        ERR("Cannot change memory mode once buffers are configured");
+        return -1;
+    }
+
+    if(!buffers || nb_buffers == 0 || nb_buffers > MAX_BUF || length < f->frame_size)
+    {
+        ERR("Invalid user buffers (got %u of %zu bytes, max %d)", nb_buffers, length, MAX_BUF);
+        return -1;
+    }
+
+    for(i = 0; i < nb_buffers; i++)
+        f->userptrs[i] = buffers[i];
+    f->userptr_length = length;
+    f->nb_buffers = nb_buffers;
+    f->memory = YUV_FETCHER_MEMORY_USERPTR;
+
+    return 0;
+}
+
+/* Sources only get their file descriptor once started */
+int yuv_fetcher_get_fd(yuv_fetcher_t *f)
+{
+    if(f->source)
+        return frame_source_get_fd(f->source);
+    return f->fd;
+}
+
+const char *yuv_fetcher_get_name(yuv_fetcher_t *f)
+{
+    return f->name;
+}
+
+void yuv_fetcher_stop(yuv_fetcher_t *f)
+{
+    enum v4l2_buf_type type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+
+    if(f->streaming && f->source)
+    {
+        frame_source_stop(f->source);
+        f->streaming = 0;
+        INF("%s : capture stopped", f->name);
+    }
+    else if(f->streaming)
+    {
+        if(xioctl(f->fd, VIDIOC_STREAMOFF, &type) == -1)
+            ERR("Cannot stop capture : %s", strerror(errno));
+        f->streaming = 0;
+        INF("%s : capture stopped", f->name);
+    }
+    _stop_writers(f);
+    _stop_bus(f);
+}
+
+void yuv_fetcher_shutdown(yuv_fetcher_t *f)
+{
+    if(!f)
+        return;
+
+    yuv_fetcher_stop(f);
+    _free_buffers(f);
+    if(f->fd >= 0)
+    {
+        INF("Closing capture device");
+        close(f->fd);
+    }
+    frame_source_destroy(f->source);
+    metrics_destroy(f->metrics);
+    pthread_mutex_destroy(&f->order_lock);
+    pthread_cond_destroy(&f->order_cond);
+    free(f);
+}
+
+/* Timings and drop counters of the device, see metrics.h */
+metrics_t *yuv_fetcher_get_metrics(yuv_fetcher_t *f)
+{
+    return f->metrics;
+}
+
+void yuv_fetcher_register_frame_callback(yuv_fetcher_t *f, yuv_frame_callback_t cb)
+{
+    f->frame_cb = cb;
+}
+
+int yuv_fetcher_set_writer_threads(yuv_fetcher_t *f, int nb_threads)
+{
+    /* 0 means one writer per online CPU */
+    if(nb_threads < 0 || nb_threads > MAX_WRITER_THREADS)
+    {
+        ERR("Invalid number of writer threads %d (must be 0-%d)", nb_threads, MAX_WRITER_THREADS);
+        return -1;
+    }
+    f->nb_writers = nb_threads;
+    return 0;
+}
+
+/* Negotiate the capture format with the driver, which may adjust every
+ * parameter : frames handed to consumers describe the actual format */
+int yuv_fetcher_set_format(yuv_fetcher_t *f, unsigned int width, unsigned int height,
+        uint32_t pixelformat, unsigned int frame_rate)
+{
+    if(f->buffers)
+    {
+        ERR("Cannot change format once buffers are configured");
+        return -1;
+    }
+
+    /* Sources can also produce frames as fast as they are consumed */
+    if(width == 0 || height == 0 || (frame_rate == 0 && !f->source))
+    {
+        ERR("Invalid format %ux%u at %u fps", width, height, frame_rate);
+        return -1;
+    }
+
+    if(f->source)
+        return _set_source_format(f, width, height, pixelformat, frame_rate);
+
+    if(_set_format(f, width, height, pixelformat) != 0 ||
+       _set_frame_rate(f, frame_rate) != 0)
+        return -1;
+
+    return 0;
+}
+
+/* Let the device and the requested output pick the pixel format : see
+ * format_negotiate() */
+int yuv_fetcher_negotiate_format(yuv_fetcher_t *f, int jpeg_output, unsigned int width,
+        unsigned int height, unsigned int frame_rate)
+{
+    format_choice choice;
+
+    /* Sources pick their own default format */
+    if(f->source)
+        return yuv_fetcher_set_format(f, width, height, 0, frame_rate);
+
+    if(format_negotiate(f->fd, f->name, jpeg_output ? FORMAT_OUTPUT_JPEG : FORMAT_OUTPUT_RAW,
+                width, height, frame_rate, &choice) != 0)
+        return -1;
+
+    return yuv_fetcher_set_format(f, choice.width, choice.height, choice.pixelformat, choice.frame_rate);
+}
+
+/* Size of a buffer holding one frame in the negotiated format */
+size_t yuv_fetcher_get_frame_size(yuv_fetcher_t *f)
+{
+    return f->frame_size;
+}
+
+/* Number of driver allocated buffers, in mmap and export modes. Import and
+ * userptr modes use as many buffers as given */
+int yuv_fetcher_set_buffer_count(yuv_fetcher_t *f, unsigned int nb_buffers)
+{
+    if(f->buffers)
+    {
+        ERR("Cannot change buffer count once buffers are configured");
+        return -1;
+    }
+
+    if(nb_buffers < 2 || nb_buffers > MAX_BUF)
+    {
+        ERR("Invalid number of buffers %u (must be 2-%d)", nb_buffers, MAX_BUF);
+        return -1;
+    }
+    f->nb_buffers = nb_buffers;
+    return 0;
+}
+
+/* Must be called before yuv_fetcher_start(). Only one frame out of every_n,
+ * and at most max_fps frames per second, are recorded. 0 disables either
+ * limit. Frame callbacks and the frame bus still get every frame */
+void yuv_fetcher_set_decimation(yuv_fetcher_t *f, unsigned int every_n, unsigned int max_fps)
+{
+    f->decimation = every_n;
+    f->record_fps = max_fps;
+}
+
+/* Records only a region of the frame, downscaled by 1, 2 or 4. A width or
+ * height of 0 selects the whole frame. Must be called once the format is
+ * set, before buffers are configured : the driver crops, and scales, when it
+ * can, which changes the frame size for every consumer. Writers crop and
+ * downscale whatever the driver could not */
+int yuv_fetcher_set_roi(yuv_fetcher_t *f, unsigned int x, unsigned int y,
+        unsigned int width, unsigned int height, unsigned int scale)
+{
+    scale_rect roi;
+    int ret = 0;
+
+    if(f->buffers || f->frame_size == 0)
+    {
+        ERR("Region of interest must be set after the format, before buffers are configured");
+        return -1;
+    }
+
+    if(scale != 1 && scale != 2 && scale != 4)
+    {
+        ERR("Invalid downscale factor %u (must be 1, 2 or 4)", scale);
+        return -1;
+    }
+
+    if(width == 0 || height == 0)
+    {
+        x = y = 0;
+        width = f->width;
+        height = f->height;
+    }
+    if(x >= f->width || y >= f->height || width > f->width - x || height > f->height - y)
+    {
+        ERR("Region %ux%u+%u+%u is outside of the %ux%u frame", width, height, x, y, f->width, f->height);
+        return -1;
+    }
+
+    /* Chroma is subsampled by 2 : output frames hold whole chroma samples */
+    roi.x = x & ~1U;
+    roi.y = y & ~1U;
+    roi.width = (width + x - roi.x) / (2 * scale) * (2 * scale);
+    roi.height = (height + y - roi.y) / (2 * scale) * (2 * scale);
+    if(roi.width == 0 || roi.height == 0)
+    {
+        ERR("Region %ux%u+%u+%u is too small", width, height, x, y);
+        return -1;
+    }
+
+    memset(&f->roi, 0, sizeof(f->roi));
+    f->scale = scale;
+    if(roi.width == f->width && roi.height == f->height)
+    {
+        if(scale == 1)
+            return 0;
+    }
+    else
+    {
+        ret = f->source ? -1 : _crop_in_hardware(f, &roi, scale);
+        if(ret == -2)
+            return -1;
+        if(ret == 0)
+        {
+            if(f->roi.width)
+            {
+                INF("%s : writers downscale by %u", f->name, scale);
+            }
+            return 0;
+        }
+    }
+
+    if(f->pixelformat != V4L2_PIX_FMT_NV12 && f->pixelformat != V4L2_PIX_FMT_NV21 &&
+       f->pixelformat != V4L2_PIX_FMT_YUYV && f->pixelformat != V4L2_PIX_FMT_MJPEG)
+    {
+        ERR("%s : cannot crop frames of this pixel format", f->name);
+        return -1;
+    }
+    f->roi = roi;
+    INF("%s : writers crop to %ux%u+%u+%u and downscale by %u", f->name,
+            roi.width, roi.height, roi.x, roi.y, scale);
+    return 0;
+}
+
+/* Must be called before yuv_fetcher_start(). Each thumbnail is the recorded
+ * frame downscaled by 2 or 4, in the output format, written to its own sink as
+ * <device>_thumb<factor> */
+int yuv_fetcher_set_thumbnails(yuv_fetcher_t *f, const unsigned int *factors, int nb_thumbs)
+{
+    int i = 0;
+
+    if(nb_thumbs < 0 || nb_thumbs > MAX_THUMBNAILS)
+    {
+        ERR("Invalid number of thumbnails %d (at most %d)", nb_thumbs, MAX_THUMBNAILS);
+        return -1;
+    }
+    for(i = 0; i < nb_thumbs; i++)
+    {
+        if(factors[i] != 2 && factors[i] != 4)
+        {
+            ERR("Invalid thumbnail downscale factor %u (must be 2 or 4)", factors[i]);
+            return -1;
+        }
+        f->thumb_factors[i] = factors[i];
+    }
+    f->nb_thumbs = nb_thumbs;
+    return 0;
+}
+
+/* Must be called before yuv_fetcher_start() */
+void yuv_fetcher_set_sink(yuv_fetcher_t *f, frame_sink_type type)
+{
+    f->sink_type = type;
+}
+
+/* Must be called before yuv_fetcher_start() */
+void yuv_fetcher_set_segment_limits(yuv_fetcher_t *f, size_t size, unsigned int duration_s)
+{
+    f->segment_size = size;
+    f->segment_duration_s = duration_s;
+}
+
+/* Must be called before yuv_fetcher_start(). Frames are then only written
+ * around events, see yuv_fetcher_trigger() */
+void yuv_fetcher_set_history(yuv_fetcher_t *f, unsigned int pre_s, unsigned int post_s, size_t budget)
+{
+    f->history = 1;
+    f->history_pre_s = pre_s;
+    f->history_post_s = post_s;
+    f->history_budget = budget;
+}
+
+/* Must be called before yuv_fetcher_start(). JPEG quality of the recorded
+ * frames, adapted between min and max to keep up with the recorded frame
+ * rate and, if not 0, to use at most cpu_budget percent of one CPU */
+int yuv_fetcher_set_quality(yuv_fetcher_t *f, int min_quality, int max_quality, unsigned int cpu_budget)
+{
+    if(min_quality < 1 || max_quality > 100 || min_quality > max_quality)
+    {
+        ERR("Invalid JPEG quality range %d-%d (must be within 1-100)", min_quality, max_quality);
+        return -1;
+    }
+    if(cpu_budget && min_quality == max_quality)
+    {
+        ERR("A CPU budget needs a JPEG quality range to adapt within");
+        return -1;
+    }
+    f->min_quality = min_quality;
+    f->max_quality = max_quality;
+    f->cpu_budget = cpu_budget;
+    return 0;
+}
+
+/* Must be called before yuv_fetcher_start(). Timings of every recorded frame
+ * are written to <output_dir>/<device>.trace, see frame_trace.h */
+void yuv_fetcher_set_trace(yuv_fetcher_t *f, int enable)
+{
+    f->trace_file = enable;
+}
+
+/* Async-signal-safe : can be called from a signal handler */
+void yuv_fetcher_trigger(yuv_fetcher_t *f)
+{
+    int i = 0;
+
+    if(f->sink)
+        frame_sink_trigger(f->sink);
+    for(i = 0; i < f->nb_thumbs; i++)
+    {
+        if(f->thumb_sinks[i])
+            frame_sink_trigger(f->thumb_sinks[i]);
+    }
+}
+
+/* Must be called before yuv_fetcher_start() */
+void yuv_fetcher_set_publish(yuv_fetcher_t *f, int publish)
+{
+    f->publish = publish;
+}
+
+void yuv_fetcher_print_avail_formats(yuv_fetcher_t *f)
+{
+    struct v4l2_fmtdesc fmt_desc;
+
+    if(f->fd != -1)
+    {
+        memset(&fmt_desc, 0, sizeof(fmt_desc));
+        fmt_desc.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+        while(xioctl(f->fd, VIDIOC_ENUM_FMT, &fmt_desc) == 0)
+        {
+            INF("Supported format : %s (code %c%c%c%c)", fmt_desc.description,
+                    fmt_desc.pixelformat & 0xFF,
+                    (fmt_desc.pixelformat >> 8) & 0xFF,
+                    (fmt_desc.pixelformat >> 16) & 0xFF,
+                    (fmt_desc.pixelformat >> 24) & 0xFF);
+            fmt_desc.index++;
+        }
+
+        if(errno != EINVAL)
+        {
+            ERR("Error while enumerating formats : %s", strerror(errno));
+        }
+    }
+}
+
+void yuv_fetcher_print_controls(yuv_fetcher_t *f)
+{
+    /* Sources have no controls */
+    if(f->source)
+        return;
+
+    /* List all available controls */
+    if(_enumerate_controls(f) != 0)
+    {
+        ERR("Cannot display all available controls");
+    }
+}
+
+void yuv_fetcher_print_capabilities(yuv_fetcher_t *f)
 {
     struct v4l2_capability cap;
-    if(xioctl(_webcam_fd, VIDIOC_QUERYCAP, &cap) == -1)
+
+    if(f->source)
+    {
+        INF("%s : software frame source", f->name);
+        return;
+    }
+    if(xioctl(f->fd, VIDIOC_QUERYCAP, &cap) == -1)
     {
         ERR("Cannot query video capture device capabilities : %s", strerror(errno));
         return;
@@ -1,15 +1,78 @@
 #ifndef YUV_FETCHER_H
 #define YUV_FETCHER_H
 
-typedef void (*yuv_data_callback_t)(void *);
-
-int yuv_fetcher_init(int print_cap, char *device);
-int yuv_fetcher_start(char * output_dir, char *format);
-void yuv_fetcher_stop(void);
-void yuv_fetcher_shutdown(void);
-void yuv_fetcher_register_data_callback(yuv_data_callback_t cb);
-void yuv_fetcher_print_avail_formats(void);
-void yuv_fetcher_print_controls(void);
-void yuv_fetcher_print_capabilities(void);
+#include <stdint.h>
+#include <stddef.h>
+
+#include "frame_sink.h"
+#include "metrics.h"
+
+typedef struct yuv_fetcher yuv_fetcher_t;
+
+/* One captured frame, handed to the frame callback. The capture buffer goes
+ * back to the driver when the callback returns, unless yuv_frame_acquire() has
+ * been called : the frame then stays valid, and out of the driver queue, until
+ * the matching yuv_frame_release(), which can be called from any thread */
+typedef struct
+{
+    yuv_fetcher_t *fetcher;
+    unsigned int index;         /* V4L2 buffer index */
+    const uint8_t *data;        /* NULL if the buffer is not CPU mapped */
+    int dmabuf_fd;              /* -1 if the buffer is not a dmabuf */
+    size_t bytesused;
+    uint32_t width;
+    uint32_t height;
+    uint32_t stride;            /* Bytes per line of the first plane */
+    uint32_t pixelformat;       /* V4L2_PIX_FMT_* */
+    uint32_t sequence;          /* Driver frame counter */
+    uint32_t flags;             /* V4L2_BUF_FLAG_* */
+    uint64_t timestamp_us;      /* Capture time, CLOCK_MONOTONIC */
+} yuv_frame;
+
+typedef void (*yuv_frame_callback_t)(const yuv_frame *frame);
+
+typedef enum
+{
+    YUV_FETCHER_MEMORY_MMAP,            /* Driver buffers, CPU access only */
+    YUV_FETCHER_MEMORY_MMAP_EXPORT,     /* Driver buffers, also exported as dmabufs */
+    YUV_FETCHER_MEMORY_DMABUF_IMPORT,   /* Caller allocated dmabufs */
+    YUV_FETCHER_MEMORY_USERPTR,         /* Caller allocated memory */
+} yuv_fetcher_memory;
+
+yuv_fetcher_t *yuv_fetcher_init(int full_init, char *device);
+int yuv_fetcher_start(yuv_fetcher_t *f, char * output_dir, char *format);
+int yuv_fetcher_process(yuv_fetcher_t *f);
+int yuv_fetcher_get_fd(yuv_fetcher_t *f);
+const char *yuv_fetcher_get_name(yuv_fetcher_t *f);
+metrics_t *yuv_fetcher_get_metrics(yuv_fetcher_t *f);
+void yuv_fetcher_stop(yuv_fetcher_t *f);
+void yuv_fetcher_shutdown(yuv_fetcher_t *f);
+void yuv_fetcher_register_frame_callback(yuv_fetcher_t *f, yuv_frame_callback_t cb);
+int yuv_fetcher_set_writer_threads(yuv_fetcher_t *f, int nb_threads);
+void yuv_fetcher_set_publish(yuv_fetcher_t *f, int publish);
+void yuv_fetcher_set_sink(yuv_fetcher_t *f, frame_sink_type type);
+void yuv_fetcher_set_segment_limits(yuv_fetcher_t *f, size_t size, unsigned int duration_s);
+void yuv_fetcher_set_history(yuv_fetcher_t *f, unsigned int pre_s, unsigned int post_s, size_t budget);
+void yuv_fetcher_trigger(yuv_fetcher_t *f);
+void yuv_fetcher_set_trace(yuv_fetcher_t *f, int enable);
+int yuv_fetcher_set_quality(yuv_fetcher_t *f, int min_quality, int max_quality, unsigned int cpu_budget);
+void yuv_fetcher_set_decimation(yuv_fetcher_t *f, unsigned int every_n, unsigned int max_fps);
+int yuv_fetcher_set_format(yuv_fetcher_t *f, unsigned int width, unsigned int height,
+        uint32_t pixelformat, unsigned int frame_rate);
+int yuv_fetcher_negotiate_format(yuv_fetcher_t *f, int jpeg_output, unsigned int width,
+        unsigned int height, unsigned int frame_rate);
+int yuv_fetcher_set_roi(yuv_fetcher_t *f, unsigned int x, unsigned int y,
+        unsigned int width, unsigned int height, unsigned int scale);
+int yuv_fetcher_set_thumbnails(yuv_fetcher_t *f, const unsigned int *factors, int nb_thumbs);
+size_t yuv_fetcher_get_frame_size(yuv_fetcher_t *f);
+int yuv_fetcher_set_buffer_count(yuv_fetcher_t *f, unsigned int nb_buffers);
+int yuv_fetcher_set_memory(yuv_fetcher_t *f, yuv_fetcher_memory memory,
+        const int *dmabuf_fds, unsigned int nb_fds);
+int yuv_fetcher_set_userptr(yuv_fetcher_t *f, void * const *buffers, unsigned int nb_buffers, size_t length);
+void yuv_frame_acquire(const yuv_frame *frame);
+int yuv_frame_release(const yuv_frame *frame);
+void yuv_fetcher_print_avail_formats(yuv_fetcher_t *f);
+void yuv_fetcher_print_controls(yuv_fetcher_t *f);
+void yuv_fetcher_print_capabilities(yuv_fetcher_t *f);
 
 #endif
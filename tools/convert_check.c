@@ -0,0 +1,119 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "utils.h"
+#include "convert.h"
+
+/* Padding added to the strides, odd so that rows are misaligned */
+#define SRC_STRIDE_PADDING  37
+#define DST_STRIDE_PADDING  13
+#define DST_GUARD           0xA5
+
+static const int _widths[] = {2, 14, 30, 1282};
+static const int _heights[] = {1, 3, 8};
+
+static const struct
+{
+    const char *name;
+    convert_src_fmt fmt;
+} _srcs[] = {
+    {"nv21", CONVERT_SRC_NV21},
+    {"nv12", CONVERT_SRC_NV12},
+    {"yuyv", CONVERT_SRC_YUYV},
+};
+
+static const struct
+{
+    const char *name;
+    convert_dst_fmt fmt;
+    int bpp;
+} _dsts[] = {
+    {"rgb", CONVERT_DST_RGB, 3},
+    {"rgba", CONVERT_DST_RGBA, 4},
+    {"ycbcr", CONVERT_DST_YCBCR, 3},
+};
+
+#define NB_ITEMS(a)         (sizeof(a) / sizeof(a[0]))
+
+/* Returns 0 if the kernels of isa write exactly what the scalar ones do, rows
+ * padding included (which neither must touch) */
+static int _check_case(convert_isa isa, int s, int d, int width, int height)
+{
+    int src_stride = (_srcs[s].fmt == CONVERT_SRC_YUYV ? 2 * width : width) + SRC_STRIDE_PADDING;
+    int src_lines = _srcs[s].fmt == CONVERT_SRC_YUYV ? height : height + (height + 1) / 2;
+    int dst_stride = width * _dsts[d].bpp + DST_STRIDE_PADDING;
+    size_t src_size = (size_t)src_stride * src_lines;
+    size_t dst_size = (size_t)dst_stride * height;
+    uint8_t *src = malloc(src_size);
+    uint8_t *ref = malloc(dst_size);
+    uint8_t *out = malloc(dst_size);
+    size_t i = 0;
+    int ret = -1;
+
+    if(!src || !ref || !out)
+    {
+        ERR("Cannot allocate conversion buffers");
+        goto check_end;
+    }
+
+    /* Full range of values, saturation included */
+    srand(width * 31 + height);
+    for(i = 0; i < src_size; i++)
+        src[i] = rand();
+    memset(ref, DST_GUARD, dst_size);
+    memset(out, DST_GUARD, dst_size);
+
+    if(convert_frame_isa(CONVERT_ISA_SCALAR, _srcs[s].fmt, src, src_stride, _dsts[d].fmt, ref,
+                dst_stride, width, height) != 0 ||
+       convert_frame_isa(isa, _srcs[s].fmt, src, src_stride, _dsts[d].fmt, out,
+                dst_stride, width, height) != 0)
+        goto check_end;
+
+    for(i = 0; i < dst_size && ref[i] == out[i]; i++);
+    if(i < dst_size)
+    {
+        ERR("%s %s>%s %dx%d differs from the scalar output at line %zu, byte %zu : %u instead of %u",
+                convert_isa_name(isa), _srcs[s].name, _dsts[d].name, width, height,
+                i / dst_stride, i % dst_stride, out[i], ref[i]);
+        goto check_end;
+    }
+    ret = 0;
+
+check_end:
+    free(src);
+    free(ref);
+    free(out);
+    return ret;
+}
+
+/* Checks the conversion kernels of every instruction set the CPU supports
+ * against the scalar reference, bit for bit */
+int main(void)
+{
+    unsigned int s, d, w, h;
+    int nb_cases = 0, nb_failed = 0;
+    int isa;
+
+    for(isa = CONVERT_ISA_SCALAR + 1; isa < CONVERT_ISA_COUNT; isa++)
+    {
+        if(!convert_isa_supported(isa))
+        {
+            INF("%s : not supported, skipped", convert_isa_name(isa));
+            continue;
+        }
+        for(s = 0; s < NB_ITEMS(_srcs); s++)
+            for(d = 0; d < NB_ITEMS(_dsts); d++)
+                for(w = 0; w < NB_ITEMS(_widths); w++)
+                    for(h = 0; h < NB_ITEMS(_heights); h++)
+                    {
+                        nb_cases++;
+                        if(_check_case(isa, s, d, _widths[w], _heights[h]) != 0)
+                            nb_failed++;
+                    }
+        INF("%s : checked", convert_isa_name(isa));
+    }
+
+    INF("%d conversion cases, %d differing from the scalar output", nb_cases, nb_failed);
+    return nb_failed ? 1 : 0;
+}
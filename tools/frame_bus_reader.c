@@ -0,0 +1,149 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <signal.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <string.h>
+#include <time.h>
+
+#include "utils.h"
+#include "frame_bus.h"
+
+#define READ_TIMEOUT_MS     1000
+
+static volatile sig_atomic_t _run = 1;
+static int _latest = 0;
+static int _nb_frames = -1;
+static int _delay_ms = 0;
+static char _output[OUTPUT_DIR_NAME_MAX_SIZE] = {0};
+
+static void _usage(char *progname)
+{
+    fprintf(stderr, "Usage : %s [-l] [-n frames] [-o file] [-s delay] bus\n", progname);
+    fprintf(stderr, "Options :\n");
+    fprintf(stderr, "  -h           prints this help\n");
+    fprintf(stderr, "  -l           only read the latest frame instead of every frame\n");
+    fprintf(stderr, "  -n           number of frames to read before quitting (default: infinite)\n");
+    fprintf(stderr, "  -o           file to dump the last frame read into\n");
+    fprintf(stderr, "  -s           simulated processing time per frame in ms (default: 0)\n");
+}
+
+static void _int_handler(int sig)
+{
+    (void)sig;
+    _run = 0;
+}
+
+static uint64_t _now_us(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static void _dump_frame(const frame_bus_frame *frame)
+{
+    FILE *file = fopen(_output, "w");
+
+    if(!file)
+    {
+        ERR("Cannot open %s", _output);
+        return;
+    }
+    fwrite(frame->data, frame->size, 1, file);
+    fclose(file);
+}
+
+int main(int argc, char *argv[])
+{
+    frame_bus_reader_t *reader = NULL;
+    frame_bus_frame frame;
+    int c = 0;
+    int ret = 0;
+    int nb_read = 0;
+    uint64_t last_seq = 0;
+
+    while ((c = getopt (argc, argv, "hln:o:s:")) != -1)
+    {
+        switch (c)
+        {
+            case 'h':
+                _usage(argv[0]);
+                return 0;
+            case 'l':
+                _latest = 1;
+                break;
+            case 'n':
+                _nb_frames = atoi(optarg);
+                break;
+            case 'o':
+                strncpy(_output, optarg, OUTPUT_DIR_NAME_MAX_SIZE - 1);
+                break;
+            case 's':
+                _delay_ms = atoi(optarg);
+                break;
+            default:
+                _usage(argv[0]);
+                return 1;
+        }
+    }
+
+    if(optind != argc - 1)
+    {
+        _usage(argv[0]);
+        return 1;
+    }
+
+    signal(SIGINT, _int_handler);
+
+    reader = frame_bus_reader_attach(argv[optind]);
+    if(!reader)
+        return 1;
+
+    while(_run && nb_read != _nb_frames)
+    {
+        if(_latest)
+        {
+            /* Poll at the pace of our own processing */
+            ret = frame_bus_reader_latest(reader, &frame);
+            if(ret != 0 || (nb_read > 0 && frame.seq == last_seq))
+            {
+                usleep(1000000 / DEFAULT_FRAME_RATE);
+                continue;
+            }
+        }
+        else
+        {
+            ret = frame_bus_reader_next(reader, &frame, READ_TIMEOUT_MS);
+            if(ret == 1)
+                continue;
+            if(ret == -1)
+            {
+                INF("Producer is gone");
+                break;
+            }
+        }
+
+        /* Frame is used in place, then checked for consistency */
+        if(_output[0] != 0)
+            _dump_frame(&frame);
+        if(_delay_ms)
+            usleep(_delay_ms * 1000);
+        if(frame_bus_reader_validate(reader, &frame) != 0)
+        {
+            INF("Frame %lu overwritten while being read", (unsigned long)frame.seq);
+            continue;
+        }
+
+        INF("Frame %lu : %zu bytes, %lu us after capture, %lu frames lost",
+                (unsigned long)frame.seq, frame.size,
+                (unsigned long)(_now_us() - frame.timestamp_us),
+                (unsigned long)frame_bus_reader_get_lost(reader));
+        last_seq = frame.seq;
+        nb_read++;
+    }
+
+    frame_bus_reader_detach(reader);
+    return 0;
+}
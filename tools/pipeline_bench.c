@@ -0,0 +1,706 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <getopt.h>
+#include <time.h>
+#include <poll.h>
+#include <dirent.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/uio.h>
+#include <linux/videodev2.h>
+
+#include "utils.h"
+#include "convert.h"
+#include "jpeg_encoder.h"
+#include "frame_source.h"
+#include "frame_sink.h"
+#include "yuv_fetcher.h"
+#include "metrics.h"
+
+#define MAX_SIZES           8
+#define MAX_QUALITIES       8
+#define DEFAULT_FRAMES      100     /* Per measure, for 720p frames */
+#define DEFAULT_DURATION_S  3
+#define REFERENCE_PIXELS    (1280 * 720)
+#define BENCH_NAME_MAX_SIZE 96
+
+typedef struct
+{
+    unsigned int width;
+    unsigned int height;
+} bench_size;
+
+typedef struct
+{
+    char name[BENCH_NAME_MAX_SIZE];
+    unsigned long frames;
+    uint64_t elapsed_ns;
+    unsigned int width;
+    unsigned int height;
+    unsigned long allocations;
+    unsigned long captured;     /* Capture runs only */
+    unsigned long dropped;
+} bench_result;
+
+static bench_size _sizes[MAX_SIZES] = {{640, 480}, {1280, 720}, {1920, 1080}, {3840, 2160}};
+static int _nb_sizes = 4;
+static bench_size _frame_size = {DEFAULT_FRAME_WIDTH, DEFAULT_FRAME_HEIGHT};   /* Sink and capture */
+static int _qualities[MAX_QUALITIES] = {50, 75, 90};
+static int _nb_qualities = 3;
+static unsigned long _frames = DEFAULT_FRAMES;
+static unsigned int _duration_s = DEFAULT_DURATION_S;
+static char _dir[OUTPUT_DIR_NAME_MAX_SIZE] = "/dev/shm";
+static char _output[OUTPUT_DIR_NAME_MAX_SIZE] = {0};
+static const char *_pattern = "moving";
+static FILE *_json = NULL;
+static int _nb_results = 0;
+
+/* Every allocation goes through these, libjpeg's included, so that steady
+ * state allocations can be counted */
+#ifdef __GLIBC__
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t nb, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+extern void *__libc_memalign(size_t alignment, size_t size);
+extern void __libc_free(void *ptr);
+
+static unsigned long _nb_allocations = 0;
+
+void *malloc(size_t size)
+{
+    __atomic_add_fetch(&_nb_allocations, 1, __ATOMIC_RELAXED);
+    return __libc_malloc(size);
+}
+
+void *calloc(size_t nb, size_t size)
+{
+    __atomic_add_fetch(&_nb_allocations, 1, __ATOMIC_RELAXED);
+    return __libc_calloc(nb, size);
+}
+
+void *realloc(void *ptr, size_t size)
+{
+    __atomic_add_fetch(&_nb_allocations, 1, __ATOMIC_RELAXED);
+    return __libc_realloc(ptr, size);
+}
+
+int posix_memalign(void **ptr, size_t alignment, size_t size)
+{
+    __atomic_add_fetch(&_nb_allocations, 1, __ATOMIC_RELAXED);
+    *ptr = __libc_memalign(alignment, size);
+    return *ptr ? 0 : ENOMEM;
+}
+
+void *aligned_alloc(size_t alignment, size_t size)
+{
+    __atomic_add_fetch(&_nb_allocations, 1, __ATOMIC_RELAXED);
+    return __libc_memalign(alignment, size);
+}
+
+void free(void *ptr)
+{
+    __libc_free(ptr);
+}
+
+static unsigned long _get_allocations(void)
+{
+    return __atomic_load_n(&_nb_allocations, __ATOMIC_RELAXED);
+}
+#else
+static unsigned long _get_allocations(void)
+{
+    return 0;
+}
+#endif
+
+static void _usage(char *progname)
+{
+    fprintf(stderr, "Usage : %s <encode|convert|sink|capture> [-s WxH[,WxH...]] [-q quality[,quality...]] [-n frames] [-t seconds] [-d directory] [-p pattern] [-o file]\n", progname);
+    fprintf(stderr, "Benchmarks :\n");
+    fprintf(stderr, "  encode       JPEG encoding of NV12 and YUYV frames, for every size and quality\n");
+    fprintf(stderr, "  convert      the original floating point yuv2rgb() as a baseline, yuv2rgb() and the conversion kernels of every supported instruction set\n");
+    fprintf(stderr, "  sink         raw and JPEG frames written by the files and segments sinks, in the directory\n");
+    fprintf(stderr, "  capture      synthetic capture to raw and JPEG segments in the directory, as fast as possible\n");
+    fprintf(stderr, "Options :\n");
+    fprintf(stderr, "  -d           output directory of sink and capture (default: /dev/shm)\n");
+    fprintf(stderr, "  -h           prints this help\n");
+    fprintf(stderr, "  -n           frames per measure, for 720p frames : scaled with the frame size (default: %d)\n", DEFAULT_FRAMES);
+    fprintf(stderr, "  -o           write results as JSON to this file (default: <benchmark>.json)\n");
+    fprintf(stderr, "  -p           synthetic pattern : 'bars', 'noise' or 'moving' (default: moving)\n");
+    fprintf(stderr, "  -q           JPEG qualities (default: 50,75,90)\n");
+    fprintf(stderr, "  -s           frame sizes (default: 640x480,1280x720,1920x1080,3840x2160), sink and capture only use the first one (default: %dx%d)\n",
+            DEFAULT_FRAME_WIDTH, DEFAULT_FRAME_HEIGHT);
+    fprintf(stderr, "  -t           capture duration in seconds (default: %d)\n", DEFAULT_DURATION_S);
+}
+
+static uint64_t _now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static unsigned long _get_frames(unsigned int width, unsigned int height)
+{
+    unsigned long frames = _frames * REFERENCE_PIXELS / ((unsigned long)width * height);
+
+    return frames ? frames : 1;
+}
+
+static void _report(const bench_result *r)
+{
+    double seconds = r->elapsed_ns / 1e9;
+    double fps = seconds > 0 ? r->frames / seconds : 0;
+    double ns_per_pixel = r->frames ? (double)r->elapsed_ns / r->frames / ((double)r->width * r->height) : 0;
+
+    printf("%-40s %9.1f fps %8.3f ns/pixel %8lu allocations\n", r->name, fps, ns_per_pixel, r->allocations);
+
+    fprintf(_json, "%s\n    {\"name\": \"%s\", \"width\": %u, \"height\": %u, \"frames\": %lu, "
+            "\"fps\": %.2f, \"ns_per_pixel\": %.4f, \"allocations\": %lu",
+            _nb_results ? "," : "", r->name, r->width, r->height, r->frames, fps, ns_per_pixel,
+            r->allocations);
+    if(r->captured)
+        fprintf(_json, ", \"captured\": %lu, \"dropped\": %lu", r->captured, r->dropped);
+    fprintf(_json, "}");
+    _nb_results++;
+}
+
+/* One frame of the synthetic pattern */
+static uint8_t *_make_frame(uint32_t pixelformat, unsigned int width, unsigned int height, size_t *size)
+{
+    char device[DEVICE_NAME_MAX_SIZE] = {0};
+    frame_source_format format;
+    frame_source_frame frame;
+    frame_source_t *source = NULL;
+    uint8_t *buf = NULL;
+
+    snprintf(device, DEVICE_NAME_MAX_SIZE, "%s:%s", FRAME_SOURCE_SYNTHETIC, _pattern);
+    memset(&format, 0, sizeof(format));
+    format.pixelformat = pixelformat;
+    format.width = width;
+    format.height = height;
+    source = frame_source_create(device);
+    if(!source || frame_source_set_format(source, &format) != 0 || frame_source_start(source) != 0)
+        goto frame_end;
+
+    buf = malloc(format.frame_size);
+    if(!buf || frame_source_next(source, buf, format.frame_size, &frame) != 1)
+    {
+        ERR("Cannot generate a %ux%u frame", width, height);
+        free(buf);
+        buf = NULL;
+        goto frame_end;
+    }
+    *size = format.frame_size;
+
+frame_end:
+    frame_source_destroy(source);
+    return buf;
+}
+
+static int _bench_encode_case(jpeg_encoder_input input, const char *input_name, uint32_t pixelformat,
+        unsigned int width, unsigned int height)
+{
+    jpeg_encoder_t *enc = NULL;
+    bench_result r;
+    unsigned long size = 0, i = 0;
+    size_t frame_size = 0;
+    uint8_t *frame = _make_frame(pixelformat, width, height, &frame_size);
+    uint64_t start = 0;
+    int q = 0, ret = -1;
+
+    enc = jpeg_encoder_create(input, width, height, pixelformat == V4L2_PIX_FMT_YUYV ? width * 2 : width);
+    if(!frame || !enc)
+        goto encode_end;
+
+    for(q = 0; q < _nb_qualities; q++)
+    {
+        memset(&r, 0, sizeof(r));
+        snprintf(r.name, BENCH_NAME_MAX_SIZE, "encode %s %ux%u q%d", input_name, width, height, _qualities[q]);
+        r.width = width;
+        r.height = height;
+        r.frames = _get_frames(width, height);
+        if(jpeg_encoder_set_quality(enc, _qualities[q]) != 0)
+            goto encode_end;
+        /* Output buffer settles on the first frame */
+        jpeg_encoder_encode_frame(enc, frame, &size);
+
+        r.allocations = _get_allocations();
+        start = _now_ns();
+        for(i = 0; i < r.frames; i++)
+        {
+            if(!jpeg_encoder_encode_frame(enc, frame, &size))
+                goto encode_end;
+        }
+        r.elapsed_ns = _now_ns() - start;
+        r.allocations = _get_allocations() - r.allocations;
+        _report(&r);
+    }
+    ret = 0;
+
+encode_end:
+    jpeg_encoder_destroy(enc);
+    free(frame);
+    return ret;
+}
+
+static int _bench_encode(void)
+{
+    int i = 0, ret = 0;
+
+    for(i = 0; i < _nb_sizes; i++)
+    {
+        if(_bench_encode_case(JPEG_ENCODER_INPUT_NV12, "nv12", V4L2_PIX_FMT_NV12,
+                    _sizes[i].width, _sizes[i].height) != 0 ||
+           _bench_encode_case(JPEG_ENCODER_INPUT_YUYV, "yuyv", V4L2_PIX_FMT_YUYV,
+                    _sizes[i].width, _sizes[i].height) != 0)
+            ret = -1;
+    }
+    return ret;
+}
+
+typedef struct
+{
+    const char *name;
+    convert_src_fmt src_fmt;
+    uint32_t pixelformat;
+    convert_dst_fmt dst_fmt;
+    unsigned int dst_bpp;
+} convert_case;
+
+static const convert_case _convert_cases[] =
+{
+    {"nv21>rgb", CONVERT_SRC_NV21, V4L2_PIX_FMT_NV21, CONVERT_DST_RGB, 3},
+    {"nv12>rgba", CONVERT_SRC_NV12, V4L2_PIX_FMT_NV12, CONVERT_DST_RGBA, 4},
+    {"yuyv>rgb", CONVERT_SRC_YUYV, V4L2_PIX_FMT_YUYV, CONVERT_DST_RGB, 3},
+    {"nv12>ycbcr", CONVERT_SRC_NV12, V4L2_PIX_FMT_NV12, CONVERT_DST_YCBCR, 3},
+};
+
+/* yuv2rgb() now goes through the conversion kernels : its original floating
+ * point loop is kept here as the baseline they are measured against */
+static void _yuv2rgb_legacy(uint8_t in[], uint8_t out[], int width, int height)
+{
+    int total = width * height;
+    int Y, Cb = 0, Cr = 0, index = 0;
+    float R, G, B;
+    int x, y;
+
+    for (y = 0; y < height; y++)
+    {
+        for (x = 0; x < width; x++)
+        {
+            Y = in[y * width + x];
+            if (Y < 0) Y += 255;
+
+            if ((x & 1) == 0)
+            {
+                Cr = in[(y >> 1) * (width) + x + total];
+                Cb = in[(y >> 1) * (width) + x + total + 1];
+                if (Cb < 0)
+                    Cb += 127;
+                else
+                    Cb -= 128;
+                if (Cr < 0)
+                    Cr += 127;
+                else
+                    Cr -= 128;
+            }
+
+            R = Y + 1.403 * Cr;
+            G = Y - 0.444 * Cb - 0.714 * Cr;
+            B = Y + 1.771 * Cb;
+
+            if (R < 0) R = 0; else if (R > 255) R = 255;
+            if (G < 0) G = 0; else if (G > 255) G = 255;
+            if (B < 0) B = 0; else if (B > 255) B = 255;
+            out[index++] = R;
+            out[index++] = G;
+            out[index++] = B;
+        }
+    }
+}
+
+/* Kernels measured besides those of convert_frame_isa() */
+#define BENCH_YUV2RGB           CONVERT_ISA_COUNT
+#define BENCH_YUV2RGB_LEGACY    (CONVERT_ISA_COUNT + 1)
+
+static int _bench_convert_case(const convert_case *c, int isa, unsigned int width, unsigned int height)
+{
+    bench_result r;
+    size_t frame_size = 0;
+    uint8_t *frame = _make_frame(c->pixelformat, width, height, &frame_size);
+    uint8_t *out = malloc((size_t)width * height * c->dst_bpp);
+    int stride = c->src_fmt == CONVERT_SRC_YUYV ? width * 2 : width;
+    uint64_t start = 0;
+    unsigned long i = 0;
+    int ret = -1;
+
+    if(!frame || !out)
+        goto convert_end;
+
+    memset(&r, 0, sizeof(r));
+    if(isa == BENCH_YUV2RGB_LEGACY)
+        snprintf(r.name, BENCH_NAME_MAX_SIZE, "yuv2rgb legacy %ux%u", width, height);
+    else if(isa == BENCH_YUV2RGB)
+        snprintf(r.name, BENCH_NAME_MAX_SIZE, "yuv2rgb %ux%u", width, height);
+    else
+        snprintf(r.name, BENCH_NAME_MAX_SIZE, "convert %s %s %ux%u", convert_isa_name(isa), c->name, width, height);
+    r.width = width;
+    r.height = height;
+    r.frames = _get_frames(width, height);
+
+    r.allocations = _get_allocations();
+    start = _now_ns();
+    for(i = 0; i < r.frames; i++)
+    {
+        if(isa == BENCH_YUV2RGB_LEGACY)
+            _yuv2rgb_legacy(frame, out, width, height);
+        else if(isa == BENCH_YUV2RGB)
+            yuv2rgb(frame, out, width, height);
+        else if(convert_frame_isa(isa, c->src_fmt, frame, stride, c->dst_fmt, out,
+                    width * c->dst_bpp, width, height) != 0)
+            goto convert_end;
+    }
+    r.elapsed_ns = _now_ns() - start;
+    r.allocations = _get_allocations() - r.allocations;
+    _report(&r);
+    ret = 0;
+
+convert_end:
+    free(out);
+    free(frame);
+    return ret;
+}
+
+static int _bench_convert(void)
+{
+    convert_isa isa;
+    size_t c = 0;
+    int i = 0, ret = 0;
+
+    for(i = 0; i < _nb_sizes; i++)
+    {
+        if(_bench_convert_case(&_convert_cases[0], BENCH_YUV2RGB_LEGACY, _sizes[i].width, _sizes[i].height) != 0 ||
+           _bench_convert_case(&_convert_cases[0], BENCH_YUV2RGB, _sizes[i].width, _sizes[i].height) != 0)
+            ret = -1;
+        for(c = 0; c < sizeof(_convert_cases) / sizeof(_convert_cases[0]); c++)
+        {
+            for(isa = CONVERT_ISA_SCALAR; isa < CONVERT_ISA_COUNT; isa++)
+            {
+                if(convert_isa_supported(isa) &&
+                   _bench_convert_case(&_convert_cases[c], isa, _sizes[i].width, _sizes[i].height) != 0)
+                    ret = -1;
+            }
+        }
+    }
+    return ret;
+}
+
+/* Output goes to a scratch directory, removed once measured */
+static void _remove_dir(const char *dir)
+{
+    char path[OUTPUT_DIR_NAME_MAX_SIZE + 256] = {0};
+    struct dirent *entry = NULL;
+    DIR *d = opendir(dir);
+
+    if(!d)
+        return;
+    while((entry = readdir(d)) != NULL)
+    {
+        if(entry->d_name[0] == '.')
+            continue;
+        snprintf(path, sizeof(path), "%s/%s", dir, entry->d_name);
+        unlink(path);
+    }
+    closedir(d);
+    rmdir(dir);
+}
+
+static int _make_scratch_dir(char *dir)
+{
+    if(snprintf(dir, OUTPUT_DIR_NAME_MAX_SIZE, "%s/bench_XXXXXX", _dir) >= OUTPUT_DIR_NAME_MAX_SIZE)
+    {
+        ERR("Scratch directory path %s is too long", _dir);
+        return -1;
+    }
+    if(!mkdtemp(dir))
+    {
+        ERR("Cannot create a scratch directory in %s : %s", _dir, strerror(errno));
+        return -1;
+    }
+    return 0;
+}
+
+/* Time until every frame has been handed to the file system, sink
+ * destruction included */
+static int _bench_sink_case(frame_sink_type type, const char *type_name, int jpeg,
+        const uint8_t *frame, size_t frame_size, unsigned int width, unsigned int height)
+{
+    char dir[OUTPUT_DIR_NAME_MAX_SIZE] = {0};
+    frame_sink_t *sink = NULL;
+    muxer_stream stream;
+    bench_result r;
+    struct iovec iov;
+    unsigned long i = 0;
+    uint64_t start = 0;
+    int ret = -1;
+
+    if(_make_scratch_dir(dir) != 0)
+        return -1;
+
+    memset(&r, 0, sizeof(r));
+    snprintf(r.name, BENCH_NAME_MAX_SIZE, "sink %s %s %ux%u", type_name, jpeg ? "jpeg" : "nv12", width, height);
+    r.width = width;
+    r.height = height;
+    r.frames = _get_frames(width, height) * 3;
+    stream.pixelformat = jpeg ? V4L2_PIX_FMT_MJPEG : V4L2_PIX_FMT_NV12;
+    stream.width = width;
+    stream.height = height;
+    stream.frame_rate = DEFAULT_FRAME_RATE;
+    iov.iov_base = (void *)frame;
+    iov.iov_len = frame_size;
+
+    r.allocations = _get_allocations();
+    start = _now_ns();
+    sink = frame_sink_create(type, dir, "bench", jpeg ? "jpeg" : "raw", &stream, SEGMENT_SIZE, 0);
+    if(!sink)
+        goto sink_end;
+    for(i = 0; i < r.frames; i++)
+    {
+        if(frame_sink_write(sink, &iov, 1, i, i * 1000000 / DEFAULT_FRAME_RATE) != 0)
+            goto sink_end;
+    }
+    frame_sink_destroy(sink);
+    sink = NULL;
+    r.elapsed_ns = _now_ns() - start;
+    r.allocations = _get_allocations() - r.allocations;
+    _report(&r);
+    ret = 0;
+
+sink_end:
+    frame_sink_destroy(sink);
+    _remove_dir(dir);
+    return ret;
+}
+
+static int _bench_sink(void)
+{
+    unsigned int width = _frame_size.width, height = _frame_size.height;
+    jpeg_encoder_t *enc = jpeg_encoder_create(JPEG_ENCODER_INPUT_NV12, width, height, width);
+    size_t frame_size = 0;
+    uint8_t *frame = _make_frame(V4L2_PIX_FMT_NV12, width, height, &frame_size);
+    unsigned char *jpeg = NULL;
+    unsigned long jpeg_size = 0;
+    int ret = -1;
+
+    if(!enc || !frame)
+        goto bench_end;
+    jpeg = jpeg_encoder_encode_frame(enc, frame, &jpeg_size);
+    if(!jpeg)
+        goto bench_end;
+
+    ret = 0;
+    if(_bench_sink_case(FRAME_SINK_FILES, "files", 0, frame, frame_size, width, height) != 0 ||
+       _bench_sink_case(FRAME_SINK_FILES, "files", 1, jpeg, jpeg_size, width, height) != 0 ||
+       _bench_sink_case(FRAME_SINK_SEGMENTS, "segments", 0, frame, frame_size, width, height) != 0 ||
+       _bench_sink_case(FRAME_SINK_SEGMENTS, "segments", 1, jpeg, jpeg_size, width, height) != 0)
+        ret = -1;
+
+bench_end:
+    jpeg_encoder_destroy(enc);
+    free(frame);
+    return ret;
+}
+
+/* Whole pipeline, from a synthetic source producing frames as fast as they
+ * are dequeued to segments. Frames the writers cannot keep up with are
+ * dropped, as with a camera : fps counts the written ones */
+static int _bench_capture_case(const char *format, unsigned int width, unsigned int height)
+{
+    char device[DEVICE_NAME_MAX_SIZE] = {0};
+    char dir[OUTPUT_DIR_NAME_MAX_SIZE] = {0};
+    char format_name[FORMAT_MAX_SIZE] = {0};
+    yuv_fetcher_t *f = NULL;
+    metrics_t *metrics = NULL;
+    struct pollfd pfd;
+    bench_result r;
+    uint64_t start = 0, end = 0;
+    int ret = -1;
+
+    if(_make_scratch_dir(dir) != 0)
+        return -1;
+
+    memset(&r, 0, sizeof(r));
+    snprintf(r.name, BENCH_NAME_MAX_SIZE, "capture %s %ux%u", format, width, height);
+    snprintf(device, DEVICE_NAME_MAX_SIZE, "%s:%s", FRAME_SOURCE_SYNTHETIC, _pattern);
+    snprintf(format_name, FORMAT_MAX_SIZE, "%s", format);
+
+    r.allocations = _get_allocations();
+    f = yuv_fetcher_init(1, device);
+    if(!f)
+        goto capture_end;
+    yuv_fetcher_set_sink(f, FRAME_SINK_SEGMENTS);
+    if(yuv_fetcher_set_format(f, width, height, V4L2_PIX_FMT_NV12, 0) != 0 ||
+       yuv_fetcher_start(f, dir, format_name) != 0)
+        goto capture_end;
+
+    pfd.fd = yuv_fetcher_get_fd(f);
+    pfd.events = POLLIN;
+    start = _now_ns();
+    end = start + _duration_s * 1000000000ULL;
+    while(_now_ns() < end)
+    {
+        if(poll(&pfd, 1, 100) > 0 && yuv_fetcher_process(f) < 0)
+            goto capture_end;
+    }
+    yuv_fetcher_stop(f);
+    r.elapsed_ns = _now_ns() - start;
+    r.allocations = _get_allocations() - r.allocations;
+
+    metrics = yuv_fetcher_get_metrics(f);
+    r.width = width;
+    r.height = height;
+    r.frames = metrics_get_counter(metrics, METRICS_COUNTER_WRITTEN);
+    r.captured = metrics_get_counter(metrics, METRICS_COUNTER_CAPTURED);
+    r.dropped = metrics_get_counter(metrics, METRICS_COUNTER_RING_FULL);
+    _report(&r);
+    ret = 0;
+
+capture_end:
+    yuv_fetcher_shutdown(f);
+    _remove_dir(dir);
+    return ret;
+}
+
+static int _bench_capture(void)
+{
+    int ret = 0;
+
+    if(_bench_capture_case("raw", _frame_size.width, _frame_size.height) != 0 ||
+       _bench_capture_case("jpeg", _frame_size.width, _frame_size.height) != 0)
+        ret = -1;
+    return ret;
+}
+
+static int _parse_sizes(char *arg)
+{
+    char *token = NULL;
+
+    for(token = strtok(arg, ","), _nb_sizes = 0; token; token = strtok(NULL, ","))
+    {
+        if(_nb_sizes >= MAX_SIZES ||
+           sscanf(token, "%ux%u", &_sizes[_nb_sizes].width, &_sizes[_nb_sizes].height) != 2 ||
+           _sizes[_nb_sizes].width < 2 || _sizes[_nb_sizes].height < 2)
+            return -1;
+        _nb_sizes++;
+    }
+    _frame_size = _sizes[0];
+    return _nb_sizes ? 0 : -1;
+}
+
+static int _parse_qualities(char *arg)
+{
+    char *token = NULL;
+
+    for(token = strtok(arg, ","), _nb_qualities = 0; token; token = strtok(NULL, ","))
+    {
+        if(_nb_qualities >= MAX_QUALITIES)
+            return -1;
+        _qualities[_nb_qualities++] = atoi(token);
+    }
+    return _nb_qualities ? 0 : -1;
+}
+
+int main(int argc, char *argv[])
+{
+    const char *benchmark = NULL;
+    struct rusage usage;
+    int c = 0;
+    int ret = 0;
+
+    while((c = getopt(argc, argv, "d:hn:o:p:q:s:t:")) != -1)
+    {
+        switch(c)
+        {
+            case 'd':
+                snprintf(_dir, OUTPUT_DIR_NAME_MAX_SIZE, "%s", optarg);
+                break;
+            case 'n':
+                _frames = strtoul(optarg, NULL, 10);
+                break;
+            case 'o':
+                snprintf(_output, OUTPUT_DIR_NAME_MAX_SIZE, "%s", optarg);
+                break;
+            case 'p':
+                _pattern = optarg;
+                break;
+            case 'q':
+                if(_parse_qualities(optarg) != 0)
+                {
+                    _usage(argv[0]);
+                    return 1;
+                }
+                break;
+            case 's':
+                if(_parse_sizes(optarg) != 0)
+                {
+                    _usage(argv[0]);
+                    return 1;
+                }
+                break;
+            case 't':
+                _duration_s = atoi(optarg);
+                break;
+            case 'h':
+            default:
+                _usage(argv[0]);
+                return 1;
+        }
+    }
+    if(optind != argc - 1)
+    {
+        _usage(argv[0]);
+        return 1;
+    }
+    benchmark = argv[optind];
+    if(_frames < 1)
+        _frames = 1;
+
+    /* Standard output is left to the summary and the pipeline logs */
+    if(_output[0] == 0)
+        snprintf(_output, OUTPUT_DIR_NAME_MAX_SIZE, "%s.json", benchmark);
+    _json = fopen(_output, "w");
+    if(!_json)
+    {
+        ERR("Cannot open %s : %s", _output, strerror(errno));
+        return 1;
+    }
+    fprintf(_json, "{\n  \"benchmark\": \"%s\",\n  \"results\": [", benchmark);
+
+    if(strcmp(benchmark, "encode") == 0)
+        ret = _bench_encode();
+    else if(strcmp(benchmark, "convert") == 0)
+        ret = _bench_convert();
+    else if(strcmp(benchmark, "sink") == 0)
+        ret = _bench_sink();
+    else if(strcmp(benchmark, "capture") == 0)
+        ret = _bench_capture();
+    else
+    {
+        _usage(argv[0]);
+        ret = -1;
+    }
+
+    /* The high-water mark of the whole run, i.e. of its largest case : RSS
+     * is never given back to the kernel in between */
+    getrusage(RUSAGE_SELF, &usage);
+    printf("Peak RSS %ld kB\n", usage.ru_maxrss);
+    fprintf(_json, "\n  ],\n  \"peak_rss_kb\": %ld\n}\n", usage.ru_maxrss);
+    fclose(_json);
+    INF("Results written to %s", _output);
+    return ret ? 1 : 0;
+}
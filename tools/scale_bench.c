@@ -0,0 +1,182 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <getopt.h>
+#include <string.h>
+#include <time.h>
+
+#include "utils.h"
+#include "scale.h"
+
+#define DEFAULT_ITERATIONS  200
+
+static unsigned int _width = DEFAULT_FRAME_WIDTH;
+static unsigned int _height = DEFAULT_FRAME_HEIGHT;
+static int _iterations = DEFAULT_ITERATIONS;
+
+typedef struct
+{
+    const char *name;
+    unsigned int factors[SCALE_MAX_OUTPUTS];
+    int nb_outputs;
+} bench_case;
+
+static const bench_case _cases[] =
+{
+    {"1/2", {2}, 1},
+    {"1/4", {4}, 1},
+    {"1/2+1/4", {2, 4}, 2},
+    {"1+1/2+1/4", {1, 2, 4}, 3},
+};
+
+static void _usage(char *progname)
+{
+    fprintf(stderr, "Usage : %s [-s WxH] [-n iterations]\n", progname);
+    fprintf(stderr, "Options :\n");
+    fprintf(stderr, "  -h           prints this help\n");
+    fprintf(stderr, "  -n           number of frames scaled per measure (default: %d)\n", DEFAULT_ITERATIONS);
+    fprintf(stderr, "  -s           source frame size (default: %dx%d)\n", DEFAULT_FRAME_WIDTH, DEFAULT_FRAME_HEIGHT);
+}
+
+static uint64_t _now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* Average time to scale one frame, in ns, or 0 if the outputs differ from the
+ * scalar ones */
+static uint64_t _run_case(convert_isa isa, scale_fmt fmt, const uint8_t *src, unsigned int stride,
+        const scale_rect *rect, const bench_case *c, uint8_t **ref, uint8_t **out)
+{
+    scale_output outputs[SCALE_MAX_OUTPUTS];
+    unsigned int width = 0, height = 0;
+    uint64_t start = 0;
+    int i;
+
+    for(i = 0; i < c->nb_outputs; i++)
+    {
+        outputs[i].factor = c->factors[i];
+        outputs[i].dst = ref[i];
+    }
+    if(scale_frame_multi_isa(CONVERT_ISA_SCALAR, fmt, src, stride, _height, rect, outputs, c->nb_outputs) != 0)
+        return 0;
+
+    for(i = 0; i < c->nb_outputs; i++)
+        outputs[i].dst = out[i];
+    if(scale_frame_multi_isa(isa, fmt, src, stride, _height, rect, outputs, c->nb_outputs) != 0)
+        return 0;
+    for(i = 0; i < c->nb_outputs; i++)
+    {
+        scale_get_output_size(rect, c->factors[i], &width, &height);
+        if(memcmp(ref[i], out[i], scale_get_frame_size(fmt, width, height)) != 0)
+        {
+            ERR("%s output of %s case differs from the scalar one", convert_isa_name(isa), c->name);
+            return 0;
+        }
+    }
+
+    start = _now_ns();
+    for(i = 0; i < _iterations; i++)
+        scale_frame_multi_isa(isa, fmt, src, stride, _height, rect, outputs, c->nb_outputs);
+    return (_now_ns() - start) / _iterations;
+}
+
+/* Every supported kernel is checked against the scalar one, on a source whose
+ * width is not a multiple of the SIMD block size, then timed */
+static int _bench_format(scale_fmt fmt, const char *name)
+{
+    unsigned int stride = scale_get_stride(fmt, _width);
+    size_t size = scale_get_frame_size(fmt, _width, _height);
+    uint8_t *ref[SCALE_MAX_OUTPUTS] = {0};
+    uint8_t *out[SCALE_MAX_OUTPUTS] = {0};
+    uint8_t *src = malloc(size);
+    uint64_t scalar_ns = 0, ns = 0;
+    scale_rect rect = {2, 2, _width - 4, _height - 4};
+    convert_isa isa;
+    size_t i = 0;
+    int ret = 0;
+
+    for(i = 0; i < SCALE_MAX_OUTPUTS; i++)
+    {
+        ref[i] = malloc(size);
+        out[i] = malloc(size);
+        if(!ref[i] || !out[i])
+            ret = -1;
+    }
+    if(!src || ret != 0 || _width < 8 || _height < 8)
+    {
+        ERR("Cannot allocate %ux%u frames", _width, _height);
+        ret = -1;
+        goto end;
+    }
+    srand(1);
+    for(i = 0; i < size; i++)
+        src[i] = rand();
+
+    for(i = 0; i < sizeof(_cases) / sizeof(_cases[0]); i++)
+    {
+        for(isa = CONVERT_ISA_SCALAR; isa < CONVERT_ISA_COUNT; isa++)
+        {
+            if(!scale_isa_supported(isa))
+                continue;
+            ns = _run_case(isa, fmt, src, stride, &rect, &_cases[i], ref, out);
+            if(ns == 0)
+            {
+                ret = -1;
+                continue;
+            }
+            if(isa == CONVERT_ISA_SCALAR)
+                scalar_ns = ns;
+            printf("%-6s %-10s %-8s %10.1f us/frame %8.3f ns/pixel %6.2fx\n", name, _cases[i].name,
+                    convert_isa_name(isa), ns / 1000.0, (double)ns / ((double)_width * _height),
+                    (double)scalar_ns / ns);
+        }
+    }
+
+end:
+    for(i = 0; i < SCALE_MAX_OUTPUTS; i++)
+    {
+        free(ref[i]);
+        free(out[i]);
+    }
+    free(src);
+    return ret;
+}
+
+int main(int argc, char *argv[])
+{
+    int c = 0;
+    int ret = 0;
+
+    while((c = getopt(argc, argv, "hn:s:")) != -1)
+    {
+        switch(c)
+        {
+            case 'n':
+                _iterations = atoi(optarg);
+                break;
+            case 's':
+                if(sscanf(optarg, "%ux%u", &_width, &_height) != 2)
+                {
+                    _usage(argv[0]);
+                    return 1;
+                }
+                break;
+            case 'h':
+            default:
+                _usage(argv[0]);
+                return 1;
+        }
+    }
+    if(_iterations < 1)
+        _iterations = 1;
+
+    printf("Scaling %ux%u frames, %d iterations\n", _width, _height, _iterations);
+    if(_bench_format(SCALE_FMT_YUV420SP, "nv12") != 0)
+        ret = 1;
+    if(_bench_format(SCALE_FMT_YUYV, "yuyv") != 0)
+        ret = 1;
+    return ret;
+}